@@ -12,13 +12,52 @@ Pre-alpha. Version: a0.1
 
 #include <assert.h>
 
+// On x86 the hot kernels are also compiled for AVX2 and AVX-512 whatever
+// the build targets, and getSimdLevel() picks one on the CPU at run time.
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define METHUSELAH_SIMD_DISPATCH
+#define METHUSELAH_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define METHUSELAH_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define METHUSELAH_ALWAYS_INLINE inline
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define METHUSELAH_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <future>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 namespace methuselah {
@@ -37,338 +76,7754 @@ class InvalidOperationException : public std::runtime_error {
   InvalidOperationException() : InvalidOperationException("") {}
 };
 
-// Cell
-// ====------------------------------------------------------------------------
+// Storage
+// =======---------------------------------------------------------------------
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+// A fixed length, cache line aligned array of T. Unlike std::vector this
+// never reallocates and never bit-packs bools, so &buffer[i] is always a T*.
 template <typename T>
-class Cell {
+class AlignedBuffer {
  public:
-  Cell(const T& val, std::vector<size_t> coordinate)
-      : value(std::make_unique<T>(val)),
-        futureValue(std::make_unique<T>(val)),
-        coordinate(coordinate) {}
-  Cell(std::vector<size_t> coordinate) : coordinate(coordinate) {}
+  AlignedBuffer() : data(nullptr), length(0), mappedBytes(0) {}
+  AlignedBuffer(size_t length, const T& val)
+      : data(nullptr), length(length), mappedBytes(0) {
+    if (length == 0) return;
+    data = static_cast<T*>(::operator new(
+        length * sizeof(T), std::align_val_t(CACHE_LINE_SIZE)));
+    std::uninitialized_fill_n(data, length, val);
+  }
+  AlignedBuffer(const AlignedBuffer&) = delete;
+  AlignedBuffer(AlignedBuffer&& other) noexcept
+      : data(other.data), length(other.length), mappedBytes(other.mappedBytes) {
+    other.data = nullptr;
+    other.length = 0;
+    other.mappedBytes = 0;
+  }
+  ~AlignedBuffer() { reset(); }
 
-  virtual T* get() { return value.get(); }
-  virtual T* getFuture() { return futureValue.get(); }
-  virtual bool isOutOfBounds() { return false; }
-  
-  std::vector<size_t> getCoordinate() { return coordinate; }
+  AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+  AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+    if (this != &other) {
+      reset();
+      std::swap(data, other.data);
+      std::swap(length, other.length);
+      std::swap(mappedBytes, other.mappedBytes);
+    }
+    return *this;
+  }
 
-  virtual void set(const T& val) {
-    *value = val;
-    *futureValue = val;
+#ifdef METHUSELAH_HAS_MMAP
+  // Takes over length cells that mmap placed at data, mappedBytes bytes in
+  // all, and unmaps them instead of freeing. Only for trivially copyable T,
+  // whose cells are valid as they are in memory.
+  static AlignedBuffer fromMapping(T* data, size_t length,
+                                   size_t mappedBytes) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable cells can be mapped.");
+    AlignedBuffer buffer;
+    buffer.data = data;
+    buffer.length = length;
+    buffer.mappedBytes = mappedBytes;
+    return buffer;
   }
+#endif
+
+  T& operator[](size_t idx) { return data[idx]; }
+  const T& operator[](size_t idx) const { return data[idx]; }
 
-  // TODO: Profile & make sure you're not wasting too much time
-  //       frequently calling the copy constructor.
-  virtual void incrementTime() { *value = *futureValue; }
+  T* get() { return data; }
+  const T* get() const { return data; }
+  size_t size() const { return length; }
+
+  void reset() {
+    if (data == nullptr) return;
+    if (mappedBytes) {
+#ifdef METHUSELAH_HAS_MMAP
+      munmap(data, mappedBytes);
+#endif
+    } else {
+      std::destroy_n(data, length);
+      ::operator delete(data, std::align_val_t(CACHE_LINE_SIZE));
+    }
+    data = nullptr;
+    length = 0;
+    mappedBytes = 0;
+  }
 
  private:
-  std::unique_ptr<T> value;
-  std::unique_ptr<T> futureValue;
-  std::vector<size_t> const coordinate;
+  T* data;
+  size_t length;
+  size_t mappedBytes;
 };
 
-template <typename T>
-class OutOfBoundsCell final : public Cell<T> {
+// Threading
+// =========-------------------------------------------------------------------
+// A persistent pool of worker threads. Each run() hands every thread an even
+// share of the chunks up front; a thread that drains its own share steals
+// from the others, so uneven chunk costs still keep everybody busy. The
+// calling thread works as thread 0 and run() returns once all chunks are
+// done, which makes every call a single barrier.
+class ThreadPool {
  public:
-  OutOfBoundsCell(T* ptr, std::vector<size_t> coordinate)
-      : ptr(ptr), Cell<T>(coordinate) {}
-  OutOfBoundsCell(std::vector<size_t> coordinate)
-      : ptr(nullptr), Cell<T>(coordinate) {}
+  explicit ThreadPool(size_t numThreads)
+      : numThreads(std::max<size_t>(numThreads, 1)),
+        queues(new Queue[this->numThreads]),
+        task(nullptr),
+        epoch(0),
+        numFinished(0),
+        stopping(false) {
+    for (size_t i = 1; i < this->numThreads; ++i) {
+      workers.emplace_back([this, i]() { workerLoop(i); });
+    }
+  }
 
-  T* get() { return ptr; }
-  T* getFuture() {
-    throw InvalidOperationException("Cannot get future value for OOB cell.");
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  size_t getNumThreads() const { return numThreads; }
+
+  // Calls task(chunk, thread) for every chunk in [0, numChunks).
+  void run(size_t numChunks,
+           const std::function<void(size_t, size_t)>& task) {
+    if (numChunks == 0) return;
+    if (numThreads == 1) {
+      for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+        task(chunk, 0);
+      }
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < numThreads; ++i) {
+        queues[i].next.store(numChunks * i / numThreads,
+                             std::memory_order_relaxed);
+        queues[i].end = numChunks * (i + 1) / numThreads;
+      }
+      this->task = &task;
+      error = nullptr;
+      numFinished = 0;
+      ++epoch;
+    }
+    wake.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&]() { return numFinished == numThreads - 1; });
+    this->task = nullptr;
+    if (error) {
+      std::rethrow_exception(error);
+    }
   }
-  void set(T* ptr) { this->ptr = ptr; }
-  bool isOutOfBounds() { return true; }
-  void incrementTime() {}
 
  private:
-  T* ptr;
+  struct alignas(CACHE_LINE_SIZE) Queue {
+    std::atomic<size_t> next{0};
+    size_t end{0};
+  };
+
+  size_t const numThreads;
+  std::unique_ptr<Queue[]> queues;
+  std::vector<std::thread> workers;
+  const std::function<void(size_t, size_t)>* task;
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished;
+  size_t epoch;
+  size_t numFinished;
+  bool stopping;
+
+  void work(size_t thread) {
+    for (size_t i = 0; i < numThreads; ++i) {
+      auto& queue = queues[(thread + i) % numThreads];
+      size_t chunk;
+      while ((chunk = queue.next.fetch_add(1, std::memory_order_relaxed)) <
+             queue.end) {
+        try {
+          (*task)(chunk, thread);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) error = std::current_exception();
+        }
+      }
+    }
+  }
+
+  void workerLoop(size_t thread) {
+    size_t seenEpoch = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stopping || epoch != seenEpoch; });
+        if (stopping) return;
+        seenEpoch = epoch;
+      }
+
+      work(thread);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (++numFinished == numThreads - 1) {
+        finished.notify_one();
+      }
+    }
+  }
 };
 
-// Grid
-// ====------------------------------------------------------------------------
-enum Wrapping { BOUNDED, TOROIDAL };
-enum Neighborhood { MOORE, VON_NEUMANN, CUSTOM };
+// Rules
+// =====-----------------------------------------------------------------------
+// The cells within radius r of a cell, along every dimension for MOORE (a
+// box), by taxicab distance for VON_NEUMANN (a diamond) and by Euclidean
+// distance for CIRCULAR. Values are stored in snapshots, so new ones go at
+// the end.
+enum Neighborhood { MOORE, VON_NEUMANN, CUSTOM, CIRCULAR };
 
-namespace {  // Helper functions
-template <typename T>
-T multiplyAll(const std::vector<T>& vec) {
-  return std::accumulate(vec.begin(), vec.end(), 1, std::multiplies<T>());
-}
+// An outer totalistic rule: a cell's next state only depends on its own
+// state and the number of live cells in its neighborhood, radius 1 Moore
+// unless set otherwise. Dead cells with a live neighbor count listed in
+// birth come alive, live cells with a count listed in survival stay alive,
+// and everything else dies. Conway's Life is {{3}, {2, 3}}, and larger
+// radii give Larger than Life rules.
+//
+// With numStates > 2 this is a Generations rule: state 1 is alive, a live
+// cell that fails to survive goes to state 2 instead of dying, and states
+// 2 and up count up to numStates - 1 and then die. Only state 1 counts as a
+// live neighbor, and only state 0 can be born.
+struct OuterTotalisticRule {
+  std::vector<size_t> birth;
+  std::vector<size_t> survival;
+  size_t numStates = 2;
+  Neighborhood neighborhood = MOORE;
+  size_t radius = 1;
 
-std::vector<size_t> allZeros(size_t length) {
-  auto result = std::vector<size_t>();
-  result.insert(result.begin(), length, 0);
-  return result;
-}
+  // Parses B/S notation such as "B3/S23" or "B6/S567", with an optional
+  // "/C<n>" (or "/G<n>") for Generations rules such as "B2/S/C4". Counts are
+  // single digits, unless a list contains commas: "B5,6,13/S4,14".
+  //
+  // Larger than Life rules use Golly's notation, such as
+  // "R5,C0,M1,S34..58,B34..45,NM": radius, states (0 and 2 both meaning
+  // 2), whether counts include the cell itself, survival and birth counts
+  // as ranges or single counts, and the neighborhood, NM (Moore), NN (von
+  // Neumann) or NC (circular). More ranges can follow a list after commas:
+  // "S2..3,7,B4..5".
+  static OuterTotalisticRule fromString(const std::string& rulestring) {
+    if (rulestring.size() > 1 && std::toupper(rulestring[0]) == 'R' &&
+        std::isdigit(static_cast<unsigned char>(rulestring[1]))) {
+      return parseLargerThanLife(rulestring);
+    }
 
-// Expand each dimension out one unit on each extremity,
-// then subtract the size of the resulting shape from the
-// original. This gives you the number of cells needed to
-// pad the grid by one unit.
-size_t determinePadding(const std::vector<size_t>& shape) {
-  auto numDims = shape.size();
-  auto expanded = std::vector<size_t>(shape);
-  for (auto i = 0; i < numDims; ++i) {
-    expanded[i] += 2;
-  }
-
-  auto size = multiplyAll<size_t>(shape);
-  auto expandedSize = multiplyAll<size_t>(expanded);
-  return expandedSize - size;
-}
-
-std::vector<std::vector<int>> generateMooreOffsets(size_t numDimensions,
-                                                   bool isLastDim = true) {
-  if (numDimensions == 0) {
-    return {};
-  }
-  auto head = std::vector<int>{-1, 0, 1};
-  auto tails = generateMooreOffsets(numDimensions - 1, false);
-  auto offsets = std::vector<std::vector<int>>();
-  for (auto x : head) {
-    if (tails.empty()) {
-      offsets.push_back(std::vector<int>{x});
-      continue;
-    }
-    for (const auto& tail : tails) {
-      std::vector<int> result{x};
-      result.insert(result.end(), tail.begin(), tail.end());
-      if (isLastDim && std::all_of(result.begin(), result.end(),
-                                   [](int x) { return x == 0; })) {
-        continue;
+    OuterTotalisticRule rule;
+    auto sawBirth = false;
+    auto sawSurvival = false;
+    size_t pos = 0;
+    while (pos <= rulestring.size()) {
+      auto end = std::min(rulestring.find('/', pos), rulestring.size());
+      auto part = rulestring.substr(pos, end - pos);
+      pos = end + 1;
+      if (part.empty())
+        throw std::invalid_argument("Malformed rulestring: " + rulestring);
+
+      auto body = part.substr(1);
+      switch (std::toupper(part[0])) {
+        case 'B':
+          rule.birth = parseCounts(body, rulestring);
+          sawBirth = true;
+          break;
+        case 'S':
+          rule.survival = parseCounts(body, rulestring);
+          sawSurvival = true;
+          break;
+        case 'C':
+        case 'G':
+          if (body.empty() ||
+              body.find_first_not_of("0123456789") != std::string::npos)
+            throw std::invalid_argument("Malformed rulestring: " +
+                                        rulestring);
+          rule.numStates = std::stoul(body);
+          if (rule.numStates < 2 || rule.numStates > 256)
+            throw std::invalid_argument(
+                "Rulestrings need between 2 and 256 states: " + rulestring);
+          break;
+        default:
+          throw std::invalid_argument("Malformed rulestring: " + rulestring);
       }
-      offsets.push_back(result);
     }
+    if (!sawBirth || !sawSurvival)
+      throw std::invalid_argument("Rulestrings need a B and an S part: " +
+                                  rulestring);
+    return rule;
+  }
+
+  std::string toString() const {
+    if (radius != 1 || neighborhood != MOORE) {
+      return "R" + std::to_string(radius) + ",C" +
+             std::to_string(numStates > 2 ? numStates : 0) + ",M0,S" +
+             formatRanges(survival) + ",B" + formatRanges(birth) + ",N" +
+             (neighborhood == VON_NEUMANN ? "N"
+                                          : neighborhood == CIRCULAR ? "C"
+                                                                     : "M");
+    }
+    auto result = "B" + formatCounts(birth) + "/S" + formatCounts(survival);
+    if (numStates > 2) {
+      result += "/C" + std::to_string(numStates);
+    }
+    return result;
   }
-  return offsets;
-}
 
-// TODO: Von Neumann offsets
-// NOTE: I think you can just take the Moore offsets, and remove all of
-//       those whose sum of absolute values is greater than 1.
+  bool operator==(const OuterTotalisticRule& other) const {
+    return birth == other.birth && survival == other.survival &&
+           numStates == other.numStates &&
+           neighborhood == other.neighborhood && radius == other.radius;
+  }
+  bool operator!=(const OuterTotalisticRule& other) const {
+    return !(*this == other);
+  }
 
-}  // namespace
+  // Next state for every (state, live neighbor count) pair, at index
+  // state * (maxNeighbors + 1) + count.
+  std::vector<uint8_t> lookupTable(size_t maxNeighbors) const {
+    if (numStates < 2 || numStates > 256)
+      throw InvalidOperationException("Rules need between 2 and 256 states.");
 
-template <typename T>
-class Grid {
- public:
-  Grid(const std::vector<size_t>& shape, Wrapping wrapping,
-       Neighborhood neighborhood,
-       std::function<void(T*, const std::vector<T*>&)> cellUpdate,
-       T defaultValue = T(), unsigned short int maxNeighborDistance = 1)
-      : shape(shape),
-        size(multiplyAll<size_t>(shape)),
-        maxNeighborDistance(maxNeighborDistance),
-        padding(determinePadding(shape) * maxNeighborDistance),
-        singleDimPadding(maxNeighborDistance * 2),
-        numDimensions(shape.size()),
-        wrapping(wrapping),
-        cellUpdate(cellUpdate),
-        defaultValue(defaultValue),
-        defaultCellValue(std::unique_ptr<T>(new T(defaultValue))) {
-    setNeighborhood(neighborhood);
+    for (auto count : birth) {
+      if (count > maxNeighbors)
+        throw InvalidOperationException("Birth count exceeds neighborhood.");
+    }
+    for (auto count : survival) {
+      if (count > maxNeighbors)
+        throw InvalidOperationException("Survival count exceeds neighborhood.");
+    }
 
-    auto coordinate = allZeros(numDimensions);
-    for (auto i = 0; i < size + padding; ++i) {
-      if (isOutOfBounds(coordinate)) {
-        cells.push_back(
-            std::unique_ptr<Cell<T>>(new OutOfBoundsCell<T>(coordinate)));
-      } else {
-        cells.push_back(std::make_unique<Cell<T>>(defaultValue, coordinate));
-      }
-      incrementCoordinate(coordinate);
-    }
-
-    for (auto i = 0; i < size + padding; ++i) {
-      auto cell = cells[i].get();
-      if (cell->isOutOfBounds()) {
-        auto oobCell = static_cast<OutOfBoundsCell<T>*>(cell);
-        switch (wrapping) {
-          case Wrapping::BOUNDED:
-            oobCell->set(defaultCellValue.get());
-            break;
-
-          case Wrapping::TOROIDAL:
-            auto coord = oobCell->getCoordinate();
-            for (auto i = 0; i < numDimensions; ++i) {
-              auto x = coord[i];
-              if (x < maxNeighborDistance) {
-                x += shape[i];
-              }
-              else if (x > shape[i]) {
-                x %= shape[i];
-              }
-              coord[i] = x;
-            }
-            auto idx = getIdx(coord, false);
-            oobCell->set(getCell(idx)->get());
-            break;
-        }
+    auto row = maxNeighbors + 1;
+    uint8_t dying = numStates > 2 ? 2 : 0;
+    std::vector<uint8_t> table(numStates * row, 0);
+    for (size_t count = 0; count < row; ++count) {
+      table[count] = contains(birth, count) ? 1 : 0;
+      table[row + count] = contains(survival, count) ? 1 : dying;
+      for (size_t state = 2; state < numStates; ++state) {
+        table[state * row + count] = (state + 1) % numStates;
       }
     }
+    return table;
   }
 
-  void update() {
-    incrementTime();
-    for (auto i = 0; i < size + padding; ++i) {
-      auto cell = getCell(i);
-      if (!cell->isOutOfBounds()) {
-        auto j = 0;
-        for (auto offset : neighborhood) {
-          auto nidx = i + offset;
-          neighbors[j++] = getCell(nidx)->get();
-        }
-        auto futureCell = cell->getFuture();
-        cellUpdate(futureCell, neighbors);
+ private:
+  static bool contains(const std::vector<size_t>& counts, size_t count) {
+    return std::find(counts.begin(), counts.end(), count) != counts.end();
+  }
+
+  static std::vector<size_t> parseCounts(const std::string& body,
+                                         const std::string& rulestring) {
+    std::vector<size_t> counts;
+    if (body.find_first_not_of("0123456789,") != std::string::npos)
+      throw std::invalid_argument("Malformed rulestring: " + rulestring);
+
+    if (body.find(',') == std::string::npos) {
+      for (auto digit : body) {
+        counts.push_back(digit - '0');
       }
+      return counts;
     }
+
+    size_t pos = 0;
+    while (pos <= body.size()) {
+      auto end = std::min(body.find(',', pos), body.size());
+      if (end == pos)
+        throw std::invalid_argument("Malformed rulestring: " + rulestring);
+      counts.push_back(std::stoul(body.substr(pos, end - pos)));
+      pos = end + 1;
+    }
+    return counts;
   }
 
-  // TODO: Write an iterator for this class
+  static OuterTotalisticRule parseLargerThanLife(
+      const std::string& rulestring) {
+    auto malformed = [&]() {
+      return std::invalid_argument("Malformed rulestring: " + rulestring);
+    };
+    auto parseNumber = [&](const std::string& digits) {
+      if (digits.empty() ||
+          digits.find_first_not_of("0123456789") != std::string::npos)
+        throw malformed();
+      return static_cast<size_t>(std::stoul(digits));
+    };
 
-  const T& getValue(const std::vector<size_t>& coordinates) {
-    return getValue(getIdx(coordinates));
+    OuterTotalisticRule rule;
+    auto sawBirth = false;
+    auto sawSurvival = false;
+    auto countsSelf = false;
+    // The count list that bare ranges are added to.
+    std::vector<size_t>* counts = nullptr;
+    size_t pos = 0;
+    while (pos <= rulestring.size()) {
+      auto end = std::min(rulestring.find(',', pos), rulestring.size());
+      auto part = rulestring.substr(pos, end - pos);
+      pos = end + 1;
+      if (part.empty()) throw malformed();
+
+      auto body = part.substr(1);
+      if (std::isdigit(static_cast<unsigned char>(part[0]))) {
+        if (!counts) throw malformed();
+        body = part;
+      } else {
+        counts = nullptr;
+      }
+      switch (counts ? 0 : std::toupper(part[0])) {
+        case 0:
+        case 'B':
+        case 'S': {
+          if (!counts) {
+            auto birth = std::toupper(part[0]) == 'B';
+            counts = birth ? &rule.birth : &rule.survival;
+            (birth ? sawBirth : sawSurvival) = true;
+            if (body.empty()) break;
+          }
+          auto dots = body.find("..");
+          auto lo = parseNumber(body.substr(0, dots));
+          auto hi = dots == std::string::npos
+                        ? lo
+                        : parseNumber(body.substr(dots + 2));
+          for (auto count = lo; count <= hi; ++count) {
+            counts->push_back(count);
+          }
+          break;
+        }
+        case 'R':
+          rule.radius = parseNumber(body);
+          if (rule.radius == 0) throw malformed();
+          break;
+        case 'C':
+          rule.numStates = std::max<size_t>(parseNumber(body), 2);
+          if (rule.numStates > 256)
+            throw std::invalid_argument(
+                "Rulestrings need between 2 and 256 states: " + rulestring);
+          break;
+        case 'M':
+          countsSelf = parseNumber(body) != 0;
+          break;
+        case 'N':
+          if (body.size() != 1) throw malformed();
+          switch (std::toupper(body[0])) {
+            case 'M':
+              rule.neighborhood = MOORE;
+              break;
+            case 'N':
+              rule.neighborhood = VON_NEUMANN;
+              break;
+            case 'C':
+              rule.neighborhood = CIRCULAR;
+              break;
+            default:
+              throw malformed();
+          }
+          break;
+        default:
+          throw malformed();
+      }
+    }
+    if (!sawBirth || !sawSurvival)
+      throw std::invalid_argument("Rulestrings need a B and an S part: " +
+                                  rulestring);
+
+    // Live cells counting themselves is the same as needing one more live
+    // neighbor.
+    if (countsSelf) {
+      std::vector<size_t> survival;
+      for (auto count : rule.survival) {
+        if (count > 0) survival.push_back(count - 1);
+      }
+      rule.survival = survival;
+    }
+    return rule;
   }
 
-  void setValue(const std::vector<size_t>& coordinates, const T& val) {
-    auto idx = getIdx(coordinates);
-    auto cell = getCell(idx);
-    if (cell->isOutOfBounds()) {
-      throw std::out_of_range(
-          "Can't manually set value for out of bounds indices");
+  // Counts as ranges of consecutive counts, "lo..hi" or a single count,
+  // separated by commas.
+  static std::string formatRanges(std::vector<size_t> counts) {
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+    std::string result;
+    for (size_t i = 0; i < counts.size();) {
+      auto j = i;
+      while (j + 1 < counts.size() && counts[j + 1] == counts[j] + 1) {
+        ++j;
+      }
+      result += (result.empty() ? "" : ",") + std::to_string(counts[i]);
+      if (j > i) {
+        result += ".." + std::to_string(counts[j]);
+      }
+      i = j + 1;
     }
-    setValue(idx, val);
+    return result;
   }
 
-  const std::vector<size_t>& getShape() const { return shape; }
+  static std::string formatCounts(const std::vector<size_t>& counts) {
+    auto singleDigits = std::all_of(counts.begin(), counts.end(),
+                                    [](size_t count) { return count < 10; });
+    std::string result;
+    for (auto count : counts) {
+      if (!singleDigits && !result.empty()) {
+        result += ",";
+      }
+      result += std::to_string(count);
+    }
+    return result;
+  }
+};
 
-  size_t getSize() const { return size; }
+// The abelian sandpile as a toppling rule for Grid::relax, over a
+// neighborhood of N cells (2n for an n-dimensional von Neumann one): a cell
+// holding N grains or more is unstable and topples, handing one grain to
+// every neighbor. Cells topple as many times as they can at once.
+template <typename T, size_t N>
+struct AbelianSandpile {
+  static constexpr size_t numNeighbors = N;
 
-  void setNeighborhood(Neighborhood neighborhoodType) {
-    if (neighborhoodType == Neighborhood::CUSTOM)
-      throw InvalidOperationException(
-          "To set custom neighborhood, provide offsets directly");
+  bool unstable(const T& cell) const { return cell >= N; }
 
-    this->neighborhoodType = neighborhoodType;
-    switch (neighborhoodType) {
-      case Neighborhood::MOORE:
-        neighborhood = generateMoore(numDimensions);
-        break;
-      case Neighborhood::VON_NEUMANN:
-        throw NotImplementedException();
-        break;
+  void operator()(T& cell, const std::array<T*, N>& neighbors) const {
+    auto topplings = cell / N;
+    cell -= topplings * N;
+    for (auto neighbor : neighbors) {
+      *neighbor += topplings;
     }
-    neighbors.resize(neighborhood.size());
   }
+};
 
-  void setNeighborhood(std::vector<std::vector<int>> offsets) {
-    neighborhood.clear();
-    for (const auto& offset : offsets) {
-      neighborhood.push_back(getIdx(offset), false);
+// Grid
+// ====------------------------------------------------------------------------
+enum Wrapping { BOUNDED, TOROIDAL };
+
+// DOUBLE_BUFFERED computes every cell from the previous generation.
+// IN_PLACE overwrites cells as it goes, so later cells in a sweep see the
+// already updated values of earlier ones, but only one generation is stored.
+enum UpdateMode { DOUBLE_BUFFERED, IN_PLACE };
+
+// ROW_MAJOR stores the grid as one padded array with the first dimension
+// contiguous, so neighbors along the last dimension of a 3D grid are a whole
+// plane apart. BLOCKED stores it as cubic bricks, each a small padded
+// row-major array of its own, so a cell's whole neighborhood stays within a
+// few cache lines. MORTON does the same with the bricks in Z-order, which
+// also keeps neighboring bricks close together.
+enum Layout { ROW_MAJOR, BLOCKED, MORTON };
+
+// Number of neighbors in a radius 1 Moore neighborhood.
+constexpr size_t mooreNeighborhoodSize(size_t numDimensions) {
+  return numDimensions == 0
+             ? 0
+             : 3 * (mooreNeighborhoodSize(numDimensions - 1) + 1) - 1;
+}
+
+// A read-only view of the N neighbors of one cell, resolved through a fixed
+// table of index offsets into the grid's storage. Cheap to construct, and
+// since N is known at compile time loops over it can be fully unrolled.
+template <typename T, size_t N>
+class StencilView {
+ public:
+  class iterator {
+   public:
+    iterator(const T* center, const long int* offset)
+        : center(center), offset(offset) {}
+    const T& operator*() const { return center[*offset]; }
+    iterator& operator++() {
+      ++offset;
+      return *this;
+    }
+    bool operator!=(const iterator& other) const {
+      return offset != other.offset;
     }
-    neighbors.resize(neighborhood.size());
-  }
+
+   private:
+    const T* center;
+    const long int* offset;
+  };
+
+  StencilView(const T* center, const long int* offsets)
+      : center(center), offsets(offsets) {}
+
+  static constexpr size_t size() { return N; }
+
+  const T& operator[](size_t idx) const { return center[offsets[idx]]; }
+
+  iterator begin() const { return iterator(center, offsets); }
+  iterator end() const { return iterator(center, offsets + N); }
 
  private:
-  // Immutable member variables
-  std::vector<size_t> const shape;
-  size_t const size;
-  size_t const maxNeighborDistance;
-  size_t const singleDimPadding;
-  size_t const padding;
-  unsigned short int const numDimensions;
-  Wrapping const wrapping;
-  T const defaultValue;
-  std::unique_ptr<T> const defaultCellValue;
+  const T* center;
+  const long int* offsets;
+};
 
-  // Mutable member variables
-  std::vector<std::unique_ptr<Cell<T>>> cells;
-  std::function<void(T*, const std::vector<T*>&)> cellUpdate;
-  Neighborhood neighborhoodType;
-  std::vector<int> neighborhood;
-  std::vector<T*> neighbors;
+// What the reductions set on a Grid found in a generation. Parts without a
+// reduction stay empty or zero.
+struct GridStatistics {
+  uint64_t generation = 0;
+  // Number of live cells, and the corners of the smallest box holding all
+  // of them, both inclusive. The corners are empty without live cells or
+  // without bounds.
+  size_t population = 0;
+  std::vector<size_t> boundsMin;
+  std::vector<size_t> boundsMax;
+  // Number of cells in each state.
+  std::vector<size_t> histogram;
+  // Of the field every cell is projected to.
+  double fieldMin = 0;
+  double fieldMax = 0;
+  double fieldSum = 0;
+};
 
-  // Private member functions
-  const T& getValue(size_t idx) { return *(getCell(idx)->get()); }
-  void setValue(size_t idx, const T& val) { getCell(idx)->set(val); }
+// A snapshot file starts with a header describing the grid, followed by its
+// storage exactly as it is in memory: the padded array of the current
+// generation and, for DOUBLE_BUFFERED grids, the one of the next. Each
+// array starts SNAPSHOT_ALIGNMENT bytes apart in the file so it can be
+// memory mapped on its own. Numbers are stored in the byte order of the
+// machine that wrote them; loading checks that it matches.
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr size_t SNAPSHOT_ALIGNMENT = 64 * 1024;
 
-  Cell<T>* getCell(size_t idx) { return cells[idx].get(); }
+namespace {  // Snapshot helpers
+constexpr char SNAPSHOT_MAGIC[8] = {'M', 'E', 'T', 'H', 'S', 'N', 'A', 'P'};
+constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
 
-  void incrementTime() {
-    for (auto i = 0; i < size + padding; ++i) {
-      getCell(i)->incrementTime();
+// Magic, version, byte order, checksum and data offset.
+constexpr size_t SNAPSHOT_PREAMBLE_SIZE = 32;
+constexpr size_t SNAPSHOT_CHECKSUM_POS = 16;
+
+size_t alignSnapshotOffset(size_t offset) {
+  return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT *
+         SNAPSHOT_ALIGNMENT;
+}
+
+uint64_t rotateLeft(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+// A 64-bit checksum that mixes four words at a time in independent lanes,
+// so it keeps up with reading the file. Passing the result of one call as
+// the seed of the next checksums several pieces in a row.
+uint64_t checksum64(const void* data, size_t length, uint64_t seed = 0) {
+  constexpr uint64_t PRIME_1 = 0x9E3779B185EBCA87ull;
+  constexpr uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4Full;
+  auto bytes = static_cast<const unsigned char*>(data);
+  uint64_t lanes[4] = {seed + PRIME_1, seed + PRIME_2, seed,
+                       seed - PRIME_1};
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    for (size_t lane = 0; lane < 4; ++lane) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i + lane * 8, 8);
+      lanes[lane] = rotateLeft(lanes[lane] + word * PRIME_2, 31) * PRIME_1;
     }
   }
+  auto hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) +
+              rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18) + length;
+  for (; i < length; ++i) {
+    hash = rotateLeft(hash ^ (bytes[i] * PRIME_1), 11) * PRIME_2;
+  }
+  hash ^= hash >> 33;
+  hash *= PRIME_2;
+  hash ^= hash >> 29;
+  return hash;
+}
 
-  size_t getRealDimSize(size_t idx) { return shape[idx] + singleDimPadding; }
+template <typename U>
+void appendBytes(std::vector<char>& bytes, const U& value) {
+  auto begin = reinterpret_cast<const char*>(&value);
+  bytes.insert(bytes.end(), begin, begin + sizeof(U));
+}
 
-  size_t getIdx(const std::vector<size_t>& coordinates, bool offsetPadding = true) {
-    if (coordinates.size() != numDimensions)
-      throw InvalidOperationException(
-          "Coordinate numDimensions do not match grid's numDimensions.");
+// Reads values off the front of a snapshot header.
+class SnapshotReader {
+ public:
+  explicit SnapshotReader(const std::vector<char>& bytes)
+      : bytes(bytes), position(0) {}
 
-    size_t result{0};
-    for (auto i = 0; i < numDimensions; ++i) {
-      auto chunk = coordinates[i];
-      if (offsetPadding) {
-        chunk += maxNeighborDistance;
-      }
-      for (auto j = 1; j <= i; ++j) {
-        chunk *= getRealDimSize(j - 1);
+  template <typename U>
+  U read() {
+    U value;
+    if (position + sizeof(U) > bytes.size())
+      throw std::invalid_argument("Snapshot header is truncated.");
+    std::memcpy(&value, bytes.data() + position, sizeof(U));
+    position += sizeof(U);
+    return value;
+  }
+
+ private:
+  const std::vector<char>& bytes;
+  size_t position;
+};
+}  // namespace
+
+// What a snapshot file holds besides the cells. read() only reads the
+// header, so it is cheap even for huge snapshots.
+struct SnapshotInfo {
+  uint32_t version;
+  uint64_t checksum;
+  size_t dataOffset;
+  uint64_t generation;
+  size_t cellSize;
+  std::vector<size_t> shape;
+  Wrapping wrapping;
+  size_t maxNeighborDistance;
+  Neighborhood neighborhood;
+  size_t neighborhoodRadius;
+  std::vector<std::vector<int>> customOffsets;
+  Layout layout;
+  size_t brickSize;
+  UpdateMode updateMode;
+  size_t paddedSize;
+  size_t numBuffers;
+  std::vector<char> defaultValue;
+
+  // Where the storage of buffer i starts, 0 being the current generation.
+  size_t getBufferOffset(size_t i) const {
+    return dataOffset + i * alignSnapshotOffset(paddedSize * cellSize);
+  }
+
+  size_t getFileSize() const {
+    return getBufferOffset(numBuffers);
+  }
+
+  // The header as stored, unpadded.
+  std::vector<char> toBytes() const {
+    std::vector<char> bytes(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + 8);
+    appendBytes(bytes, version);
+    appendBytes(bytes, SNAPSHOT_BYTE_ORDER);
+    appendBytes(bytes, checksum);
+    appendBytes(bytes, static_cast<uint64_t>(dataOffset));
+    appendBytes(bytes, generation);
+    appendBytes(bytes, static_cast<uint64_t>(cellSize));
+    appendBytes(bytes, static_cast<uint64_t>(shape.size()));
+    for (auto extent : shape) {
+      appendBytes(bytes, static_cast<uint64_t>(extent));
+    }
+    appendBytes(bytes, static_cast<uint32_t>(wrapping));
+    appendBytes(bytes, static_cast<uint64_t>(maxNeighborDistance));
+    appendBytes(bytes, static_cast<uint32_t>(neighborhood));
+    appendBytes(bytes, static_cast<uint64_t>(neighborhoodRadius));
+    appendBytes(bytes, static_cast<uint64_t>(customOffsets.size()));
+    for (const auto& offset : customOffsets) {
+      for (auto x : offset) {
+        appendBytes(bytes, static_cast<int32_t>(x));
       }
-      result += chunk;
     }
-    return result;
+    appendBytes(bytes, static_cast<uint32_t>(layout));
+    appendBytes(bytes, static_cast<uint64_t>(brickSize));
+    appendBytes(bytes, static_cast<uint32_t>(updateMode));
+    appendBytes(bytes, static_cast<uint64_t>(paddedSize));
+    appendBytes(bytes, static_cast<uint64_t>(numBuffers));
+    bytes.insert(bytes.end(), defaultValue.begin(), defaultValue.end());
+    return bytes;
   }
 
-  long int getOffsetIdx(const std::vector<int>& offsetCoords) {
-    if (offsetCoords.size() != numDimensions)
-      throw InvalidOperationException(
-          "Coordinate numDimensions do not match grid's numDimensions.");
+  static SnapshotInfo fromBytes(const std::vector<char>& bytes) {
+    SnapshotReader reader(bytes);
+    char magic[8];
+    for (auto& c : magic) {
+      c = reader.read<char>();
+    }
+    if (!std::equal(magic, magic + 8, SNAPSHOT_MAGIC))
+      throw std::invalid_argument("Not a snapshot file.");
 
-    long int result{0};
-    for (auto i = 0; i < numDimensions; ++i) {
-      auto chunk = offsetCoords[i];
-      for (auto j = 1; j <= i; ++j) {
-        chunk *= getRealDimSize(j - 1);
+    SnapshotInfo info;
+    info.version = reader.read<uint32_t>();
+    if (info.version != SNAPSHOT_VERSION)
+      throw std::invalid_argument("Unsupported snapshot version " +
+                                  std::to_string(info.version) + ".");
+    if (reader.read<uint32_t>() != SNAPSHOT_BYTE_ORDER)
+      throw std::invalid_argument(
+          "Snapshot was written on a machine of a different byte order.");
+    info.checksum = reader.read<uint64_t>();
+    info.dataOffset = reader.read<uint64_t>();
+    info.generation = reader.read<uint64_t>();
+    info.cellSize = reader.read<uint64_t>();
+    info.shape.resize(reader.read<uint64_t>());
+    for (auto& extent : info.shape) {
+      extent = reader.read<uint64_t>();
+    }
+    auto wrapping = reader.read<uint32_t>();
+    if (wrapping > Wrapping::TOROIDAL)
+      throw std::invalid_argument("Snapshot has an unknown wrapping.");
+    info.wrapping = static_cast<Wrapping>(wrapping);
+    info.maxNeighborDistance = reader.read<uint64_t>();
+    auto neighborhood = reader.read<uint32_t>();
+    if (neighborhood > Neighborhood::CIRCULAR)
+      throw std::invalid_argument("Snapshot has an unknown neighborhood.");
+    info.neighborhood = static_cast<Neighborhood>(neighborhood);
+    info.neighborhoodRadius = reader.read<uint64_t>();
+    info.customOffsets.resize(reader.read<uint64_t>());
+    for (auto& offset : info.customOffsets) {
+      offset.resize(info.shape.size());
+      for (auto& x : offset) {
+        x = reader.read<int32_t>();
       }
-      result += chunk;
     }
-    return result;
+    auto layout = reader.read<uint32_t>();
+    if (layout > Layout::MORTON)
+      throw std::invalid_argument("Snapshot has an unknown layout.");
+    info.layout = static_cast<Layout>(layout);
+    info.brickSize = reader.read<uint64_t>();
+    // Checked before the checksum, since loading sets the layout up first.
+    if (info.layout != Layout::ROW_MAJOR && info.brickSize == 0)
+      throw std::invalid_argument("Snapshot has bricks of no cells.");
+    auto updateMode = reader.read<uint32_t>();
+    if (updateMode > UpdateMode::IN_PLACE)
+      throw std::invalid_argument("Snapshot has an unknown update mode.");
+    info.updateMode = static_cast<UpdateMode>(updateMode);
+    info.paddedSize = reader.read<uint64_t>();
+    info.numBuffers = reader.read<uint64_t>();
+    for (size_t i = 0; i < info.cellSize; ++i) {
+      info.defaultValue.push_back(reader.read<char>());
+    }
+    return info;
   }
 
-  std::vector<int> generateMoore(size_t numDimensions) {
-    auto offsets = generateMooreOffsets(numDimensions);
-    std::vector<int> neighborhood;
-    for (const auto& coord : offsets) {
-      neighborhood.push_back(getOffsetIdx(coord));
+  static SnapshotInfo read(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("Can't open snapshot " + path + ".");
+
+    std::vector<char> bytes(SNAPSHOT_PREAMBLE_SIZE);
+    file.read(bytes.data(), bytes.size());
+    uint64_t dataOffset = 0;
+    if (file) {
+      std::memcpy(&dataOffset, bytes.data() + SNAPSHOT_PREAMBLE_SIZE - 8, 8);
     }
-    std::sort(neighborhood.begin(), neighborhood.end());
-    return neighborhood;
+    if (dataOffset < SNAPSHOT_PREAMBLE_SIZE || dataOffset > (1u << 30)) {
+      // Let fromBytes say what is wrong with it.
+      return fromBytes(bytes);
+    }
+    bytes.resize(dataOffset);
+    file.read(bytes.data() + SNAPSHOT_PREAMBLE_SIZE,
+              dataOffset - SNAPSHOT_PREAMBLE_SIZE);
+    if (!file) throw std::invalid_argument("Snapshot header is truncated.");
+    return fromBytes(bytes);
   }
+};
 
-  void incrementCoordinate(std::vector<size_t>& coordinate) {
-    auto i = 0;
-    do {
-      coordinate[i] = (coordinate[i] + 1) % getRealDimSize(i);
-    } while (coordinate[i] == 0 && ++i < numDimensions);
+namespace {  // Helper functions
+template <typename T>
+T multiplyAll(const std::vector<T>& vec) {
+  return std::accumulate(vec.begin(), vec.end(), T(1), std::multiplies<T>());
+}
+
+std::vector<size_t> allZeros(size_t length) {
+  auto result = std::vector<size_t>();
+  result.insert(result.begin(), length, 0);
+  return result;
+}
+
+// Index of the lowest set bit of a nonzero word.
+inline int countTrailingZeros(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(word);
+#else
+  int result = 0;
+  for (; !(word & 1); word >>= 1) {
+    ++result;
   }
+  return result;
+#endif
+}
 
-  bool isOutOfBounds(const std::vector<size_t>& coordinate) {
-    for (auto i = 0; i < numDimensions; ++i) {
-      auto coord = coordinate[i];
-      if (coord < maxNeighborDistance ||
-          coord >= shape[i] + maxNeighborDistance) {
-        return true;
+// The widest vector instruction set the running CPU supports among the ones
+// kernels are compiled for.
+enum class SimdLevel { NONE, AVX2, AVX512 };
+
+inline SimdLevel getSimdLevel() {
+#ifdef METHUSELAH_SIMD_DISPATCH
+  static const auto level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    return SimdLevel::NONE;
+  }();
+  return level;
+#else
+  return SimdLevel::NONE;
+#endif
+}
+
+template <typename T, typename = void>
+struct isEqualityComparable : std::false_type {};
+
+template <typename T>
+struct isEqualityComparable<
+    T, decltype(void(std::declval<const T&>() == std::declval<const T&>()))>
+    : std::true_type {};
+
+// Whether two runs of cells hold the same values. Cell types without an
+// operator== are compared bytewise, which may report padding differences
+// as changes but never misses a real one; anything else counts as changed.
+template <typename T>
+auto cellsEqual(const T* a, const T* b, size_t length, int)
+    -> decltype(bool(*a == *b)) {
+  return std::equal(a, a + length, b);
+}
+
+template <typename T>
+bool cellsEqual(const T* a, const T* b, size_t length, long) {
+  if (!std::is_trivially_copyable<T>::value) return false;
+  return std::memcmp(a, b, length * sizeof(T)) == 0;
+}
+
+inline uint64_t mixBits(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+// Hash of a cell's bytes at storage index idx. Grids hash their state as
+// the sum of it over every cell, which a changed cell updates by adding
+// the difference between its new and old hash.
+template <typename T>
+uint64_t hashCell(size_t idx, const T& cell) {
+  auto bytes = reinterpret_cast<const unsigned char*>(&cell);
+  if (sizeof(T) <= 4) {
+    // Index and bytes fit in one word side by side, and mixBits is a
+    // bijection, so distinct cells never collide.
+    uint64_t word = 0;
+    std::memcpy(&word, bytes, std::min<size_t>(4, sizeof(T)));
+    return mixBits(uint64_t(idx) << (8 * sizeof(T) % 64) | word);
+  }
+  auto hash = mixBits(idx + 0x9E3779B97F4A7C15ull);
+  for (size_t i = 0; i < sizeof(T); i += 8) {
+    uint64_t word = 0;
+    std::memcpy(&word, bytes + i, std::min<size_t>(8, sizeof(T) - i));
+    hash = mixBits(hash ^ word);
+  }
+  return hash;
+}
+
+// Reads 8 bytes as a word whose lowest byte is the first one.
+inline uint64_t loadLittleEndian(const unsigned char* bytes) {
+  uint64_t word;
+  std::memcpy(&word, bytes, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+// Writes word as 8 bytes, its lowest byte first.
+inline void storeLittleEndian(uint64_t word, unsigned char* bytes) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  std::memcpy(bytes, &word, 8);
+}
+
+// Bit i is set when cell i of a differs bytewise from cell i of b, for
+// the first count cells, at most 64 of them. Cells of 1, 2, 4 or 8 bytes
+// are compared a word at a time: the differing bits of each cell are ORed
+// down into its lowest one, and a multiply gathers those into the result.
+template <typename T>
+uint64_t changedCells(const T* a, const T* b, size_t count) {
+  constexpr size_t size = sizeof(T);
+  uint64_t result = 0;
+  size_t i = 0;
+  if (size <= 8 && 8 % size == 0) {
+    constexpr size_t perWord = 8 / std::min<size_t>(size, 8);
+    uint64_t lowBits = 0;
+    uint64_t gather = 0;
+    for (size_t lane = 0; lane < perWord; ++lane) {
+      lowBits |= uint64_t(1) << lane * size * 8;
+      gather |= uint64_t(1) << (56 + lane - lane * size * 8);
+    }
+    auto x = reinterpret_cast<const unsigned char*>(a);
+    auto y = reinterpret_cast<const unsigned char*>(b);
+    for (; i + perWord <= count; i += perWord) {
+      auto diff = loadLittleEndian(x + i * size) ^
+                  loadLittleEndian(y + i * size);
+      for (auto shift = size * 4; shift; shift /= 2) {
+        diff |= diff >> shift;
       }
+      result |= ((diff & lowBits) * gather) >> 56 << i;
     }
-    return false;
+  }
+  for (; i < count; ++i) {
+    result |= uint64_t(std::memcmp(a + i, b + i, size) != 0) << i;
+  }
+  return result;
+}
+
+// What replacing the length cells of previous, from storage index idx on,
+// with those of now adds to a state hash. Most cells usually stay the
+// same, so unchanged rows and blocks of 64 cells are skipped with one
+// comparison each, and only the cells set in the mask of a changed block
+// are hashed, with no branch on the ones in between.
+template <typename T>
+uint64_t hashDifference(size_t idx, const T* previous, const T* now,
+                        size_t length) {
+  if (std::memcmp(previous, now, length * sizeof(T)) == 0) return 0;
+  constexpr size_t BLOCK = 64;
+  uint64_t result = 0;
+  for (size_t x = 0; x < length; x += BLOCK) {
+    auto changed =
+        changedCells(previous + x, now + x, std::min(BLOCK, length - x));
+    while (changed) {
+      auto cell = x + countTrailingZeros(changed);
+      changed &= changed - 1;
+      result += hashCell(idx + cell, now[cell]) -
+                hashCell(idx + cell, previous[cell]);
+    }
+  }
+  return result;
+}
+
+// Offsets of the cells in a neighborhood of the given radius, the cell
+// itself excluded, with the first dimension fastest.
+std::vector<std::vector<int>> generateNeighborhoodOffsets(
+    Neighborhood neighborhood, size_t numDimensions, size_t radius) {
+  if (neighborhood == Neighborhood::CUSTOM)
+    throw InvalidOperationException(
+        "Custom neighborhoods are made of offsets given directly.");
+
+  auto r = static_cast<int>(radius);
+  std::vector<std::vector<int>> offsets;
+  std::vector<int> offset(numDimensions, -r);
+  while (numDimensions > 0) {
+    size_t taxicab = 0;
+    size_t squared = 0;
+    for (auto x : offset) {
+      taxicab += std::abs(x);
+      squared += x * x;
+    }
+    auto inside = neighborhood == Neighborhood::MOORE ||
+                  (neighborhood == Neighborhood::VON_NEUMANN &&
+                   taxicab <= radius) ||
+                  (neighborhood == Neighborhood::CIRCULAR &&
+                   squared <= radius * radius);
+    if (inside && taxicab > 0) {
+      offsets.push_back(offset);
+    }
+
+    size_t i = 0;
+    for (; i < numDimensions; ++i) {
+      if (++offset[i] <= r) break;
+      offset[i] = -r;
+    }
+    if (i == numDimensions) break;
+  }
+  return offsets;
+}
+
+}  // namespace
+
+// Rule tables
+// ===========-----------------------------------------------------------------
+// A rule functor evaluated once for every configuration of a cell and its
+// neighbors, for rules with few enough states that it pays to. Each state
+// gets a code of bitsPerCell bits, its index in states, and the next state
+// is looked up by the codes of the cell and its neighbors, each shifted to
+// its own place in the index (getShift). Cells are told apart by their
+// bytes, so T must be trivially copyable and at most two bytes wide; cells
+// that aren't one of the states read as states[0].
+//
+// Tables for eight neighbors take them in the order of a 2D Moore
+// neighborhood and lay the index out as the 3x3 block around the cell,
+// column by column, so Grid can put it together from the packed columns
+// of three cells at once. Binary ones also get a table of the 2x2 block of
+// next states at the center of every 4x4 block of cells, which updates
+// four cells per lookup. Bit r * 4 + c of its index is the cell in row r and
+// column c of the 4x4 block, and bit r * 2 + c of an entry the next state
+// of the center cell in row r + 1 and column c + 1.
+template <typename T>
+class RuleTable {
+ public:
+  // Indices get at most this many bits, which bounds a table to 16M cells.
+  static constexpr size_t MAX_INDEX_BITS = 24;
+
+  // The table for a stateless Rule and states. Tables are cached, so every
+  // grid running the same rule over the same states shares one.
+  template <typename Rule>
+  static std::shared_ptr<const RuleTable> get(const std::vector<T>& states) {
+    static_assert(std::is_empty<Rule>::value,
+                  "Only stateless rules are cached, use compile() instead.");
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::shared_ptr<const RuleTable>>
+        cache;
+
+    std::string key(reinterpret_cast<const char*>(states.data()),
+                    states.size() * sizeof(T));
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& table = cache[key];
+    if (!table) {
+      table = compile(Rule(), states);
+    }
+    return table;
+  }
+
+  // Tabulates rule, which follows the same contract as the rule functors
+  // Grid::update takes, over states.
+  template <typename Rule>
+  static std::shared_ptr<const RuleTable> compile(
+      const Rule& rule, const std::vector<T>& states) {
+    // Checked here rather than on the class, which overload resolution
+    // instantiates for any Grid<T>.
+    static_assert(std::is_trivially_copyable<T>::value && sizeof(T) <= 2,
+                  "Rule tables need trivially copyable cells of up to 2 "
+                  "bytes.");
+    constexpr auto numNeighbors = Rule::numNeighbors;
+    std::shared_ptr<RuleTable> result(new RuleTable(states, numNeighbors));
+    auto& table = *result;
+
+    // The cell goes first and its neighbors after it.
+    std::array<long int, numNeighbors> offsets;
+    std::iota(offsets.begin(), offsets.end(), 1);
+    std::array<T, numNeighbors + 1> cells;
+    auto mask = (uint32_t(1) << table.bitsPerCell) - 1;
+    for (uint32_t index = 0; index < table.next.size(); ++index) {
+      auto valid = true;
+      for (size_t j = 0; j <= numNeighbors; ++j) {
+        auto code = index >> table.shifts[j] & mask;
+        valid = valid && code < states.size();
+        cells[j] = states[valid ? code : 0];
+      }
+      if (!valid) continue;
+
+      auto cell = cells[0];
+      rule(cell, StencilView<T, numNeighbors>(cells.data(), offsets.data()));
+      if (!table.contains(cell))
+        throw InvalidOperationException(
+            "Rule produced a cell that isn't one of the table's states.");
+      table.next[index] = cell;
+    }
+
+    if (states.size() == 2 && table.isWindowed()) {
+      table.compileBlocks();
+    }
+    return result;
+  }
+
+  size_t getNumNeighbors() const { return numNeighbors; }
+
+  size_t getBitsPerCell() const { return bitsPerCell; }
+
+  const std::vector<T>& getStates() const { return states; }
+
+  bool contains(const T& cell) const {
+    auto key = getKey(cell);
+    return std::any_of(states.begin(), states.end(),
+                       [&](const T& state) { return getKey(state) == key; });
+  }
+
+  // Where the code of the cell (slot 0) or of neighbor slot - 1 goes in
+  // the index.
+  size_t getShift(size_t slot) const { return shifts[slot]; }
+
+  bool isWindowed() const { return numNeighbors == mooreNeighborhoodSize(2); }
+
+  bool hasBlockTable() const { return !nextBlock.empty(); }
+
+  uint32_t getCode(const T& cell) const { return codes[getKey(cell)]; }
+
+  // Writes the codes of count cells to out.
+  void getCodes(const T* cells, size_t count, uint8_t* out) const {
+    auto table = codes.data();
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = table[getKey(cells[i])];
+    }
+  }
+
+  const T& getNext(uint32_t index) const { return next[index]; }
+
+  // Writes the next states of count indices to out.
+  void getNexts(const uint32_t* indices, size_t count, T* out) const {
+    auto table = next.data();
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = table[indices[i]];
+    }
+  }
+
+  uint8_t getNextBlock(uint32_t index) const { return nextBlock[index]; }
+
+ private:
+  // 2D Moore neighbors in the order Grid sorts them in: by row, then by
+  // column.
+  static constexpr int MOORE_2D[8][2] = {{-1, -1}, {0, -1}, {1, -1}, {-1, 0},
+                                         {1, 0},   {-1, 1}, {0, 1},  {1, 1}};
+
+  std::vector<T> states;
+  size_t numNeighbors;
+  size_t bitsPerCell;
+  std::vector<size_t> shifts;
+  // Code of every possible key.
+  std::vector<uint8_t> codes;
+  std::vector<T> next;
+  std::vector<uint8_t> nextBlock;
+
+  RuleTable(const std::vector<T>& states, size_t numNeighbors)
+      : states(states), numNeighbors(numNeighbors), bitsPerCell(1) {
+    if (states.empty() || states.size() > 256)
+      throw std::invalid_argument("Rule tables need between 1 and 256 states.");
+    while (size_t(1) << bitsPerCell < states.size()) {
+      ++bitsPerCell;
+    }
+    if (bitsPerCell * (numNeighbors + 1) > MAX_INDEX_BITS)
+      throw InvalidOperationException(
+          "Rule has too many configurations to tabulate.");
+
+    for (size_t slot = 0; slot <= numNeighbors; ++slot) {
+      shifts.push_back(slot * bitsPerCell);
+    }
+    if (isWindowed()) {
+      shifts[0] = 4 * bitsPerCell;
+      for (size_t j = 0; j < numNeighbors; ++j) {
+        auto column = MOORE_2D[j][0] + 1;
+        auto row = MOORE_2D[j][1] + 1;
+        shifts[j + 1] = (column * 3 + row) * bitsPerCell;
+      }
+    }
+
+    codes.assign(size_t(1) << (8 * sizeof(T)), 0);
+    for (size_t code = 0; code < states.size(); ++code) {
+      auto key = getKey(states[code]);
+      for (size_t other = 0; other < code; ++other) {
+        if (getKey(states[other]) == key)
+          throw std::invalid_argument("Rule table states must be distinct.");
+      }
+      codes[key] = static_cast<uint8_t>(code);
+    }
+    next.assign(size_t(1) << (bitsPerCell * (numNeighbors + 1)), states[0]);
+  }
+
+  static uint32_t getKey(const T& cell) {
+    uint16_t key = 0;
+    std::memcpy(&key, &cell, sizeof(T));
+    return key;
+  }
+
+  void compileBlocks() {
+    nextBlock.assign(size_t(1) << 16, 0);
+    for (uint32_t index = 0; index < nextBlock.size(); ++index) {
+      auto bit = [&](int x, int y) { return index >> (y * 4 + x) & 1; };
+      uint8_t block = 0;
+      for (int y = 1; y <= 2; ++y) {
+        for (int x = 1; x <= 2; ++x) {
+          auto cellIndex = bit(x, y) << shifts[0];
+          for (int j = 0; j < 8; ++j) {
+            cellIndex |= bit(x + MOORE_2D[j][0], y + MOORE_2D[j][1])
+                         << shifts[j + 1];
+          }
+          block |= getCode(next[cellIndex]) << ((y - 1) * 2 + x - 1);
+        }
+      }
+      nextBlock[index] = block;
+    }
+  }
+};
+
+// History
+// =======---------------------------------------------------------------------
+// The runs of changed cells a thread of a Grid found in the rows it wrote,
+// in the order it wrote them, for a HistoryRecorder to join into a delta.
+// Each row's first run is offset from the row's first cell rather than
+// from the end of the run before.
+struct HistoryDeltaRows {
+  struct Row {
+    // Cell numbers of the row's first cell and of the end of its last run.
+    uint64_t cellIdx;
+    uint64_t runEnd;
+    // The row's runs in bytes.
+    size_t begin;
+    size_t end;
+  };
+
+  std::vector<uint8_t> bytes;
+  std::vector<Row> rows;
+
+  void clear() {
+    bytes.clear();
+    rows.clear();
+  }
+};
+
+// Records the generations of a Grid for replay and rewinding. Every
+// keyframeInterval generations a keyframe holds every cell; the generations
+// in between are deltas holding the cells that changed since the one
+// before. A delta is a sequence of runs of changed cells, each written as
+// the number of unchanged cells before it and its length, both as varints,
+// followed by the new values. Cells are numbered in row-major order with
+// the first dimension fastest, whatever the grid's layout.
+//
+// Frames either go into an in-memory ring that drops the oldest keyframe
+// and its deltas once it holds more than maxBytes, or are streamed to a
+// file. Any generation still held decodes from the keyframe before it.
+// Cells are stored bytewise, so T must be trivially copyable.
+template <typename T>
+class HistoryRecorder {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "HistoryRecorder stores cells bytewise.");
+
+  struct Frame {
+    uint64_t generation;
+    bool keyframe;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+ public:
+  // Records into memory.
+  explicit HistoryRecorder(size_t keyframeInterval = 64,
+                           size_t maxBytes = size_t(256) << 20)
+      : keyframeInterval(std::max<size_t>(keyframeInterval, 1)),
+        maxBytes(maxBytes),
+        numCells(0),
+        byteSize(0) {}
+
+  // Records into a new file at path, replacing any file there.
+  HistoryRecorder(const std::string& path, size_t keyframeInterval = 64)
+      : HistoryRecorder(keyframeInterval, 0) {
+    file.reset(new std::fstream(path, std::ios::binary | std::ios::in |
+                                          std::ios::out | std::ios::trunc));
+    if (!*file) throw std::runtime_error("Can't create history " + path + ".");
+    this->path = path;
+  }
+
+  // Opens a file written by a HistoryRecorder to replay it, or to record
+  // more generations after the last one in it.
+  static std::shared_ptr<HistoryRecorder> open(const std::string& path) {
+    std::shared_ptr<HistoryRecorder> recorder(new HistoryRecorder(1, 0));
+    recorder->file.reset(
+        new std::fstream(path, std::ios::binary | std::ios::in |
+                                   std::ios::out));
+    auto& file = *recorder->file;
+    if (!file) throw std::runtime_error("Can't open history " + path + ".");
+    recorder->path = path;
+
+    char magic[8];
+    uint32_t version, byteOrder;
+    uint64_t cellSize, numCells, keyframeInterval;
+    file.read(magic, 8);
+    file.read(reinterpret_cast<char*>(&version), 4);
+    file.read(reinterpret_cast<char*>(&byteOrder), 4);
+    file.read(reinterpret_cast<char*>(&cellSize), 8);
+    file.read(reinterpret_cast<char*>(&numCells), 8);
+    file.read(reinterpret_cast<char*>(&keyframeInterval), 8);
+    if (!file || !std::equal(magic, magic + 8, HISTORY_MAGIC))
+      throw std::invalid_argument("Not a history file.");
+    if (version != HISTORY_VERSION || byteOrder != SNAPSHOT_BYTE_ORDER)
+      throw std::invalid_argument("Unsupported history file.");
+    if (cellSize != sizeof(T))
+      throw InvalidOperationException(
+          "History was recorded with a different cell type.");
+    recorder->numCells = numCells;
+    recorder->keyframeInterval = std::max<uint64_t>(keyframeInterval, 1);
+
+    // A frame cut short by a crash ends the history.
+    file.seekg(0, std::ios::end);
+    uint64_t fileSize = file.tellg();
+    uint64_t offset = HISTORY_HEADER_SIZE;
+    while (offset + HISTORY_FRAME_HEADER_SIZE <= fileSize) {
+      uint8_t keyframe;
+      uint64_t generation, length;
+      file.seekg(offset);
+      file.read(reinterpret_cast<char*>(&keyframe), 1);
+      file.read(reinterpret_cast<char*>(&generation), 8);
+      file.read(reinterpret_cast<char*>(&length), 8);
+      auto payload = offset + HISTORY_FRAME_HEADER_SIZE;
+      if (!file || length > fileSize - payload) break;
+      if (recorder->frames.empty() && !keyframe) break;
+      recorder->frames.push_back(
+          Frame{generation, keyframe != 0, payload, length});
+      recorder->byteSize += length;
+      offset = payload + length;
+    }
+    file.clear();
+    recorder->fileEnd = offset;
+    return recorder;
+  }
+
+  bool isEmpty() const { return frames.empty(); }
+
+  // The range of generations that can be decoded.
+  uint64_t getFirstGeneration() const {
+    checkNotEmpty();
+    return frames.front().generation;
+  }
+
+  uint64_t getLastGeneration() const {
+    checkNotEmpty();
+    return frames.back().generation;
+  }
+
+  size_t getKeyframeInterval() const { return keyframeInterval; }
+
+  size_t getNumCells() const { return numCells; }
+
+  // Bytes of frames held.
+  size_t getByteSize() const { return byteSize; }
+
+  // Every cell of a recorded generation, in row-major order with the first
+  // dimension fastest.
+  std::vector<T> decode(uint64_t generation) {
+    if (frames.empty() || generation < frames.front().generation ||
+        generation > frames.back().generation)
+      throw std::out_of_range("Generation " + std::to_string(generation) +
+                              " is not recorded.");
+
+    // Frames hold consecutive generations from each keyframe on.
+    auto end = std::upper_bound(frames.begin(), frames.end(), generation,
+                                [](uint64_t g, const Frame& frame) {
+                                  return g < frame.generation;
+                                });
+    auto key = end;
+    do {
+      --key;
+    } while (!key->keyframe);
+
+    std::vector<T> cells(numCells);
+    std::vector<uint8_t> scratch;
+    for (auto frame = key; frame != end; ++frame) {
+      const auto& bytes = readFrame(frame - frames.begin(), scratch);
+      if (frame->keyframe) {
+        std::memcpy(cells.data(), bytes.data(), numCells * sizeof(T));
+      } else {
+        applyDelta(bytes, cells.data());
+      }
+    }
+    return cells;
+  }
+
+  // Whether recording generation of a grid of numCells cells takes a
+  // keyframe: generations that don't follow the last one start with one.
+  bool needsKeyframe(uint64_t generation, size_t numCells) const {
+    return this->numCells != numCells || frames.empty() ||
+           generation != frames.back().generation + 1 ||
+           generation - lastKeyframe() >= keyframeInterval;
+  }
+
+  // Records generation as a keyframe, calling forEachRow(f) for f(cells,
+  // length) to go over every row of cells in order, after dropping any
+  // recorded generations from there on.
+  template <typename ForEachRow>
+  void recordKeyframe(uint64_t generation, size_t numCells,
+                      ForEachRow&& forEachRow) {
+    if (this->numCells != numCells) {
+      if (!frames.empty())
+        throw InvalidOperationException(
+            "History was recorded from a grid of a different size.");
+      this->numCells = numCells;
+    }
+    if (!frames.empty() && generation <= frames.back().generation) {
+      truncate(generation);
+    }
+
+    std::vector<uint8_t> bytes(numCells * sizeof(T));
+    size_t cellIdx = 0;
+    forEachRow([&](const T* cells, size_t length) {
+      std::memcpy(bytes.data() + cellIdx * sizeof(T), cells,
+                  length * sizeof(T));
+      cellIdx += length;
+    });
+    appendFrame(generation, true, bytes);
+  }
+
+  // Records generation, which must not need a keyframe, as a delta from
+  // the last one, calling forEachPart(f) for f(rows) to go over the
+  // HistoryDeltaRows it was taken into.
+  template <typename ForEachPart>
+  void recordDelta(uint64_t generation, ForEachPart&& forEachPart) {
+    using Row = HistoryDeltaRows::Row;
+    std::vector<std::pair<const Row*, const uint8_t*>> rows;
+    size_t numBytes = 0;
+    forEachPart([&](const HistoryDeltaRows& part) {
+      for (const auto& row : part.rows) {
+        rows.emplace_back(&row, part.bytes.data());
+      }
+      numBytes += part.bytes.size();
+    });
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+      return a.first->cellIdx < b.first->cellIdx;
+    });
+
+    // Only the offset of each row's first run changes.
+    std::vector<uint8_t> bytes;
+    bytes.reserve(numBytes + rows.size() * 2);
+    uint64_t runEnd = 0;
+    for (const auto& entry : rows) {
+      const auto& row = *entry.first;
+      auto position = row.begin;
+      auto offset = readVarint(entry.second, row.end, position);
+      appendVarint(row.cellIdx + offset - runEnd, bytes);
+      bytes.insert(bytes.end(), entry.second + position,
+                   entry.second + row.end);
+      runEnd = row.runEnd;
+    }
+    appendFrame(generation, false, bytes);
+  }
+
+  // Adds the runs of the length cells from cell number cellIdx on that
+  // differ from previous to rows. Cells are compared bytewise, since
+  // decoding has to restore them bit for bit: -0.0 differs from 0.0, and
+  // NaN equals itself.
+  static void encodeRow(uint64_t cellIdx, const T* cells, const T* previous,
+                        size_t length, HistoryDeltaRows& rows) {
+    // Whole rows usually match, and are skipped with one comparison, the
+    // unchanged blocks of 64 cells of the others with one each. The cells
+    // of a changed block are compared into a mask, whose edges are where
+    // runs start and end, so only those branch.
+    if (std::memcmp(cells, previous, length * sizeof(T)) == 0) return;
+    constexpr size_t BLOCK = 64;
+    // bytes grows ahead of the runs written to it, by enough for a block of
+    // short runs, and is cut back to the bytes used at the end.
+    auto& bytes = rows.bytes;
+    auto begin = bytes.size();
+    auto used = begin;
+    size_t runEnd = 0;
+    size_t start = 0;
+    auto inRun = false;
+    // Short runs are copied as a fixed SHORT_RUN bytes where the row has
+    // them, which is far cheaper than a copy of variable length.
+    constexpr size_t SHORT_RUN = 16;
+    auto rowBytes = length * sizeof(T);
+    auto endRun = [&](size_t end) {
+      auto runBytes = (end - start) * sizeof(T);
+      auto needed =
+          used + 2 * MAX_VARINT_BYTES + std::max(runBytes, SHORT_RUN);
+      if (needed > bytes.size()) {
+        bytes.resize(needed + BLOCK * (sizeof(T) + 2 * MAX_VARINT_BYTES));
+      }
+      auto out = writeVarint(start - runEnd, &bytes[used]);
+      out = writeVarint(end - start, out);
+      if (runBytes <= SHORT_RUN && start * sizeof(T) + SHORT_RUN <= rowBytes) {
+        std::memcpy(out, cells + start, SHORT_RUN);
+      } else {
+        std::memcpy(out, cells + start, runBytes);
+      }
+      used = static_cast<size_t>(out - bytes.data()) + runBytes;
+      runEnd = end;
+    };
+    for (size_t x = 0; x < length; x += BLOCK) {
+      auto count = std::min(BLOCK, length - x);
+      uint64_t changed = 0;
+      if (std::memcmp(cells + x, previous + x, count * sizeof(T)) != 0) {
+        changed = bridgeGaps(changedCells(cells + x, previous + x, count),
+                             inRun);
+      }
+      auto edges = changed ^ (changed << 1 | uint64_t(inRun));
+      if (count < BLOCK) {
+        edges &= (uint64_t(1) << count) - 1;
+      }
+      while (edges) {
+        auto position = x + countTrailingZeros(edges);
+        edges &= edges - 1;
+        if (inRun) {
+          endRun(position);
+        } else {
+          start = position;
+        }
+        inRun = !inRun;
+      }
+    }
+    if (inRun) endRun(length);
+    bytes.resize(used);
+    if (used != begin) {
+      rows.rows.push_back({cellIdx, cellIdx + runEnd, begin, used});
+    }
+  }
+
+  // Drops every generation from generation on.
+  void truncate(uint64_t generation) {
+    auto end = std::lower_bound(frames.begin(), frames.end(), generation,
+                                [](const Frame& frame, uint64_t g) {
+                                  return frame.generation < g;
+                                });
+    if (frames.end() == end) return;
+    while (frames.end() != end) {
+      byteSize -= frames.back().length;
+      if (file) {
+        fileEnd = frames.back().offset - HISTORY_FRAME_HEADER_SIZE;
+      } else {
+        ring.pop_back();
+      }
+      frames.pop_back();
+    }
+    if (file) {
+      file->flush();
+      std::filesystem::resize_file(path, fileEnd);
+    }
+  }
+
+ private:
+  static constexpr char HISTORY_MAGIC[8] = {'M', 'E', 'T', 'H',
+                                            'H', 'I', 'S', 'T'};
+  static constexpr uint32_t HISTORY_VERSION = 1;
+  static constexpr uint64_t HISTORY_HEADER_SIZE = 40;
+  // Keyframe flag, generation and payload length.
+  static constexpr uint64_t HISTORY_FRAME_HEADER_SIZE = 17;
+
+  size_t keyframeInterval;
+  size_t maxBytes;
+  size_t numCells;
+  size_t byteSize;
+  std::deque<Frame> frames;
+  std::deque<std::vector<uint8_t>> ring;
+  std::unique_ptr<std::fstream> file;
+  std::string path;
+  uint64_t fileEnd = HISTORY_HEADER_SIZE;
+
+  void checkNotEmpty() const {
+    if (frames.empty())
+      throw InvalidOperationException("Nothing has been recorded.");
+  }
+
+  uint64_t lastKeyframe() const {
+    for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+      if (frame->keyframe) return frame->generation;
+    }
+    return 0;
+  }
+
+  void applyDelta(const std::vector<uint8_t>& bytes, T* cells) const {
+    size_t position = 0;
+    size_t cellIdx = 0;
+    while (position < bytes.size()) {
+      cellIdx += readVarint(bytes.data(), bytes.size(), position);
+      auto length = readVarint(bytes.data(), bytes.size(), position);
+      if (cellIdx + length > numCells ||
+          position + length * sizeof(T) > bytes.size())
+        throw std::invalid_argument("History delta is corrupt.");
+      std::memcpy(cells + cellIdx, bytes.data() + position,
+                  length * sizeof(T));
+      position += length * sizeof(T);
+      cellIdx += length;
+    }
+  }
+
+  // Joins the runs in a mask of changed cells that are at most as many
+  // bytes apart as the header of a run takes, which is at least two. The
+  // joined run is no larger, and costs one run less to write and apply.
+  // inRun is whether the cell before the first one changed.
+  static uint64_t bridgeGaps(uint64_t changed, bool inRun) {
+    auto before = changed << 1 | uint64_t(inRun);
+    auto gaps = ~changed;
+    if (sizeof(T) <= 2) {
+      changed |= before & gaps & changed >> 1;
+    }
+    if (sizeof(T) == 1) {
+      auto pairs = before & gaps & gaps >> 1 & changed >> 2;
+      changed |= pairs | pairs << 1;
+    }
+    return changed;
+  }
+
+  // A varint of a 64-bit value takes at most this many bytes.
+  static constexpr size_t MAX_VARINT_BYTES = 10;
+
+  // Writes value as a varint to out, and returns the end of it.
+  static uint8_t* writeVarint(uint64_t value, uint8_t* out) {
+    while (value >= 0x80) {
+      *out++ = static_cast<uint8_t>(value | 0x80);
+      value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+  }
+
+  static void appendVarint(uint64_t value, std::vector<uint8_t>& bytes) {
+    while (value >= 0x80) {
+      bytes.push_back(static_cast<uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+  }
+
+  static uint64_t readVarint(const uint8_t* bytes, size_t end,
+                             size_t& position) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (position >= end)
+        throw std::invalid_argument("History delta is corrupt.");
+      auto byte = bytes[position++];
+      value |= uint64_t(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    throw std::invalid_argument("History delta is corrupt.");
+  }
+
+  void appendFrame(uint64_t generation, bool keyframe,
+                   std::vector<uint8_t>& bytes) {
+    Frame frame{generation, keyframe, 0, bytes.size()};
+    if (file) {
+      if (fileEnd == HISTORY_HEADER_SIZE) {
+        writeFileHeader();
+      }
+      uint8_t flag = keyframe;
+      file->seekp(fileEnd);
+      file->write(reinterpret_cast<const char*>(&flag), 1);
+      file->write(reinterpret_cast<const char*>(&generation), 8);
+      file->write(reinterpret_cast<const char*>(&frame.length), 8);
+      file->write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+      file->flush();
+      if (!*file)
+        throw std::runtime_error("Can't write history " + path + ".");
+      frame.offset = fileEnd + HISTORY_FRAME_HEADER_SIZE;
+      fileEnd = frame.offset + frame.length;
+    } else {
+      ring.push_back(std::move(bytes));
+    }
+    frames.push_back(frame);
+    byteSize += frame.length;
+
+    if (file) return;
+    // Drop whole keyframe groups, always keeping the newest one.
+    while (byteSize > maxBytes) {
+      auto next = std::find_if(frames.begin() + 1, frames.end(),
+                               [](const Frame& f) { return f.keyframe; });
+      if (next == frames.end()) break;
+      while (frames.begin() != next) {
+        byteSize -= frames.front().length;
+        frames.pop_front();
+        ring.pop_front();
+      }
+    }
+  }
+
+  void writeFileHeader() {
+    uint64_t cellSize = sizeof(T);
+    uint64_t cells = numCells;
+    uint64_t interval = keyframeInterval;
+    file->seekp(0);
+    file->write(HISTORY_MAGIC, 8);
+    file->write(reinterpret_cast<const char*>(&HISTORY_VERSION), 4);
+    file->write(reinterpret_cast<const char*>(&SNAPSHOT_BYTE_ORDER), 4);
+    file->write(reinterpret_cast<const char*>(&cellSize), 8);
+    file->write(reinterpret_cast<const char*>(&cells), 8);
+    file->write(reinterpret_cast<const char*>(&interval), 8);
+  }
+
+  // The payload of frames[index], read into scratch from a file.
+  const std::vector<uint8_t>& readFrame(size_t index,
+                                        std::vector<uint8_t>& scratch) {
+    if (!file) return ring[index];
+    const auto& frame = frames[index];
+    scratch.resize(frame.length);
+    file->seekg(frame.offset);
+    file->read(reinterpret_cast<char*>(scratch.data()), frame.length);
+    if (!*file) throw std::runtime_error("Can't read history " + path + ".");
+    return scratch;
+  }
+};
+
+// Convolution
+// ===========-----------------------------------------------------------------
+namespace {
+
+// The radix-2 butterflies of count sequences at once: with t = w * b,
+// a becomes a + t and b becomes a - t, lane by lane.
+template <typename R>
+void fftButterfliesScalar(R* re0, R* im0, R* re1, R* im1, R wr, R wi,
+                          size_t count) {
+  for (size_t l = 0; l < count; ++l) {
+    auto tr = re1[l] * wr - im1[l] * wi;
+    auto ti = re1[l] * wi + im1[l] * wr;
+    re1[l] = re0[l] - tr;
+    im1[l] = im0[l] - ti;
+    re0[l] += tr;
+    im0[l] += ti;
+  }
+}
+
+#ifdef METHUSELAH_SIMD_DISPATCH
+METHUSELAH_TARGET("avx2")
+void fftButterfliesAvx2(float* re0, float* im0, float* re1, float* im1,
+                        float wr, float wi, size_t count) {
+  size_t l = 0;
+  auto wrs = _mm256_set1_ps(wr);
+  auto wis = _mm256_set1_ps(wi);
+  for (; l + 8 <= count; l += 8) {
+    auto br = _mm256_loadu_ps(re1 + l);
+    auto bi = _mm256_loadu_ps(im1 + l);
+    auto tr = _mm256_sub_ps(_mm256_mul_ps(br, wrs), _mm256_mul_ps(bi, wis));
+    auto ti = _mm256_add_ps(_mm256_mul_ps(br, wis), _mm256_mul_ps(bi, wrs));
+    auto ar = _mm256_loadu_ps(re0 + l);
+    auto ai = _mm256_loadu_ps(im0 + l);
+    _mm256_storeu_ps(re0 + l, _mm256_add_ps(ar, tr));
+    _mm256_storeu_ps(im0 + l, _mm256_add_ps(ai, ti));
+    _mm256_storeu_ps(re1 + l, _mm256_sub_ps(ar, tr));
+    _mm256_storeu_ps(im1 + l, _mm256_sub_ps(ai, ti));
+  }
+  fftButterfliesScalar(re0 + l, im0 + l, re1 + l, im1 + l, wr, wi,
+                       count - l);
+}
+
+METHUSELAH_TARGET("avx512f")
+void fftButterfliesAvx512(float* re0, float* im0, float* re1, float* im1,
+                          float wr, float wi, size_t count) {
+  size_t l = 0;
+  auto wrs = _mm512_set1_ps(wr);
+  auto wis = _mm512_set1_ps(wi);
+  for (; l + 16 <= count; l += 16) {
+    auto br = _mm512_loadu_ps(re1 + l);
+    auto bi = _mm512_loadu_ps(im1 + l);
+    auto tr = _mm512_sub_ps(_mm512_mul_ps(br, wrs), _mm512_mul_ps(bi, wis));
+    auto ti = _mm512_add_ps(_mm512_mul_ps(br, wis), _mm512_mul_ps(bi, wrs));
+    auto ar = _mm512_loadu_ps(re0 + l);
+    auto ai = _mm512_loadu_ps(im0 + l);
+    _mm512_storeu_ps(re0 + l, _mm512_add_ps(ar, tr));
+    _mm512_storeu_ps(im0 + l, _mm512_add_ps(ai, ti));
+    _mm512_storeu_ps(re1 + l, _mm512_sub_ps(ar, tr));
+    _mm512_storeu_ps(im1 + l, _mm512_sub_ps(ai, ti));
+  }
+  fftButterfliesScalar(re0 + l, im0 + l, re1 + l, im1 + l, wr, wi,
+                       count - l);
+}
+
+METHUSELAH_TARGET("avx2")
+void fftButterfliesAvx2(double* re0, double* im0, double* re1, double* im1,
+                        double wr, double wi, size_t count) {
+  size_t l = 0;
+  auto wrs = _mm256_set1_pd(wr);
+  auto wis = _mm256_set1_pd(wi);
+  for (; l + 4 <= count; l += 4) {
+    auto br = _mm256_loadu_pd(re1 + l);
+    auto bi = _mm256_loadu_pd(im1 + l);
+    auto tr = _mm256_sub_pd(_mm256_mul_pd(br, wrs), _mm256_mul_pd(bi, wis));
+    auto ti = _mm256_add_pd(_mm256_mul_pd(br, wis), _mm256_mul_pd(bi, wrs));
+    auto ar = _mm256_loadu_pd(re0 + l);
+    auto ai = _mm256_loadu_pd(im0 + l);
+    _mm256_storeu_pd(re0 + l, _mm256_add_pd(ar, tr));
+    _mm256_storeu_pd(im0 + l, _mm256_add_pd(ai, ti));
+    _mm256_storeu_pd(re1 + l, _mm256_sub_pd(ar, tr));
+    _mm256_storeu_pd(im1 + l, _mm256_sub_pd(ai, ti));
+  }
+  fftButterfliesScalar(re0 + l, im0 + l, re1 + l, im1 + l, wr, wi,
+                       count - l);
+}
+
+METHUSELAH_TARGET("avx512f")
+void fftButterfliesAvx512(double* re0, double* im0, double* re1, double* im1,
+                          double wr, double wi, size_t count) {
+  size_t l = 0;
+  auto wrs = _mm512_set1_pd(wr);
+  auto wis = _mm512_set1_pd(wi);
+  for (; l + 8 <= count; l += 8) {
+    auto br = _mm512_loadu_pd(re1 + l);
+    auto bi = _mm512_loadu_pd(im1 + l);
+    auto tr = _mm512_sub_pd(_mm512_mul_pd(br, wrs), _mm512_mul_pd(bi, wis));
+    auto ti = _mm512_add_pd(_mm512_mul_pd(br, wis), _mm512_mul_pd(bi, wrs));
+    auto ar = _mm512_loadu_pd(re0 + l);
+    auto ai = _mm512_loadu_pd(im0 + l);
+    _mm512_storeu_pd(re0 + l, _mm512_add_pd(ar, tr));
+    _mm512_storeu_pd(im0 + l, _mm512_add_pd(ai, ti));
+    _mm512_storeu_pd(re1 + l, _mm512_sub_pd(ar, tr));
+    _mm512_storeu_pd(im1 + l, _mm512_sub_pd(ai, ti));
+  }
+  fftButterfliesScalar(re0 + l, im0 + l, re1 + l, im1 + l, wr, wi,
+                       count - l);
+}
+#endif
+
+inline void fftButterflies(float* re0, float* im0, float* re1, float* im1,
+                           float wr, float wi, size_t count) {
+#ifdef METHUSELAH_SIMD_DISPATCH
+  switch (getSimdLevel()) {
+    case SimdLevel::AVX512:
+      return fftButterfliesAvx512(re0, im0, re1, im1, wr, wi, count);
+    case SimdLevel::AVX2:
+      return fftButterfliesAvx2(re0, im0, re1, im1, wr, wi, count);
+    case SimdLevel::NONE:
+      break;
+  }
+#endif
+  fftButterfliesScalar(re0, im0, re1, im1, wr, wi, count);
+}
+
+inline void fftButterflies(double* re0, double* im0, double* re1,
+                           double* im1, double wr, double wi, size_t count) {
+#ifdef METHUSELAH_SIMD_DISPATCH
+  switch (getSimdLevel()) {
+    case SimdLevel::AVX512:
+      return fftButterfliesAvx512(re0, im0, re1, im1, wr, wi, count);
+    case SimdLevel::AVX2:
+      return fftButterfliesAvx2(re0, im0, re1, im1, wr, wi, count);
+    case SimdLevel::NONE:
+      break;
+  }
+#endif
+  fftButterfliesScalar(re0, im0, re1, im1, wr, wi, count);
+}
+
+}  // namespace
+
+// A discrete Fourier transform of one length, run over a batch of
+// sequences at once. The sequences are interleaved lane by lane, element k
+// of sequence l at index k * batch + l of split real and imaginary arrays,
+// so every butterfly works on whole vectors of lanes. Powers of two go
+// through iterative radix-2 Cooley-Tukey; other lengths through Bluestein's
+// algorithm, as a convolution with a chirp of a power of two length at
+// least twice as long.
+template <typename T>
+class FFT {
+ public:
+  explicit FFT(size_t length) : length(length) {
+    static_assert(std::is_floating_point<T>::value,
+                  "FFTs need floating point values.");
+    if (length == 0)
+      throw std::invalid_argument("FFT length must be positive.");
+
+    if ((length & (length - 1)) == 0) {
+      size_t bits = 0;
+      while (size_t(1) << bits < length) {
+        ++bits;
+      }
+      bitReversed.resize(length);
+      for (size_t i = 0; i < length; ++i) {
+        size_t reversed = 0;
+        for (size_t b = 0; b < bits; ++b) {
+          reversed |= (i >> b & 1) << (bits - 1 - b);
+        }
+        bitReversed[i] = reversed;
+      }
+      for (size_t j = 0; j < length / 2; ++j) {
+        auto angle = -2 * PI * static_cast<double>(j) / length;
+        twiddleRe.push_back(static_cast<T>(std::cos(angle)));
+        twiddleIm.push_back(static_cast<T>(std::sin(angle)));
+      }
+      return;
+    }
+
+    // X[k] = c[k] * sum over j of x[j] c[j] conj(c[k - j]), with the chirp
+    // c[k] = e^(-i pi k^2 / n), as a cyclic convolution of length m.
+    size_t m = 1;
+    while (m < 2 * length - 1) {
+      m *= 2;
+    }
+    inner.reset(new FFT(m));
+    for (size_t k = 0; k < length; ++k) {
+      auto angle = -PI * static_cast<double>(k * k % (2 * length)) / length;
+      chirpRe.push_back(static_cast<T>(std::cos(angle)));
+      chirpIm.push_back(static_cast<T>(std::sin(angle)));
+    }
+    filterRe.assign(m, 0);
+    filterIm.assign(m, 0);
+    for (size_t k = 0; k < length; ++k) {
+      filterRe[k] = filterRe[(m - k) % m] = chirpRe[k] / m;
+      filterIm[k] = filterIm[(m - k) % m] = -chirpIm[k] / m;
+    }
+    inner->transformPowerOfTwo(filterRe.data(), filterIm.data(), 1, false);
+  }
+
+  size_t getLength() const { return length; }
+
+  // Transforms batch sequences in place. Forward transforms multiply by
+  // e^(-2 pi i jk / n), inverse ones by e^(2 pi i jk / n) without scaling
+  // by 1 / n. scratch is only used by lengths that aren't powers of two.
+  void transform(T* re, T* im, size_t batch, bool inverse,
+                 std::vector<T>& scratch) const {
+    if (inner) {
+      transformBluestein(re, im, batch, inverse, scratch);
+    } else {
+      transformPowerOfTwo(re, im, batch, inverse);
+    }
+  }
+
+ private:
+  static constexpr double PI = 3.14159265358979323846;
+
+  size_t length;
+  std::vector<size_t> bitReversed;
+  std::vector<T> twiddleRe;
+  std::vector<T> twiddleIm;
+  std::shared_ptr<const FFT> inner;
+  std::vector<T> chirpRe;
+  std::vector<T> chirpIm;
+  // Spectrum of the conjugate chirp, scaled by 1 / m.
+  std::vector<T> filterRe;
+  std::vector<T> filterIm;
+
+  void transformPowerOfTwo(T* re, T* im, size_t batch, bool inverse) const {
+    for (size_t i = 0; i < length; ++i) {
+      auto j = bitReversed[i];
+      if (i < j) {
+        std::swap_ranges(re + i * batch, re + (i + 1) * batch, re + j * batch);
+        std::swap_ranges(im + i * batch, im + (i + 1) * batch, im + j * batch);
+      }
+    }
+    for (size_t half = 1; half < length; half *= 2) {
+      auto step = length / (2 * half);
+      for (size_t start = 0; start < length; start += 2 * half) {
+        for (size_t j = 0; j < half; ++j) {
+          auto a = (start + j) * batch;
+          auto b = a + half * batch;
+          auto wi = twiddleIm[j * step];
+          fftButterflies(re + a, im + a, re + b, im + b, twiddleRe[j * step],
+                         inverse ? -wi : wi, batch);
+        }
+      }
+    }
+  }
+
+  // Inverse transforms conjugate their input and output around a forward
+  // one.
+  void transformBluestein(T* re, T* im, size_t batch, bool inverse,
+                          std::vector<T>& scratch) const {
+    auto m = inner->length;
+    scratch.assign(2 * m * batch, 0);
+    auto ar = scratch.data();
+    auto ai = ar + m * batch;
+    T sign = inverse ? -1 : 1;
+    for (size_t k = 0; k < length; ++k) {
+      auto cr = chirpRe[k];
+      auto ci = chirpIm[k];
+      for (size_t l = 0; l < batch; ++l) {
+        auto xr = re[k * batch + l];
+        auto xi = sign * im[k * batch + l];
+        ar[k * batch + l] = xr * cr - xi * ci;
+        ai[k * batch + l] = xr * ci + xi * cr;
+      }
+    }
+    inner->transformPowerOfTwo(ar, ai, batch, false);
+    for (size_t k = 0; k < m; ++k) {
+      auto fr = filterRe[k];
+      auto fi = filterIm[k];
+      for (size_t l = 0; l < batch; ++l) {
+        auto xr = ar[k * batch + l];
+        auto xi = ai[k * batch + l];
+        ar[k * batch + l] = xr * fr - xi * fi;
+        ai[k * batch + l] = xr * fi + xi * fr;
+      }
+    }
+    inner->transformPowerOfTwo(ar, ai, batch, true);
+    for (size_t k = 0; k < length; ++k) {
+      auto cr = chirpRe[k];
+      auto ci = chirpIm[k];
+      for (size_t l = 0; l < batch; ++l) {
+        auto xr = ar[k * batch + l];
+        auto xi = ai[k * batch + l];
+        re[k * batch + l] = xr * cr - xi * ci;
+        im[k * batch + l] = sign * (xr * ci + xi * cr);
+      }
+    }
+  }
+};
+
+// A kernel convolved with every cell of a toroidal grid of a given shape,
+// for continuous rules like Lenia whose neighborhoods are far too large to
+// sum directly: the potential of a cell is the sum over the offsets o
+// within radius along every dimension of kernel(o) times the cell at o
+// from it. The kernel's spectrum is taken once, so each step costs a
+// real-to-complex FFT of the grid, a product with that spectrum and an
+// inverse FFT, O(log size) per cell whatever the radius. Kernels wider than
+// the grid wrap around it.
+//
+// The real-to-complex transform along the first dimension packs two rows
+// into the real and imaginary parts of one complex transform and splits
+// them by symmetry, and only keeps the shape[0] / 2 + 1 frequencies a real
+// row doesn't mirror. The other dimensions are complex transforms that
+// take a cache line of consecutive frequencies as lanes.
+template <typename T>
+class Convolution {
+  // Per-thread working memory.
+  struct Scratch {
+    std::vector<T> re;
+    std::vector<T> im;
+    std::vector<T> row;
+    std::vector<T> fft;
+  };
+
+ public:
+  // Frequencies transformed together along the higher dimensions.
+  static constexpr size_t LANES = std::max<size_t>(1, 64 / sizeof(T));
+
+  // kernel holds the weight of every offset within radius along each
+  // dimension, (2 * radius + 1)^n of them with the first dimension fastest,
+  // the cell itself in the middle.
+  Convolution(const std::vector<size_t>& shape, size_t radius,
+              const std::vector<T>& kernel)
+      : shape(shape),
+        radius(radius),
+        numDimensions(shape.size()),
+        numFrequencies(shape.empty() ? 0 : shape[0] / 2 + 1),
+        numRows(1) {
+    static_assert(std::is_floating_point<T>::value,
+                  "Convolutions need floating point cells.");
+    if (shape.empty() || std::count(shape.begin(), shape.end(), 0))
+      throw std::invalid_argument("Convolution shape must not be empty.");
+    size_t width = 2 * radius + 1;
+    size_t kernelSize = 1;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      kernelSize *= width;
+    }
+    if (kernel.size() != kernelSize)
+      throw std::invalid_argument(
+          "Convolution kernel must have (2 * radius + 1)^n weights.");
+
+    for (size_t i = 0; i < numDimensions; ++i) {
+      ffts.emplace_back(shape[i]);
+      spectrumStrides.push_back(i == 0 ? 1 : numFrequencies * numRows);
+      if (i > 0) numRows *= shape[i];
+    }
+    spectrumRe.resize(numFrequencies * numRows);
+    spectrumIm.resize(numFrequencies * numRows);
+
+    // Correlating with the kernel is convolving with it mirrored, so the
+    // weight of offset o goes to -o, wrapped around the grid.
+    std::vector<T> mirrored(shape[0] * numRows, 0);
+    std::vector<size_t> offset(numDimensions, 0);
+    for (size_t k = 0; k < kernelSize; ++k) {
+      size_t idx = 0;
+      size_t stride = 1;
+      auto rest = k;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        auto o = static_cast<long int>(rest % width) -
+                 static_cast<long int>(radius);
+        rest /= width;
+        auto n = static_cast<long int>(shape[i]);
+        idx += static_cast<size_t>(((-o) % n + n) % n) * stride;
+        stride *= shape[i];
+      }
+      mirrored[idx] += kernel[k];
+    }
+
+    auto serial = [](size_t numItems, auto&& f) { f(0, numItems, 0); };
+    threadScratch.resize(1);
+    forward(
+        [&](size_t row, T* cells) {
+          std::copy_n(&mirrored[row * shape[0]], shape[0], cells);
+        },
+        serial);
+    // The inverse transform doesn't scale by 1 / size, so the kernel does.
+    T scale = T(1) / (shape[0] * numRows);
+    kernelRe = spectrumRe;
+    kernelIm = spectrumIm;
+    for (size_t i = 0; i < kernelRe.size(); ++i) {
+      kernelRe[i] *= scale;
+      kernelIm[i] *= scale;
+    }
+  }
+
+  // The Lenia kernel of a radius: concentric shells, peaks[j] high at
+  // distance (j + 0.5) / peaks.size() of the radius, each a smooth bump
+  // e^(4 - 1 / (r (1 - r))) of the position r within its shell. Weights sum
+  // up to 1.
+  static std::vector<T> leniaKernel(size_t numDimensions, size_t radius,
+                                    const std::vector<T>& peaks = {1}) {
+    if (radius == 0 || peaks.empty())
+      throw std::invalid_argument(
+          "Lenia kernels need a positive radius and at least one peak.");
+    size_t width = 2 * radius + 1;
+    size_t kernelSize = 1;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      kernelSize *= width;
+    }
+
+    std::vector<T> kernel(kernelSize, 0);
+    double total = 0;
+    for (size_t k = 0; k < kernelSize; ++k) {
+      double squared = 0;
+      auto rest = k;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        auto o = static_cast<double>(rest % width) - radius;
+        rest /= width;
+        squared += o * o;
+      }
+      auto distance = std::sqrt(squared) / radius * peaks.size();
+      if (distance >= peaks.size()) continue;
+      auto shell = static_cast<size_t>(distance);
+      auto r = distance - shell;
+      if (r <= 0) continue;
+      auto weight = peaks[shell] * std::exp(4 - 1 / (r * (1 - r)));
+      kernel[k] = static_cast<T>(weight);
+      total += weight;
+    }
+    if (total > 0) {
+      for (auto& weight : kernel) {
+        weight = static_cast<T>(weight / total);
+      }
+    }
+    return kernel;
+  }
+
+  const std::vector<size_t>& getShape() const { return shape; }
+
+  size_t getRadius() const { return radius; }
+
+  // Calls loadRow(row, T* cells) for every row along the first dimension,
+  // rows numbered with the second dimension fastest, to fill cells with its
+  // shape[0] values, then storeRow(row, const T* potentials, thread) with
+  // their potentials. Every row is loaded before any is stored. Work is
+  // handed out through forEachChunk(numItems, f(begin, end, thread)) with
+  // threads below numThreads.
+  template <typename LoadRow, typename StoreRow, typename ForEachChunk>
+  void convolve(LoadRow&& loadRow, StoreRow&& storeRow,
+                ForEachChunk&& forEachChunk, size_t numThreads) {
+    if (threadScratch.size() < numThreads) {
+      threadScratch.resize(numThreads);
+    }
+    forward(loadRow, forEachChunk);
+
+    forEachChunk(spectrumRe.size(), [&](size_t begin, size_t end, size_t) {
+      for (auto i = begin; i < end; ++i) {
+        auto xr = spectrumRe[i];
+        auto xi = spectrumIm[i];
+        spectrumRe[i] = xr * kernelRe[i] - xi * kernelIm[i];
+        spectrumIm[i] = xr * kernelIm[i] + xi * kernelRe[i];
+      }
+    });
+
+    for (size_t d = 1; d < numDimensions; ++d) {
+      transformColumns(d, true, forEachChunk);
+    }
+    forEachChunk((numRows + 1) / 2, [&](size_t begin, size_t end,
+                                        size_t thread) {
+      auto& scratch = threadScratch[thread];
+      auto store = [&](size_t row, const T* potentials) {
+        storeRow(row, potentials, thread);
+      };
+      for (auto pair = begin; pair < end; pair += LANES) {
+        auto lanes = std::min(LANES, end - pair);
+        inverseRows(pair, lanes, scratch, store);
+      }
+    });
+  }
+
+ private:
+  std::vector<size_t> shape;
+  size_t radius;
+  size_t numDimensions;
+  size_t numFrequencies;
+  // Rows along the first dimension.
+  size_t numRows;
+  std::vector<FFT<T>> ffts;
+  // The half spectrum is laid out like the grid with shape[0] replaced by
+  // numFrequencies.
+  std::vector<size_t> spectrumStrides;
+  std::vector<T> spectrumRe;
+  std::vector<T> spectrumIm;
+  std::vector<T> kernelRe;
+  std::vector<T> kernelIm;
+  std::vector<Scratch> threadScratch;
+
+  // Fills the spectrum with the transform of the rows loadRow gives.
+  template <typename LoadRow, typename ForEachChunk>
+  void forward(LoadRow&& loadRow, ForEachChunk&& forEachChunk) {
+    forEachChunk((numRows + 1) / 2, [&](size_t begin, size_t end,
+                                        size_t thread) {
+      auto& scratch = threadScratch[thread];
+      for (auto pair = begin; pair < end; pair += LANES) {
+        auto lanes = std::min(LANES, end - pair);
+        forwardRows(pair, lanes, scratch, loadRow);
+      }
+    });
+    for (size_t d = 1; d < numDimensions; ++d) {
+      transformColumns(d, false, forEachChunk);
+    }
+  }
+
+  // Transforms rows 2 * p and 2 * p + 1 as the real and imaginary parts of
+  // lane p - firstPair, and splits them apart: with Z the transform of
+  // a + ib, A[k] = (Z[k] + conj(Z[n - k])) / 2 and
+  // B[k] = (Z[k] - conj(Z[n - k])) / 2i.
+  template <typename LoadRow>
+  void forwardRows(size_t firstPair, size_t lanes, Scratch& scratch,
+                   LoadRow& loadRow) {
+    auto n = shape[0];
+    scratch.re.resize(n * lanes);
+    scratch.im.resize(n * lanes);
+    scratch.row.resize(n);
+    auto re = scratch.re.data();
+    auto im = scratch.im.data();
+    for (size_t l = 0; l < lanes; ++l) {
+      auto row = 2 * (firstPair + l);
+      loadRow(row, scratch.row.data());
+      for (size_t x = 0; x < n; ++x) {
+        re[x * lanes + l] = scratch.row[x];
+      }
+      if (row + 1 < numRows) {
+        loadRow(row + 1, scratch.row.data());
+      } else {
+        std::fill(scratch.row.begin(), scratch.row.end(), 0);
+      }
+      for (size_t x = 0; x < n; ++x) {
+        im[x * lanes + l] = scratch.row[x];
+      }
+    }
+
+    ffts[0].transform(re, im, lanes, false, scratch.fft);
+
+    for (size_t l = 0; l < lanes; ++l) {
+      auto row = 2 * (firstPair + l);
+      auto outA = row * numFrequencies;
+      auto outB = outA + numFrequencies;
+      auto hasB = row + 1 < numRows;
+      for (size_t k = 0; k < numFrequencies; ++k) {
+        auto zr = re[k * lanes + l];
+        auto zi = im[k * lanes + l];
+        auto mirror = (n - k) % n;
+        auto nr = re[mirror * lanes + l];
+        auto ni = im[mirror * lanes + l];
+        spectrumRe[outA + k] = (zr + nr) / 2;
+        spectrumIm[outA + k] = (zi - ni) / 2;
+        if (hasB) {
+          spectrumRe[outB + k] = (zi + ni) / 2;
+          spectrumIm[outB + k] = (nr - zr) / 2;
+        }
+      }
+    }
+  }
+
+  // The inverse of forwardRows: rebuilds the full spectra of rows A and B
+  // from their halves and transforms A + iB, whose real part is A and
+  // imaginary part B.
+  template <typename StoreRow>
+  void inverseRows(size_t firstPair, size_t lanes, Scratch& scratch,
+                   StoreRow& storeRow) {
+    auto n = shape[0];
+    scratch.re.resize(n * lanes);
+    scratch.im.resize(n * lanes);
+    scratch.row.resize(n);
+    auto re = scratch.re.data();
+    auto im = scratch.im.data();
+    for (size_t l = 0; l < lanes; ++l) {
+      auto row = 2 * (firstPair + l);
+      auto inA = row * numFrequencies;
+      auto inB = inA + numFrequencies;
+      auto hasB = row + 1 < numRows;
+      for (size_t k = 0; k < n; ++k) {
+        auto mirrored = k >= numFrequencies;
+        auto f = mirrored ? n - k : k;
+        T sign = mirrored ? -1 : 1;
+        auto ar = spectrumRe[inA + f];
+        auto ai = sign * spectrumIm[inA + f];
+        auto br = hasB ? spectrumRe[inB + f] : 0;
+        auto bi = hasB ? sign * spectrumIm[inB + f] : 0;
+        re[k * lanes + l] = ar - bi;
+        im[k * lanes + l] = ai + br;
+      }
+    }
+
+    ffts[0].transform(re, im, lanes, true, scratch.fft);
+
+    for (size_t l = 0; l < lanes; ++l) {
+      auto row = 2 * (firstPair + l);
+      for (size_t x = 0; x < n; ++x) {
+        scratch.row[x] = re[x * lanes + l];
+      }
+      storeRow(row, static_cast<const T*>(scratch.row.data()));
+      if (row + 1 < numRows) {
+        for (size_t x = 0; x < n; ++x) {
+          scratch.row[x] = im[x * lanes + l];
+        }
+        storeRow(row + 1, static_cast<const T*>(scratch.row.data()));
+      }
+    }
+  }
+
+  // Transforms the spectrum along dimension d, LANES frequencies of every
+  // line along it at a time.
+  template <typename ForEachChunk>
+  void transformColumns(size_t d, bool inverse, ForEachChunk&& forEachChunk) {
+    auto n = shape[d];
+    auto stride = spectrumStrides[d];
+    auto numBlocks = (numFrequencies + LANES - 1) / LANES;
+    auto numLines = numRows / n;
+    forEachChunk(numBlocks * numLines, [&](size_t begin, size_t end,
+                                           size_t thread) {
+      auto& scratch = threadScratch[thread];
+      scratch.re.resize(n * LANES);
+      scratch.im.resize(n * LANES);
+      auto re = scratch.re.data();
+      auto im = scratch.im.data();
+      for (auto item = begin; item < end; ++item) {
+        auto block = item % numBlocks;
+        auto line = item / numBlocks;
+        auto base = block * LANES;
+        for (size_t i = 1; i < numDimensions; ++i) {
+          if (i == d) continue;
+          base += line % shape[i] * spectrumStrides[i];
+          line /= shape[i];
+        }
+        auto lanes = std::min(LANES, numFrequencies - block * LANES);
+
+        for (size_t j = 0; j < n; ++j) {
+          std::copy_n(&spectrumRe[base + j * stride], lanes, re + j * lanes);
+          std::copy_n(&spectrumIm[base + j * stride], lanes, im + j * lanes);
+        }
+        ffts[d].transform(re, im, lanes, inverse, scratch.fft);
+        for (size_t j = 0; j < n; ++j) {
+          std::copy_n(re + j * lanes, lanes, &spectrumRe[base + j * stride]);
+          std::copy_n(im + j * lanes, lanes, &spectrumIm[base + j * stride]);
+        }
+      }
+    });
+  }
+};
+
+// The growth function of Lenia: the potential u moves a cell by
+// dt * (2 e^(-(u - mu)^2 / (2 sigma^2)) - 1), clipped to [0, 1]. The
+// defaults are those of Orbium, with a radius 13 kernel of one shell.
+template <typename T>
+struct LeniaGrowth {
+  T mu = T(0.15);
+  T sigma = T(0.015);
+  T dt = T(0.1);
+
+  void operator()(T& cell, T potential) const {
+    auto d = (potential - mu) / sigma;
+    auto growth = 2 * std::exp(-d * d / 2) - 1;
+    cell = std::min(T(1), std::max(T(0), cell + dt * growth));
+  }
+};
+
+template <typename T>
+class Grid {
+  // The cells of a neighborhood along the first dimension within halfWidth
+  // of the center, rowOffset padded rows away.
+  struct CountSpan {
+    long int rowOffset;
+    size_t halfWidth;
+  };
+
+  // A compiled outer totalistic rule: the next state of a cell is
+  // table[state * tableRow + count], where count is the number of cells in
+  // state 1 in its neighborhood, itself included. That's the box within
+  // radius of it, unless spans lists the rows of some other shape, or the
+  // diamond within radius steps of it with diamond. States above maxState
+  // are looked up as maxState. offsets is the neighborhood for grids that
+  // count each cell's neighbors directly.
+  struct CountKernel {
+    std::vector<uint32_t> table;
+    size_t tableRow = 0;
+    uint32_t maxState = 0;
+    size_t radius = 0;
+    std::vector<CountSpan> spans;
+    bool diamond = false;
+    std::vector<long int> offsets;
+  };
+
+  // Per-thread working memory for RuleTable lookups: the codes of the last
+  // few rows converted, and the packed columns and indices of a row.
+  struct TableScratch {
+    struct Row {
+      uint64_t generation = 0;
+      size_t rowIdx = 0;
+      size_t length = 0;
+      std::vector<uint8_t> codes;
+    };
+    std::array<Row, 4> rows;
+    size_t nextRow = 0;
+    std::vector<uint32_t> columns;
+    std::vector<uint32_t> indices;
+  };
+
+  // Per-thread working memory for the count kernel.
+  struct CountScratch {
+    std::vector<std::vector<uint32_t>> levels;
+    std::vector<uint32_t> ring;
+    std::vector<uint32_t> total;
+    std::vector<uint32_t> line;
+    std::vector<uint32_t> diagonals;
+  };
+
+  // What a thread's share of an update adds to the state hash, and a copy
+  // of the row being updated in place.
+  struct alignas(64) HashScratch {
+    uint64_t delta;
+    std::vector<T> row;
+  };
+
+  // The runs of cells a thread's share of an update changed, for the
+  // recorder.
+  struct alignas(64) HistoryScratch {
+    HistoryDeltaRows delta;
+    std::vector<size_t> coord;
+  };
+
+  // A thread's share of the statistics of a generation.
+  struct alignas(64) StatisticsScratch {
+    GridStatistics statistics;
+    std::vector<size_t> coord;
+  };
+
+  // Adds length cells of a grid, the first at storage index idx, to a
+  // thread's statistics.
+  using Reduction = std::function<void(const Grid&, const T*, size_t, size_t,
+                                       StatisticsScratch&)>;
+
+  // How update(generations) cuts the grid: every block owns blockShape
+  // cells, and its working buffers hold localShape cells, which adds a
+  // margin of generations * maxNeighborDistance on either side. offsets are
+  // the neighborhood within those buffers.
+  struct TemporalBlocks {
+    size_t generations;
+    size_t margin;
+    std::vector<size_t> blockShape;
+    std::vector<size_t> blocksPerDim;
+    size_t numBlocks;
+    std::vector<size_t> localShape;
+    std::vector<size_t> localStrides;
+    size_t localSize;
+    std::vector<long int> offsets;
+  };
+
+  // Upper bound on the working buffers of one block, about the size of a
+  // per-core L2 cache, and the shortest rows blocks are cut into. Short
+  // rows make the copies in and out of the blocks slow to stream.
+  static constexpr size_t TEMPORAL_BLOCK_BYTES = 1024 * 1024;
+  static constexpr size_t TEMPORAL_ROW_BYTES = 2048;
+
+  // Row sums of the count kernel add up shifted copies of the row, which
+  // vectorize, up to this radius, and slide a running sum past it.
+  static constexpr size_t MAX_SHIFTED_SUM_RADIUS = 1;
+
+  // 2D von Neumann counts slide diamonds from this radius on, and sum the
+  // few rows of smaller ones.
+  static constexpr size_t MIN_DIAMOND_RADIUS = 2;
+
+  // Histograms of up to this many states are counted locally per row.
+  static constexpr size_t LOCAL_HISTOGRAM_STATES = 16;
+
+ public:
+  Grid(const std::vector<size_t>& shape, Wrapping wrapping,
+       Neighborhood neighborhood,
+       std::function<void(T*, const std::vector<T*>&)> cellUpdate,
+       T defaultValue = T(), unsigned short int maxNeighborDistance = 1)
+      : shape(shape),
+        size(multiplyAll<size_t>(shape)),
+        maxNeighborDistance(maxNeighborDistance),
+        singleDimPadding(maxNeighborDistance * 2),
+        numDimensions(shape.size()),
+        wrapping(wrapping),
+        defaultValue(defaultValue),
+        updateMode(UpdateMode::DOUBLE_BUFFERED),
+        cellUpdate(cellUpdate),
+        neighborhoodRadius(1),
+        threadNeighbors(1),
+        chunkSize(0),
+        changeTracking(false),
+        tileSize(0),
+        changeCount(0),
+        layout(Layout::ROW_MAJOR),
+        brickSize(0),
+        generation(0),
+        stateHashing(false),
+        stopOnCycle(false),
+        stateHash(0),
+        hashHistoryLength(0),
+        hashEdited(false),
+        cyclePeriod(0),
+        cycleStart(0),
+        populationBounds(false),
+        histogramSize(0),
+        reducingRows(false),
+        statisticsStale(false),
+        recordingRows(false),
+        historyEdited(false) {
+    for (auto i = 0; i < numDimensions; ++i) {
+      if (shape[i] < maxNeighborDistance)
+        throw InvalidOperationException(
+            "Every dimension must be at least maxNeighborDistance wide.");
+    }
+
+    // Both generations live in flat row-major arrays with a halo of
+    // maxNeighborDistance cells around the interior. Bounded halos keep the
+    // default value forever; toroidal ones are refreshed from the opposite
+    // edge every generation.
+    initLayout();
+    values = AlignedBuffer<T>(paddedSize, defaultValue);
+    futureValues = AlignedBuffer<T>(paddedSize, defaultValue);
+
+    setNeighborhood(neighborhood);
+  }
+
+  void update() {
+    if (!cellUpdate)
+      throw InvalidOperationException(
+          "Grid has no cellUpdate callback, use update<Rule>() instead.");
+
+    sweep([&](size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+              size_t thread) {
+      updateRow(rowIdx, length, target, threadNeighbors[thread]);
+    });
+  }
+
+  // Runs a rule functor instead of the cellUpdate callback. Rule must declare
+  // its neighborhood size as a static constexpr numNeighbors and be callable
+  // as rule(T& cell, const StencilView<T, numNeighbors>& neighbors), where
+  // cell starts out as the current value and neighbors come in the same
+  // order cellUpdate gets them. The rule is inlined into the update loop.
+  template <typename Rule,
+            typename = std::enable_if_t<std::is_class<Rule>::value>>
+  void update(const Rule& rule) {
+    constexpr auto numNeighbors = Rule::numNeighbors;
+    if (numNeighbors != neighborhood.size())
+      throw InvalidOperationException(
+          "Rule::numNeighbors does not match the grid's neighborhood.");
+
+    std::array<long int, numNeighbors> offsets;
+    std::copy(neighborhood.begin(), neighborhood.end(), offsets.begin());
+    sweep([&](size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+              size_t) { updateRow(rowIdx, length, target, rule, offsets); });
+  }
+
+  template <typename Rule>
+  void update() {
+    update(Rule());
+  }
+
+  // Runs a rule through a RuleTable of it: each cell's next state is looked
+  // up from the codes of the cell and its neighbors rather than computed.
+  // 2D grids with the Moore neighborhood go through the block table of a
+  // binary rule instead, four cells per lookup, unless they track changes,
+  // are bricked or update IN_PLACE. Every cell, the default value included,
+  // must be one of the table's states.
+  void update(const RuleTable<T>& table) {
+    if (table.getNumNeighbors() != neighborhood.size())
+      throw InvalidOperationException(
+          "The rule table's numNeighbors does not match the grid's "
+          "neighborhood.");
+    if (!table.contains(defaultValue))
+      throw InvalidOperationException(
+          "The default value is not one of the rule table's states.");
+
+    if (threadTableScratch.size() != getNumThreads()) {
+      threadTableScratch.resize(getNumThreads());
+    }
+    ++tableGeneration;
+    if (!canUseBlockTable(table)) {
+      sweep([&](size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+                size_t thread) {
+        updateTableRow(rowIdx, length, target, table, thread);
+      });
+      return;
+    }
+
+    if (!beginGeneration()) return;
+    incrementTime();
+    auto numPairs = shape[1] / 2;
+    forEachWorkChunk(numPairs, [&](size_t begin, size_t end, size_t thread) {
+      updateTableBlocks(begin, end, table, thread);
+    });
+    // An odd last column or row doesn't fill a block.
+    auto updateRest = [&](size_t rowIdx, size_t length) {
+      writeRow(rowIdx, length, futureValues, 0, [&] {
+        updateTableRow(rowIdx, length, futureValues, table, 0);
+      });
+    };
+    if (shape[0] % 2) {
+      for (size_t y = 0; y < numPairs * 2; ++y) {
+        updateRest(getIdx({shape[0] - 1, y}), 1);
+      }
+    }
+    if (shape[1] % 2) {
+      updateRest(getIdx({0, shape[1] - 1}), shape[0]);
+    }
+    endGeneration();
+  }
+
+  // Runs an outer totalistic rule through a dedicated kernel: neighbor
+  // counts come from running sums along each dimension in turn, and next
+  // states from a lookup table, so no per cell callback is involved. Moore
+  // neighborhoods cost the same per cell whatever their radius, and so do
+  // von Neumann ones in 2D, whose diamonds slide along each row by the sums
+  // of their edges, taken from prefix sums along both diagonals. Von
+  // Neumann neighborhoods in 3 or more dimensions and circular ones in 2 or
+  // more are summed one row of the neighborhood at a time, from prefix sums
+  // along every row, so they cost O(radius^(n-1)) per cell rather than
+  // O(radius^n). The rule's radius can be up to maxNeighborDistance, and is
+  // independent of the grid's own neighborhood. Cell values are the rule's
+  // states; values at or above rule.numStates are looked up as the last
+  // state. The rule is compiled once and reused for as long as the same
+  // rule runs. The kernel reads only the previous generation even in
+  // IN_PLACE mode.
+  void update(const OuterTotalisticRule& rule) {
+    static_assert(std::is_integral<T>::value,
+                  "Outer totalistic rules need integral cell states.");
+    if (rule.neighborhood == Neighborhood::CUSTOM)
+      throw InvalidOperationException(
+          "Outer totalistic rules need a Moore, von Neumann or circular "
+          "neighborhood.");
+    if (rule.radius == 0 || rule.radius > maxNeighborDistance)
+      throw InvalidOperationException(
+          "Rule radius must be between 1 and maxNeighborDistance.");
+
+    const auto& kernel = getCountKernel(rule);
+    if (changeTracking || layout != Layout::ROW_MAJOR) {
+      // Tiles and bricks are too small for running sums to pay off, so
+      // those grids count each cell's neighbors directly.
+      const auto& offsets = kernel.offsets;
+      auto table = kernel.table.data();
+      auto tableRow = static_cast<uint32_t>(kernel.tableRow);
+      auto maxState = kernel.maxState;
+      sweep([&](size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+                size_t) {
+        for (auto i = rowIdx; i < rowIdx + length; ++i) {
+          auto state = std::min(static_cast<uint32_t>(values[i]), maxState);
+          uint32_t count = state == 1;
+          for (auto offset : offsets) {
+            count += values[i + offset] == 1;
+          }
+          target[i] = static_cast<T>(table[state * tableRow + count]);
+        }
+      });
+      return;
+    }
+
+    if (threadCountScratch.size() != getNumThreads()) {
+      threadCountScratch.resize(getNumThreads());
+    }
+
+    if (!beginGeneration()) return;
+    if (!kernel.spans.empty()) {
+      if (updateMode == UpdateMode::IN_PLACE) {
+        refreshHalo(values);
+      } else {
+        incrementTime();
+      }
+      updateSpanCounts(
+          updateMode == UpdateMode::IN_PLACE ? values : futureValues, kernel);
+    } else if (updateMode == UpdateMode::IN_PLACE) {
+      refreshHalo(values);
+      updateCountSlabs(0, numSlabs(), values, kernel, 0);
+    } else {
+      incrementTime();
+      forEachSlabChunk([&](size_t slabBegin, size_t slabEnd, size_t thread) {
+        updateCountSlabs(slabBegin, slabEnd, futureValues, kernel, thread);
+      });
+    }
+    endGeneration();
+  }
+
+  // Runs a continuous rule through a Convolution of the grid's shape: the
+  // potential of every cell, its neighbors weighted by the kernel, comes
+  // from FFTs of the whole grid, and growth(T& cell, T potential), with
+  // cell starting out as its current value, gives its next state (see
+  // LeniaGrowth). The grid must be toroidal, which is what the FFT
+  // computes, and can't track changes, since any cell may change. Every
+  // potential is taken from the previous generation, even IN_PLACE.
+  template <typename Growth>
+  void update(Convolution<T>& convolution, const Growth& growth) {
+    if (convolution.getShape() != shape)
+      throw InvalidOperationException(
+          "The convolution's shape does not match the grid's.");
+    if (wrapping != Wrapping::TOROIDAL)
+      throw InvalidOperationException("Convolutions need a toroidal grid.");
+    if (changeTracking)
+      throw InvalidOperationException(
+          "Convolutions can't skip quiescent tiles, turn change tracking "
+          "off.");
+
+    if (!beginGeneration()) return;
+    if (updateMode != UpdateMode::IN_PLACE) {
+      incrementTime();
+    }
+    auto& target = updateMode == UpdateMode::IN_PLACE ? values : futureValues;
+    auto inPlace = &target == &values;
+    convolution.convolve(
+        [&](size_t row, T* cells) {
+          forEachSegmentOfRow(row, [&](size_t rowIdx, size_t x,
+                                       size_t length) {
+            std::copy_n(&values[rowIdx], length, cells + x);
+          });
+        },
+        [&](size_t row, const T* potentials, size_t thread) {
+          forEachSegmentOfRow(row, [&](size_t rowIdx, size_t x,
+                                       size_t length) {
+            writeRow(rowIdx, length, target, thread, [&] {
+              for (size_t i = 0; i < length; ++i) {
+                if (!inPlace) {
+                  target[rowIdx + i] = values[rowIdx + i];
+                }
+                growth(target[rowIdx + i], potentials[x + i]);
+              }
+            });
+          });
+        },
+        [&](size_t numItems, auto&& f) { forEachWorkChunk(numItems, f); },
+        getNumThreads());
+    endGeneration();
+  }
+
+  // Runs a block cellular automaton, as in the Margolus neighborhood: the
+  // grid is cut into blocks of 2 cells along every dimension, and
+  // rule(std::array<T, 2^n>& block, size_t phase) maps each block to its
+  // next state. Cell i of a block is offset by bit d of i along dimension
+  // d. Blocks start at even coordinates on even generations (phase 0) and at
+  // odd ones on odd generations (phase 1), so information crosses block
+  // boundaries every other generation. Rule must declare the grid's number
+  // of dimensions as a static constexpr numDimensions.
+  //
+  // Blocks don't overlap, so rules that only move cells around within a
+  // block conserve them, and blocks are spread over the thread pool without
+  // any synchronization. IN_PLACE grids update every block in place, with
+  // no future generation at all. Toroidal grids need even extents so that
+  // blocks tile them in both phases; on bounded grids, blocks that stick out
+  // past an edge are left as they are. Change tracking isn't supported.
+  template <typename Rule>
+  void updateBlocks(const Rule& rule) {
+    constexpr auto blockSize = size_t(1) << Rule::numDimensions;
+    if (Rule::numDimensions != numDimensions)
+      throw InvalidOperationException(
+          "Rule::numDimensions does not match the grid's.");
+    if (changeTracking)
+      throw InvalidOperationException(
+          "Block updates don't support change tracking.");
+    if (wrapping == Wrapping::TOROIDAL) {
+      for (auto extent : shape) {
+        if (extent % 2)
+          throw InvalidOperationException(
+              "Toroidal block updates need even extents.");
+      }
+    }
+
+    auto phase = static_cast<size_t>(generation % 2);
+    if (!beginGeneration(false, false)) return;
+    if (updateMode != UpdateMode::IN_PLACE) {
+      incrementTime();
+    }
+    auto& target = updateMode == UpdateMode::IN_PLACE ? values : futureValues;
+
+    // Bounded grids also get the partial blocks that stick out, so that
+    // every cell belongs to some block.
+    std::vector<size_t> blocksPerDim(numDimensions);
+    size_t numBlockRows = 1;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      blocksPerDim[i] = wrapping == Wrapping::TOROIDAL
+                            ? shape[i] / 2
+                            : (shape[i] + phase + 1) / 2;
+      if (i > 0) numBlockRows *= blocksPerDim[i];
+    }
+    std::array<long int, blockSize> offsets;
+    for (size_t i = 0; i < blockSize; ++i) {
+      offsets[i] = 0;
+      for (size_t d = 0; d < numDimensions; ++d) {
+        offsets[i] += static_cast<long int>(i >> d & 1) * strides[d];
+      }
+    }
+
+    forEachWorkChunk(numBlockRows, [&](size_t begin, size_t end,
+                                       size_t thread) {
+      std::vector<long int> origin(numDimensions);
+      std::vector<size_t> coord(numDimensions);
+      std::array<T, blockSize> block;
+      for (auto row = begin; row < end; ++row) {
+        auto inside = layout == Layout::ROW_MAJOR;
+        auto rest = row;
+        for (size_t d = 1; d < numDimensions; ++d) {
+          origin[d] = static_cast<long int>(2 * (rest % blocksPerDim[d])) -
+                      static_cast<long int>(phase);
+          rest /= blocksPerDim[d];
+          coord[d] = static_cast<size_t>(std::max(0L, origin[d]));
+          inside = inside && origin[d] >= 0 &&
+                   origin[d] + 1 < static_cast<long int>(shape[d]);
+        }
+        coord[0] = 0;
+        auto rowIdx = inside ? getIdx(coord) : 0;
+
+        for (size_t j = 0; j < blocksPerDim[0]; ++j) {
+          origin[0] = static_cast<long int>(2 * j) -
+                      static_cast<long int>(phase);
+          if (!inside || origin[0] < 0 ||
+              origin[0] + 1 >= static_cast<long int>(shape[0])) {
+            updateBlockAt(origin, coord, block, target, rule, phase, thread);
+            continue;
+          }
+          auto idx = rowIdx + origin[0];
+          for (size_t i = 0; i < blockSize; ++i) {
+            block[i] = values[idx + offsets[i]];
+          }
+          rule(block, phase);
+          if (stateHashing) {
+            for (size_t i = 0; i < blockSize; ++i) {
+              auto cellIdx = idx + offsets[i];
+              threadHashScratch[thread].delta +=
+                  hashDifference(cellIdx, &values[cellIdx], &block[i], 1);
+            }
+          }
+          for (size_t i = 0; i < blockSize; ++i) {
+            target[idx + offsets[i]] = block[i];
+          }
+        }
+      }
+    });
+    endGeneration();
+  }
+
+  template <typename Rule>
+  void updateBlocks() {
+    updateBlocks(Rule());
+  }
+
+  // Relaxes the grid to a fixed point of a toppling rule, as in the abelian
+  // sandpile. rule.unstable(cell) tells the cells that must topple, and
+  // rule(T& cell, const std::array<T*, numNeighbors>& neighbors) topples
+  // one, handing whatever it sheds to its neighbors, in the grid's
+  // neighborhood order. Only unstable cells are visited: they are marked in
+  // a bitmap that is scanned in index order, and the neighbors of a cell
+  // that toppled are marked if they became unstable, so the cost is
+  // proportional to the number of topplings rather than to the volume
+  // times the number of sweeps it would take. Whatever falls past a bounded
+  // edge is lost. Counts as one generation; DOUBLE_BUFFERED grids copy the
+  // current generation into the next one first, IN_PLACE ones don't.
+  // Returns the number of times rule was applied.
+  //
+  // With a thread pool, the grid is cut into bands of slabs along the last
+  // dimension, at least 2 * maxNeighborDistance slabs thick, and every
+  // other band relaxes at the same time, so no two cells that topple at
+  // once share a neighbor. Cells spilled into the bands in between are
+  // handed over to them for the next phase, until no band has work left.
+  // Topplings then happen in a different order than with one thread, which
+  // gives the same result only for abelian rules. Needs the ROW_MAJOR layout
+  // and no change tracking.
+  template <typename Rule>
+  size_t relax(const Rule& rule) {
+    return relaxFrom(rule, nullptr);
+  }
+
+  // Same as relax(rule), but only starts from seeds, the cells that may
+  // have become unstable since the grid last was stable, rather than
+  // looking through every cell.
+  template <typename Rule>
+  size_t relax(const Rule& rule,
+               const std::vector<std::vector<size_t>>& seeds) {
+    return relaxFrom(rule, &seeds);
+  }
+
+  // Advances generations generations at once, with the same result as that
+  // many calls to update(). The grid is cut into blocks small enough to stay
+  // in cache, and each block is carried through every generation before the
+  // next one is touched, so the grid is streamed through memory once per
+  // call instead of once per generation. A block starts out with a margin
+  // of generations * maxNeighborDistance cells around it, and the part of
+  // it that can be computed shrinks by maxNeighborDistance per generation;
+  // margins are computed again by every block that overlaps them, so
+  // cellUpdate must be a pure function of the neighborhood. This pays off
+  // for rules cheap enough to be bound by memory bandwidth, and more so the
+  // more generations are run at once. Blocks are spread over the thread
+  // pool. Grids with change tracking, a history recorder, state hashing,
+  // reductions, a bricked layout or IN_PLACE updates run the generations one
+  // at a time.
+  void update(size_t generations) {
+    if (!cellUpdate)
+      throw InvalidOperationException(
+          "Grid has no cellUpdate callback, use update<Rule>() instead.");
+    if (!canBlockGenerations(generations)) {
+      for (size_t i = 0; i < generations; ++i) {
+        update();
+      }
+      return;
+    }
+
+    auto blocks = planTemporalBlocks(generations);
+    sweepTemporalBlocks(blocks, [&](T* in, T* out, size_t rowIdx,
+                                    size_t length, size_t thread) {
+      auto& neighbors = threadNeighbors[thread];
+      for (auto i = rowIdx; i < rowIdx + length; ++i) {
+        auto j = 0;
+        for (auto offset : blocks.offsets) {
+          neighbors[j++] = in + i + offset;
+        }
+        out[i] = in[i];
+        cellUpdate(out + i, neighbors);
+      }
+    });
+  }
+
+  // Same as update(generations) with a rule functor.
+  template <typename Rule>
+  void update(const Rule& rule, size_t generations) {
+    constexpr auto numNeighbors = Rule::numNeighbors;
+    if (numNeighbors != neighborhood.size())
+      throw InvalidOperationException(
+          "Rule::numNeighbors does not match the grid's neighborhood.");
+    if (!canBlockGenerations(generations)) {
+      for (size_t i = 0; i < generations; ++i) {
+        update(rule);
+      }
+      return;
+    }
+
+    auto blocks = planTemporalBlocks(generations);
+    std::array<long int, numNeighbors> offsets;
+    std::copy(blocks.offsets.begin(), blocks.offsets.end(), offsets.begin());
+    sweepTemporalBlocks(blocks, [&](T* in, T* out, size_t rowIdx,
+                                    size_t length, size_t) {
+      for (auto i = rowIdx; i < rowIdx + length; ++i) {
+        StencilView<T, numNeighbors> neighbors(in + i, offsets.data());
+        out[i] = in[i];
+        rule(out[i], neighbors);
+      }
+    });
+  }
+
+  template <typename Rule>
+  void update(size_t generations) {
+    update(Rule(), generations);
+  }
+
+  // The count kernel already makes a single pass over the grid per
+  // generation, and blocks too small for its running sums would cost more
+  // than they save, so this runs the generations one at a time.
+  void update(const OuterTotalisticRule& rule, size_t generations) {
+    for (size_t i = 0; i < generations; ++i) {
+      update(rule);
+    }
+  }
+
+  // TODO: Write an iterator for this class
+
+  const T& getValue(const std::vector<size_t>& coordinates) {
+    checkBounds(coordinates);
+    return getValue(getIdx(coordinates));
+  }
+
+  void setValue(const std::vector<size_t>& coordinates, const T& val) {
+    checkBounds(coordinates);
+    setValue(getIdx(coordinates), val);
+    if (changeTracking) {
+      auto tile = getTileIdx(coordinates);
+      activateAround(tile);
+      tileChangedAt[tile] = ++changeCount;
+    }
+  }
+
+  // Calls f(x, cells, length) for the runs of contiguous cells that make
+  // up row row of the generation getValue() reads, where x is the first
+  // dimension coordinate of cells[0]. Rows run along the first dimension
+  // and are numbered with the second dimension fastest, so in 2D row is the
+  // y coordinate. Nothing is written, so several threads can read rows at
+  // once as long as the grid isn't updated meanwhile.
+  template <typename F>
+  void readRow(size_t row, F&& f) {
+    if (row >= size / shape[0])
+      throw std::out_of_range("Can't read rows past the end of the grid.");
+    forEachSegmentOfRow(row, [&](size_t rowIdx, size_t x, size_t length) {
+      f(x, static_cast<const T*>(&values[rowIdx]), length);
+    });
+  }
+
+  const std::vector<size_t>& getShape() const { return shape; }
+
+  size_t getSize() const { return size; }
+
+  size_t getNumThreads() const { return threadNeighbors.size(); }
+
+  // Splits double buffered updates into slabs along the last dimension and
+  // runs them on a pool of numThreads threads (0 picks one per hardware
+  // thread). cellUpdate is then called concurrently, so it must not touch
+  // shared state. In-place updates always run serially since their result
+  // depends on the order cells are visited in.
+  void setNumThreads(size_t numThreads) {
+    if (numThreads == 0) {
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadPool.reset(numThreads > 1 ? new ThreadPool(numThreads) : nullptr);
+    threadNeighbors.assign(numThreads, std::vector<T*>(neighborhood.size()));
+  }
+
+  size_t getChunkSize() const { return chunkSize; }
+
+  // Number of slabs (or active tiles, or bricks) per unit of work handed to
+  // the thread pool. 0 picks a size that gives every thread about four
+  // chunks.
+  void setChunkSize(size_t chunkSize) { this->chunkSize = chunkSize; }
+
+  UpdateMode getUpdateMode() const { return updateMode; }
+
+  // Switching to IN_PLACE frees the future generation. Switching back seeds
+  // it from the current one, as if every cell had been set with setValue.
+  void setUpdateMode(UpdateMode mode) {
+    if (mode == updateMode) return;
+    detachSnapshot();
+    if (mode == UpdateMode::IN_PLACE && changeTracking)
+      throw InvalidOperationException(
+          "Change tracking needs a double buffered grid.");
+    if (mode == UpdateMode::IN_PLACE && layout != Layout::ROW_MAJOR)
+      throw InvalidOperationException(
+          "In-place updates need the ROW_MAJOR layout.");
+
+    updateMode = mode;
+    if (mode == UpdateMode::IN_PLACE) {
+      futureValues.reset();
+      spareValues.reset();
+    } else {
+      futureValues = AlignedBuffer<T>(paddedSize, defaultValue);
+      std::copy(values.get(), values.get() + paddedSize, futureValues.get());
+    }
+    restartStateHash();
+    statisticsStale = hasReductions();
+    historyEdited = true;
+  }
+
+  Layout getLayout() const { return layout; }
+
+  size_t getBrickSize() const { return brickSize; }
+
+  // Moves the cells into a different layout. Bricks are brickSize cells
+  // along every dimension, and updates go through them one at a time in
+  // storage order, so the thread pool hands out runs of bricks instead of
+  // slabs. Each brick carries its own halo, refreshed from the bricks
+  // around it every generation, which costs extra memory and copying in
+  // exchange for locality. That can only pay off when updates are bound by
+  // memory traffic: cheap rules on grids so large that the 2 * radius + 1
+  // planes a ROW_MAJOR sweep reuses no longer fit in cache. Otherwise
+  // ROW_MAJOR is faster; 3D Life on 128^3 and 256^3 grids updates about
+  // 5-30% slower in 16^3 bricks and 15-35% slower in 8^3 ones. Bricked
+  // layouts need DOUBLE_BUFFERED updates.
+  void setLayout(Layout layout, size_t brickSize = 16) {
+    if (layout != Layout::ROW_MAJOR && updateMode == UpdateMode::IN_PLACE)
+      throw InvalidOperationException(
+          "In-place updates need the ROW_MAJOR layout.");
+    if (layout != Layout::ROW_MAJOR && brickSize == 0)
+      throw InvalidOperationException("Bricks need at least one cell.");
+
+    detachSnapshot();
+    std::vector<T> current, future;
+    current.reserve(size);
+    future.reserve(size);
+    forEachCoordinate([&](const std::vector<size_t>& coord) {
+      auto idx = getIdx(coord);
+      current.push_back(values[idx]);
+      if (updateMode == UpdateMode::DOUBLE_BUFFERED) {
+        future.push_back(futureValues[idx]);
+      }
+    });
+
+    this->layout = layout;
+    this->brickSize = layout == Layout::ROW_MAJOR ? 0 : brickSize;
+    initLayout();
+    values = AlignedBuffer<T>(paddedSize, defaultValue);
+    if (updateMode == UpdateMode::DOUBLE_BUFFERED) {
+      futureValues = AlignedBuffer<T>(paddedSize, defaultValue);
+    }
+
+    size_t i = 0;
+    forEachCoordinate([&](const std::vector<size_t>& coord) {
+      auto idx = getIdx(coord);
+      values[idx] = current[i];
+      if (updateMode == UpdateMode::DOUBLE_BUFFERED) {
+        futureValues[idx] = future[i];
+      }
+      ++i;
+    });
+
+    // Neighbor offsets depend on the strides, and so do cell hashes.
+    if (neighborhoodType == Neighborhood::CUSTOM) {
+      setNeighborhood(customOffsets);
+    } else {
+      setNeighborhood(neighborhoodType, neighborhoodRadius);
+    }
+    restartStateHash();
+    statisticsStale = hasReductions();
+  }
+
+  bool getChangeTracking() const { return changeTracking; }
+
+  // With change tracking on, the grid is split into tiles of tileSize cells
+  // along every dimension, and an update only recomputes the tiles that had
+  // a changed cell within reach in the previous generation. Every other tile
+  // is known to stay as it is, so the result matches a full update as long
+  // as the update rule is a pure function of the neighborhood. Switching to
+  // a different rule or callback between updates breaks that; turn tracking
+  // on again afterwards to recompute everything once. Needs DOUBLE_BUFFERED.
+  void setChangeTracking(bool enabled, size_t tileSize = 16) {
+    if (enabled && updateMode == UpdateMode::IN_PLACE)
+      throw InvalidOperationException(
+          "Change tracking needs a double buffered grid.");
+    if (tileSize == 0)
+      throw InvalidOperationException("Tiles need at least one cell.");
+
+    changeTracking = enabled;
+    activeTiles.clear();
+    changedTiles.clear();
+    if (!enabled) {
+      tileActive.clear();
+      tileChanged.clear();
+      tileChangedAt.clear();
+      return;
+    }
+
+    this->tileSize = tileSize;
+    tileStrides.resize(numDimensions);
+    tilesPerDim.resize(numDimensions);
+    size_t numTiles = 1;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      tilesPerDim[i] = (shape[i] + tileSize - 1) / tileSize;
+      tileStrides[i] = numTiles;
+      numTiles *= tilesPerDim[i];
+    }
+    tileActive.assign(numTiles, 1);
+    tileChanged.assign(numTiles, 0);
+    tileChangedAt.assign(numTiles, ++changeCount);
+    for (size_t tile = 0; tile < numTiles; ++tile) {
+      activeTiles.push_back(tile);
+    }
+  }
+
+  // Number of tiles the next update will recompute, or 0 without change
+  // tracking.
+  size_t getActiveTileCount() const { return activeTiles.size(); }
+
+  // Goes up whenever a change tracking grid is updated or a cell is set, so
+  // that readers can ask forEachChangedTile() what changed since they last
+  // looked.
+  uint64_t getChangeCount() const { return changeCount; }
+
+  // Calls f(lo, hi) with the first coordinates of every tile with a cell
+  // that may have changed since getChangeCount() returned since, and the
+  // coordinates one past its last cell along every dimension. Turning
+  // change tracking on counts as a change to every tile.
+  template <typename F>
+  void forEachChangedTile(uint64_t since, F&& f) const {
+    if (!changeTracking)
+      throw InvalidOperationException("Change tracking is off.");
+    auto lo = allZeros(numDimensions);
+    auto hi = allZeros(numDimensions);
+    for (size_t tile = 0; tile < tileChangedAt.size(); ++tile) {
+      if (tileChangedAt[tile] <= since) continue;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        lo[i] = tile / tileStrides[i] % tilesPerDim[i] * tileSize;
+        hi[i] = std::min(lo[i] + tileSize, shape[i]);
+      }
+      f(lo, hi);
+    }
+  }
+
+  bool getStateHashing() const { return stateHashing; }
+
+  // With state hashing on, the grid keeps a 64-bit hash of its cells, the
+  // sum of a hash of every cell's bytes and index, and remembers the hashes
+  // of the last historyLength generations. Updates add what the cells they
+  // write change to it, comparing them with the previous generation while
+  // they are still in cache rather than going over the grid again, and
+  // update(generations) runs the generations one at a time. A generation
+  // whose hash matches a remembered one means the grid entered a cycle:
+  // getCyclePeriod() and getCycleStart() tell which, and with stopOnCycle
+  // updates do nothing from then on. Setting a cell clears the cycle, and
+  // loading a snapshot, seeking a generation or changing the layout or
+  // update mode starts over from the current generation. Cells are hashed
+  // bytewise, so T must be trivially copyable, and hashes only compare
+  // between grids of the same shape and layout. Two different states hash
+  // alike with a chance of about 2^-64. Unchanged rows cost one comparison,
+  // but every changed cell is hashed twice, its old and new value, which
+  // adds around 15-20% to an update of a Life soup with cells of a byte.
+  void setStateHashing(bool enabled, size_t historyLength = 256,
+                       bool stopOnCycle = false) {
+    if (enabled && !std::is_trivially_copyable<T>::value)
+      throw InvalidOperationException(
+          "State hashing needs trivially copyable cells.");
+    if (enabled && historyLength == 0)
+      throw InvalidOperationException(
+          "State hashing needs a history of at least one generation.");
+
+    stateHashing = enabled;
+    this->stopOnCycle = stopOnCycle;
+    hashHistoryLength = historyLength;
+    restartStateHash();
+  }
+
+  // Hash of the generation last computed, or 0 without state hashing.
+  uint64_t getStateHash() const { return stateHash; }
+
+  // Period of the cycle the grid entered, or 0 if it didn't yet.
+  size_t getCyclePeriod() const { return cyclePeriod; }
+
+  // Generation the cycle started at, the first one of it the grid went
+  // through, if hashing was on by then.
+  uint64_t getCycleStart() const { return cycleStart; }
+
+  // Reductions gather statistics about every generation in the pass that
+  // computes it: each thread reduces the rows it writes while they are
+  // still in cache, and the threads' partial results are merged once the
+  // generation is done. Updates that don't write every cell (with change
+  // tracking, block updates and relax()) reduce the grid in a pass of
+  // their own afterwards. The reductions run once for every row, so they
+  // should be cheap, and must not touch shared state.
+
+  // Counts the cells for which isLive(const T& cell) holds and, with
+  // bounds, finds the box around them.
+  template <typename IsLive>
+  void setPopulationReduction(const IsLive& isLive, bool bounds = true) {
+    populationReduction = [isLive, bounds](const Grid& grid, const T* cells,
+                                           size_t idx, size_t length,
+                                           StatisticsScratch& scratch) {
+      size_t count = 0;
+      for (size_t x = 0; x < length; ++x) {
+        count += isLive(cells[x]) ? 1 : 0;
+      }
+      scratch.statistics.population += count;
+      if (!bounds || !count) return;
+
+      size_t first = 0;
+      while (!isLive(cells[first])) ++first;
+      auto last = length - 1;
+      while (!isLive(cells[last])) --last;
+      grid.getCoordinates(idx + first, scratch.coord);
+      auto& boundsMin = scratch.statistics.boundsMin;
+      auto& boundsMax = scratch.statistics.boundsMax;
+      for (size_t d = 0; d < scratch.coord.size(); ++d) {
+        boundsMin[d] = std::min(boundsMin[d], scratch.coord[d]);
+        boundsMax[d] = std::max(boundsMax[d], scratch.coord[d]);
+      }
+      boundsMax[0] = std::max(boundsMax[0], scratch.coord[0] + last - first);
+    };
+    populationBounds = bounds;
+    statisticsStale = true;
+  }
+
+  // Counts the cells in each state stateOf(const T& cell) gives, which
+  // converts to size_t. States from numStates on aren't counted. Up to
+  // LOCAL_HISTOGRAM_STATES states, each row is counted into a few local
+  // histograms taking turns, so runs of cells in the same state don't wait
+  // on each other's increments, and those are added up once per row.
+  template <typename StateOf>
+  void setHistogramReduction(size_t numStates, const StateOf& stateOf) {
+    histogramReduction = [numStates, stateOf](const Grid&, const T* cells,
+                                              size_t, size_t length,
+                                              StatisticsScratch& scratch) {
+      auto histogram = scratch.statistics.histogram.data();
+      if (numStates > LOCAL_HISTOGRAM_STATES) {
+        for (size_t x = 0; x < length; ++x) {
+          auto state = static_cast<size_t>(stateOf(cells[x]));
+          if (state < numStates) ++histogram[state];
+        }
+        return;
+      }
+
+      // The last bin of each takes the states that aren't counted.
+      size_t local[4][LOCAL_HISTOGRAM_STATES + 1];
+      for (auto& counts : local) {
+        std::fill_n(counts, numStates + 1, 0);
+      }
+      auto bin = [&](size_t x) {
+        return std::min(static_cast<size_t>(stateOf(cells[x])), numStates);
+      };
+      size_t x = 0;
+      for (; x + 4 <= length; x += 4) {
+        ++local[0][bin(x)];
+        ++local[1][bin(x + 1)];
+        ++local[2][bin(x + 2)];
+        ++local[3][bin(x + 3)];
+      }
+      for (; x < length; ++x) {
+        ++local[0][bin(x)];
+      }
+      for (size_t state = 0; state < numStates; ++state) {
+        histogram[state] +=
+            local[0][state] + local[1][state] + local[2][state] +
+            local[3][state];
+      }
+    };
+    histogramSize = numStates;
+    statisticsStale = true;
+  }
+
+  // Finds the minimum, maximum and sum of project(const T& cell), which
+  // converts to double, over every cell.
+  template <typename Project>
+  void setFieldReduction(const Project& project) {
+    fieldReduction = [project](const Grid&, const T* cells, size_t,
+                               size_t length, StatisticsScratch& scratch) {
+      auto& statistics = scratch.statistics;
+      auto fieldMin = statistics.fieldMin;
+      auto fieldMax = statistics.fieldMax;
+      double sum = 0;
+      for (size_t x = 0; x < length; ++x) {
+        auto value = static_cast<double>(project(cells[x]));
+        fieldMin = std::min(fieldMin, value);
+        fieldMax = std::max(fieldMax, value);
+        sum += value;
+      }
+      statistics.fieldMin = fieldMin;
+      statistics.fieldMax = fieldMax;
+      statistics.fieldSum += sum;
+    };
+    statisticsStale = true;
+  }
+
+  void clearReductions() {
+    populationReduction = nullptr;
+    histogramReduction = nullptr;
+    fieldReduction = nullptr;
+    statistics = GridStatistics();
+    statisticsStale = false;
+  }
+
+  // Statistics of the generation last computed. Cells set since then are
+  // accounted for by reducing the whole grid again.
+  const GridStatistics& getStatistics() {
+    if (statisticsStale) {
+      gatherStatistics();
+    }
+    return statistics;
+  }
+
+  // Neighbors come sorted by their index in the grid's storage, which for
+  // row-major grids is by the last dimension, then by the one before it,
+  // and so on. radius can be up to maxNeighborDistance.
+  void setNeighborhood(Neighborhood neighborhoodType, size_t radius = 1) {
+    if (neighborhoodType == Neighborhood::CUSTOM)
+      throw InvalidOperationException(
+          "To set custom neighborhood, provide offsets directly");
+    if (radius == 0 || radius > maxNeighborDistance)
+      throw InvalidOperationException(
+          "Neighborhood radius must be between 1 and maxNeighborDistance.");
+
+    this->neighborhoodType = neighborhoodType;
+    neighborhoodRadius = radius;
+    neighborhood = generateNeighborhood(neighborhoodType, radius);
+    for (auto& neighbors : threadNeighbors) {
+      neighbors.resize(neighborhood.size());
+    }
+    if (changeTracking) {
+      setChangeTracking(true, tileSize);
+    }
+  }
+
+  Neighborhood getNeighborhood() const { return neighborhoodType; }
+
+  size_t getNeighborhoodRadius() const { return neighborhoodRadius; }
+
+  // The grid is left as it was if any offset is out of range or has the
+  // wrong number of dimensions.
+  void setNeighborhood(std::vector<std::vector<int>> offsets) {
+    std::vector<long int> indices;
+    indices.reserve(offsets.size());
+    for (const auto& offset : offsets) {
+      for (auto x : offset) {
+        if (std::abs(x) > maxNeighborDistance)
+          throw InvalidOperationException(
+              "Neighbor offset exceeds maxNeighborDistance.");
+      }
+      indices.push_back(getOffsetIdx(offset));
+    }
+
+    neighborhoodType = Neighborhood::CUSTOM;
+    customOffsets = std::move(offsets);
+    neighborhood = std::move(indices);
+    for (auto& neighbors : threadNeighbors) {
+      neighbors.resize(neighborhood.size());
+    }
+    if (changeTracking) {
+      setChangeTracking(true, tileSize);
+    }
+  }
+
+  // Number of generations since the grid was made, or since the generation
+  // of the snapshot it was loaded from.
+  uint64_t getGeneration() const { return generation; }
+
+  // Writes the grid to a snapshot file (see SNAPSHOT_VERSION). The file is
+  // written next to path and renamed over it once complete, so a crash
+  // never leaves a torn snapshot behind and grids still mapped from an
+  // older file at path keep their cells. Needs trivially copyable T.
+  void saveSnapshot(const std::string& path) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Snapshots need trivially copyable cells.");
+    snapshotJob.reset();
+    writeSnapshot(path, getSnapshotInfo(), getSnapshotBuffers());
+  }
+
+  // Same as saveSnapshot, but writes from a background thread while the
+  // simulation goes on, and the file holds the grid as it is now. The
+  // first thing to change the cells before the write is done hands the
+  // buffers over to the writer and carries on with copies of them, so the
+  // grid pays for one copy at most, and nothing if the write is done by
+  // then. Only one write runs at a time; another call waits for the last
+  // one. The future is ready once the file is complete, and rethrows any
+  // error writing it.
+  std::future<void> saveSnapshotAsync(const std::string& path) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Snapshots need trivially copyable cells.");
+    snapshotJob.reset();
+    auto info = getSnapshotInfo();
+    auto buffers = getSnapshotBuffers();
+    std::promise<void> promise;
+    auto future = promise.get_future();
+
+    snapshotJob.reset(new SnapshotJob());
+    auto finished = &snapshotJob->finished;
+    snapshotJob->thread =
+        std::thread([path, info, buffers, finished,
+                     promise = std::move(promise)]() mutable {
+          try {
+            writeSnapshot(path, info, buffers);
+            finished->store(true);
+            promise.set_value();
+          } catch (...) {
+            finished->store(true);
+            promise.set_exception(std::current_exception());
+          }
+        });
+    return future;
+  }
+
+  // Loads a snapshot saved by a grid with the same cell type, shape,
+  // wrapping, maxNeighborDistance and default value, along with its
+  // layout, update mode, neighborhood and generation. Where mmap is
+  // available the cells are mapped straight from the file as private
+  // copy-on-write pages, so they're only read from disk as they're touched
+  // and the file itself never changes; elsewhere they're read in. verify
+  // checks the checksum first, which reads the whole file once. With change
+  // tracking on, every tile starts out active.
+  void loadSnapshot(const std::string& path, bool verify = true) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Snapshots need trivially copyable cells.");
+    auto info = SnapshotInfo::read(path);
+    auto snapshotDefault = defaultValue;
+    if (info.cellSize == sizeof(T)) {
+      std::memcpy(&snapshotDefault, info.defaultValue.data(), sizeof(T));
+    }
+    if (info.cellSize != sizeof(T) || info.shape != shape ||
+        info.wrapping != wrapping ||
+        info.maxNeighborDistance != maxNeighborDistance ||
+        !cellsEqual(&snapshotDefault, &defaultValue, 1, 0))
+      throw InvalidOperationException(
+          "Snapshot was saved by a grid of a different kind.");
+    if (info.numBuffers != (info.updateMode == UpdateMode::IN_PLACE ? 1 : 2))
+      throw std::invalid_argument("Snapshot has the wrong number of buffers.");
+    if (changeTracking && info.updateMode == UpdateMode::IN_PLACE)
+      throw InvalidOperationException(
+          "Change tracking needs a double buffered grid.");
+
+    snapshotJob.reset();
+    auto oldLayout = layout;
+    auto oldBrickSize = brickSize;
+    layout = info.layout;
+    brickSize = info.layout == Layout::ROW_MAJOR ? 0 : info.brickSize;
+    initLayout();
+    std::array<AlignedBuffer<T>, 2> buffers;
+    try {
+      if (paddedSize != info.paddedSize)
+        throw std::invalid_argument("Snapshot storage has the wrong size.");
+      for (size_t i = 0; i < info.numBuffers; ++i) {
+        buffers[i] = loadSnapshotBuffer(path, info.getBufferOffset(i));
+      }
+      if (verify && computeSnapshotChecksum(info, buffers[0].get(),
+                                            buffers[1].get()) != info.checksum)
+        throw std::invalid_argument("Snapshot checksum mismatch.");
+    } catch (...) {
+      layout = oldLayout;
+      brickSize = oldBrickSize;
+      initLayout();
+      throw;
+    }
+
+    values = std::move(buffers[0]);
+    futureValues = std::move(buffers[1]);
+    spareValues.reset();
+    updateMode = info.updateMode;
+    generation = info.generation;
+    if (info.neighborhood == Neighborhood::CUSTOM) {
+      setNeighborhood(info.customOffsets);
+    } else {
+      setNeighborhood(info.neighborhood, info.neighborhoodRadius);
+    }
+    if (changeTracking) {
+      setChangeTracking(true, tileSize);
+    }
+    restartStateHash();
+    statisticsStale = hasReductions();
+    historyEdited = true;
+  }
+
+  // Records every generation from now on into recorder, starting with the
+  // current one as a keyframe; nullptr stops recording. Generations the
+  // recorder already holds from this one on are dropped. Recording needs
+  // every generation, so update(generations) runs them one at a time.
+  void setRecorder(std::shared_ptr<HistoryRecorder<T>> recorder) {
+    this->recorder = std::move(recorder);
+    historyEdited = true;
+    recordGeneration();
+  }
+
+  const std::shared_ptr<HistoryRecorder<T>>& getRecorder() const {
+    return recorder;
+  }
+
+  // Rewinds or fast-forwards to a generation the recorder holds. The cells
+  // are set as with setValue, and recording carries on from there, after
+  // dropping the generations that came after it.
+  void seekGeneration(uint64_t generation) {
+    if (!recorder)
+      throw InvalidOperationException("Grid has no history recorder.");
+    if (recorder->getNumCells() != size)
+      throw InvalidOperationException(
+          "History was recorded from a grid of a different size.");
+
+    auto cells = recorder->decode(generation);
+    detachSnapshot();
+    auto target = updateMode == UpdateMode::IN_PLACE ? &values : &futureValues;
+    size_t cellIdx = 0;
+    forEachCellRow(*target, [&](T* row, size_t length) {
+      std::copy_n(&cells[cellIdx], length, row);
+      cellIdx += length;
+    });
+    if (target != &values) {
+      std::copy_n(futureValues.get(), paddedSize, values.get());
+    }
+    this->generation = generation;
+    recorder->truncate(generation + 1);
+    if (changeTracking) {
+      setChangeTracking(true, tileSize);
+    }
+    restartStateHash();
+    statisticsStale = hasReductions();
+  }
+
+ private:
+  // A snapshot being written in the background. Until the grid detaches
+  // from it, the writer reads the grid's own buffers; after that, buffers
+  // keeps them alive.
+  struct SnapshotJob {
+    std::thread thread;
+    std::atomic<bool> finished{false};
+    bool detached = false;
+    std::array<AlignedBuffer<T>, 2> buffers;
+
+    ~SnapshotJob() {
+      if (thread.joinable()) thread.join();
+    }
+  };
+
+  // Immutable member variables
+  std::vector<size_t> const shape;
+  size_t const size;
+  size_t const maxNeighborDistance;
+  size_t const singleDimPadding;
+  unsigned short int const numDimensions;
+  Wrapping const wrapping;
+  T const defaultValue;
+
+  // Mutable member variables
+  size_t paddedSize;
+  std::vector<size_t> strides;
+  UpdateMode updateMode;
+  AlignedBuffer<T> values;
+  AlignedBuffer<T> futureValues;
+  AlignedBuffer<T> spareValues;
+  std::function<void(T*, const std::vector<T*>&)> cellUpdate;
+  Neighborhood neighborhoodType;
+  size_t neighborhoodRadius;
+  std::vector<long int> neighborhood;
+  std::vector<std::vector<T*>> threadNeighbors;
+  std::vector<CountScratch> threadCountScratch;
+  std::vector<TableScratch> threadTableScratch;
+  // Tells the rows of codes of one RuleTable generation from the last's.
+  uint64_t tableGeneration = 0;
+  CountKernel countKernel;
+  OuterTotalisticRule countKernelRule;
+  // Prefix sums of live cells along every padded row, for the count kernel.
+  std::vector<uint32_t> rowPrefixes;
+  // The cells waiting to topple in relax(), one bit each, and whether
+  // cells are within maxNeighborDistance of an edge.
+  std::vector<uint64_t> relaxPending;
+  std::vector<uint8_t> relaxEdges;
+  std::vector<std::array<AlignedBuffer<T>, 2>> threadBlockBuffers;
+  std::unique_ptr<ThreadPool> threadPool;
+  size_t chunkSize;
+  bool changeTracking;
+  size_t tileSize;
+  std::vector<size_t> tilesPerDim;
+  std::vector<size_t> tileStrides;
+  std::vector<size_t> activeTiles;
+  std::vector<uint8_t> tileActive;
+  std::vector<uint8_t> tileChanged;
+  // Tiles that changed in the last update, which getValue() only shows
+  // after the next one, and the value of changeCount when getValue() began
+  // showing a change to each tile.
+  std::vector<size_t> changedTiles;
+  uint64_t changeCount;
+  std::vector<uint64_t> tileChangedAt;
+  std::vector<std::vector<int>> customOffsets;
+  Layout layout;
+  size_t brickSize;
+  size_t brickPaddedSize;
+  std::vector<size_t> bricksPerDim;
+  std::vector<size_t> brickSlots;
+  std::vector<std::vector<size_t>> brickOrigins;
+  uint64_t generation;
+  bool stateHashing;
+  bool stopOnCycle;
+  uint64_t stateHash;
+  std::vector<HashScratch> threadHashScratch;
+  // Generations and hashes of the last hashHistoryLength generations,
+  // oldest first, and the latest generation each hash was seen in.
+  size_t hashHistoryLength;
+  std::deque<std::pair<uint64_t, uint64_t>> hashHistory;
+  std::unordered_map<uint64_t, uint64_t> hashGenerations;
+  // Whether cells were set since the last update, which makes the history
+  // useless for finding cycles.
+  bool hashEdited;
+  size_t cyclePeriod;
+  uint64_t cycleStart;
+  Reduction populationReduction;
+  Reduction histogramReduction;
+  Reduction fieldReduction;
+  bool populationBounds;
+  size_t histogramSize;
+  std::vector<StatisticsScratch> threadStatistics;
+  GridStatistics statistics;
+  // Whether the update under way reduces the rows it writes, rather than
+  // the whole grid once it is done.
+  bool reducingRows;
+  // Whether cells changed since statistics were last gathered.
+  bool statisticsStale;
+  std::shared_ptr<HistoryRecorder<T>> recorder;
+  std::vector<HistoryScratch> threadHistoryScratch;
+  // Whether the update under way takes the recorder's delta from the rows
+  // it writes.
+  bool recordingRows;
+  // Whether cells changed since the recorder last saw them other than by
+  // an update, so the next generation it gets must be a keyframe.
+  bool historyEdited;
+  // Last, so it is destroyed, and the writer joined, before the buffers.
+  std::unique_ptr<SnapshotJob> snapshotJob;
+
+  // Private member functions
+  const T& getValue(size_t idx) { return values[idx]; }
+  void setValue(size_t idx, const T& val) {
+    detachSnapshot();
+    if (stateHashing) {
+      auto& cells = updateMode == UpdateMode::IN_PLACE ? values : futureValues;
+      stateHash += hashCell(idx, val) - hashCell(idx, cells[idx]);
+      hashEdited = true;
+      cyclePeriod = 0;
+    }
+    statisticsStale = hasReductions();
+    historyEdited = true;
+    values[idx] = val;
+    if (updateMode == UpdateMode::DOUBLE_BUFFERED) {
+      futureValues[idx] = val;
+    }
+  }
+
+  // Advancing a generation only swaps the two buffers; the cells are copied
+  // into the future generation lazily, right before cellUpdate sees them.
+  void incrementTime() {
+    std::swap(values, futureValues);
+    refreshHalo(values);
+  }
+
+  void updateRow(size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+                 std::vector<T*>& neighbors) {
+    auto inPlace = &target == &values;
+    for (auto i = rowIdx; i < rowIdx + length; ++i) {
+      auto j = 0;
+      for (auto offset : neighborhood) {
+        neighbors[j++] = &values[i + offset];
+      }
+      if (!inPlace) {
+        target[i] = values[i];
+      }
+      cellUpdate(&target[i], neighbors);
+    }
+  }
+
+  template <typename Rule, size_t N>
+  void updateRow(size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+                 const Rule& rule, const std::array<long int, N>& offsets) {
+    auto inPlace = &target == &values;
+    for (auto i = rowIdx; i < rowIdx + length; ++i) {
+      StencilView<T, N> neighbors(&values[i], offsets.data());
+      if (!inPlace) {
+        target[i] = values[i];
+      }
+      rule(target[i], neighbors);
+    }
+  }
+
+  // The part of the grid one relaxCells call works on: cells with an index
+  // in [idxBegin, idxEnd), pending ones in words [lo, hi) of relaxPending.
+  struct RelaxBand {
+    size_t idxBegin;
+    size_t idxEnd;
+    size_t lo;
+    size_t hi;
+    std::vector<size_t> spilled;
+    size_t count;
+    uint64_t hashDelta;
+  };
+
+  template <typename Rule>
+  size_t relaxFrom(const Rule& rule,
+                   const std::vector<std::vector<size_t>>* seeds) {
+    constexpr auto numNeighbors = Rule::numNeighbors;
+    if (numNeighbors != neighborhood.size())
+      throw InvalidOperationException(
+          "Rule::numNeighbors does not match the grid's neighborhood.");
+    if (layout != Layout::ROW_MAJOR || changeTracking)
+      throw InvalidOperationException(
+          "Relaxation needs the ROW_MAJOR layout and no change tracking.");
+    if (seeds) {
+      for (const auto& seed : *seeds) {
+        checkBounds(seed);
+      }
+    }
+
+    if (!beginGeneration(false, false)) return 0;
+    if (updateMode != UpdateMode::IN_PLACE) {
+      incrementTime();
+      std::copy_n(&values[0], paddedSize, &futureValues[0]);
+    }
+    auto& cells = updateMode == UpdateMode::IN_PLACE ? values : futureValues;
+    if (relaxEdges.size() != paddedSize) {
+      initRelaxEdges();
+      relaxPending.assign((paddedSize + 63) / 64, 0);
+    }
+
+    // Bands of at least 2 * maxNeighborDistance slabs keep the cells two
+    // bands apart from ever sharing a neighbor, and of at least 64 cells
+    // from sharing a word of relaxPending. The two ends of a toroidal grid
+    // touch, so it needs an even number of them.
+    auto numSlabsTotal = numSlabs();
+    auto lastStride = strides[numDimensions - 1];
+    auto minWidth = std::max<size_t>(2 * maxNeighborDistance,
+                                     (64 + lastStride - 1) / lastStride);
+    size_t numBands = 1;
+    if (threadPool) {
+      numBands = std::min(numSlabsTotal / minWidth,
+                          2 * threadPool->getNumThreads());
+      if (wrapping == Wrapping::TOROIDAL && numBands % 2) {
+        --numBands;
+      }
+      numBands = std::max<size_t>(numBands, 1);
+    }
+    auto bandWidth = numSlabsTotal / numBands;
+    std::vector<RelaxBand> bands(numBands);
+    for (size_t band = 0; band < numBands; ++band) {
+      auto slabEnd = band + 1 < numBands ? (band + 1) * bandWidth
+                                         : numSlabsTotal;
+      bands[band] = {(band * bandWidth + maxNeighborDistance) * lastStride,
+                     (slabEnd + maxNeighborDistance) * lastStride,
+                     SIZE_MAX,
+                     0,
+                     {},
+                     0,
+                     0};
+    }
+    if (numBands == 1) {
+      bands[0].idxBegin = 0;
+      bands[0].idxEnd = paddedSize;
+    }
+
+    auto mark = [&](size_t idx) {
+      if (!rule.unstable(cells[idx])) return;
+      auto slab = idx / lastStride - maxNeighborDistance;
+      auto& band = bands[std::min(slab / bandWidth, numBands - 1)];
+      relaxPending[idx / 64] |= uint64_t(1) << (idx % 64);
+      band.lo = std::min(band.lo, idx / 64);
+      band.hi = std::max(band.hi, idx / 64 + 1);
+    };
+    if (seeds) {
+      for (const auto& seed : *seeds) {
+        mark(getIdx(seed));
+      }
+    } else {
+      forEachInteriorRow(0, numSlabs(), [&](size_t rowIdx, size_t length) {
+        for (auto i = rowIdx; i < rowIdx + length; ++i) {
+          mark(i);
+        }
+      });
+    }
+
+    auto neighborCoords = getNeighborCoordinateOffsets();
+    if (numBands == 1) {
+      relaxCells(rule, cells, bands[0], neighborCoords);
+    }
+    std::vector<size_t> active;
+    while (numBands > 1) {
+      auto done = true;
+      for (size_t parity = 0; parity < 2; ++parity) {
+        active.clear();
+        for (auto band = parity; band < numBands; band += 2) {
+          if (bands[band].lo < bands[band].hi) active.push_back(band);
+        }
+        if (active.empty()) continue;
+        done = false;
+        threadPool->run(active.size(), [&](size_t i, size_t) {
+          relaxCells(rule, cells, bands[active[i]], neighborCoords);
+        });
+        for (auto band : active) {
+          for (auto idx : bands[band].spilled) {
+            mark(idx);
+          }
+          bands[band].spilled.clear();
+        }
+      }
+      if (done) break;
+    }
+
+    size_t count = 0;
+    for (const auto& band : bands) {
+      count += band.count;
+      if (stateHashing) {
+        threadHashScratch[0].delta += band.hashDelta;
+      }
+    }
+    endGeneration();
+    return count;
+  }
+
+  // Topples the pending cells of band, in index order, until none is left.
+  // Cells that become unstable are marked pending if they are in the band
+  // and added to band.spilled otherwise. Passes go over the words that got
+  // marked behind them until one marks none.
+  template <typename Rule>
+  void relaxCells(const Rule& rule, AlignedBuffer<T>& cells, RelaxBand& band,
+                  const std::vector<std::vector<long int>>& neighborCoords) {
+    constexpr auto numNeighbors = Rule::numNeighbors;
+    std::array<T*, numNeighbors> neighbors;
+    std::array<bool, numNeighbors> inGrid;
+    std::array<long int, numNeighbors> offsets;
+    std::copy(neighborhood.begin(), neighborhood.end(), offsets.begin());
+    std::vector<size_t> coord(numDimensions);
+    T sink = defaultValue;
+
+    // With state hashing, the cells a toppling touches are taken out of the
+    // hash before it and put back after. Neighborhoods wrapped around a
+    // small toroidal grid may touch a cell twice.
+    std::array<size_t, numNeighbors + 1> touched;
+    size_t numTouched = 0;
+    auto hashTouched = [&] {
+      uint64_t sum = 0;
+      for (size_t k = 0; k < numTouched; ++k) {
+        sum += hashCell(touched[k], cells[touched[k]]);
+      }
+      return sum;
+    };
+    auto topple = [&](size_t idx, bool wrapped) {
+      if (!stateHashing) {
+        rule(cells[idx], neighbors);
+        return;
+      }
+      touched[0] = idx;
+      numTouched = 1;
+      for (auto neighbor : neighbors) {
+        if (neighbor != &sink) {
+          touched[numTouched++] = static_cast<size_t>(neighbor - &cells[0]);
+        }
+      }
+      if (wrapped) {
+        std::sort(touched.begin(), touched.begin() + numTouched);
+        numTouched = static_cast<size_t>(
+            std::unique(touched.begin(), touched.begin() + numTouched) -
+            touched.begin());
+      }
+      band.hashDelta -= hashTouched();
+      rule(cells[idx], neighbors);
+      band.hashDelta += hashTouched();
+    };
+
+    // The first and last words may be shared with the bands next to this
+    // one.
+    auto firstWord = band.idxBegin / 64;
+    auto lastWord = (band.idxEnd - 1) / 64;
+    auto firstMask = ~uint64_t(0) << (band.idxBegin % 64);
+    auto lastMask = ~uint64_t(0) >> (63 - (band.idxEnd - 1) % 64);
+
+    while (band.lo < band.hi) {
+      auto w = band.lo;
+      auto end = band.hi;
+      band.lo = SIZE_MAX;
+      band.hi = 0;
+      // Whether a neighbor became unstable is too random to branch on, so
+      // it goes straight into its bit.
+      auto mark = [&](size_t idx) {
+        uint64_t unstable = rule.unstable(cells[idx]);
+        if (idx < band.idxBegin || idx >= band.idxEnd) {
+          if (unstable) band.spilled.push_back(idx);
+          return;
+        }
+        auto word = idx / 64;
+        relaxPending[word] |= unstable << (idx % 64);
+        if (word < w) {
+          band.lo = std::min(band.lo, word);
+          band.hi = std::max(band.hi, word + 1);
+        } else {
+          end = std::max(end, word + 1);
+        }
+      };
+
+      for (; w < end; ++w) {
+        auto mask = (w == firstWord ? firstMask : ~uint64_t(0)) &
+                    (w == lastWord ? lastMask : ~uint64_t(0));
+        while (auto bits = relaxPending[w] & mask) {
+          relaxPending[w] &= ~mask;
+          for (; bits; bits &= bits - 1) {
+            auto idx = w * 64 + countTrailingZeros(bits);
+            if (!rule.unstable(cells[idx])) continue;
+
+            // Cells away from the edges find their neighbors at fixed
+            // offsets; the others go through coordinates, wrapped or sunk.
+            ++band.count;
+            if (!relaxEdges[idx]) {
+              for (size_t j = 0; j < numNeighbors; ++j) {
+                neighbors[j] = &cells[idx + offsets[j]];
+              }
+              topple(idx, false);
+              mark(idx);
+              for (size_t j = 0; j < numNeighbors; ++j) {
+                mark(idx + offsets[j]);
+              }
+              continue;
+            }
+
+            auto rest = idx;
+            for (auto d = numDimensions; d-- > 0;) {
+              coord[d] = rest / strides[d] - maxNeighborDistance;
+              rest %= strides[d];
+            }
+            for (size_t j = 0; j < numNeighbors; ++j) {
+              inGrid[j] = true;
+              size_t neighborIdx = 0;
+              for (size_t d = 0; d < numDimensions; ++d) {
+                auto extent = static_cast<long int>(shape[d]);
+                auto x =
+                    static_cast<long int>(coord[d]) + neighborCoords[j][d];
+                if (x < 0 || x >= extent) {
+                  inGrid[j] = inGrid[j] && wrapping == Wrapping::TOROIDAL;
+                  x = (x + extent) % extent;
+                }
+                neighborIdx += (x + maxNeighborDistance) * strides[d];
+              }
+              neighbors[j] = inGrid[j] ? &cells[neighborIdx] : &sink;
+            }
+
+            topple(idx, wrapping == Wrapping::TOROIDAL);
+            sink = defaultValue;
+            mark(idx);
+            for (size_t j = 0; j < numNeighbors; ++j) {
+              if (inGrid[j]) {
+                mark(static_cast<size_t>(neighbors[j] - &cells[0]));
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void initRelaxEdges() {
+    relaxEdges.assign(paddedSize, 0);
+    forEachCoordinate([&](const std::vector<size_t>& coord) {
+      for (size_t d = 0; d < numDimensions; ++d) {
+        if (coord[d] < maxNeighborDistance ||
+            coord[d] + maxNeighborDistance >= shape[d]) {
+          relaxEdges[getIdx(coord)] = 1;
+          return;
+        }
+      }
+    });
+  }
+
+  // The neighborhood as coordinate offsets, in the same order.
+  std::vector<std::vector<long int>> getNeighborCoordinateOffsets() {
+    std::vector<std::vector<long int>> result;
+    for (auto offset : neighborhood) {
+      std::vector<long int> coord(numDimensions);
+      for (auto d = numDimensions; d-- > 0;) {
+        auto stride = static_cast<long int>(strides[d]);
+        auto x = (std::abs(offset) + stride / 2) / stride;
+        coord[d] = offset < 0 ? -x : x;
+        offset -= coord[d] * stride;
+      }
+      result.push_back(coord);
+    }
+    return result;
+  }
+
+  // Updates the block at origin cell by cell, wrapping it around toroidal
+  // grids. Blocks that stick out past a bounded edge keep their cells.
+  template <typename Rule, size_t N>
+  void updateBlockAt(const std::vector<long int>& origin,
+                     std::vector<size_t>& coord, std::array<T, N>& block,
+                     AlignedBuffer<T>& target, const Rule& rule,
+                     size_t phase, size_t thread) {
+    std::array<size_t, N> indices;
+    auto full = true;
+    for (size_t i = 0; i < N; ++i) {
+      auto valid = true;
+      for (size_t d = 0; d < numDimensions; ++d) {
+        auto extent = static_cast<long int>(shape[d]);
+        auto x = origin[d] + static_cast<long int>(i >> d & 1);
+        if (x < 0 || x >= extent) {
+          valid = wrapping == Wrapping::TOROIDAL;
+          x = (x + extent) % extent;
+        }
+        coord[d] = static_cast<size_t>(x);
+      }
+      full = full && valid;
+      indices[i] = valid ? getIdx(coord) : 0;
+      if (valid && &target != &values) {
+        target[indices[i]] = values[indices[i]];
+      }
+    }
+    if (!full) return;
+
+    for (size_t i = 0; i < N; ++i) {
+      block[i] = values[indices[i]];
+    }
+    rule(block, phase);
+    for (size_t i = 0; i < N; ++i) {
+      if (stateHashing) {
+        threadHashScratch[thread].delta += hashDifference(
+            indices[i], &values[indices[i]], &block[i], 1);
+      }
+      target[indices[i]] = block[i];
+    }
+  }
+
+  void updateTableRow(size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+                      const RuleTable<T>& table, size_t thread) {
+    if (table.isWindowed() && numDimensions == 2 &&
+        neighborhoodType == Neighborhood::MOORE && &target != &values) {
+      updateTableWindows(rowIdx, length, target, table, thread);
+      return;
+    }
+    for (auto i = rowIdx; i < rowIdx + length; ++i) {
+      auto index = table.getCode(values[i]) << table.getShift(0);
+      for (size_t j = 0; j < neighborhood.size(); ++j) {
+        index |= table.getCode(values[i + neighborhood[j]])
+                 << table.getShift(j + 1);
+      }
+      target[i] = table.getNext(index);
+    }
+  }
+
+  // Looks each cell up by the 3x3 block around it, from the codes of the
+  // rows above, at and below it. Each of those is converted once for the
+  // three rows that read it, and the indices are put together from them
+  // with no dependency from cell to cell. The row below is neighbor 6.
+  void updateTableWindows(size_t rowIdx, size_t length,
+                          AlignedBuffer<T>& target, const RuleTable<T>& table,
+                          size_t thread) {
+    auto bits = table.getBitsPerCell();
+    auto below = neighborhood[6];
+    auto& scratch = threadTableScratch[thread];
+    auto above = getTableCodes(rowIdx - below, length, table, scratch);
+    auto middle = getTableCodes(rowIdx, length, table, scratch);
+    auto under = getTableCodes(rowIdx + below, length, table, scratch);
+    scratch.columns.resize(length + 2);
+    auto columns = scratch.columns.data();
+    for (size_t x = 0; x < length + 2; ++x) {
+      columns[x] = above[x] | uint32_t(middle[x]) << bits |
+                   uint32_t(under[x]) << 2 * bits;
+    }
+    scratch.indices.resize(length);
+    auto indices = scratch.indices.data();
+    for (size_t x = 0; x < length; ++x) {
+      indices[x] = columns[x] | columns[x + 1] << 3 * bits |
+                   columns[x + 2] << 6 * bits;
+    }
+    table.getNexts(indices, length, &target[rowIdx]);
+  }
+
+  // The codes of the cells from one before rowIdx to one past the
+  // length cells after it, kept for as long as the generation lasts.
+  const uint8_t* getTableCodes(size_t rowIdx, size_t length,
+                               const RuleTable<T>& table,
+                               TableScratch& scratch) {
+    for (auto& row : scratch.rows) {
+      if (row.generation == tableGeneration && row.rowIdx == rowIdx &&
+          row.length == length)
+        return row.codes.data();
+    }
+    auto& row = scratch.rows[scratch.nextRow];
+    scratch.nextRow = (scratch.nextRow + 1) % scratch.rows.size();
+    row.generation = tableGeneration;
+    row.rowIdx = rowIdx;
+    row.length = length;
+    row.codes.resize(length + 2);
+    table.getCodes(&values[rowIdx - 1], length + 2, row.codes.data());
+    return row.codes.data();
+  }
+
+  bool canUseBlockTable(const RuleTable<T>& table) const {
+    return table.hasBlockTable() && numDimensions == 2 &&
+           neighborhoodType == Neighborhood::MOORE && !changeTracking &&
+           layout == Layout::ROW_MAJOR &&
+           updateMode == UpdateMode::DOUBLE_BUFFERED;
+  }
+
+  // Updates the 2x2 blocks in row pairs [pairBegin, pairEnd). Each row of
+  // the 4x4 block around a 2x2 block is kept as a window of four codes,
+  // which slides two cells along per block.
+  void updateTableBlocks(size_t pairBegin, size_t pairEnd,
+                         const RuleTable<T>& table, size_t thread) {
+    const auto& states = table.getStates();
+    auto stride = strides[1];
+    auto numBlocks = shape[0] / 2;
+    for (auto pair = pairBegin; pair < pairEnd; ++pair) {
+      // The first row and column of the 4x4 blocks are in the halo.
+      auto cornerIdx = getIdx({0, pair * 2}) - stride - 1;
+      const T* rows[4];
+      uint32_t windows[4];
+      for (size_t r = 0; r < 4; ++r) {
+        rows[r] = &values[cornerIdx + r * stride];
+        windows[r] =
+            table.getCode(rows[r][0]) | table.getCode(rows[r][1]) << 1;
+      }
+      auto top = &futureValues[cornerIdx + stride + 1];
+      auto bottom = top + stride;
+      for (size_t x = 0; x < numBlocks * 2; x += 2) {
+        uint32_t index = 0;
+        for (size_t r = 0; r < 4; ++r) {
+          windows[r] |= table.getCode(rows[r][x + 2]) << 2 |
+                        table.getCode(rows[r][x + 3]) << 3;
+          index |= windows[r] << (r * 4);
+          windows[r] >>= 2;
+        }
+        auto block = table.getNextBlock(index);
+        top[x] = states[block & 1];
+        top[x + 1] = states[block >> 1 & 1];
+        bottom[x] = states[block >> 2 & 1];
+        bottom[x + 1] = states[block >> 3];
+      }
+      auto topIdx = cornerIdx + stride + 1;
+      for (auto idx : {topIdx, topIdx + stride}) {
+        noteRow(idx, &values[idx], futureValues, numBlocks * 2, thread);
+      }
+    }
+  }
+
+  // Toroidal halos hold copies of the interior cells on the opposite side.
+  // Dimensions are wrapped one after another over the full padded extent of
+  // the lower ones, so corner cells pick up the already wrapped edges.
+  void refreshHalo(AlignedBuffer<T>& buffer) {
+    if (layout != Layout::ROW_MAJOR) {
+      refreshBrickHalos(buffer);
+      return;
+    }
+    if (wrapping != Wrapping::TOROIDAL) return;
+
+    for (size_t dim = 0; dim < numDimensions; ++dim) {
+      auto stride = strides[dim];
+      auto extent = shape[dim];
+      forEachHaloLine(dim, [&](size_t base) {
+        for (size_t j = 0; j < maxNeighborDistance; ++j) {
+          buffer[base + j * stride] = buffer[base + (extent + j) * stride];
+          buffer[base + (maxNeighborDistance + extent + j) * stride] =
+              buffer[base + (maxNeighborDistance + j) * stride];
+        }
+      });
+    }
+  }
+
+  // Box sums are separable, so the count kernel reduces one dimension at a
+  // time with a running sum along it: first along each row, then across
+  // rows within each hyperplane of the last dimension, and finally across a
+  // window of hyperplanes that slides along the slabs. Every stage only
+  // adds the entry that enters the window and subtracts the one that leaves
+  // it. Hyperplanes are summed before any slab they cover is written, so
+  // in-place sweeps still see the previous generation.
+  void updateCountSlabs(size_t slabBegin, size_t slabEnd,
+                        AlignedBuffer<T>& target, const CountKernel& kernel,
+                        size_t thread) {
+    auto& scratch = threadCountScratch[thread];
+    auto radius = kernel.radius;
+    auto width = shape[0];
+    if (numDimensions == 1) {
+      // Slabs of a 1D grid are single cells.
+      scratch.total.resize(width);
+      sumRows(0, 1, radius, scratch.total.data());
+      applyCounts(slabBegin + maxNeighborDistance,
+                  scratch.total.data() + slabBegin, slabEnd - slabBegin,
+                  target, kernel, thread);
+      return;
+    }
+
+    size_t top = numDimensions - 1;
+    auto planeRows = strides[top] / strides[1];
+    auto planeSize = planeRows * width;
+    auto window = 2 * radius + 1;
+    scratch.levels.resize(top);
+    for (size_t level = 0; level + 1 < top; ++level) {
+      scratch.levels[level].resize(planeSize);
+    }
+    scratch.ring.resize(window * planeSize);
+    scratch.total.assign(planeSize, 0);
+    scratch.line.resize(width);
+    auto total = scratch.total.data();
+
+    // Slab z covers the hyperplanes at padded indices z + pad - radius to
+    // z + pad + radius.
+    auto firstPlane = slabBegin + maxNeighborDistance - radius;
+    for (auto plane = firstPlane; plane < firstPlane + window - 1; ++plane) {
+      auto sum = scratch.ring.data() + plane % window * planeSize;
+      sumHyperplane(plane, radius, scratch, sum);
+      for (size_t i = 0; i < planeSize; ++i) {
+        total[i] += sum[i];
+      }
+    }
+
+    for (auto z = slabBegin; z < slabEnd; ++z) {
+      auto entering = z + maxNeighborDistance + radius;
+      auto sum = scratch.ring.data() + entering % window * planeSize;
+      if (z > slabBegin) {
+        for (size_t i = 0; i < planeSize; ++i) {
+          total[i] -= sum[i];
+        }
+      }
+      sumHyperplane(entering, radius, scratch, sum);
+      for (size_t i = 0; i < planeSize; ++i) {
+        total[i] += sum[i];
+      }
+
+      auto slabIdx = (z + maxNeighborDistance) * strides[top];
+      forEachInteriorPlaneRow([&](size_t planeRow) {
+        applyCounts(slabIdx + planeRow * strides[1] + maxNeighborDistance,
+                    total + planeRow * width, width, target, kernel,
+                    thread);
+      });
+    }
+  }
+
+  // Writes the box sums over the first n - 1 dimensions of every row in the
+  // hyperplane at padded index plane of the last dimension to out.
+  void sumHyperplane(size_t plane, size_t radius, CountScratch& scratch,
+                     uint32_t* out) {
+    size_t top = numDimensions - 1;
+    auto width = shape[0];
+    auto planeRows = strides[top] / strides[1];
+    auto firstRow = plane * planeRows;
+
+    auto level0 = top == 1 ? out : scratch.levels[0].data();
+    for (size_t row = 0; row < planeRows; ++row) {
+      sumRows(firstRow + row, 1, radius, level0 + row * width);
+    }
+
+    for (size_t level = 1; level < top; ++level) {
+      auto in = scratch.levels[level - 1].data();
+      auto sum = level + 1 == top ? out : scratch.levels[level].data();
+      auto stride = strides[level] / strides[1];
+      auto window = 2 * radius + 1;
+      forEachPlaneLine(level, [&](size_t firstLineRow) {
+        auto running = scratch.line.data();
+        std::fill_n(running, width, 0);
+        auto lineRow = [&](size_t c) { return firstLineRow + c * stride; };
+        auto first = maxNeighborDistance - radius;
+        for (auto c = first; c < first + window - 1; ++c) {
+          addRow(running, in + lineRow(c) * width, width);
+        }
+        for (auto c = maxNeighborDistance;
+             c < maxNeighborDistance + shape[level]; ++c) {
+          addRow(running, in + lineRow(c + radius) * width, width);
+          std::copy_n(running, width, sum + lineRow(c) * width);
+          subtractRow(running, in + lineRow(c - radius) * width, width);
+        }
+      });
+    }
+  }
+
+  // Writes the running sums of live cells along each of numRows padded rows,
+  // starting at padded row index firstRow, to out.
+  void sumRows(size_t firstRow, size_t numRows, size_t radius,
+               uint32_t* out) {
+    auto width = shape[0];
+    for (size_t row = 0; row < numRows; ++row) {
+      auto cells = &values[(firstRow + row) * strides[1] + maxNeighborDistance];
+      auto sum = out + row * width;
+      if (radius > MAX_SHIFTED_SUM_RADIUS) {
+        // Wide windows slide a running sum along the row instead.
+        auto leaving = cells - radius;
+        uint32_t running = 0;
+        for (auto cell = leaving; cell < cells + radius; ++cell) {
+          running += *cell == 1;
+        }
+        for (size_t x = 0; x < width; ++x) {
+          running += cells[x + radius] == 1;
+          sum[x] = running;
+          running -= leaving[x] == 1;
+        }
+        continue;
+      }
+
+      // Adding whole shifted rows keeps the loops free of carried
+      // dependencies, so they vectorize.
+      std::fill_n(sum, width, 0);
+      for (auto shift = cells - radius; shift <= cells + radius; ++shift) {
+        for (size_t x = 0; x < width; ++x) {
+          sum[x] += shift[x] == 1;
+        }
+      }
+    }
+  }
+
+  // The spans of a neighborhood, a single one for every row of it.
+  // The count kernel of rule, compiled on first use and kept until a
+  // different rule runs or the layout changes the strides it was built for.
+  const CountKernel& getCountKernel(const OuterTotalisticRule& rule) {
+    if (!countKernel.table.empty() && countKernelRule == rule)
+      return countKernel;
+
+    auto spans = getCountSpans(rule.neighborhood, rule.radius);
+    size_t maxNeighbors = 0;
+    for (const auto& span : spans) {
+      maxNeighbors += 2 * span.halfWidth + 1;
+    }
+    --maxNeighbors;
+    auto lookup = rule.lookupTable(maxNeighbors);
+
+    // Counting the cell itself saves a compare per cell, and only shifts
+    // the row for state 1 by one.
+    CountKernel kernel;
+    kernel.tableRow = maxNeighbors + 2;
+    kernel.maxState = static_cast<uint32_t>(rule.numStates - 1);
+    kernel.radius = rule.radius;
+    if (rule.neighborhood != Neighborhood::MOORE && numDimensions > 1) {
+      kernel.spans = spans;
+      kernel.diamond = rule.neighborhood == Neighborhood::VON_NEUMANN &&
+                       numDimensions == 2 &&
+                       rule.radius >= MIN_DIAMOND_RADIUS;
+    }
+    kernel.offsets = generateNeighborhood(rule.neighborhood, rule.radius);
+    kernel.table.assign(rule.numStates * kernel.tableRow, 0);
+    for (size_t state = 0; state < rule.numStates; ++state) {
+      for (size_t count = 0; count <= maxNeighbors; ++count) {
+        kernel.table[state * kernel.tableRow + count + (state == 1)] =
+            lookup[state * (maxNeighbors + 1) + count];
+      }
+    }
+    countKernel = std::move(kernel);
+    countKernelRule = rule;
+    return countKernel;
+  }
+
+  std::vector<CountSpan> getCountSpans(Neighborhood type, size_t radius) {
+    auto r = static_cast<long int>(radius);
+    std::vector<CountSpan> spans;
+    std::vector<long int> offset(numDimensions, -r);
+    offset[0] = 0;
+    while (true) {
+      long int rowOffset = 0;
+      size_t taxicab = 0;
+      size_t squared = 0;
+      for (size_t i = 1; i < numDimensions; ++i) {
+        rowOffset += offset[i] * static_cast<long int>(strides[i] / strides[1]);
+        taxicab += std::abs(offset[i]);
+        squared += offset[i] * offset[i];
+      }
+
+      auto inside = true;
+      size_t halfWidth = radius;
+      if (type == Neighborhood::VON_NEUMANN) {
+        inside = taxicab <= radius;
+        halfWidth = radius - std::min(taxicab, radius);
+      } else if (type == Neighborhood::CIRCULAR) {
+        inside = squared <= radius * radius;
+        auto rest = radius * radius - std::min(squared, radius * radius);
+        halfWidth = static_cast<size_t>(std::sqrt(static_cast<double>(rest)));
+        while (halfWidth * halfWidth > rest) --halfWidth;
+        while ((halfWidth + 1) * (halfWidth + 1) <= rest) ++halfWidth;
+      }
+      if (inside) {
+        spans.push_back({rowOffset, halfWidth});
+      }
+
+      size_t i = 1;
+      for (; i < numDimensions; ++i) {
+        if (++offset[i] <= r) break;
+        offset[i] = -r;
+      }
+      if (i >= numDimensions) return spans;
+    }
+  }
+
+  // Counts neighbors span by span from prefix sums along every padded row,
+  // which are all taken before any cell is written.
+  void updateSpanCounts(AlignedBuffer<T>& target, const CountKernel& kernel) {
+    if (kernel.diamond) {
+      if (&target == &values) {
+        updateDiamondCounts(0, numSlabs(), target, kernel, 0);
+      } else {
+        forEachSlabChunk([&](size_t slabBegin, size_t slabEnd,
+                             size_t thread) {
+          updateDiamondCounts(slabBegin, slabEnd, target, kernel, thread);
+        });
+      }
+      return;
+    }
+
+    auto rowLength = strides[1];
+    auto prefixLength = rowLength + 1;
+    auto numRows = paddedSize / rowLength;
+    rowPrefixes.resize(numRows * prefixLength);
+    forEachWorkChunk(numRows, [&](size_t begin, size_t end, size_t) {
+      for (auto row = begin; row < end; ++row) {
+        auto cells = &values[row * rowLength];
+        auto prefix = &rowPrefixes[row * prefixLength];
+        prefix[0] = 0;
+        for (size_t x = 0; x < rowLength; ++x) {
+          prefix[x + 1] = prefix[x] + (cells[x] == 1);
+        }
+      }
+    });
+
+    auto updateSlabs = [&](size_t slabBegin, size_t slabEnd, size_t thread) {
+      auto& total = threadCountScratch[thread].total;
+      total.resize(shape[0]);
+      forEachInteriorRow(
+          slabBegin, slabEnd, [&](size_t rowIdx, size_t length) {
+            auto row = rowIdx / rowLength;
+            auto x = rowIdx % rowLength;
+            std::fill_n(total.data(), length, 0);
+            for (const auto& span : kernel.spans) {
+              auto prefix = &rowPrefixes[(row + span.rowOffset) * prefixLength +
+                                         x];
+              auto hi = prefix + span.halfWidth + 1;
+              auto lo = prefix - span.halfWidth;
+              for (size_t i = 0; i < length; ++i) {
+                total[i] += hi[i] - lo[i];
+              }
+            }
+            applyCounts(rowIdx, total.data(), length, target, kernel,
+                        thread);
+          });
+    };
+    if (&target == &values) {
+      updateSlabs(0, numSlabs(), 0);
+    } else {
+      forEachSlabChunk(updateSlabs);
+    }
+  }
+
+  // Counts the neighbors in the 2D diamonds of the rows from slabBegin to
+  // slabEnd. The count of the first cell of a row is summed cell by cell,
+  // and every next one differs from it by the right edge of its diamond
+  // less the left edge of the one before, each made of two diagonal runs.
+  // Those come from prefix sums down both diagonals, kept for the 2 *
+  // radius + 2 padded rows around the current one, so every count but the
+  // first of each row costs the same whatever the radius. First counts are
+  // taken before any cell is written, and prefix sums only reach rows
+  // below the ones written.
+  void updateDiamondCounts(size_t slabBegin, size_t slabEnd,
+                           AlignedBuffer<T>& target, const CountKernel& kernel,
+                           size_t thread) {
+    auto r = static_cast<long int>(kernel.radius);
+    auto rowLength = static_cast<long int>(strides[1]);
+    // Prefix sums start from a row of zeros and have a column of zeros on
+    // either side, for the runs that start at the edge.
+    auto width = rowLength + 2;
+    auto window = 2 * r + 2;
+    auto firstRow = static_cast<long int>(slabBegin + maxNeighborDistance) - r;
+    auto& diagonals = threadCountScratch[thread].diagonals;
+    diagonals.resize(2 * window * width);
+    // down sums cells towards the upper left, and up towards the upper
+    // right, both by padded row and column.
+    auto down = [&](long int y) {
+      return &diagonals[((y - firstRow + 1) % window) * width + 1];
+    };
+    auto up = [&](long int y) {
+      return &diagonals[(window + (y - firstRow + 1) % window) * width + 1];
+    };
+    std::fill_n(down(firstRow - 1) - 1, width, 0);
+    std::fill_n(up(firstRow - 1) - 1, width, 0);
+    auto nextRow = firstRow;
+    auto sumDiagonals = [&](long int lastRow) {
+      for (; nextRow <= lastRow; ++nextRow) {
+        auto cells = &values[nextRow * rowLength];
+        auto downRow = down(nextRow);
+        auto upRow = up(nextRow);
+        auto downAbove = down(nextRow - 1);
+        auto upAbove = up(nextRow - 1);
+        downRow[-1] = 0;
+        upRow[rowLength] = 0;
+        for (long int x = 0; x < rowLength; ++x) {
+          uint32_t live = cells[x] == 1;
+          downRow[x] = downAbove[x - 1] + live;
+          upRow[x] = upAbove[x + 1] + live;
+        }
+        downRow[rowLength] = 0;
+        upRow[-1] = 0;
+      }
+    };
+
+    auto& firstCounts = threadCountScratch[thread].line;
+    firstCounts.clear();
+    forEachInteriorRow(slabBegin, slabEnd, [&](size_t rowIdx, size_t) {
+      auto y = static_cast<long int>(rowIdx) / rowLength;
+      auto first = static_cast<long int>(rowIdx) % rowLength;
+      uint32_t count = 0;
+      for (auto dy = -r; dy <= r; ++dy) {
+        auto half = r - std::abs(dy);
+        auto cells = &values[(y + dy) * rowLength + first];
+        for (auto dx = -half; dx <= half; ++dx) {
+          count += cells[dx] == 1;
+        }
+      }
+      firstCounts.push_back(count);
+    });
+
+    // The edges of the diamond of cell x are the runs ending at rows
+    // y + r and y - 1 of up from x and of down from x + r - 1 on the
+    // right, and of down from x - 1 and of up from x - r on the left.
+    auto& total = threadCountScratch[thread].total;
+    total.resize(shape[0]);
+    size_t row = 0;
+    forEachInteriorRow(slabBegin, slabEnd, [&](size_t rowIdx, size_t length) {
+      auto y = static_cast<long int>(rowIdx) / rowLength;
+      auto first = static_cast<long int>(rowIdx) % rowLength;
+      sumDiagonals(y + r);
+      auto rightUp = up(y + r) + first;
+      auto rightUpEnd = up(y - 1) + first + r + 1;
+      auto rightDown = down(y - 1) + first + r - 1;
+      auto rightDownEnd = down(y - r - 1) + first - 1;
+      auto leftDown = down(y + r) + first - 1;
+      auto leftDownEnd = down(y - 1) + first - r - 2;
+      auto leftUp = up(y - 1) + first - r;
+      auto leftUpEnd = up(y - r - 1) + first;
+      for (size_t i = 1; i < length; ++i) {
+        total[i] = (rightUp[i] - rightUpEnd[i]) +
+                   (rightDown[i] - rightDownEnd[i]) -
+                   (leftDown[i] - leftDownEnd[i]) -
+                   (leftUp[i] - leftUpEnd[i]);
+      }
+      total[0] = firstCounts[row++];
+      for (size_t i = 1; i < length; ++i) {
+        total[i] += total[i - 1];
+      }
+      applyCounts(rowIdx, total.data(), length, target, kernel, thread);
+    });
+  }
+
+  void applyCounts(size_t rowIdx, const uint32_t* total, size_t length,
+                   AlignedBuffer<T>& target, const CountKernel& kernel,
+                   size_t thread) {
+    auto table = kernel.table.data();
+    auto tableRow = static_cast<uint32_t>(kernel.tableRow);
+    auto maxState = kernel.maxState;
+    auto cells = &values[rowIdx];
+    auto out = &target[rowIdx];
+    writeRow(rowIdx, length, target, thread, [&] {
+      for (size_t x = 0; x < length; ++x) {
+        auto state = std::min(static_cast<uint32_t>(cells[x]), maxState);
+        out[x] = static_cast<T>(table[state * tableRow + total[x]]);
+      }
+    });
+  }
+
+  static void addRow(uint32_t* acc, const uint32_t* row, size_t length) {
+    for (size_t x = 0; x < length; ++x) {
+      acc[x] += row[x];
+    }
+  }
+
+  static void subtractRow(uint32_t* acc, const uint32_t* row, size_t length) {
+    for (size_t x = 0; x < length; ++x) {
+      acc[x] -= row[x];
+    }
+  }
+
+  // Calls f with the index, within its hyperplane, of every row whose
+  // coordinates are all interior.
+  template <typename F>
+  void forEachInteriorPlaneRow(F&& f) {
+    size_t top = numDimensions - 1;
+    auto coord = allZeros(numDimensions);
+    size_t planeRow = 0;
+    for (size_t i = 1; i < top; ++i) {
+      planeRow += maxNeighborDistance * strides[i] / strides[1];
+    }
+    auto count = size / shape[0] / shape[top];
+    for (size_t row = 0; row < count; ++row) {
+      f(planeRow);
+      for (size_t i = 1; i < top; ++i) {
+        if (++coord[i] < shape[i]) {
+          planeRow += strides[i] / strides[1];
+          break;
+        }
+        coord[i] = 0;
+        planeRow -= (shape[i] - 1) * strides[i] / strides[1];
+      }
+    }
+  }
+
+  // Calls f with the index, within its hyperplane, of the first row of every
+  // line along dim, covering the interior of the dimensions below dim and
+  // the full padded extent of the ones above it.
+  template <typename F>
+  void forEachPlaneLine(size_t dim, F&& f) {
+    size_t top = numDimensions - 1;
+    auto lo = allZeros(numDimensions);
+    auto hi = allZeros(numDimensions);
+    for (size_t i = 1; i < top; ++i) {
+      lo[i] = i < dim ? maxNeighborDistance : 0;
+      hi[i] = i < dim ? maxNeighborDistance + shape[i] : getRealDimSize(i);
+    }
+    lo[dim] = 0;
+    hi[dim] = 1;
+
+    auto coord = lo;
+    while (true) {
+      size_t planeRow = 0;
+      for (size_t i = 1; i < top; ++i) {
+        planeRow += coord[i] * strides[i] / strides[1];
+      }
+      f(planeRow);
+      size_t i = 1;
+      for (; i < top; ++i) {
+        if (++coord[i] < hi[i]) break;
+        coord[i] = lo[i];
+      }
+      if (i >= top) return;
+    }
+  }
+
+  // Advances a generation and calls f(rowIdx, length, target, thread) for
+  // every interior row, where target is the buffer the row's new values go
+  // to. Double buffered sweeps are spread over the thread pool.
+  template <typename F>
+  void sweep(F&& f) {
+    if (!beginGeneration(!changeTracking)) return;
+    sweepCells([&](size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+                   size_t thread) {
+      writeRow(rowIdx, length, target, thread,
+               [&] { f(rowIdx, length, target, thread); });
+    });
+    endGeneration();
+  }
+
+  template <typename F>
+  void sweepCells(F&& f) {
+    if (changeTracking) {
+      sweepActiveTiles(f);
+      return;
+    }
+
+    if (layout != Layout::ROW_MAJOR) {
+      incrementTime();
+      forEachWorkChunk(brickOrigins.size(),
+                       [&](size_t begin, size_t end, size_t thread) {
+                         for (auto slot = begin; slot < end; ++slot) {
+                           forEachBrickRow(slot, [&](size_t rowIdx,
+                                                     size_t length) {
+                             f(rowIdx, length, futureValues, thread);
+                           });
+                         }
+                       });
+      return;
+    }
+
+    if (updateMode == UpdateMode::IN_PLACE) {
+      refreshHalo(values);
+      forEachInteriorRow(0, numSlabs(), [&](size_t rowIdx, size_t length) {
+        f(rowIdx, length, values, 0);
+      });
+      return;
+    }
+
+    incrementTime();
+    forEachSlabChunk([&](size_t slabBegin, size_t slabEnd, size_t thread) {
+      forEachInteriorRow(
+          slabBegin, slabEnd, [&](size_t rowIdx, size_t length) {
+            f(rowIdx, length, futureValues, thread);
+          });
+    });
+  }
+
+  // Like sweep, but only visits the rows of active tiles, and notes which of
+  // them changed to pick the active tiles of the next generation.
+  template <typename F>
+  void sweepActiveTiles(F&& f) {
+    incrementTime();
+    ++changeCount;
+    for (auto tile : changedTiles) {
+      tileChangedAt[tile] = changeCount;
+    }
+    auto updateTiles = [&](size_t begin, size_t end, size_t thread) {
+      for (auto i = begin; i < end; ++i) {
+        auto tile = activeTiles[i];
+        auto changed = false;
+        forEachTileRow(tile, [&](size_t rowIdx, size_t length) {
+          f(rowIdx, length, futureValues, thread);
+          changed = changed || !cellsEqual(&futureValues[rowIdx],
+                                           &values[rowIdx], length, 0);
+        });
+        tileChanged[tile] = changed;
+      }
+    };
+
+    forEachWorkChunk(activeTiles.size(), updateTiles);
+
+    changedTiles.clear();
+    for (auto tile : activeTiles) {
+      tileActive[tile] = 0;
+      if (tileChanged[tile]) {
+        changedTiles.push_back(tile);
+      }
+    }
+    activeTiles.clear();
+    for (auto tile : changedTiles) {
+      activateAround(tile);
+    }
+  }
+
+  bool canBlockGenerations(size_t generations) const {
+    return generations > 1 && !changeTracking && !recorder &&
+           !stateHashing && !hasReductions() &&
+           layout == Layout::ROW_MAJOR &&
+           updateMode == UpdateMode::DOUBLE_BUFFERED;
+  }
+
+  // Picks blocks by halving their longest side until both working buffers
+  // fit in TEMPORAL_BLOCK_BYTES, but keeps rows at least TEMPORAL_ROW_BYTES
+  // long and blocks at least as wide as both margins, past which the
+  // redundant work on the margins outweighs the savings.
+  TemporalBlocks planTemporalBlocks(size_t generations) {
+    TemporalBlocks blocks;
+    blocks.generations = generations;
+    blocks.margin = generations * maxNeighborDistance;
+    blocks.blockShape = shape;
+    auto workingBytes = [&]() {
+      size_t cells = 2;
+      for (auto extent : blocks.blockShape) {
+        cells *= extent + 2 * blocks.margin;
+      }
+      return cells * sizeof(T);
+    };
+    while (workingBytes() > TEMPORAL_BLOCK_BYTES) {
+      auto longest = numDimensions;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        auto minimum = std::max<size_t>(
+            2 * blocks.margin,
+            i == 0 ? std::max<size_t>(1, TEMPORAL_ROW_BYTES / sizeof(T)) : 1);
+        auto halved = (blocks.blockShape[i] + 1) / 2;
+        if (halved >= minimum &&
+            (longest == numDimensions ||
+             blocks.blockShape[i] >= blocks.blockShape[longest])) {
+          longest = i;
+        }
+      }
+      if (longest == numDimensions) break;
+      blocks.blockShape[longest] = (blocks.blockShape[longest] + 1) / 2;
+    }
+
+    blocks.numBlocks = 1;
+    blocks.localSize = 1;
+    blocks.blocksPerDim.resize(numDimensions);
+    blocks.localShape.resize(numDimensions);
+    blocks.localStrides.resize(numDimensions);
+    for (size_t i = 0; i < numDimensions; ++i) {
+      blocks.blocksPerDim[i] =
+          (shape[i] + blocks.blockShape[i] - 1) / blocks.blockShape[i];
+      blocks.numBlocks *= blocks.blocksPerDim[i];
+      blocks.localShape[i] = blocks.blockShape[i] + 2 * blocks.margin;
+      blocks.localStrides[i] = blocks.localSize;
+      blocks.localSize *= blocks.localShape[i];
+    }
+
+    for (auto offset : neighborhood) {
+      long int localOffset = 0;
+      auto coords = getOffsetCoords(offset);
+      for (size_t i = 0; i < numDimensions; ++i) {
+        localOffset +=
+            coords[i] * static_cast<long int>(blocks.localStrides[i]);
+      }
+      blocks.offsets.push_back(localOffset);
+    }
+    return blocks;
+  }
+
+  // Runs update(generations) with f(in, out, rowIdx, length, thread), which
+  // computes a row of cells of the next generation within a block's working
+  // buffers. The next to last generation goes to values and the last to
+  // spareValues, which then takes the place of futureValues; futureValues
+  // holds the first generation the blocks start from, so it can't be
+  // written to before every block is done.
+  template <typename F>
+  void sweepTemporalBlocks(const TemporalBlocks& blocks, F&& f) {
+    detachSnapshot();
+    generation += blocks.generations;
+    if (spareValues.size() != paddedSize) {
+      spareValues = AlignedBuffer<T>(paddedSize, defaultValue);
+    }
+    threadBlockBuffers.resize(getNumThreads());
+    forEachWorkChunk(blocks.numBlocks, [&](size_t begin, size_t end,
+                                           size_t thread) {
+      auto& buffers = threadBlockBuffers[thread];
+      for (auto& buffer : buffers) {
+        if (buffer.size() < blocks.localSize) {
+          buffer = AlignedBuffer<T>(blocks.localSize, defaultValue);
+        }
+      }
+      for (auto block = begin; block < end; ++block) {
+        updateTemporalBlock(blocks, block, buffers, f, thread);
+      }
+    });
+    std::swap(futureValues, spareValues);
+    refreshHalo(values);
+  }
+
+  template <typename F>
+  void updateTemporalBlock(const TemporalBlocks& blocks, size_t block,
+                           std::array<AlignedBuffer<T>, 2>& buffers, F&& f,
+                           size_t thread) {
+    // Grid coordinates of the block's own cells, and of the first cell of
+    // its working buffers.
+    std::vector<long int> lo(numDimensions), hi(numDimensions);
+    std::vector<long int> origin(numDimensions);
+    auto margin = static_cast<long int>(blocks.margin);
+    auto pastEdge = false;
+    auto rest = block;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      auto extent = static_cast<long int>(shape[i]);
+      lo[i] = rest % blocks.blocksPerDim[i] * blocks.blockShape[i];
+      hi[i] = std::min<long int>(lo[i] + blocks.blockShape[i], extent);
+      origin[i] = lo[i] - margin;
+      pastEdge = pastEdge || lo[i] < margin || hi[i] + margin > extent;
+      rest /= blocks.blocksPerDim[i];
+    }
+    auto bounded = wrapping != Wrapping::TOROIDAL;
+
+    gatherTemporalBlock(blocks, origin, buffers[0]);
+    if (bounded && pastEdge) {
+      // Cells past the edge are never computed, so the other buffer needs
+      // the default value there as well.
+      std::fill_n(buffers[1].get(), blocks.localSize, defaultValue);
+    }
+
+    std::vector<size_t> from(numDimensions), to(numDimensions);
+    for (size_t step = 1; step <= blocks.generations; ++step) {
+      auto reach = static_cast<long int>((blocks.generations - step) *
+                                         maxNeighborDistance);
+      for (size_t i = 0; i < numDimensions; ++i) {
+        auto first = lo[i] - reach;
+        auto last = hi[i] + reach;
+        if (bounded) {
+          first = std::max(first, 0L);
+          last = std::min(last, static_cast<long int>(shape[i]));
+        }
+        from[i] = first - origin[i];
+        to[i] = last - origin[i];
+      }
+      auto in = buffers[(step - 1) % 2].get();
+      auto out = buffers[step % 2].get();
+      forEachLocalRow(blocks, from, to,
+                      [&](const std::vector<size_t>&, size_t rowIdx) {
+                        f(in, out, rowIdx, to[0] - from[0], thread);
+                      });
+    }
+
+    auto previous = buffers[(blocks.generations - 1) % 2].get();
+    auto last = buffers[blocks.generations % 2].get();
+    auto coord = allZeros(numDimensions);
+    for (size_t i = 0; i < numDimensions; ++i) {
+      from[i] = lo[i] - origin[i];
+      to[i] = hi[i] - origin[i];
+    }
+    forEachLocalRow(blocks, from, to,
+                    [&](const std::vector<size_t>& local, size_t rowIdx) {
+                      for (size_t i = 0; i < numDimensions; ++i) {
+                        coord[i] = local[i] + origin[i];
+                      }
+                      auto idx = getIdx(coord);
+                      auto length = to[0] - from[0];
+                      std::copy_n(previous + rowIdx, length, &values[idx]);
+                      std::copy_n(last + rowIdx, length, &spareValues[idx]);
+                    });
+  }
+
+  // Copies the cells a block's working buffer stands for out of
+  // futureValues, wrapping around toroidal grids and with the default value
+  // past the edges of bounded ones. futureValues' halo is out of date at
+  // this point, so this goes by grid coordinates.
+  void gatherTemporalBlock(const TemporalBlocks& blocks,
+                           const std::vector<long int>& origin,
+                           AlignedBuffer<T>& buffer) {
+    std::vector<size_t> from(numDimensions, 0);
+    auto coord = allZeros(numDimensions);
+    auto width = blocks.localShape[0];
+    auto extent0 = static_cast<long int>(shape[0]);
+    forEachLocalRow(
+        blocks, from, blocks.localShape,
+        [&](const std::vector<size_t>& local, size_t rowIdx) {
+          auto out = &buffer[rowIdx];
+          for (size_t i = 1; i < numDimensions; ++i) {
+            auto extent = static_cast<long int>(shape[i]);
+            auto x = origin[i] + static_cast<long int>(local[i]);
+            if (wrapping != Wrapping::TOROIDAL && (x < 0 || x >= extent)) {
+              std::fill_n(out, width, defaultValue);
+              return;
+            }
+            coord[i] = static_cast<size_t>((x % extent + extent) % extent);
+          }
+          for (size_t x = 0; x < width;) {
+            auto cell = origin[0] + static_cast<long int>(x);
+            if (cell < 0 || cell >= extent0) {
+              if (wrapping != Wrapping::TOROIDAL) {
+                auto run = cell < 0 ? std::min<size_t>(-cell, width - x)
+                                    : width - x;
+                std::fill_n(out + x, run, defaultValue);
+                x += run;
+                continue;
+              }
+              cell = (cell % extent0 + extent0) % extent0;
+            }
+            auto run = std::min<size_t>(extent0 - cell, width - x);
+            coord[0] = static_cast<size_t>(cell);
+            std::copy_n(&futureValues[getIdx(coord)], run, out + x);
+            x += run;
+          }
+        });
+  }
+
+  // Calls f(local, rowIdx) with the coordinates within a block's working
+  // buffers and the index there of the first cell of every row of the box
+  // [from, to).
+  template <typename F>
+  void forEachLocalRow(const TemporalBlocks& blocks,
+                       const std::vector<size_t>& from,
+                       const std::vector<size_t>& to, F&& f) {
+    auto local = from;
+    size_t rowIdx = 0;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      rowIdx += from[i] * blocks.localStrides[i];
+    }
+    while (true) {
+      f(local, rowIdx);
+      size_t i = 1;
+      for (; i < numDimensions; ++i) {
+        if (++local[i] < to[i]) {
+          rowIdx += blocks.localStrides[i];
+          break;
+        }
+        rowIdx -= (local[i] - 1 - from[i]) * blocks.localStrides[i];
+        local[i] = from[i];
+      }
+      if (i >= numDimensions) return;
+    }
+  }
+
+  // Marks every tile active that holds a cell within maxNeighborDistance of
+  // the given one, which includes the tile itself.
+  void activateAround(size_t tile) {
+    // Tiles within reach along each dimension, wrapping around toroidal
+    // grids. The last tile may be narrower than the reach, so this goes by
+    // cell ranges rather than adjacent tiles.
+    std::vector<std::vector<size_t>> reach(numDimensions);
+    for (size_t i = 0; i < numDimensions; ++i) {
+      auto tileCoord = tile / tileStrides[i] % tilesPerDim[i];
+      auto extent = static_cast<long int>(shape[i]);
+      auto distance = static_cast<long int>(maxNeighborDistance);
+      auto lo = static_cast<long int>(tileCoord * tileSize) - distance;
+      auto hi = std::min(static_cast<long int>((tileCoord + 1) * tileSize),
+                         extent) - 1 + distance;
+      if (wrapping == Wrapping::TOROIDAL && hi - lo + 1 >= extent) {
+        lo = 0;
+        hi = extent - 1;
+      } else if (wrapping != Wrapping::TOROIDAL) {
+        lo = std::max(lo, 0L);
+        hi = std::min(hi, extent - 1);
+      }
+      for (auto x = lo; x <= hi; ++x) {
+        auto cell = static_cast<size_t>((x % extent + extent) % extent);
+        auto t = cell / tileSize;
+        if (std::find(reach[i].begin(), reach[i].end(), t) == reach[i].end()) {
+          reach[i].push_back(t);
+        }
+        // Skip ahead to the last cell of this tile within the range.
+        x += static_cast<long int>(std::min(tileSize - cell % tileSize,
+                                            shape[i] - cell)) - 1;
+      }
+    }
+
+    auto coord = allZeros(numDimensions);
+    while (true) {
+      size_t neighbor = 0;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        neighbor += reach[i][coord[i]] * tileStrides[i];
+      }
+      if (!tileActive[neighbor]) {
+        tileActive[neighbor] = 1;
+        activeTiles.push_back(neighbor);
+      }
+      size_t i = 0;
+      for (; i < numDimensions; ++i) {
+        if (++coord[i] < reach[i].size()) break;
+        coord[i] = 0;
+      }
+      if (i == numDimensions) return;
+    }
+  }
+
+  // Calls f(rowIdx, length) with the padded index of the first cell of every
+  // row of a tile, and the number of cells the tile holds in that row.
+  template <typename F>
+  void forEachTileRow(size_t tile, F&& f) {
+    auto lo = allZeros(numDimensions);
+    auto hi = allZeros(numDimensions);
+    for (size_t i = 0; i < numDimensions; ++i) {
+      lo[i] = tile / tileStrides[i] % tilesPerDim[i] * tileSize;
+      hi[i] = std::min(lo[i] + tileSize, shape[i]);
+    }
+
+    auto coord = lo;
+    while (true) {
+      forEachRowSegment(coord, hi[0] - lo[0], f);
+      size_t i = 1;
+      for (; i < numDimensions; ++i) {
+        if (++coord[i] < hi[i]) break;
+        coord[i] = lo[i];
+      }
+      if (i >= numDimensions) return;
+    }
+  }
+
+  size_t getTileIdx(const std::vector<size_t>& coordinates) {
+    size_t result = 0;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      result += coordinates[i] / tileSize * tileStrides[i];
+    }
+    return result;
+  }
+
+  // Slabs are the hyperplanes of the last dimension, or single cells for
+  // one dimensional grids.
+  size_t numSlabs() const { return shape[numDimensions - 1]; }
+
+  // Calls f(slabBegin, slabEnd, thread) for consecutive runs of slabs,
+  // spread over the thread pool when there is one.
+  template <typename F>
+  void forEachSlabChunk(F&& f) {
+    forEachWorkChunk(numSlabs(), f);
+  }
+
+  // Calls f(begin, end, thread) for consecutive runs of numItems work items,
+  // spread over the thread pool when there is one.
+  template <typename F>
+  void forEachWorkChunk(size_t numItems, F&& f) {
+    if (!threadPool) {
+      f(0, numItems, 0);
+      return;
+    }
+
+    auto chunk = chunkSize;
+    if (chunk == 0) {
+      chunk = std::max<size_t>(1,
+                               numItems / (threadPool->getNumThreads() * 4));
+    }
+    auto numChunks = (numItems + chunk - 1) / chunk;
+    threadPool->run(numChunks, [&](size_t i, size_t thread) {
+      f(i * chunk, std::min(numItems, (i + 1) * chunk), thread);
+    });
+  }
+
+  // Calls f(rowIdx, length) with the padded index of the first cell of every
+  // interior row in the given slabs, where a row runs along the first
+  // (contiguous) dimension.
+  template <typename F>
+  void forEachInteriorRow(size_t slabBegin, size_t slabEnd, F&& f) {
+    if (numDimensions == 1) {
+      f(maxNeighborDistance + slabBegin, slabEnd - slabBegin);
+      return;
+    }
+
+    auto last = numDimensions - 1;
+    auto coord = allZeros(numDimensions);
+    coord[last] = slabBegin;
+    auto rowIdx = getIdx(coord);
+    auto numRows = size / shape[0] / shape[last] * (slabEnd - slabBegin);
+    for (size_t row = 0; row < numRows; ++row) {
+      f(rowIdx, shape[0]);
+      for (auto i = 1; i < numDimensions; ++i) {
+        if (++coord[i] < shape[i]) {
+          rowIdx += strides[i];
+          break;
+        }
+        coord[i] = 0;
+        rowIdx -= (shape[i] - 1) * strides[i];
+      }
+    }
+  }
+
+  // Calls f with the padded index of every cell whose coordinate along dim
+  // is zero, covering the full padded extent of the dimensions below dim and
+  // only the interior of the ones above it.
+  template <typename F>
+  void forEachHaloLine(size_t dim, F&& f) {
+    auto lo = allZeros(numDimensions);
+    auto hi = allZeros(numDimensions);
+    for (size_t i = 0; i < numDimensions; ++i) {
+      lo[i] = i < dim ? 0 : maxNeighborDistance;
+      hi[i] = i < dim ? getRealDimSize(i) : maxNeighborDistance + shape[i];
+    }
+    lo[dim] = 0;
+    hi[dim] = 1;
+
+    auto coord = lo;
+    while (true) {
+      f(getIdx(coord, false));
+      auto i = 0;
+      for (; i < numDimensions; ++i) {
+        if (++coord[i] < hi[i]) break;
+        coord[i] = lo[i];
+      }
+      if (i == numDimensions) return;
+    }
+  }
+
+  // Computes strides, the padded size and, for bricked layouts, the order
+  // the bricks are stored in. In bricked layouts strides are those of the
+  // padded array of a single brick.
+  void initLayout() {
+    countKernel = CountKernel();
+    strides.resize(numDimensions);
+    if (layout == Layout::ROW_MAJOR) {
+      paddedSize = 1;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        strides[i] = paddedSize;
+        paddedSize *= getRealDimSize(i);
+      }
+      bricksPerDim.clear();
+      brickSlots.clear();
+      brickOrigins.clear();
+      return;
+    }
+
+    brickPaddedSize = 1;
+    size_t numBricks = 1;
+    bricksPerDim.resize(numDimensions);
+    for (size_t i = 0; i < numDimensions; ++i) {
+      strides[i] = brickPaddedSize;
+      brickPaddedSize *= brickSize + singleDimPadding;
+      bricksPerDim[i] = (shape[i] + brickSize - 1) / brickSize;
+      numBricks *= bricksPerDim[i];
+    }
+    paddedSize = numBricks * brickPaddedSize;
+
+    // brickSlots maps the row-major number of a brick to its place in
+    // storage, brickOrigins a place back to the brick's first cell.
+    std::vector<std::vector<size_t>> coords(numBricks);
+    for (size_t brick = 0; brick < numBricks; ++brick) {
+      auto rest = brick;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        coords[brick].push_back(rest % bricksPerDim[i]);
+        rest /= bricksPerDim[i];
+      }
+    }
+    std::vector<size_t> order(numBricks);
+    std::iota(order.begin(), order.end(), 0);
+    if (layout == Layout::MORTON) {
+      std::vector<uint64_t> keys(numBricks);
+      for (size_t brick = 0; brick < numBricks; ++brick) {
+        keys[brick] = mortonKey(coords[brick]);
+      }
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return keys[a] < keys[b];
+      });
+    }
+    brickSlots.resize(numBricks);
+    brickOrigins.resize(numBricks);
+    for (size_t slot = 0; slot < numBricks; ++slot) {
+      brickSlots[order[slot]] = slot;
+      brickOrigins[slot] = coords[order[slot]];
+      for (auto& x : brickOrigins[slot]) {
+        x *= brickSize;
+      }
+    }
+  }
+
+  // Interleaves the bits of the coordinates, lowest bits first.
+  uint64_t mortonKey(const std::vector<size_t>& coords) const {
+    uint64_t key = 0;
+    size_t bit = 0;
+    for (size_t level = 0; bit < 64 && level < 64; ++level) {
+      for (size_t i = 0; i < numDimensions && bit < 64; ++i, ++bit) {
+        key |= uint64_t((coords[i] >> level) & 1) << bit;
+      }
+    }
+    return key;
+  }
+
+  size_t getBrickedIdx(const std::vector<size_t>& coordinates) const {
+    size_t brick = 0;
+    size_t brickStride = 1;
+    size_t result = 0;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      brick += coordinates[i] / brickSize * brickStride;
+      brickStride *= bricksPerDim[i];
+      result +=
+          (coordinates[i] % brickSize + maxNeighborDistance) * strides[i];
+    }
+    return brickSlots[brick] * brickPaddedSize + result;
+  }
+
+  // Number of cells of the grid a brick holds along a dimension; bricks at
+  // the far edges may be cut short.
+  size_t getBrickExtent(size_t slot, size_t dim) const {
+    return std::min(brickSize, shape[dim] - brickOrigins[slot][dim]);
+  }
+
+  // Calls f(rowIdx, length) for every row of the grid's cells in a brick.
+  template <typename F>
+  void forEachBrickRow(size_t slot, F&& f) {
+    auto base = slot * brickPaddedSize;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      base += maxNeighborDistance * strides[i];
+    }
+    auto length = getBrickExtent(slot, 0);
+    auto coord = allZeros(numDimensions);
+    auto rowIdx = base;
+    while (true) {
+      f(rowIdx, length);
+      size_t i = 1;
+      for (; i < numDimensions; ++i) {
+        if (++coord[i] < getBrickExtent(slot, i)) {
+          rowIdx += strides[i];
+          break;
+        }
+        rowIdx -= (coord[i] - 1) * strides[i];
+        coord[i] = 0;
+      }
+      if (i >= numDimensions) return;
+    }
+  }
+
+  // Calls f(rowIdx, x, length) for the contiguous runs of cells of row row,
+  // rows along the first dimension numbered with the second dimension
+  // fastest, where x is the first dimension coordinate of the run.
+  template <typename F>
+  void forEachSegmentOfRow(size_t row, F&& f) {
+    auto coord = allZeros(numDimensions);
+    for (size_t i = 1; i < numDimensions; ++i) {
+      coord[i] = row % shape[i];
+      row /= shape[i];
+    }
+    size_t x = 0;
+    forEachRowSegment(coord, shape[0], [&](size_t rowIdx, size_t length) {
+      f(rowIdx, x, length);
+      x += length;
+    });
+  }
+
+  // Calls f(rowIdx, length) for the contiguous runs of the length cells
+  // along the first dimension starting at coord.
+  template <typename F>
+  void forEachRowSegment(std::vector<size_t> coord, size_t length, F&& f) {
+    if (layout == Layout::ROW_MAJOR) {
+      f(getIdx(coord), length);
+      return;
+    }
+    auto end = coord[0] + length;
+    while (coord[0] < end) {
+      auto run = std::min(end - coord[0], brickSize - coord[0] % brickSize);
+      f(getBrickedIdx(coord), run);
+      coord[0] += run;
+    }
+  }
+
+  // One piece of the padded extent of a brick along a dimension: length
+  // positions starting at dst that stand for cells of the grid, or for
+  // cells past a bounded edge if !valid. What the first of those cells
+  // adds to the number of the brick holding it and to its index within
+  // that brick come split into srcBrick and srcIdx, so the source of a box
+  // of pieces is found without dividing. own pieces are the brick's own
+  // cells.
+  struct HaloPiece {
+    size_t dst;
+    size_t srcBrick;
+    size_t srcIdx;
+    size_t length;
+    bool valid;
+    bool own;
+  };
+
+  // Fills every cell of each brick's padded array that isn't one of the
+  // grid's cells in that brick: halos, and the part of bricks at the far
+  // edges that lies past the grid. Each gets the cell it stands for, the
+  // cell on the opposite side for toroidal grids, or the default value.
+  void refreshBrickHalos(AlignedBuffer<T>& buffer) {
+    forEachWorkChunk(brickOrigins.size(), [&](size_t begin, size_t end,
+                                              size_t) {
+      std::vector<std::vector<HaloPiece>> pieces(numDimensions);
+      for (auto slot = begin; slot < end; ++slot) {
+        refreshBrickHalo(buffer, slot, pieces);
+      }
+    });
+  }
+
+  // Splits the padded extent of the brick along every dimension into
+  // pieces that each come from within a single brick, and copies the boxes
+  // they span one row at a time.
+  void refreshBrickHalo(AlignedBuffer<T>& buffer, size_t slot,
+                        std::vector<std::vector<HaloPiece>>& pieces) {
+    auto paddedWidth = brickSize + singleDimPadding;
+    size_t brickStride = 1;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      auto origin = brickOrigins[slot][i];
+      auto extent = getBrickExtent(slot, i);
+      pieces[i].clear();
+      addHaloPieces(i, brickStride, origin, 0, maxNeighborDistance,
+                    pieces[i]);
+      pieces[i].push_back(HaloPiece{
+          maxNeighborDistance, origin / brickSize * brickStride,
+          maxNeighborDistance * strides[i], extent, true, true});
+      addHaloPieces(i, brickStride, origin, maxNeighborDistance + extent,
+                    paddedWidth, pieces[i]);
+      brickStride *= bricksPerDim[i];
+    }
+
+    auto brickBase = slot * brickPaddedSize;
+    std::vector<size_t> choice(numDimensions, 0);
+    auto row = allZeros(numDimensions);
+    while (true) {
+      auto own = true;
+      auto valid = true;
+      auto dstIdx = brickBase;
+      size_t srcBrick = 0;
+      size_t srcIdx = 0;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        const auto& piece = pieces[i][choice[i]];
+        own = own && piece.own;
+        valid = valid && piece.valid;
+        srcBrick += piece.srcBrick;
+        srcIdx += piece.srcIdx;
+        dstIdx += piece.dst * strides[i];
+      }
+
+      if (!own) {
+        // Cells are copied through pointers and counts held in locals, which
+        // stores of T that may alias anything don't force to be reloaded.
+        auto src = &buffer[0];
+        if (valid) {
+          src += brickSlots[srcBrick] * brickPaddedSize + srcIdx;
+        }
+        auto dst = &buffer[dstIdx];
+        auto length = pieces[0][choice[0]].length;
+        auto rows = numDimensions > 1 ? pieces[1][choice[1]].length : 1;
+        auto rowStride = numDimensions > 1 ? strides[1] : 0;
+        std::fill(row.begin(), row.end(), 0);
+        size_t offset = 0;
+        while (true) {
+          auto at = offset;
+          for (size_t y = 0; y < rows; ++y, at += rowStride) {
+            if (!valid) {
+              std::fill_n(dst + at, length, defaultValue);
+            } else if (length == 1) {
+              // Halos along the first dimension are columns of rows this
+              // short, too many to copy through a call each.
+              dst[at] = src[at];
+            } else {
+              std::copy_n(src + at, length, dst + at);
+            }
+          }
+          size_t i = 2;
+          for (; i < numDimensions; ++i) {
+            auto extent = pieces[i][choice[i]].length;
+            if (++row[i] < extent) {
+              offset += strides[i];
+              break;
+            }
+            offset -= (extent - 1) * strides[i];
+            row[i] = 0;
+          }
+          if (i >= numDimensions) break;
+        }
+      }
+
+      size_t i = 0;
+      for (; i < numDimensions; ++i) {
+        if (++choice[i] < pieces[i].size()) break;
+        choice[i] = 0;
+      }
+      if (i == numDimensions) return;
+    }
+  }
+
+  // Adds the pieces for padded positions [from, to) of a brick starting at
+  // origin along dim, where a brick further along is brickStride bricks on.
+  void addHaloPieces(size_t dim, size_t brickStride, size_t origin,
+                     size_t from, size_t to,
+                     std::vector<HaloPiece>& pieces) const {
+    for (auto x = from; x < to;) {
+      size_t cell;
+      if (!resolve(dim, origin, x, cell)) {
+        pieces.push_back(HaloPiece{x, 0, 0, 1, false, false});
+        ++x;
+        continue;
+      }
+      auto inBrick = cell % brickSize;
+      auto run = std::min({to - x, brickSize - inBrick, shape[dim] - cell});
+      pieces.push_back(HaloPiece{
+          x, cell / brickSize * brickStride,
+          (inBrick + maxNeighborDistance) * strides[dim], run, true, false});
+      x += run;
+    }
+  }
+
+  // Maps a padded position within a brick along dim to the cell of the grid
+  // it stands for. Returns false if that is past a bounded edge.
+  bool resolve(size_t dim, size_t origin, size_t local, size_t& cell) const {
+    auto x = static_cast<long int>(origin + local) -
+             static_cast<long int>(maxNeighborDistance);
+    auto extent = static_cast<long int>(shape[dim]);
+    if (x >= 0 && x < extent) {
+      cell = x;
+      return true;
+    }
+    if (wrapping != Wrapping::TOROIDAL) return false;
+    cell = (x % extent + extent) % extent;
+    return true;
+  }
+
+  // Calls f(coordinates) for every cell of the grid in row-major order.
+  template <typename F>
+  void forEachCoordinate(F&& f) {
+    auto coord = allZeros(numDimensions);
+    for (size_t n = 0; n < size; ++n) {
+      f(coord);
+      for (size_t i = 0; i < numDimensions; ++i) {
+        if (++coord[i] < shape[i]) break;
+        coord[i] = 0;
+      }
+    }
+  }
+
+  size_t getRealDimSize(size_t idx) { return shape[idx] + singleDimPadding; }
+
+  size_t getIdx(const std::vector<size_t>& coordinates, bool offsetPadding = true) {
+    if (coordinates.size() != numDimensions)
+      throw InvalidOperationException(
+          "Coordinate numDimensions do not match grid's numDimensions.");
+    if (layout != Layout::ROW_MAJOR) return getBrickedIdx(coordinates);
+
+    size_t result{0};
+    for (auto i = 0; i < numDimensions; ++i) {
+      auto chunk = coordinates[i];
+      if (offsetPadding) {
+        chunk += maxNeighborDistance;
+      }
+      result += chunk * strides[i];
+    }
+    return result;
+  }
+
+  long int getOffsetIdx(const std::vector<int>& offsetCoords) {
+    if (offsetCoords.size() != numDimensions)
+      throw InvalidOperationException(
+          "Coordinate numDimensions do not match grid's numDimensions.");
+
+    long int result{0};
+    for (auto i = 0; i < numDimensions; ++i) {
+      result += offsetCoords[i] * static_cast<long int>(strides[i]);
+    }
+    return result;
+  }
+
+  SnapshotInfo getSnapshotInfo() const {
+    SnapshotInfo info;
+    info.version = SNAPSHOT_VERSION;
+    info.checksum = 0;
+    info.dataOffset = 0;
+    info.generation = generation;
+    info.cellSize = sizeof(T);
+    info.shape = shape;
+    info.wrapping = wrapping;
+    info.maxNeighborDistance = maxNeighborDistance;
+    info.neighborhood = neighborhoodType;
+    info.neighborhoodRadius = neighborhoodRadius;
+    if (neighborhoodType == Neighborhood::CUSTOM) {
+      info.customOffsets = customOffsets;
+    }
+    info.layout = layout;
+    info.brickSize = brickSize;
+    info.updateMode = updateMode;
+    info.paddedSize = paddedSize;
+    info.numBuffers = updateMode == UpdateMode::IN_PLACE ? 1 : 2;
+    auto bytes = reinterpret_cast<const char*>(&defaultValue);
+    info.defaultValue.assign(bytes, bytes + sizeof(T));
+    info.dataOffset = alignSnapshotOffset(info.toBytes().size());
+    return info;
+  }
+
+  std::array<const T*, 2> getSnapshotBuffers() const {
+    return {values.get(), futureValues.get()};
+  }
+
+  // The checksum covers the header, with the checksum itself as 0, and the
+  // cells of every buffer.
+  static uint64_t computeSnapshotChecksum(SnapshotInfo info,
+                                          const T* current,
+                                          const T* future) {
+    info.checksum = 0;
+    auto header = info.toBytes();
+    auto checksum = checksum64(header.data(), header.size());
+    auto bytes = info.paddedSize * sizeof(T);
+    checksum = checksum64(current, bytes, checksum);
+    if (info.numBuffers > 1) {
+      checksum = checksum64(future, bytes, checksum);
+    }
+    return checksum;
+  }
+
+  static void writeSnapshot(const std::string& path, SnapshotInfo info,
+                            std::array<const T*, 2> buffers) {
+    info.checksum = computeSnapshotChecksum(info, buffers[0], buffers[1]);
+    auto header = info.toBytes();
+    header.resize(info.dataOffset, 0);
+
+    auto partialPath = path + ".partial";
+    {
+      std::ofstream file(partialPath, std::ios::binary | std::ios::trunc);
+      if (!file)
+        throw std::runtime_error("Can't write snapshot " + partialPath +
+                                 ".");
+      file.write(header.data(), header.size());
+      auto bytes = info.paddedSize * sizeof(T);
+      std::vector<char> padding(alignSnapshotOffset(bytes) - bytes, 0);
+      for (size_t i = 0; i < info.numBuffers; ++i) {
+        file.write(reinterpret_cast<const char*>(buffers[i]), bytes);
+        file.write(padding.data(), padding.size());
+      }
+      file.close();
+      if (!file)
+        throw std::runtime_error("Can't write snapshot " + partialPath +
+                                 ".");
+    }
+    if (std::rename(partialPath.c_str(), path.c_str()) != 0)
+      throw std::runtime_error("Can't move snapshot to " + path + ".");
+  }
+
+  // Maps paddedSize cells starting at offset in the file at path, or reads
+  // them where mmap isn't available or the offset isn't page aligned.
+  AlignedBuffer<T> loadSnapshotBuffer(const std::string& path,
+                                      size_t offset) {
+    auto bytes = paddedSize * sizeof(T);
+#ifdef METHUSELAH_HAS_MMAP
+    auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    if (offset % pageSize == 0) {
+      auto fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        throw std::runtime_error("Can't open snapshot " + path + ".");
+      // Pages past the end of the file would fault when touched.
+      auto fileSize = lseek(fd, 0, SEEK_END);
+      if (fileSize < 0 || static_cast<size_t>(fileSize) < offset + bytes) {
+        close(fd);
+        throw std::invalid_argument("Snapshot is truncated.");
+      }
+      auto data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       fd, static_cast<off_t>(offset));
+      close(fd);
+      if (data == MAP_FAILED)
+        throw std::runtime_error("Can't map snapshot " + path + ".");
+      return AlignedBuffer<T>::fromMapping(static_cast<T*>(data), paddedSize,
+                                           bytes);
+    }
+#endif
+    AlignedBuffer<T> buffer(paddedSize, defaultValue);
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(offset);
+    file.read(reinterpret_cast<char*>(buffer.get()), bytes);
+    if (!file) throw std::invalid_argument("Snapshot is truncated.");
+    return buffer;
+  }
+
+  // Called by every update before it changes anything, with whether it
+  // writes every cell through writeRow or noteRow, and whether every cell
+  // it changes goes through them. Returns false, and the update does
+  // nothing, once the grid stopped on a cycle.
+  bool beginGeneration(bool writesEveryCell = true,
+                       bool notesEveryChange = true) {
+    if (stateHashing && stopOnCycle && cyclePeriod) return false;
+    if (hashEdited) {
+      forgetStateHashes();
+    }
+    detachSnapshot();
+    ++generation;
+    recordingRows = recorder && notesEveryChange && !historyEdited &&
+                    !recorder->needsKeyframe(generation, size);
+    if (recordingRows) {
+      threadHistoryScratch.resize(getNumThreads());
+      for (auto& scratch : threadHistoryScratch) {
+        scratch.delta.clear();
+      }
+    }
+    if (stateHashing || recordingRows) {
+      threadHashScratch.resize(getNumThreads());
+      for (auto& scratch : threadHashScratch) {
+        scratch.delta = 0;
+      }
+    }
+    reducingRows = hasReductions() && writesEveryCell;
+    if (reducingRows) {
+      threadStatistics.resize(getNumThreads());
+      for (auto& scratch : threadStatistics) {
+        resetStatistics(scratch.statistics);
+      }
+    }
+    return true;
+  }
+
+  // Called by every update once the generation is computed.
+  void endGeneration() {
+    if (stateHashing) {
+      for (const auto& scratch : threadHashScratch) {
+        stateHash += scratch.delta;
+      }
+      noteStateHash();
+    }
+    if (reducingRows) {
+      mergeStatistics();
+      reducingRows = false;
+    } else if (hasReductions()) {
+      gatherStatistics();
+    }
+    recordGeneration();
+  }
+
+  // Calls write(), which updates the length cells of target from rowIdx
+  // on, then notes them. Cells updated in place are copied first when the
+  // state hash or the recorder needs to compare with them.
+  template <typename F>
+  void writeRow(size_t rowIdx, size_t length, AlignedBuffer<T>& target,
+                size_t thread, F&& write) {
+    if (!stateHashing && !recordingRows) {
+      write();
+      noteRow(rowIdx, nullptr, target, length, thread);
+      return;
+    }
+    const T* previous = &values[rowIdx];
+    if (&target == &values) {
+      auto& row = threadHashScratch[thread].row;
+      row.assign(previous, previous + length);
+      previous = row.data();
+    }
+    write();
+    noteRow(rowIdx, previous, target, length, thread);
+  }
+
+  // Adds what writing the length cells of target from rowIdx on changed
+  // from previous to thread's share of the state hash and of the recorded
+  // delta, and reduces them.
+  void noteRow(size_t rowIdx, const T* previous, AlignedBuffer<T>& target,
+               size_t length, size_t thread) {
+    auto cells = &target[rowIdx];
+    if (stateHashing) {
+      threadHashScratch[thread].delta +=
+          hashDifference(rowIdx, previous, cells, length);
+    }
+    if (recordingRows) {
+      auto& scratch = threadHistoryScratch[thread];
+      HistoryRecorder<T>::encodeRow(getCellNumber(rowIdx, scratch.coord),
+                                    cells, previous, length, scratch.delta);
+    }
+    if (reducingRows) {
+      reduceRow(cells, rowIdx, length, threadStatistics[thread]);
+    }
+  }
+
+  bool hasReductions() const {
+    return populationReduction || histogramReduction || fieldReduction;
+  }
+
+  void reduceRow(const T* cells, size_t idx, size_t length,
+                 StatisticsScratch& scratch) {
+    if (populationReduction) {
+      populationReduction(*this, cells, idx, length, scratch);
+    }
+    if (histogramReduction) {
+      histogramReduction(*this, cells, idx, length, scratch);
+    }
+    if (fieldReduction) {
+      fieldReduction(*this, cells, idx, length, scratch);
+    }
+  }
+
+  void resetStatistics(GridStatistics& partial) const {
+    partial = GridStatistics();
+    partial.generation = generation;
+    if (populationReduction && populationBounds) {
+      partial.boundsMin.assign(numDimensions, SIZE_MAX);
+      partial.boundsMax.assign(numDimensions, 0);
+    }
+    if (histogramReduction) {
+      partial.histogram.assign(histogramSize, 0);
+    }
+    if (fieldReduction) {
+      partial.fieldMin = std::numeric_limits<double>::infinity();
+      partial.fieldMax = -std::numeric_limits<double>::infinity();
+    }
+  }
+
+  // Merges the threads' statistics into statistics.
+  void mergeStatistics() {
+    resetStatistics(statistics);
+    for (const auto& scratch : threadStatistics) {
+      const auto& partial = scratch.statistics;
+      statistics.population += partial.population;
+      for (size_t d = 0; d < partial.boundsMin.size(); ++d) {
+        statistics.boundsMin[d] =
+            std::min(statistics.boundsMin[d], partial.boundsMin[d]);
+        statistics.boundsMax[d] =
+            std::max(statistics.boundsMax[d], partial.boundsMax[d]);
+      }
+      for (size_t state = 0; state < partial.histogram.size(); ++state) {
+        statistics.histogram[state] += partial.histogram[state];
+      }
+      statistics.fieldMin = std::min(statistics.fieldMin, partial.fieldMin);
+      statistics.fieldMax = std::max(statistics.fieldMax, partial.fieldMax);
+      statistics.fieldSum += partial.fieldSum;
+    }
+    if (!statistics.population) {
+      statistics.boundsMin.clear();
+      statistics.boundsMax.clear();
+    }
+    statisticsStale = false;
+  }
+
+  // Reduces the generation last computed in a pass of its own.
+  void gatherStatistics() {
+    threadStatistics.resize(std::max<size_t>(threadStatistics.size(), 1));
+    for (auto& scratch : threadStatistics) {
+      resetStatistics(scratch.statistics);
+    }
+    auto& cells = updateMode == UpdateMode::IN_PLACE ? values : futureValues;
+    forEachCellRow(cells, [&](T* row, size_t length) {
+      reduceRow(row, static_cast<size_t>(row - &cells[0]), length,
+                threadStatistics[0]);
+    });
+    mergeStatistics();
+  }
+
+  // Inverse of getIdx: the coordinates of the cell at storage index idx.
+  void getCoordinates(size_t idx, std::vector<size_t>& coord) const {
+    coord.resize(numDimensions);
+    const std::vector<size_t>* origin = nullptr;
+    if (layout != Layout::ROW_MAJOR) {
+      origin = &brickOrigins[idx / brickPaddedSize];
+      idx %= brickPaddedSize;
+    }
+    for (auto d = numDimensions; d-- > 0;) {
+      coord[d] = idx / strides[d] - maxNeighborDistance;
+      if (origin) coord[d] += (*origin)[d];
+      idx %= strides[d];
+    }
+  }
+
+  // The number of the cell at storage index idx in row-major order with the
+  // first dimension fastest, as the recorder numbers cells.
+  size_t getCellNumber(size_t idx, std::vector<size_t>& coord) const {
+    getCoordinates(idx, coord);
+    size_t number = 0;
+    for (auto d = numDimensions; d-- > 0;) {
+      number = number * shape[d] + coord[d];
+    }
+    return number;
+  }
+
+  // Hashes the current generation from scratch and forgets the others.
+  void restartStateHash() {
+    stateHash = 0;
+    if (stateHashing) {
+      auto& cells =
+          updateMode == UpdateMode::IN_PLACE ? values : futureValues;
+      forEachCellRow(cells, [&](T* row, size_t length) {
+        auto idx = static_cast<size_t>(row - &cells[0]);
+        for (size_t i = 0; i < length; ++i) {
+          stateHash += hashCell(idx + i, row[i]);
+        }
+      });
+    }
+    forgetStateHashes();
+  }
+
+  // Starts the history over from the current generation.
+  void forgetStateHashes() {
+    hashHistory.clear();
+    hashGenerations.clear();
+    hashEdited = false;
+    cyclePeriod = 0;
+    cycleStart = 0;
+    if (stateHashing) {
+      noteStateHash();
+    }
+  }
+
+  // Looks the hash of the generation just computed up among the earlier
+  // ones, then remembers it.
+  void noteStateHash() {
+    auto seen = hashGenerations.find(stateHash);
+    if (seen != hashGenerations.end() && !cyclePeriod) {
+      cyclePeriod = static_cast<size_t>(generation - seen->second);
+      cycleStart = seen->second;
+    }
+    hashGenerations[stateHash] = generation;
+    hashHistory.emplace_back(generation, stateHash);
+    if (hashHistory.size() > hashHistoryLength) {
+      auto oldest = hashHistory.front();
+      hashHistory.pop_front();
+      auto entry = hashGenerations.find(oldest.second);
+      if (entry->second == oldest.first) {
+        hashGenerations.erase(entry);
+      }
+    }
+  }
+
+  // Hands the generation just computed to the recorder, if there is one:
+  // as the delta taken from the rows the update wrote, or else from the
+  // generation before, which double buffered grids still hold, or as a
+  // keyframe when the recorder needs one or the cells were edited.
+  void recordGeneration() {
+    if (!recorder) return;
+    auto& cells = updateMode == UpdateMode::IN_PLACE ? values : futureValues;
+    if (recordingRows) {
+      recorder->recordDelta(generation, [&](auto&& f) {
+        for (const auto& scratch : threadHistoryScratch) {
+          f(scratch.delta);
+        }
+      });
+      recordingRows = false;
+    } else if (!historyEdited && &cells != &values &&
+               !recorder->needsKeyframe(generation, size)) {
+      threadHistoryScratch.resize(
+          std::max<size_t>(threadHistoryScratch.size(), 1));
+      auto& scratch = threadHistoryScratch[0];
+      scratch.delta.clear();
+      forEachCellRow(cells, [&](T* row, size_t length) {
+        auto idx = static_cast<size_t>(row - &cells[0]);
+        HistoryRecorder<T>::encodeRow(getCellNumber(idx, scratch.coord), row,
+                                      &values[idx], length, scratch.delta);
+      });
+      recorder->recordDelta(generation,
+                            [&](auto&& f) { f(scratch.delta); });
+    } else {
+      recorder->recordKeyframe(generation, size, [&](auto&& f) {
+        forEachCellRow(cells,
+                       [&](T* row, size_t length) { f(row, length); });
+      });
+    }
+    historyEdited = false;
+  }
+
+  // Calls f(cells, length) for every interior row of buffer in row-major
+  // order, split where rows cross bricks.
+  template <typename F>
+  void forEachCellRow(AlignedBuffer<T>& buffer, F&& f) {
+    if (layout == Layout::ROW_MAJOR) {
+      forEachInteriorRow(0, numSlabs(), [&](size_t rowIdx, size_t length) {
+        f(&buffer[rowIdx], length);
+      });
+      return;
+    }
+    auto coord = allZeros(numDimensions);
+    while (true) {
+      forEachRowSegment(coord, shape[0], [&](size_t rowIdx, size_t length) {
+        f(&buffer[rowIdx], length);
+      });
+      size_t i = 1;
+      for (; i < numDimensions; ++i) {
+        if (++coord[i] < shape[i]) break;
+        coord[i] = 0;
+      }
+      if (i >= numDimensions) return;
+    }
+  }
+
+  // Called before anything changes the cells. While a snapshot is still
+  // being written from the grid's buffers, they're handed over to the
+  // writer and the grid carries on with copies.
+  void detachSnapshot() {
+    if (!snapshotJob) return;
+    if (snapshotJob->finished) {
+      snapshotJob.reset();
+      return;
+    }
+    if (snapshotJob->detached) return;
+
+    snapshotJob->detached = true;
+    for (auto buffer : {&values, &futureValues}) {
+      if (buffer->size() == 0) continue;
+      AlignedBuffer<T> copy(buffer->size(), defaultValue);
+      std::copy_n(buffer->get(), buffer->size(), copy.get());
+      snapshotJob->buffers[buffer == &values ? 0 : 1] = std::move(*buffer);
+      *buffer = std::move(copy);
+    }
+  }
+
+  // Inverse of getOffsetIdx for row-major strides. Every coordinate is
+  // within maxNeighborDistance of 0, which keeps them unique: the lower
+  // dimensions together never move more than half a stride of the next.
+  std::vector<int> getOffsetCoords(long int offset) const {
+    std::vector<int> coords(numDimensions);
+    for (auto i = numDimensions; i-- > 0;) {
+      auto stride = static_cast<long int>(strides[i]);
+      auto coord = offset / stride;
+      auto rest = offset - coord * stride;
+      if (2 * rest > stride) {
+        ++coord;
+      } else if (2 * rest < -stride) {
+        --coord;
+      }
+      coords[i] = static_cast<int>(coord);
+      offset -= coord * stride;
+    }
+    return coords;
+  }
+
+  std::vector<long int> generateNeighborhood(Neighborhood type,
+                                             size_t radius) {
+    auto offsets = generateNeighborhoodOffsets(type, numDimensions, radius);
+    std::vector<long int> neighborhood;
+    for (const auto& coord : offsets) {
+      neighborhood.push_back(getOffsetIdx(coord));
+    }
+    std::sort(neighborhood.begin(), neighborhood.end());
+    return neighborhood;
+  }
+
+  void checkBounds(const std::vector<size_t>& coordinates) {
+    if (coordinates.size() != numDimensions)
+      throw InvalidOperationException(
+          "Coordinate numDimensions do not match grid's numDimensions.");
+
+    for (auto i = 0; i < numDimensions; ++i) {
+      if (coordinates[i] >= shape[i]) {
+        throw std::out_of_range(
+            "Can't access values for out of bounds indices");
+      }
+    }
+  }
+};
+
+// SparseGrid
+// ====------------------------------------------------------------------------
+// An unbounded n-dimensional grid that stores only the chunks of space that
+// hold anything but the default value. Chunks are cubes of chunkSize cells
+// kept in a hash map by chunk coordinate, each with its own halo and the
+// same two generations a Grid has. Chunks are allocated as soon as a
+// non-default cell comes within reach of their border and dropped once both
+// generations are back to the default value, so memory follows the live
+// cells rather than their bounding box. This relies on the update leaving a
+// cell whose whole neighborhood is at the default value unchanged.
+template <typename T>
+class SparseGrid {
+  static_assert(isEqualityComparable<T>::value ||
+                    std::is_trivially_copyable<T>::value,
+                "SparseGrid needs to compare cells with the default value.");
+
+  struct Chunk {
+    AlignedBuffer<T> values;
+    AlignedBuffer<T> futureValues;
+    bool allDefault;
+  };
+
+  struct ChunkHash {
+    size_t operator()(const std::vector<long int>& key) const {
+      uint64_t h = 0;
+      for (auto x : key) {
+        h = (h ^ static_cast<uint64_t>(x)) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+      }
+      return static_cast<size_t>(h);
+    }
+  };
+
+ public:
+  SparseGrid(size_t numDimensions, Neighborhood neighborhood,
+             std::function<void(T*, const std::vector<T*>&)> cellUpdate,
+             T defaultValue = T(), unsigned short int maxNeighborDistance = 1,
+             size_t chunkSize = 16)
+      : numDimensions(numDimensions),
+        maxNeighborDistance(maxNeighborDistance),
+        chunkSize(chunkSize),
+        defaultValue(defaultValue),
+        cellUpdate(cellUpdate),
+        threadNeighbors(1) {
+    if (numDimensions == 0)
+      throw InvalidOperationException("SparseGrid needs a dimension.");
+    if (chunkSize < maxNeighborDistance || chunkSize == 0)
+      throw InvalidOperationException(
+          "chunkSize must be at least maxNeighborDistance.");
+
+    strides.resize(numDimensions);
+    paddedSize = 1;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      strides[i] = paddedSize;
+      paddedSize *= chunkSize + 2 * maxNeighborDistance;
+    }
+    setNeighborhood(neighborhood);
+  }
+
+  // Same as Grid::update, over every allocated chunk.
+  void update() {
+    if (!cellUpdate)
+      throw InvalidOperationException(
+          "SparseGrid has no cellUpdate callback, use update<Rule>() instead.");
+
+    sweep([&](Chunk& chunk, size_t rowIdx, size_t thread) {
+      auto& neighbors = threadNeighbors[thread];
+      for (auto i = rowIdx; i < rowIdx + chunkSize; ++i) {
+        auto j = 0;
+        for (auto offset : neighborhood) {
+          neighbors[j++] = &chunk.values[i + offset];
+        }
+        chunk.futureValues[i] = chunk.values[i];
+        cellUpdate(&chunk.futureValues[i], neighbors);
+      }
+    });
+  }
+
+  // Same as Grid::update(const Rule&).
+  template <typename Rule>
+  void update(const Rule& rule) {
+    constexpr auto numNeighbors = Rule::numNeighbors;
+    if (numNeighbors != neighborhood.size())
+      throw InvalidOperationException(
+          "Rule::numNeighbors does not match the grid's neighborhood.");
+
+    std::array<long int, numNeighbors> offsets;
+    std::copy(neighborhood.begin(), neighborhood.end(), offsets.begin());
+    sweep([&](Chunk& chunk, size_t rowIdx, size_t) {
+      for (auto i = rowIdx; i < rowIdx + chunkSize; ++i) {
+        StencilView<T, numNeighbors> neighbors(&chunk.values[i],
+                                               offsets.data());
+        chunk.futureValues[i] = chunk.values[i];
+        rule(chunk.futureValues[i], neighbors);
+      }
+    });
+  }
+
+  template <typename Rule>
+  void update() {
+    update(Rule());
+  }
+
+  const T& getValue(const std::vector<long int>& coordinates) const {
+    checkDimensions(coordinates);
+    auto chunk = chunks.find(getChunkCoords(coordinates));
+    if (chunk == chunks.end()) return defaultValue;
+    return chunk->second.values[getCellIdx(coordinates)];
+  }
+
+  void setValue(const std::vector<long int>& coordinates, const T& val) {
+    checkDimensions(coordinates);
+    auto key = getChunkCoords(coordinates);
+    auto chunk = chunks.find(key);
+    if (chunk == chunks.end()) {
+      if (isDefault(val)) return;
+      chunk = chunks.emplace(key, newChunk()).first;
+    }
+    auto idx = getCellIdx(coordinates);
+    chunk->second.values[idx] = val;
+    chunk->second.futureValues[idx] = val;
+  }
+
+  size_t getNumDimensions() const { return numDimensions; }
+
+  size_t getChunkSize() const { return chunkSize; }
+
+  size_t getChunkCount() const { return chunks.size(); }
+
+  // Calls f(chunkCoords) for every allocated chunk, where chunk c covers
+  // cells c * chunkSize up to (c + 1) * chunkSize along each dimension.
+  template <typename F>
+  void forEachChunk(F&& f) const {
+    for (const auto& chunk : chunks) {
+      f(chunk.first);
+    }
+  }
+
+  size_t getNumThreads() const { return threadNeighbors.size(); }
+
+  // Same as Grid::setNumThreads, with chunks as the unit of work.
+  void setNumThreads(size_t numThreads) {
+    if (numThreads == 0) {
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadPool.reset(numThreads > 1 ? new ThreadPool(numThreads) : nullptr);
+    threadNeighbors.assign(numThreads, std::vector<T*>(neighborhood.size()));
+  }
+
+  void setNeighborhood(Neighborhood neighborhoodType, size_t radius = 1) {
+    if (neighborhoodType == Neighborhood::CUSTOM)
+      throw InvalidOperationException(
+          "To set custom neighborhood, provide offsets directly");
+    if (radius == 0 || radius > maxNeighborDistance)
+      throw InvalidOperationException(
+          "Neighborhood radius must be between 1 and maxNeighborDistance.");
+
+    neighborhood.clear();
+    for (const auto& offset :
+         generateNeighborhoodOffsets(neighborhoodType, numDimensions, radius)) {
+      neighborhood.push_back(getOffsetIdx(offset));
+    }
+    std::sort(neighborhood.begin(), neighborhood.end());
+    for (auto& neighbors : threadNeighbors) {
+      neighbors.resize(neighborhood.size());
+    }
+  }
+
+  // The grid is left as it was if any offset is out of range or has the
+  // wrong number of dimensions.
+  void setNeighborhood(std::vector<std::vector<int>> offsets) {
+    std::vector<long int> indices;
+    indices.reserve(offsets.size());
+    for (const auto& offset : offsets) {
+      for (auto x : offset) {
+        if (std::abs(x) > maxNeighborDistance)
+          throw InvalidOperationException(
+              "Neighbor offset exceeds maxNeighborDistance.");
+      }
+      indices.push_back(getOffsetIdx(offset));
+    }
+    neighborhood = std::move(indices);
+    for (auto& neighbors : threadNeighbors) {
+      neighbors.resize(neighborhood.size());
+    }
+  }
+
+ private:
+  // Immutable member variables
+  size_t const numDimensions;
+  size_t const maxNeighborDistance;
+  size_t const chunkSize;
+  T const defaultValue;
+
+  // Mutable member variables
+  size_t paddedSize;
+  std::vector<size_t> strides;
+  std::unordered_map<std::vector<long int>, Chunk, ChunkHash> chunks;
+  std::function<void(T*, const std::vector<T*>&)> cellUpdate;
+  std::vector<long int> neighborhood;
+  std::vector<std::vector<T*>> threadNeighbors;
+  std::unique_ptr<ThreadPool> threadPool;
+
+  // Private member functions
+  // Advances a generation: allocates the chunks the new generation can
+  // reach, calls f(chunk, rowIdx, thread) for every interior row of every
+  // chunk, and drops the chunks that ended up empty.
+  template <typename F>
+  void sweep(F&& f) {
+    std::vector<std::vector<long int>> reached;
+    for (auto& entry : chunks) {
+      auto& chunk = entry.second;
+      std::swap(chunk.values, chunk.futureValues);
+      chunk.allDefault = findReachedChunks(entry.first, chunk, reached);
+    }
+    for (const auto& key : reached) {
+      if (chunks.find(key) == chunks.end()) {
+        chunks.emplace(key, newChunk());
+      }
+    }
+
+    std::vector<Chunk*> work;
+    for (auto& entry : chunks) {
+      refreshHalo(entry.first, entry.second);
+      work.push_back(&entry.second);
+    }
+
+    auto updateChunk = [&](Chunk& chunk, size_t thread) {
+      forEachInteriorRow([&](size_t rowIdx) { f(chunk, rowIdx, thread); });
+    };
+    if (!threadPool) {
+      for (auto chunk : work) {
+        updateChunk(*chunk, 0);
+      }
+    } else {
+      threadPool->run(work.size(), [&](size_t i, size_t thread) {
+        updateChunk(*work[i], thread);
+      });
+    }
+
+    for (auto it = chunks.begin(); it != chunks.end();) {
+      auto& chunk = it->second;
+      if (chunk.allDefault && isInteriorDefault(chunk.futureValues)) {
+        it = chunks.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Adds the coordinates of every chunk that a non-default cell of this one
+  // can reach to reached, and returns whether there were none.
+  bool findReachedChunks(const std::vector<long int>& key, const Chunk& chunk,
+                         std::vector<std::vector<long int>>& reached) {
+    // Bit (d + 1) * 3^i of a direction index says the chunk next along
+    // dimension i by d in {-1, 0, 1} is reached.
+    size_t numDirections = 1;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      numDirections *= 3;
+    }
+    std::vector<uint8_t> directions(numDirections, 0);
+    auto paddedWidth = chunkSize + 2 * maxNeighborDistance;
+    auto allDefault = true;
+    std::vector<int> lowSides(numDimensions), highSides(numDimensions);
+    forEachInteriorRow([&](size_t rowIdx) {
+      for (size_t x = 0; x < chunkSize; ++x) {
+        if (isDefault(chunk.values[rowIdx + x])) continue;
+        allDefault = false;
+
+        // Near a face the cell reaches past it, near both faces of a thin
+        // chunk it reaches past either.
+        auto idx = rowIdx + x;
+        for (size_t i = 0; i < numDimensions; ++i) {
+          auto coord = idx / strides[i] % paddedWidth - maxNeighborDistance;
+          lowSides[i] = coord < maxNeighborDistance ? -1 : 0;
+          highSides[i] = coord + maxNeighborDistance >= chunkSize ? 1 : 0;
+        }
+        forEachDirection(lowSides, highSides, [&](size_t direction) {
+          directions[direction] = 1;
+        });
+      }
+    });
+
+    for (size_t direction = 0; direction < numDirections; ++direction) {
+      if (!directions[direction] || direction == (numDirections - 1) / 2) {
+        continue;
+      }
+      auto neighbor = key;
+      auto rest = direction;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        neighbor[i] += static_cast<long int>(rest % 3) - 1;
+        rest /= 3;
+      }
+      reached.push_back(neighbor);
+    }
+    return allDefault;
+  }
+
+  // Calls f with the direction index of every combination of per-dimension
+  // offsets in [low[i], high[i]].
+  template <typename F>
+  void forEachDirection(const std::vector<int>& low,
+                        const std::vector<int>& high, F&& f) {
+    auto offset = low;
+    while (true) {
+      size_t direction = 0;
+      size_t weight = 1;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        direction += (offset[i] + 1) * weight;
+        weight *= 3;
+      }
+      f(direction);
+      size_t i = 0;
+      for (; i < numDimensions; ++i) {
+        if (++offset[i] <= high[i]) break;
+        offset[i] = low[i];
+      }
+      if (i == numDimensions) return;
+    }
+  }
+
+  // Fills the halo of a chunk's current generation from the chunks around
+  // it, or with the default value where there are none.
+  void refreshHalo(const std::vector<long int>& key, Chunk& chunk) {
+    std::vector<int> low(numDimensions, -1), high(numDimensions, 1);
+    forEachDirection(low, high, [&](size_t direction) {
+      auto neighbor = key;
+      std::vector<size_t> dstLo(numDimensions), srcLo(numDimensions),
+          extent(numDimensions);
+      auto rest = direction;
+      auto isSelf = true;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        auto d = static_cast<int>(rest % 3) - 1;
+        rest /= 3;
+        neighbor[i] += d;
+        isSelf = isSelf && d == 0;
+        if (d < 0) {
+          dstLo[i] = 0;
+          srcLo[i] = chunkSize;
+          extent[i] = maxNeighborDistance;
+        } else if (d == 0) {
+          dstLo[i] = srcLo[i] = maxNeighborDistance;
+          extent[i] = chunkSize;
+        } else {
+          dstLo[i] = maxNeighborDistance + chunkSize;
+          srcLo[i] = maxNeighborDistance;
+          extent[i] = maxNeighborDistance;
+        }
+      }
+      if (isSelf) return;
+
+      auto source = chunks.find(neighbor);
+      copyBox(source == chunks.end() ? nullptr : &source->second.values,
+              chunk.values, srcLo, dstLo, extent);
+    });
+  }
+
+  // Copies a box of cells between the padded arrays of two chunks, or fills
+  // it with the default value when there is no source.
+  void copyBox(const AlignedBuffer<T>* source, AlignedBuffer<T>& target,
+               const std::vector<size_t>& srcLo,
+               const std::vector<size_t>& dstLo,
+               const std::vector<size_t>& extent) {
+    auto coord = allZeros(numDimensions);
+    while (true) {
+      size_t srcIdx = 0;
+      size_t dstIdx = 0;
+      for (size_t i = 0; i < numDimensions; ++i) {
+        srcIdx += (srcLo[i] + coord[i]) * strides[i];
+        dstIdx += (dstLo[i] + coord[i]) * strides[i];
+      }
+      if (source) {
+        std::copy_n(&(*source)[srcIdx], extent[0], &target[dstIdx]);
+      } else {
+        std::fill_n(&target[dstIdx], extent[0], defaultValue);
+      }
+      size_t i = 1;
+      for (; i < numDimensions; ++i) {
+        if (++coord[i] < extent[i]) break;
+        coord[i] = 0;
+      }
+      if (i >= numDimensions) return;
+    }
+  }
+
+  // Calls f with the padded index of the first cell of every interior row
+  // of a chunk.
+  template <typename F>
+  void forEachInteriorRow(F&& f) const {
+    auto coord = allZeros(numDimensions);
+    size_t rowIdx = 0;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      rowIdx += maxNeighborDistance * strides[i];
+    }
+    size_t numRows = 1;
+    for (size_t i = 1; i < numDimensions; ++i) {
+      numRows *= chunkSize;
+    }
+    for (size_t row = 0; row < numRows; ++row) {
+      f(rowIdx);
+      for (size_t i = 1; i < numDimensions; ++i) {
+        if (++coord[i] < chunkSize) {
+          rowIdx += strides[i];
+          break;
+        }
+        coord[i] = 0;
+        rowIdx -= (chunkSize - 1) * strides[i];
+      }
+    }
+  }
+
+  bool isDefault(const T& val) const {
+    return cellsEqual(&val, &defaultValue, 1, 0);
+  }
+
+  bool isInteriorDefault(const AlignedBuffer<T>& buffer) const {
+    auto result = true;
+    forEachInteriorRow([&](size_t rowIdx) {
+      for (size_t x = 0; x < chunkSize && result; ++x) {
+        result = isDefault(buffer[rowIdx + x]);
+      }
+    });
+    return result;
+  }
+
+  Chunk newChunk() const {
+    return Chunk{AlignedBuffer<T>(paddedSize, defaultValue),
+                 AlignedBuffer<T>(paddedSize, defaultValue), true};
+  }
+
+  std::vector<long int> getChunkCoords(
+      const std::vector<long int>& coordinates) const {
+    std::vector<long int> key(numDimensions);
+    auto size = static_cast<long int>(chunkSize);
+    for (size_t i = 0; i < numDimensions; ++i) {
+      auto x = coordinates[i];
+      key[i] = x >= 0 ? x / size : -((-x - 1) / size) - 1;
+    }
+    return key;
+  }
+
+  size_t getCellIdx(const std::vector<long int>& coordinates) const {
+    auto size = static_cast<long int>(chunkSize);
+    size_t result = 0;
+    for (size_t i = 0; i < numDimensions; ++i) {
+      auto x = ((coordinates[i] % size) + size) % size;
+      result += (x + maxNeighborDistance) * strides[i];
+    }
+    return result;
+  }
+
+  long int getOffsetIdx(const std::vector<int>& offsetCoords) const {
+    if (offsetCoords.size() != numDimensions)
+      throw InvalidOperationException(
+          "Coordinate numDimensions do not match grid's numDimensions.");
+
+    long int result{0};
+    for (size_t i = 0; i < numDimensions; ++i) {
+      result += offsetCoords[i] * static_cast<long int>(strides[i]);
+    }
+    return result;
+  }
+
+  void checkDimensions(const std::vector<long int>& coordinates) const {
+    if (coordinates.size() != numDimensions)
+      throw InvalidOperationException(
+          "Coordinate numDimensions do not match grid's numDimensions.");
+  }
+};
+
+// BitGrid
+// =======---------------------------------------------------------------------
+namespace {  // Bit-sliced arithmetic
+// Counts are kept bit-sliced: plane p of a row holds bit p of the count of
+// every cell in the row, one cell per bit, so a handful of word-wide logic
+// operations add up 64 cells at a time.
+constexpr size_t WORD_BITS = 64;
+
+// Moves bit i of byte to the lowest bit of byte i of the result. The
+// multiply lays copies of the low 7 bits 7 bits apart, which puts bit i of
+// one of them at bit 8i; the top bit would carry into the others, so it
+// goes on its own.
+uint64_t spreadBits(uint64_t byte) {
+  return ((byte & 0x7f) * 0x0002040810204081ull & 0x0101010101010101ull) |
+         (byte >> 7) << 56;
+}
+
+// Number of bit planes needed to hold values up to maxValue.
+size_t numPlanes(size_t maxValue) {
+  size_t result = 1;
+  while (maxValue >> result) {
+    ++result;
+  }
+  return result;
+}
+
+// Runs of words the kernels below work on as one vector V each, as wide as
+// the instruction set they are compiled for handles natively. Compilers
+// without vector extensions go a word at a time.
+#if defined(__GNUC__) || defined(__clang__)
+typedef uint64_t WordVector128 __attribute__((vector_size(16)));
+typedef uint64_t WordVector256 __attribute__((vector_size(32)));
+typedef uint64_t WordVector512 __attribute__((vector_size(64)));
+typedef WordVector128 DefaultWordVector;
+#else
+typedef uint64_t DefaultWordVector;
+#endif
+
+template <typename V>
+constexpr size_t vectorWords() {
+  return sizeof(V) / sizeof(uint64_t);
+}
+
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void loadWords(V& v, const uint64_t* words) {
+  std::memcpy(&v, words, sizeof(V));
+}
+
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void storeWords(uint64_t* words, const V& v) {
+  std::memcpy(words, &v, sizeof(V));
+}
+
+// acc += addend over the words of one V, where plane p of either starts
+// stride words after plane p - 1.
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void addPlaneWords(uint64_t* acc, size_t accPlanes,
+                                            const uint64_t* addend,
+                                            size_t addendPlanes,
+                                            size_t stride) {
+  V a, b, carry{};
+  size_t p = 0;
+  for (; p < addendPlanes; ++p) {
+    loadWords(a, acc + p * stride);
+    loadWords(b, addend + p * stride);
+    storeWords(acc + p * stride, a ^ b ^ carry);
+    carry = (a & b) | (carry & (a ^ b));
+  }
+  for (; p < accPlanes; ++p) {
+    loadWords(a, acc + p * stride);
+    storeWords(acc + p * stride, a ^ carry);
+    carry &= a;
+  }
+}
+
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void addPlanesKernel(uint64_t* acc, size_t accPlanes,
+                                              const uint64_t* addend,
+                                              size_t addendPlanes,
+                                              size_t length, size_t stride) {
+  size_t w = 0;
+  for (; w + vectorWords<V>() <= length; w += vectorWords<V>()) {
+    addPlaneWords<V>(acc + w, accPlanes, addend + w, addendPlanes, stride);
+  }
+  for (; w < length; ++w) {
+    addPlaneWords<uint64_t>(acc + w, accPlanes, addend + w, addendPlanes,
+                            stride);
+  }
+}
+
+// The 2-plane sum of the cells of the words of one V from row and their two
+// neighbors along the row, which takes the words either side of them.
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void addNeighborWords(const uint64_t* row,
+                                               uint64_t* sum, size_t stride) {
+  V before, center, after;
+  loadWords(before, row - 1);
+  loadWords(center, row);
+  loadWords(after, row + 1);
+  auto left = (center << 1) | (before >> (WORD_BITS - 1));
+  auto right = (center >> 1) | (after << (WORD_BITS - 1));
+  storeWords(sum, left ^ center ^ right);
+  storeWords(sum + stride, (left & center) | (right & (left ^ center)));
+}
+
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void addRowNeighborsKernel(const uint64_t* row,
+                                                    uint64_t* sum,
+                                                    size_t length,
+                                                    size_t stride) {
+  // The first and last words have no word beyond them to read.
+  auto edge = [&](size_t w) {
+    auto center = row[w];
+    auto left = (center << 1) | (w > 0 ? row[w - 1] >> (WORD_BITS - 1) : 0);
+    auto right = (center >> 1) |
+                 (w + 1 < length ? row[w + 1] << (WORD_BITS - 1) : 0);
+    sum[w] = left ^ center ^ right;
+    sum[stride + w] = (left & center) | (right & (left ^ center));
+  };
+  edge(0);
+  if (length == 1) return;
+  size_t w = 1;
+  for (; w + vectorWords<V>() < length; w += vectorWords<V>()) {
+    addNeighborWords<V>(row + w, sum + w, stride);
+  }
+  for (; w + 1 < length; ++w) {
+    addNeighborWords<uint64_t>(row + w, sum + w, stride);
+  }
+  edge(length - 1);
+}
+
+// Sets matched to the cells of the words of one V whose total, of planes
+// planes stride words apart, is one of counts.
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void matchTotalWords(
+    V& matched, const uint64_t* total, size_t planes, size_t stride,
+    const std::vector<size_t>& counts) {
+  matched = V{};
+  for (auto count : counts) {
+    V match = ~V{};
+    V plane;
+    for (size_t p = 0; p < planes; ++p) {
+      loadWords(plane, total + p * stride);
+      match &= (count >> p) & 1 ? plane : ~plane;
+    }
+    matched |= match;
+  }
+}
+
+// The cells of the words of one V from alive that are born or survive with
+// their totals, within mask.
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void applyRuleWords(
+    const uint64_t* alive, uint64_t* future, const uint64_t* mask,
+    const uint64_t* total, size_t planes, size_t stride,
+    const std::vector<size_t>& birthTotals,
+    const std::vector<size_t>& survivalTotals) {
+  V cells, inside, born, survived;
+  loadWords(cells, alive);
+  loadWords(inside, mask);
+  matchTotalWords(born, total, planes, stride, birthTotals);
+  matchTotalWords(survived, total, planes, stride, survivalTotals);
+  storeWords(future, ((~cells & born) | (cells & survived)) & inside);
+}
+
+template <typename V>
+METHUSELAH_ALWAYS_INLINE void applyRuleKernel(
+    const uint64_t* alive, uint64_t* future, const uint64_t* mask,
+    const uint64_t* total, size_t planes, size_t length,
+    const std::vector<size_t>& birthTotals,
+    const std::vector<size_t>& survivalTotals) {
+  size_t w = 0;
+  for (; w + vectorWords<V>() <= length; w += vectorWords<V>()) {
+    applyRuleWords<V>(alive + w, future + w, mask + w, total + w, planes,
+                      length, birthTotals, survivalTotals);
+  }
+  for (; w < length; ++w) {
+    applyRuleWords<uint64_t>(alive + w, future + w, mask + w, total + w,
+                             planes, length, birthTotals, survivalTotals);
+  }
+}
+
+#ifdef METHUSELAH_SIMD_DISPATCH
+METHUSELAH_TARGET("avx2")
+void addPlanesAvx2(uint64_t* acc, size_t accPlanes, const uint64_t* addend,
+                   size_t addendPlanes, size_t length, size_t stride) {
+  addPlanesKernel<WordVector256>(acc, accPlanes, addend, addendPlanes, length,
+                                 stride);
+}
+
+METHUSELAH_TARGET("avx512f")
+void addPlanesAvx512(uint64_t* acc, size_t accPlanes, const uint64_t* addend,
+                     size_t addendPlanes, size_t length, size_t stride) {
+  addPlanesKernel<WordVector512>(acc, accPlanes, addend, addendPlanes, length,
+                                 stride);
+}
+
+METHUSELAH_TARGET("avx2")
+void addRowNeighborsAvx2(const uint64_t* row, uint64_t* sum, size_t length,
+                         size_t stride) {
+  addRowNeighborsKernel<WordVector256>(row, sum, length, stride);
+}
+
+METHUSELAH_TARGET("avx512f")
+void addRowNeighborsAvx512(const uint64_t* row, uint64_t* sum, size_t length,
+                           size_t stride) {
+  addRowNeighborsKernel<WordVector512>(row, sum, length, stride);
+}
+
+METHUSELAH_TARGET("avx2")
+void applyRuleAvx2(const uint64_t* alive, uint64_t* future,
+                   const uint64_t* mask, const uint64_t* total, size_t planes,
+                   size_t length, const std::vector<size_t>& birthTotals,
+                   const std::vector<size_t>& survivalTotals) {
+  applyRuleKernel<WordVector256>(alive, future, mask, total, planes, length,
+                                 birthTotals, survivalTotals);
+}
+
+METHUSELAH_TARGET("avx512f")
+void applyRuleAvx512(const uint64_t* alive, uint64_t* future,
+                     const uint64_t* mask, const uint64_t* total,
+                     size_t planes, size_t length,
+                     const std::vector<size_t>& birthTotals,
+                     const std::vector<size_t>& survivalTotals) {
+  applyRuleKernel<WordVector512>(alive, future, mask, total, planes, length,
+                                 birthTotals, survivalTotals);
+}
+#endif
+
+// acc += addend, where acc has accPlanes planes and addend has addendPlanes
+// planes of length words each, every plane stride words after the one
+// before. acc must be wide enough to hold the sum.
+void addPlanes(uint64_t* acc, size_t accPlanes, const uint64_t* addend,
+               size_t addendPlanes, size_t length, size_t stride) {
+#ifdef METHUSELAH_SIMD_DISPATCH
+  switch (getSimdLevel()) {
+    case SimdLevel::AVX512:
+      return addPlanesAvx512(acc, accPlanes, addend, addendPlanes, length,
+                             stride);
+    case SimdLevel::AVX2:
+      return addPlanesAvx2(acc, accPlanes, addend, addendPlanes, length,
+                           stride);
+    case SimdLevel::NONE:
+      break;
+  }
+#endif
+  addPlanesKernel<DefaultWordVector>(acc, accPlanes, addend, addendPlanes,
+                                     length, stride);
+}
+
+// Writes the 2-plane sum of every cell and its two neighbors along the row,
+// the high plane stride words after the low one. Runs of rows can go at
+// once: the bits that cross between them only reach their halo cells.
+void addRowNeighbors(const uint64_t* row, uint64_t* sum, size_t length,
+                     size_t stride) {
+#ifdef METHUSELAH_SIMD_DISPATCH
+  switch (getSimdLevel()) {
+    case SimdLevel::AVX512:
+      return addRowNeighborsAvx512(row, sum, length, stride);
+    case SimdLevel::AVX2:
+      return addRowNeighborsAvx2(row, sum, length, stride);
+    case SimdLevel::NONE:
+      break;
+  }
+#endif
+  addRowNeighborsKernel<DefaultWordVector>(row, sum, length, stride);
+}
+
+// Writes the next generation of the length words of alive to future, from
+// the totals of every cell and itself in planes planes length words apart.
+// Cells outside mask are cleared.
+void applyRule(const uint64_t* alive, uint64_t* future, const uint64_t* mask,
+               const uint64_t* total, size_t planes, size_t length,
+               const std::vector<size_t>& birthTotals,
+               const std::vector<size_t>& survivalTotals) {
+#ifdef METHUSELAH_SIMD_DISPATCH
+  switch (getSimdLevel()) {
+    case SimdLevel::AVX512:
+      return applyRuleAvx512(alive, future, mask, total, planes, length,
+                             birthTotals, survivalTotals);
+    case SimdLevel::AVX2:
+      return applyRuleAvx2(alive, future, mask, total, planes, length,
+                           birthTotals, survivalTotals);
+    case SimdLevel::NONE:
+      break;
+  }
+#endif
+  applyRuleKernel<DefaultWordVector>(alive, future, mask, total, planes,
+                                     length, birthTotals, survivalTotals);
+}
+
+}  // namespace
+
+// A grid of booleans stored 64 cells to a word that runs an outer totalistic
+// rule over its Moore neighborhood with bit-sliced adders instead of a
+// per-cell callback. Rows along the first dimension are packed into words
+// with one halo bit on either end, and every other dimension gets a halo of
+// one row on either side, just like Grid.
+//
+// update(), getValue() and setValue() behave like Grid<bool>'s.
+class BitGrid {
+  // Per-thread working memory for the neighbor count kernel.
+  struct Scratch {
+    std::vector<std::vector<uint64_t>> levels;
+    std::vector<uint64_t> ring;
+    std::vector<uint64_t> total;
+  };
+
+ public:
+  BitGrid(const std::vector<size_t>& shape, Wrapping wrapping,
+          const OuterTotalisticRule& rule)
+      : shape(shape),
+        size(multiplyAll<size_t>(shape)),
+        numDimensions(shape.size()),
+        wrapping(wrapping),
+        rowLength((shape[0] + 2 + WORD_BITS - 1) / WORD_BITS),
+        threadScratch(1) {
+    rowStrides.resize(numDimensions);
+    numRows = 1;
+    for (auto i = 1; i < numDimensions; ++i) {
+      rowStrides[i] = numRows;
+      numRows *= shape[i] + 2;
+    }
+
+    // The interior cells of a hyperplane of the last dimension, the only
+    // ones an update writes.
+    size_t top = numDimensions - 1;
+    planeRows = numDimensions == 1 ? 1 : rowStrides[top];
+    planeMask.assign(planeRows * rowLength, 0);
+    for (size_t row = 0; row < planeRows; ++row) {
+      auto interior = true;
+      for (size_t i = 1; i < top; ++i) {
+        auto coord = row / rowStrides[i] % (shape[i] + 2);
+        interior = interior && coord != 0 && coord <= shape[i];
+      }
+      for (size_t x = 1; x <= shape[0] && interior; ++x) {
+        planeMask[row * rowLength + x / WORD_BITS] |= uint64_t(1)
+                                                      << (x % WORD_BITS);
+      }
+    }
+
+    // Level d of the neighbor count sums a 3^(d+1) cell box.
+    size_t boxSize = 1;
+    for (auto i = 0; i < numDimensions; ++i) {
+      boxSize *= 3;
+      levelPlanes.push_back(numPlanes(boxSize));
+    }
+
+    values = AlignedBuffer<uint64_t>(numRows * rowLength, 0);
+    futureValues = AlignedBuffer<uint64_t>(numRows * rowLength, 0);
+
+    setRule(rule);
+  }
+
+  void update() {
+    std::swap(values, futureValues);
+    refreshHalo();
+    forEachSlabChunk([&](size_t slabBegin, size_t slabEnd, size_t thread) {
+      updateSlabs(slabBegin, slabEnd, threadScratch[thread]);
+    });
+  }
+
+  bool getValue(const std::vector<size_t>& coordinates) const {
+    checkBounds(coordinates);
+    auto bit = getBit(coordinates);
+    return (values[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+  }
+
+  void setValue(const std::vector<size_t>& coordinates, bool val) {
+    checkBounds(coordinates);
+    auto bit = getBit(coordinates);
+    auto mask = uint64_t(1) << (bit % WORD_BITS);
+    for (auto buffer : {&values, &futureValues}) {
+      auto& word = (*buffer)[bit / WORD_BITS];
+      word = val ? word | mask : word & ~mask;
+    }
+  }
+
+  // Same as Grid::readRow, with the cells unpacked a word at a time.
+  template <typename F>
+  void readRow(size_t row, F&& f) const {
+    if (row >= size / shape[0])
+      throw std::out_of_range("Can't read rows past the end of the grid.");
+    size_t rowIdx = 0;
+    for (auto i = 1; i < numDimensions; ++i) {
+      rowIdx += (row % shape[i] + 1) * rowStrides[i];
+      row /= shape[i];
+    }
+    auto words = &values[rowIdx * rowLength];
+    bool cells[WORD_BITS];
+    for (size_t x = 0; x < shape[0]; x += WORD_BITS) {
+      auto length = std::min<size_t>(WORD_BITS, shape[0] - x);
+      // Cell x is bit x + 1, after the padding bit, so the run straddles
+      // two words. Its bits are spread out to a byte each, 8 at a time.
+      auto i = x / WORD_BITS;
+      auto word = words[i] >> 1;
+      if ((x + length) / WORD_BITS > i) {
+        word |= words[i + 1] << (WORD_BITS - 1);
+      }
+      for (size_t j = 0; j < length; j += 8) {
+        storeLittleEndian(spreadBits(word >> j & 0xff),
+                          reinterpret_cast<unsigned char*>(cells + j));
+      }
+      f(x, static_cast<const bool*>(cells), length);
+    }
+  }
+
+  const std::vector<size_t>& getShape() const { return shape; }
+
+  size_t getSize() const { return size; }
+
+  const OuterTotalisticRule& getRule() const { return rule; }
+
+  void setRule(const OuterTotalisticRule& rule) {
+    if (rule.numStates != 2)
+      throw InvalidOperationException("BitGrid only supports binary rules.");
+    if (rule.neighborhood != Neighborhood::MOORE || rule.radius != 1)
+      throw InvalidOperationException(
+          "BitGrid only supports radius 1 Moore neighborhoods.");
+    auto maxNeighbors = mooreNeighborhoodSize(numDimensions);
+
+    // The kernel counts the cell itself along with its neighbors, so
+    // survival counts are shifted up by one.
+    birthTotals.clear();
+    survivalTotals.clear();
+    for (auto count : rule.birth) {
+      if (count > maxNeighbors)
+        throw InvalidOperationException("Birth count exceeds neighborhood.");
+      birthTotals.push_back(count);
+    }
+    for (auto count : rule.survival) {
+      if (count > maxNeighbors)
+        throw InvalidOperationException("Survival count exceeds neighborhood.");
+      survivalTotals.push_back(count + 1);
+    }
+    this->rule = rule;
+  }
+
+  size_t getNumThreads() const { return threadScratch.size(); }
+
+  // Same as Grid::setNumThreads.
+  void setNumThreads(size_t numThreads) {
+    if (numThreads == 0) {
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadPool.reset(numThreads > 1 ? new ThreadPool(numThreads) : nullptr);
+    threadScratch.resize(numThreads);
+  }
+
+ private:
+  // Immutable member variables
+  std::vector<size_t> const shape;
+  size_t const size;
+  unsigned short int const numDimensions;
+  Wrapping const wrapping;
+  size_t const rowLength;
+
+  // Mutable member variables
+  size_t numRows;
+  std::vector<size_t> rowStrides;
+  size_t planeRows;
+  std::vector<uint64_t> planeMask;
+  std::vector<size_t> levelPlanes;
+  AlignedBuffer<uint64_t> values;
+  AlignedBuffer<uint64_t> futureValues;
+  OuterTotalisticRule rule;
+  std::vector<size_t> birthTotals;
+  std::vector<size_t> survivalTotals;
+  std::unique_ptr<ThreadPool> threadPool;
+  std::vector<Scratch> threadScratch;
+
+  // Private member functions
+  uint64_t* getRow(AlignedBuffer<uint64_t>& buffer, size_t rowIdx) {
+    return buffer.get() + rowIdx * rowLength;
+  }
+
+  // Neighbor counts are separable: the 3^n box sum is the sum along the
+  // first dimension, summed over three rows along the second, and so on.
+  // Each hyperplane of the last dimension is reduced to its (n-1)
+  // dimensional box sums once, and a ring of three of those gives the full
+  // count for every row of the middle one. Sums hold a whole hyperplane per
+  // bit plane, so every step runs over one long stretch of words however
+  // short the rows are. Halo rows get sums too, which are wrong but never
+  // used.
+  void updateSlabs(size_t slabBegin, size_t slabEnd, Scratch& scratch) {
+    auto planeWords = planeRows * rowLength;
+    if (numDimensions == 1) {
+      scratch.total.resize(levelPlanes[0] * planeWords);
+      addRowNeighbors(getRow(values, 0), scratch.total.data(), planeWords,
+                      planeWords);
+      applyRule(getRow(values, 0), getRow(futureValues, 0), planeMask.data(),
+                scratch.total.data(), levelPlanes[0], planeWords,
+                birthTotals, survivalTotals);
+      return;
+    }
+
+    size_t top = numDimensions - 1;
+    auto ringSize = levelPlanes[top - 1] * planeWords;
+    scratch.levels.resize(top);
+    for (size_t level = 0; level + 1 < top; ++level) {
+      scratch.levels[level].resize(levelPlanes[level] * planeWords);
+    }
+    scratch.ring.resize(3 * ringSize);
+    scratch.total.resize(levelPlanes[top] * planeWords);
+
+    // Padded slab index z + 1 holds interior slab z.
+    for (auto z = slabBegin; z < slabEnd + 2; ++z) {
+      sumHyperplane(z, scratch, scratch.ring.data() + (z % 3) * ringSize);
+      if (z < slabBegin + 2) continue;
+
+      auto total = scratch.total.data();
+      std::fill(scratch.total.begin(), scratch.total.end(), 0);
+      for (size_t k = 0; k < 3; ++k) {
+        addPlanes(total, levelPlanes[top], scratch.ring.data() + k * ringSize,
+                  levelPlanes[top - 1], planeWords, planeWords);
+      }
+      auto firstRow = (z - 1) * planeRows;
+      applyRule(getRow(values, firstRow), getRow(futureValues, firstRow),
+                planeMask.data(), total, levelPlanes[top], planeWords,
+                birthTotals, survivalTotals);
+    }
+  }
+
+  // Writes the (n-1) dimensional box sums of the hyperplane at padded slab
+  // index z to out, reducing one dimension at a time.
+  void sumHyperplane(size_t z, Scratch& scratch, uint64_t* out) {
+    size_t top = numDimensions - 1;
+    auto planeWords = planeRows * rowLength;
+
+    auto level0 = top == 1 ? out : scratch.levels[0].data();
+    addRowNeighbors(getRow(values, z * planeRows), level0, planeWords,
+                    planeWords);
+
+    // Rows with a neighbor on either side along the level's dimension
+    // within the hyperplane, which takes all but the first and last ones.
+    for (size_t level = 1; level < top; ++level) {
+      auto in = scratch.levels[level - 1].data();
+      auto sum = level + 1 == top ? out : scratch.levels[level].data();
+      auto offset = rowStrides[level] * rowLength;
+      auto length = planeWords - 2 * offset;
+      for (size_t p = 0; p < levelPlanes[level]; ++p) {
+        std::fill_n(sum + p * planeWords + offset, length, 0);
+      }
+      for (auto neighbor : {in, in + offset, in + 2 * offset}) {
+        addPlanes(sum + offset, levelPlanes[level], neighbor,
+                  levelPlanes[level - 1], length, planeWords);
+      }
+    }
+  }
+
+  // Bounded halos are never written, so they stay dead. Toroidal ones are
+  // copied from the opposite edge, one dimension after another.
+  void refreshHalo() {
+    if (wrapping != Wrapping::TOROIDAL) return;
+
+    auto extent = shape[0];
+    forEachInteriorRow(0, numSlabs(), [&](size_t rowIdx) {
+      auto row = getRow(values, rowIdx);
+      writeBit(row, 0, readBit(row, extent));
+      writeBit(row, extent + 1, readBit(row, 1));
+    });
+
+    for (size_t dim = 1; dim < numDimensions; ++dim) {
+      auto stride = rowStrides[dim];
+      extent = shape[dim];
+      forEachHaloRow(dim, [&](size_t rowIdx) {
+        std::copy_n(getRow(values, rowIdx + extent * stride), rowLength,
+                    getRow(values, rowIdx));
+        std::copy_n(getRow(values, rowIdx + stride), rowLength,
+                    getRow(values, rowIdx + (extent + 1) * stride));
+      });
+    }
+  }
+
+  static bool readBit(const uint64_t* row, size_t bit) {
+    return (row[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+  }
+
+  static void writeBit(uint64_t* row, size_t bit, bool val) {
+    auto mask = uint64_t(1) << (bit % WORD_BITS);
+    auto& word = row[bit / WORD_BITS];
+    word = val ? word | mask : word & ~mask;
+  }
+
+  // Same slab partitioning as Grid: hyperplanes of the last dimension, or
+  // the single row of a one dimensional grid.
+  size_t numSlabs() const {
+    return numDimensions == 1 ? 1 : shape[numDimensions - 1];
+  }
+
+  template <typename F>
+  void forEachSlabChunk(F&& f) {
+    auto slabs = numSlabs();
+    if (!threadPool) {
+      f(0, slabs, 0);
+      return;
+    }
+
+    auto chunk =
+        std::max<size_t>(1, slabs / (threadPool->getNumThreads() * 4));
+    auto numChunks = (slabs + chunk - 1) / chunk;
+    threadPool->run(numChunks, [&](size_t i, size_t thread) {
+      f(i * chunk, std::min(slabs, (i + 1) * chunk), thread);
+    });
+  }
+
+  // Calls f with the index of every interior row in the given slabs.
+  template <typename F>
+  void forEachInteriorRow(size_t slabBegin, size_t slabEnd, F&& f) {
+    if (numDimensions == 1) {
+      f(0);
+      return;
+    }
+
+    auto last = numDimensions - 1;
+    auto coord = allZeros(numDimensions);
+    coord[last] = slabBegin;
+    auto rowIdx = getRowIdx(coord);
+    auto count = size / shape[0] / shape[last] * (slabEnd - slabBegin);
+    for (size_t row = 0; row < count; ++row) {
+      f(rowIdx);
+      for (auto i = 1; i < numDimensions; ++i) {
+        if (++coord[i] < shape[i]) {
+          rowIdx += rowStrides[i];
+          break;
+        }
+        coord[i] = 0;
+        rowIdx -= (shape[i] - 1) * rowStrides[i];
+      }
+    }
+  }
+
+  // Calls f with the index of every row whose padded coordinate along dim is
+  // zero, covering the halos of the dimensions below dim.
+  template <typename F>
+  void forEachHaloRow(size_t dim, F&& f) {
+    auto lo = allZeros(numDimensions);
+    auto hi = allZeros(numDimensions);
+    for (size_t i = 1; i < numDimensions; ++i) {
+      lo[i] = i < dim ? 0 : 1;
+      hi[i] = i < dim ? shape[i] + 2 : shape[i] + 1;
+    }
+    lo[dim] = 0;
+    hi[dim] = 1;
+
+    auto coord = lo;
+    while (true) {
+      size_t rowIdx = 0;
+      for (size_t i = 1; i < numDimensions; ++i) {
+        rowIdx += coord[i] * rowStrides[i];
+      }
+      f(rowIdx);
+      size_t i = 1;
+      for (; i < numDimensions; ++i) {
+        if (++coord[i] < hi[i]) break;
+        coord[i] = lo[i];
+      }
+      if (i == numDimensions) return;
+    }
+  }
+
+  size_t getRowIdx(const std::vector<size_t>& coordinates) const {
+    size_t result = 0;
+    for (auto i = 1; i < numDimensions; ++i) {
+      result += (coordinates[i] + 1) * rowStrides[i];
+    }
+    return result;
+  }
+
+  // Index of the bit holding an interior cell, counted from the first word.
+  size_t getBit(const std::vector<size_t>& coordinates) const {
+    return getRowIdx(coordinates) * rowLength * WORD_BITS + coordinates[0] + 1;
+  }
+
+  void checkBounds(const std::vector<size_t>& coordinates) const {
+    if (coordinates.size() != numDimensions)
+      throw InvalidOperationException(
+          "Coordinate numDimensions do not match grid's numDimensions.");
+
+    for (auto i = 0; i < numDimensions; ++i) {
+      if (coordinates[i] >= shape[i]) {
+        throw std::out_of_range(
+            "Can't access values for out of bounds indices");
+      }
+    }
+  }
+};
+
+// HashLife
+// ====------------------------------------------------------------------------
+// An unbounded 2D universe of binary cells that advances by HashLife: the
+// universe is a quadtree whose identical subtrees are shared, and every node
+// remembers the center half it evolves into, so repetitive patterns can skip
+// ahead by huge powers of two at the cost of a few hash lookups. Cells
+// outside the pattern are dead, so rules with B0 can't run here. Coordinates
+// are (x, y) pairs of 64 bit integers around the origin, with y pointing
+// down like the second dimension of a Grid.
+class HashLife {
+  static constexpr uint32_t DEAD = 0;
+  static constexpr uint32_t ALIVE = 1;
+  static constexpr uint8_t NO_RESULT = 255;
+
+  // A node of level n covers 2^n x 2^n cells. Leaves are the two level 0
+  // nodes DEAD and ALIVE. result is the center 2^(n-1) square after
+  // 2^resultLog2 generations.
+  struct Node {
+    std::array<uint32_t, 4> children;  // nw, ne, sw, se
+    uint32_t result;
+    uint8_t level;
+    uint8_t resultLog2;
+  };
+
+ public:
+  explicit HashLife(const OuterTotalisticRule& rule,
+                    size_t memoryLimit = size_t(1) << 30)
+      : memoryLimit(memoryLimit), generation(0), stepLog2(0) {
+    setRule(rule);
+    clear();
+  }
+
+  // Advances 2^getStepLog2() generations.
+  void step() { stepPow2(stepLog2); }
+
+  // Advances any number of generations, one power of two at a time.
+  void advance(uint64_t generations) {
+    for (uint8_t log2 = 0; generations != 0; ++log2, generations >>= 1) {
+      if (generations & 1) {
+        stepPow2(log2);
+      }
+    }
+  }
+
+  unsigned getStepLog2() const { return stepLog2; }
+
+  void setStepLog2(unsigned stepLog2) {
+    if (stepLog2 > 63)
+      throw InvalidOperationException("Steps are at most 2^63 generations.");
+    this->stepLog2 = stepLog2;
+  }
+
+  uint64_t getGeneration() const { return generation; }
+
+  bool getValue(int64_t x, int64_t y) const {
+    auto level = nodes[root].level;
+    auto quadrants = nodes[root].children;
+    reduceToDirectLevel(level, quadrants);
+    if (!inRange(level, x) || !inRange(level, y)) return false;
+
+    auto node = quadrants[quadrantOf(x, y)];
+    for (--level; level > 0; --level) {
+      moveToChild(level, x, y);
+      node = nodes[node].children[quadrantOf(x, y)];
+    }
+    return node == ALIVE;
+  }
+
+  void setValue(int64_t x, int64_t y, bool val) {
+    while (nodes[root].level < MIN_ROOT_LEVEL ||
+           (nodes[root].level < DIRECT_LEVEL &&
+            (!inRange(nodes[root].level, x) || !inRange(nodes[root].level, y)))) {
+      root = expand(root);
+    }
+    root = setCell(root, x, y, val);
+  }
+
+  // Removes every live cell and resets the generation count.
+  void clear() {
+    nodes.clear();
+    hashTable.assign(1024, 0);
+    emptyNodes.clear();
+    numHashed = 0;
+    nodes.push_back(Node{{}, DEAD, 0, NO_RESULT});
+    nodes.push_back(Node{{}, ALIVE, 0, NO_RESULT});
+    root = empty(MIN_ROOT_LEVEL);
+    generation = 0;
+  }
+
+  // Replaces the universe with the cells of a Grid<bool> or BitGrid, placing
+  // grid cell (i, j) at (x + i, y + j).
+  template <typename GridType>
+  void readFrom(GridType& grid, int64_t x = 0, int64_t y = 0) {
+    const auto& shape = grid.getShape();
+    if (shape.size() != 2)
+      throw InvalidOperationException("HashLife needs a 2D grid.");
+
+    clear();
+    while (nodes[root].level < DIRECT_LEVEL &&
+           !(inRange(nodes[root].level, x) && inRange(nodes[root].level, y) &&
+             inRange(nodes[root].level, x + int64_t(shape[0]) - 1) &&
+             inRange(nodes[root].level, y + int64_t(shape[1]) - 1))) {
+      root = expand(root);
+    }
+
+    std::vector<size_t> coords(2);
+    auto level = nodes[root].level;
+    auto corner = cornerOf(level);
+    root = build(level, corner, corner, [&](int64_t cellX, int64_t cellY) {
+      if (cellX < x || cellY < y) return false;
+      coords[0] = static_cast<uint64_t>(cellX - x);
+      coords[1] = static_cast<uint64_t>(cellY - y);
+      return coords[0] < shape[0] && coords[1] < shape[1] &&
+             bool(grid.getValue(coords));
+    }, x, y, shape[0], shape[1]);
+  }
+
+  // Copies the cells at (x + i, y + j) into grid cell (i, j), for rendering
+  // a window of the universe. Every grid cell is written.
+  template <typename GridType>
+  void writeTo(GridType& grid, int64_t x = 0, int64_t y = 0) const {
+    const auto& shape = grid.getShape();
+    if (shape.size() != 2)
+      throw InvalidOperationException("HashLife needs a 2D grid.");
+
+    std::vector<size_t> coords(2);
+    for (coords[1] = 0; coords[1] < shape[1]; ++coords[1]) {
+      for (coords[0] = 0; coords[0] < shape[0]; ++coords[0]) {
+        grid.setValue(coords, false);
+      }
+    }
+
+    auto level = nodes[root].level;
+    auto quadrants = nodes[root].children;
+    reduceToDirectLevel(level, quadrants);
+    auto corner = cornerOf(level);
+    auto setAlive = [&](int64_t cellX, int64_t cellY) {
+      coords[0] = static_cast<size_t>(cellX - x);
+      coords[1] = static_cast<size_t>(cellY - y);
+      grid.setValue(coords, true);
+    };
+    for (size_t q = 0; q < 4; ++q) {
+      forEachLiveCell(quadrants[q], level - 1,
+                      q & 1 ? secondHalf(corner, level) : corner,
+                      q & 2 ? secondHalf(corner, level) : corner, x, y,
+                      shape[0], shape[1], setAlive);
+    }
+  }
+
+  const OuterTotalisticRule& getRule() const { return rule; }
+
+  // Changing the rule keeps the cells but forgets every memoized result.
+  void setRule(const OuterTotalisticRule& rule) {
+    if (rule.numStates != 2)
+      throw InvalidOperationException("HashLife only supports binary rules.");
+    if (rule.neighborhood != Neighborhood::MOORE || rule.radius != 1)
+      throw InvalidOperationException(
+          "HashLife only supports radius 1 Moore neighborhoods.");
+    if (std::find(rule.birth.begin(), rule.birth.end(), 0) != rule.birth.end())
+      throw InvalidOperationException("HashLife can't run B0 rules.");
+
+    // The next state of the center 2x2 of every 4x4 block, with bit
+    // y * 4 + x of the index holding cell (x, y) and bit y * 2 + x of the
+    // entry holding center cell (x + 1, y + 1).
+    auto lookup = rule.lookupTable(mooreNeighborhoodSize(2));
+    blockTable.assign(1 << 16, 0);
+    for (uint32_t block = 0; block < blockTable.size(); ++block) {
+      for (int y = 1; y < 3; ++y) {
+        for (int x = 1; x < 3; ++x) {
+          size_t count = 0;
+          for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+              if (dx != 0 || dy != 0) {
+                count += (block >> ((y + dy) * 4 + x + dx)) & 1;
+              }
+            }
+          }
+          auto state = (block >> (y * 4 + x)) & 1;
+          if (lookup[state * (mooreNeighborhoodSize(2) + 1) + count]) {
+            blockTable[block] |= 1 << ((y - 1) * 2 + x - 1);
+          }
+        }
+      }
+    }
+    for (auto& node : nodes) {
+      node.resultLog2 = NO_RESULT;
+    }
+    this->rule = rule;
+  }
+
+  size_t getMemoryLimit() const { return memoryLimit; }
+
+  // Once the node cache outgrows memoryLimit bytes, nodes that the current
+  // universe no longer uses are collected between steps, along with the
+  // results that point at them. Nodes are never collected in the middle of
+  // a step, so a single huge step may overshoot the limit.
+  void setMemoryLimit(size_t memoryLimit) { this->memoryLimit = memoryLimit; }
+
+  size_t getMemoryUsage() const {
+    return nodes.capacity() * sizeof(Node) +
+           hashTable.capacity() * sizeof(uint32_t);
+  }
+
+  size_t getNodeCount() const { return nodes.size(); }
+
+  // Drops every node the universe doesn't use. Results of the remaining
+  // nodes are kept when they point at nodes that are kept too. The empty
+  // node of every level is always kept, it is what lets traversals skip
+  // dead space.
+  void collectGarbage() {
+    std::vector<uint8_t> marked(nodes.size(), 0);
+    marked[DEAD] = marked[ALIVE] = 1;
+    std::vector<uint32_t> stack(emptyNodes.begin(), emptyNodes.end());
+    stack.push_back(root);
+    while (!stack.empty()) {
+      auto idx = stack.back();
+      stack.pop_back();
+      if (marked[idx]) continue;
+      marked[idx] = 1;
+      for (auto child : nodes[idx].children) {
+        stack.push_back(child);
+      }
+    }
+
+    // Children are always created before their parents, so compacting in
+    // order keeps them in front.
+    std::vector<uint32_t> newIdx(nodes.size(), 0);
+    uint32_t numKept = 0;
+    for (size_t idx = 0; idx < nodes.size(); ++idx) {
+      if (marked[idx]) {
+        newIdx[idx] = numKept++;
+      }
+    }
+
+    std::vector<Node> kept;
+    kept.reserve(numKept);
+    for (size_t idx = 0; idx < nodes.size(); ++idx) {
+      if (!marked[idx]) continue;
+      auto node = nodes[idx];
+      if (node.level > 0) {
+        for (auto& child : node.children) {
+          child = newIdx[child];
+        }
+        if (node.resultLog2 != NO_RESULT && marked[node.result]) {
+          node.result = newIdx[node.result];
+        } else {
+          node.resultLog2 = NO_RESULT;
+        }
+      }
+      kept.push_back(node);
+    }
+    nodes = std::move(kept);
+    root = newIdx[root];
+    for (auto& idx : emptyNodes) {
+      idx = newIdx[idx];
+    }
+
+    hashTable.assign(std::max<size_t>(1024, nextPowerOfTwo(nodes.size() * 2)),
+                     0);
+    hashTable.shrink_to_fit();
+    numHashed = 0;
+    for (uint32_t idx = 2; idx < nodes.size(); ++idx) {
+      insertHashed(idx);
+    }
+  }
+
+ private:
+  // Roots always have grandchildren of grandchildren, so their center can
+  // be checked for room to grow. Nodes up to DIRECT_LEVEL can be addressed
+  // with 64 bit coordinates.
+  static constexpr uint8_t MIN_ROOT_LEVEL = 3;
+  static constexpr uint8_t DIRECT_LEVEL = 64;
+
+  OuterTotalisticRule rule;
+  std::vector<uint8_t> blockTable;
+  std::vector<Node> nodes;
+  std::vector<uint32_t> hashTable;
+  size_t numHashed;
+  std::vector<uint32_t> emptyNodes;
+  uint32_t root;
+  size_t memoryLimit;
+  uint64_t generation;
+  unsigned stepLog2;
+
+  void stepPow2(uint8_t log2) {
+    // The root's result is its center half, so the pattern first has to fit
+    // well inside that. Keeping it in the center quarter of a root of level
+    // at least log2 + 3 leaves a margin of 2^log2 cells, as far as anything
+    // can travel in that time.
+    while (nodes[root].level < log2 + 3 ||
+           expand(expand(centeredSubSubnode(root))) != root) {
+      root = expand(root);
+    }
+    root = evolve(root, log2);
+    while (nodes[root].level > MIN_ROOT_LEVEL &&
+           expand(centeredSubnode(root)) == root) {
+      root = centeredSubnode(root);
+    }
+    generation += uint64_t(1) << log2;
+
+    if (getMemoryUsage() > memoryLimit) {
+      collectGarbage();
+    }
+  }
+
+  // The center half of a node after 2^log2 generations, for
+  // log2 <= level - 2. Nine overlapping half size nodes cover the node; the
+  // first pass evolves them into a 3x3 arrangement of quarter size nodes,
+  // and the second combines those into four half size nodes and evolves or
+  // just centers them, depending on whether the step uses the full
+  // 2^(level - 2) generations.
+  uint32_t evolve(uint32_t idx, uint8_t log2) {
+    if (nodes[idx].resultLog2 == log2) return nodes[idx].result;
+
+    auto level = nodes[idx].level;
+    uint32_t result;
+    if (level == 2) {
+      result = evolveBlock(idx);
+    } else {
+      auto c = nodes[idx].children;
+      auto nw = nodes[c[0]].children;
+      auto ne = nodes[c[1]].children;
+      auto sw = nodes[c[2]].children;
+      auto se = nodes[c[3]].children;
+      std::array<uint32_t, 9> parts{
+          c[0],
+          join(nw[1], ne[0], nw[3], ne[2]),
+          c[1],
+          join(nw[2], nw[3], sw[0], sw[1]),
+          join(nw[3], ne[2], sw[1], se[0]),
+          join(ne[2], ne[3], se[0], se[1]),
+          c[2],
+          join(sw[1], se[0], sw[3], se[2]),
+          c[3]};
+
+      auto fullSpeed = log2 + 2 == level;
+      auto innerLog2 = fullSpeed ? uint8_t(log2 - 1) : log2;
+      for (auto& part : parts) {
+        part = evolve(part, innerLog2);
+      }
+
+      std::array<uint32_t, 4> quadrants;
+      for (size_t q = 0; q < 4; ++q) {
+        auto i = q / 2 * 3 + q % 2;
+        auto combined =
+            join(parts[i], parts[i + 1], parts[i + 3], parts[i + 4]);
+        quadrants[q] = fullSpeed ? evolve(combined, innerLog2)
+                                 : centeredSubnode(combined);
+      }
+      result = join(quadrants[0], quadrants[1], quadrants[2], quadrants[3]);
+    }
+
+    nodes[idx].result = result;
+    nodes[idx].resultLog2 = log2;
+    return result;
+  }
+
+  // Base case: one generation of a 4x4 block.
+  uint32_t evolveBlock(uint32_t idx) {
+    uint32_t block = 0;
+    for (size_t q = 0; q < 4; ++q) {
+      auto quadrant = nodes[nodes[idx].children[q]].children;
+      for (size_t cell = 0; cell < 4; ++cell) {
+        auto x = q % 2 * 2 + cell % 2;
+        auto y = q / 2 * 2 + cell / 2;
+        block |= quadrant[cell] << (y * 4 + x);
+      }
+    }
+    auto next = blockTable[block];
+    return join(next & 1, next >> 1 & 1, next >> 2 & 1, next >> 3 & 1);
+  }
+
+  uint32_t centeredSubnode(uint32_t idx) {
+    auto c = nodes[idx].children;
+    return join(nodes[c[0]].children[3], nodes[c[1]].children[2],
+                nodes[c[2]].children[1], nodes[c[3]].children[0]);
+  }
+
+  uint32_t centeredSubSubnode(uint32_t idx) {
+    auto c = nodes[idx].children;
+    auto grandchild = [&](size_t q) {
+      return nodes[nodes[c[q]].children[3 - q]].children[3 - q];
+    };
+    return join(grandchild(0), grandchild(1), grandchild(2), grandchild(3));
+  }
+
+  // A node of the next level up with this one in its center.
+  uint32_t expand(uint32_t idx) {
+    auto level = nodes[idx].level;
+    auto c = nodes[idx].children;
+    auto e = empty(level - 1);
+    return join(join(e, e, e, c[0]), join(e, e, c[1], e),
+                join(e, c[2], e, e), join(c[3], e, e, e));
+  }
+
+  uint32_t empty(uint8_t level) {
+    while (emptyNodes.size() <= level) {
+      auto e = emptyNodes.empty() ? DEAD : emptyNodes.back();
+      emptyNodes.push_back(emptyNodes.empty() ? DEAD : join(e, e, e, e));
+    }
+    return emptyNodes[level];
+  }
+
+  // The unique node with the given children.
+  uint32_t join(uint32_t nw, uint32_t ne, uint32_t sw, uint32_t se) {
+    std::array<uint32_t, 4> children{nw, ne, sw, se};
+    auto mask = hashTable.size() - 1;
+    for (auto slot = hash(children) & mask;; slot = (slot + 1) & mask) {
+      auto idx = hashTable[slot];
+      if (idx == 0) break;
+      if (nodes[idx].children == children) return idx;
+    }
+
+    uint8_t level = nodes[nw].level + 1;
+    nodes.push_back(Node{children, 0, level, NO_RESULT});
+    uint32_t idx = nodes.size() - 1;
+    if ((numHashed + 1) * 2 > hashTable.size()) {
+      hashTable.assign(hashTable.size() * 2, 0);
+      numHashed = 0;
+      for (uint32_t i = 2; i < idx; ++i) {
+        insertHashed(i);
+      }
+    }
+    insertHashed(idx);
+    return idx;
+  }
+
+  void insertHashed(uint32_t idx) {
+    auto mask = hashTable.size() - 1;
+    auto slot = hash(nodes[idx].children) & mask;
+    while (hashTable[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    hashTable[slot] = idx;
+    ++numHashed;
+  }
+
+  static size_t hash(const std::array<uint32_t, 4>& children) {
+    uint64_t h = children[0];
+    for (size_t i = 1; i < 4; ++i) {
+      h = (h ^ children[i]) * 0x9E3779B97F4A7C15ull;
+      h ^= h >> 29;
+    }
+    return static_cast<size_t>(h);
+  }
+
+  static size_t nextPowerOfTwo(size_t n) {
+    size_t result = 1;
+    while (result < n) {
+      result *= 2;
+    }
+    return result;
+  }
+
+  uint32_t setCell(uint32_t idx, int64_t x, int64_t y, bool val) {
+    auto level = nodes[idx].level;
+    if (level == 0) return val ? ALIVE : DEAD;
+
+    auto c = nodes[idx].children;
+    if (level > DIRECT_LEVEL) {
+      // The cell lies in the center, which shares this node's origin.
+      auto center = nodes[setCell(centeredSubnode(idx), x, y, val)].children;
+      auto child = [&](size_t q) { return nodes[c[q]].children; };
+      auto nw = child(0), ne = child(1), sw = child(2), se = child(3);
+      return join(join(nw[0], nw[1], nw[2], center[0]),
+                  join(ne[0], ne[1], center[1], ne[3]),
+                  join(sw[0], center[2], sw[2], sw[3]),
+                  join(center[3], se[1], se[2], se[3]));
+    }
+
+    auto q = quadrantOf(x, y);
+    moveToChild(level - 1, x, y);
+    c[q] = setCell(c[q], x, y, val);
+    return join(c[0], c[1], c[2], c[3]);
+  }
+
+  // Builds a node of the given level with its top left cell at (left, top)
+  // from cell(x, y), skipping the parts outside the w x h window at
+  // (windowX, windowY).
+  template <typename F>
+  uint32_t build(uint8_t level, int64_t left, int64_t top, F&& cell,
+                 int64_t windowX, int64_t windowY, size_t w, size_t h) {
+    if (!overlaps(left, level, windowX, w) || !overlaps(top, level, windowY, h))
+      return empty(level);
+    if (level == 0) return cell(left, top) ? ALIVE : DEAD;
+
+    std::array<uint32_t, 4> children;
+    for (size_t q = 0; q < 4; ++q) {
+      children[q] = build(level - 1, q & 1 ? secondHalf(left, level) : left,
+                          q & 2 ? secondHalf(top, level) : top, cell, windowX,
+                          windowY, w, h);
+    }
+    return join(children[0], children[1], children[2], children[3]);
+  }
+
+  // Calls f(x, y) for every live cell of a node with its top left cell at
+  // (left, top) that lies in the w x h window at (windowX, windowY).
+  template <typename F>
+  void forEachLiveCell(uint32_t idx, uint8_t level, int64_t left, int64_t top,
+                       int64_t windowX, int64_t windowY, size_t w, size_t h,
+                       F&& f) const {
+    if (idx == DEAD || (level > 0 && isEmpty(idx))) return;
+    if (!overlaps(left, level, windowX, w) || !overlaps(top, level, windowY, h))
+      return;
+    if (level == 0) {
+      f(left, top);
+      return;
+    }
+
+    for (size_t q = 0; q < 4; ++q) {
+      forEachLiveCell(nodes[idx].children[q], level - 1,
+                      q & 1 ? secondHalf(left, level) : left,
+                      q & 2 ? secondHalf(top, level) : top, windowX, windowY,
+                      w, h, f);
+    }
+  }
+
+  bool isEmpty(uint32_t idx) const {
+    auto level = nodes[idx].level;
+    return level < emptyNodes.size() ? emptyNodes[level] == idx : false;
+  }
+
+  // Whether [start, start + 2^level) overlaps [windowStart, windowStart + w).
+  static bool overlaps(int64_t start, uint8_t level, int64_t windowStart,
+                       size_t w) {
+    if (w == 0) return false;
+    if (level >= DIRECT_LEVEL) return true;
+    auto last = start + int64_t((uint64_t(1) << level) - 1);
+    auto windowLast = windowStart + int64_t(w - 1);
+    return start <= windowLast && windowStart <= last;
+  }
+
+  // Replaces the quadrants of a node above DIRECT_LEVEL by those of its
+  // center, which covers every 64 bit coordinate.
+  void reduceToDirectLevel(uint8_t& level,
+                           std::array<uint32_t, 4>& quadrants) const {
+    for (; level > DIRECT_LEVEL; --level) {
+      for (size_t q = 0; q < 4; ++q) {
+        quadrants[q] = nodes[quadrants[q]].children[3 - q];
+      }
+    }
+  }
+
+  // Whether a coordinate falls in a node of the given level centered on the
+  // origin.
+  static bool inRange(uint8_t level, int64_t x) {
+    if (level >= DIRECT_LEVEL) return true;
+    auto half = int64_t(1) << (level - 1);
+    return x >= -half && x < half;
+  }
+
+  // Top left coordinate of a node of the given level centered on the origin.
+  static int64_t cornerOf(uint8_t level) {
+    return level >= DIRECT_LEVEL ? INT64_MIN : -(int64_t(1) << (level - 1));
+  }
+
+  // Coordinate where the second half of a node of the given level starts.
+  // Computed unsigned, since it is 0 for a DIRECT_LEVEL node at INT64_MIN.
+  static int64_t secondHalf(int64_t start, uint8_t level) {
+    return static_cast<int64_t>(static_cast<uint64_t>(start) +
+                                (uint64_t(1) << (level - 1)));
+  }
+
+  static size_t quadrantOf(int64_t x, int64_t y) {
+    return (x >= 0 ? 1 : 0) + (y >= 0 ? 2 : 0);
+  }
+
+  // Makes coordinates relative to the center of a node relative to the
+  // center of its child of the given level that holds them. Level 0
+  // children are single cells and keep them as they are.
+  static void moveToChild(uint8_t childLevel, int64_t& x, int64_t& y) {
+    if (childLevel == 0) return;
+    auto half = int64_t(1) << (childLevel - 1);
+    x += x < 0 ? half : -half;
+    y += y < 0 ? half : -half;
   }
 };
 
-}  // namespace methuselah
\ No newline at end of file
+}  // namespace methuselah
@@ -0,0 +1,167 @@
+// Exports the Game of Life headless and reports how much each encoder slows
+// the simulation down, as JSON.
+//
+// Usage: ExportBench [--size=N] [--frames=N] [--workers=N] [--threads=N]
+//                    [--out=PREFIX]
+//
+// Steps a size x size BitGrid (default 2048) for --frames generations
+// (default 30), first on its own and then rendering every generation with
+// a HeadlessColorRenderer into a Y4M stream at PREFIX.y4m and into PNG
+// files from PREFIX000000.png on. PREFIX defaults to "exportBench", and
+// the files are removed once timed. --workers sets the number of workers
+// colorizing and encoding frames, one per hardware thread by default, and
+// --threads the number of threads render() copies rows on, 1 by default.
+// renderMsPerFrame is the time render() takes on the simulation thread.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "headlessRenderer.h"
+#include "methuselah.h"
+
+using methuselah::BitGrid;
+using methuselah::FrameEncoder;
+using methuselah::HeadlessColorRenderer;
+using methuselah::OuterTotalisticRule;
+using methuselah::PngSequenceEncoder;
+using methuselah::Wrapping;
+using methuselah::Y4mEncoder;
+
+namespace {
+
+const auto LIFE = OuterTotalisticRule::fromString("B3/S23");
+
+struct Options {
+  size_t size = 2048;
+  size_t frames = 30;
+  size_t workers = 0;
+  size_t threads = 1;
+  std::string out = "exportBench";
+};
+
+struct Result {
+  std::string encoder;
+  size_t frames;
+  double seconds;
+  double renderSeconds;
+};
+
+std::tuple<uint8_t, uint8_t, uint8_t, uint8_t> colorize(const bool& alive) {
+  if (alive) {
+    return {255, 255, 255, 255};
+  } else {
+    return {0, 0, 0, 255};
+  }
+}
+
+// Steps a random soup options.frames times, rendering every generation
+// into the encoder makeEncoder returns, or into nothing if it's null.
+Result run(const std::string& name, const Options& options,
+           const std::function<std::shared_ptr<FrameEncoder>()>& makeEncoder) {
+  auto grid = std::make_shared<BitGrid>(
+      std::vector<size_t>{options.size, options.size}, Wrapping::TOROIDAL,
+      LIFE);
+  std::mt19937 rng(1);
+  std::vector<size_t> coord{0, 0};
+  for (coord[1] = 0; coord[1] < options.size; ++coord[1]) {
+    for (coord[0] = 0; coord[0] < options.size; ++coord[0]) {
+      grid->setValue(coord, rng() % 2 == 0);
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> rendering{};
+  {
+    std::unique_ptr<HeadlessColorRenderer<bool, BitGrid>> renderer;
+    if (auto encoder = makeEncoder()) {
+      renderer.reset(new HeadlessColorRenderer<bool, BitGrid>(
+          grid, colorize, encoder, options.workers));
+      renderer->setNumThreads(options.threads);
+    }
+    for (size_t frame = 0; frame < options.frames; ++frame) {
+      if (renderer) {
+        auto renderStart = std::chrono::steady_clock::now();
+        renderer->render();
+        rendering += std::chrono::steady_clock::now() - renderStart;
+      }
+      grid->update();
+    }
+    if (renderer) renderer->flush();
+  }
+  auto seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  return {name, options.frames, seconds, rendering.count()};
+}
+
+void printJson(const std::vector<Result>& results, const Options& options) {
+  std::printf("{\n  \"benchmarks\": [");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& result = results[i];
+    std::printf(i ? ",\n" : "\n");
+    std::printf("    {\"encoder\": \"%s\", \"shape\": [%zu, %zu], ",
+                result.encoder.c_str(), options.size, options.size);
+    std::printf("\"workers\": %zu, \"threads\": %zu, ", options.workers,
+                options.threads);
+    std::printf("\"frames\": %zu, \"seconds\": %.6f, ", result.frames,
+                result.seconds);
+    std::printf("\"msPerFrame\": %.6g, \"renderMsPerFrame\": %.6g}",
+                result.seconds * 1e3 / result.frames,
+                result.renderSeconds * 1e3 / result.frames);
+  }
+  std::printf("\n  ]\n}\n");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  for (auto i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 7, "--size=") == 0) {
+      options.size = std::stoul(arg.substr(7));
+    } else if (arg.compare(0, 9, "--frames=") == 0) {
+      options.frames = std::stoul(arg.substr(9));
+    } else if (arg.compare(0, 10, "--workers=") == 0) {
+      options.workers = std::stoul(arg.substr(10));
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      options.threads = std::stoul(arg.substr(10));
+    } else if (arg.compare(0, 6, "--out=") == 0) {
+      options.out = arg.substr(6);
+    } else {
+      std::fprintf(stderr,
+                   "Usage: %s [--size=N] [--frames=N] [--workers=N] "
+                   "[--threads=N] [--out=PREFIX]\n",
+                   argv[0]);
+      return 1;
+    }
+  }
+  if (options.workers == 0) {
+    options.workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<Result> results;
+  results.push_back(run("none", options, []() { return nullptr; }));
+
+  auto videoPath = options.out + ".y4m";
+  results.push_back(run("y4m", options, [&]() {
+    return std::make_shared<Y4mEncoder>(videoPath);
+  }));
+  std::remove(videoPath.c_str());
+
+  auto png = std::make_shared<PngSequenceEncoder>(options.out);
+  results.push_back(run("png", options, [&]() { return png; }));
+  for (size_t frame = 0; frame < options.frames; ++frame) {
+    std::remove(png->getPath(frame).c_str());
+  }
+
+  printJson(results, options);
+}
@@ -0,0 +1,198 @@
+// Compares the cache behaviour of Grid layouts on a 3D Life-like rule.
+//
+// Usage: LayoutBench [size] [generations] [brickSize]
+//
+// The layouts take turns, one generation each, so changes in clock speed
+// or load on the machine affect them alike. Cache misses are read through
+// perf_event_open on Linux. Where hardware counters aren't available, as
+// on most virtual machines, the miss columns read n/a and only the times
+// are compared. The build keeps loops and branches off 32-byte boundaries,
+// since on some Intel cores where the update loop lands decides which
+// layout wins.
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "methuselah.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using methuselah::Grid;
+using methuselah::Layout;
+using methuselah::StencilView;
+
+namespace {
+
+struct Life3D {
+  static constexpr size_t numNeighbors = methuselah::mooreNeighborhoodSize(3);
+  void operator()(uint8_t& cell,
+                  const StencilView<uint8_t, numNeighbors>& neighbors) const {
+    auto count = 0;
+    for (auto neighbor : neighbors) {
+      count += neighbor;
+    }
+    cell = cell ? (count == 5 || count == 7) : count == 6;
+  }
+};
+
+// A hardware cache event counter, or a no-op where there is none.
+class CacheCounter {
+ public:
+  CacheCounter(uint32_t type, uint64_t config) : fd(-1) {
+#ifdef __linux__
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+  }
+
+  ~CacheCounter() {
+#ifdef __linux__
+    if (fd >= 0) close(fd);
+#endif
+  }
+
+  bool isAvailable() const { return fd >= 0; }
+
+  void start() {
+#ifdef __linux__
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+
+  uint64_t stop() {
+    uint64_t count = 0;
+#ifdef __linux__
+    if (fd < 0) return 0;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+#endif
+    return count;
+  }
+
+ private:
+  int fd;
+};
+
+#ifdef __linux__
+constexpr uint64_t L1D_READ_MISS = PERF_COUNT_HW_CACHE_L1D |
+                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+#endif
+
+// A grid in one of the layouts, with what its generations took so far.
+struct LayoutRun {
+  LayoutRun(const char* name, Layout layout, size_t size, size_t brickSize)
+      : name(name),
+        grid({size, size, size}, methuselah::TOROIDAL, methuselah::MOORE,
+             nullptr),
+#ifdef __linux__
+        l1Misses(PERF_TYPE_HW_CACHE, L1D_READ_MISS),
+        llcMisses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+#else
+        l1Misses(0, 0),
+        llcMisses(0, 0),
+#endif
+        seconds(0),
+        l1(0),
+        llc(0) {
+    grid.setLayout(layout, brickSize);
+  }
+
+  const char* name;
+  Grid<uint8_t> grid;
+  CacheCounter l1Misses;
+  CacheCounter llcMisses;
+  double seconds;
+  uint64_t l1;
+  uint64_t llc;
+};
+
+void fillRandomly(Grid<uint8_t>& grid, size_t size) {
+  std::mt19937 rng(1);
+  std::vector<size_t> coords(3);
+  for (coords[2] = 0; coords[2] < size; ++coords[2]) {
+    for (coords[1] = 0; coords[1] < size; ++coords[1]) {
+      for (coords[0] = 0; coords[0] < size; ++coords[0]) {
+        grid.setValue(coords, rng() % 4 == 0);
+      }
+    }
+  }
+}
+
+void step(LayoutRun& run) {
+  run.l1Misses.start();
+  run.llcMisses.start();
+  auto start = std::chrono::steady_clock::now();
+  run.grid.update<Life3D>();
+  run.seconds += std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  run.l1 += run.l1Misses.stop();
+  run.llc += run.llcMisses.stop();
+}
+
+void report(const LayoutRun& run, size_t generations) {
+  auto cells = static_cast<double>(run.grid.getSize()) * generations;
+  std::printf("%-10s %10.2f", run.name, run.seconds * 1e9 / cells);
+  if (run.l1Misses.isAvailable()) {
+    std::printf(" %14.4f", run.l1 / cells);
+  } else {
+    std::printf(" %14s", "n/a");
+  }
+  if (run.llcMisses.isAvailable()) {
+    std::printf(" %14.4f", run.llc / cells);
+  } else {
+    std::printf(" %14s", "n/a");
+  }
+  std::printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  size_t size = argc > 1 ? std::stoul(argv[1]) : 256;
+  size_t generations = argc > 2 ? std::stoul(argv[2]) : 4;
+  size_t brickSize = argc > 3 ? std::stoul(argv[3]) : 16;
+
+  std::printf("%zu^3 cells, %zu generations, %zu^3 bricks\n", size,
+              generations, brickSize);
+  std::printf("%-10s %10s %14s %14s\n", "layout", "ns/cell", "L1D miss/cell",
+              "LLC miss/cell");
+  std::vector<std::unique_ptr<LayoutRun>> runs;
+  runs.emplace_back(new LayoutRun("row-major", methuselah::ROW_MAJOR, size,
+                                  brickSize));
+  runs.emplace_back(
+      new LayoutRun("blocked", methuselah::BLOCKED, size, brickSize));
+  runs.emplace_back(
+      new LayoutRun("morton", methuselah::MORTON, size, brickSize));
+  for (auto& run : runs) {
+    fillRandomly(run->grid, size);
+    run->grid.update<Life3D>();
+  }
+
+  for (size_t i = 0; i < generations; ++i) {
+    for (auto& run : runs) {
+      step(*run);
+    }
+  }
+  for (const auto& run : runs) {
+    report(*run, generations);
+  }
+}
@@ -0,0 +1,355 @@
+// Runs every example rule headless and reports throughput as JSON.
+//
+// Usage: MethuselahBench [--quick] [--min-time=SECONDS] [--threads=N]
+//
+// Each rule is swept over grid sizes, wrapping modes and thread counts (1 up
+// to the hardware concurrency in powers of two, or just N). Every run is
+// repeated until it has taken at least --min-time seconds (default 0.5) and
+// reports cell updates per second, nanoseconds per cell update and the peak
+// resident set size while it ran. --quick only runs the smallest size.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fluidFlowRule.h"
+#include "methuselah.h"
+#include "sandpileRule.h"
+
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
+
+using methuselah::BitGrid;
+using methuselah::Convolution;
+using methuselah::Grid;
+using methuselah::LeniaGrowth;
+using methuselah::OuterTotalisticRule;
+using methuselah::RuleTable;
+using methuselah::Wrapping;
+
+namespace {
+
+// Same rulestrings as the GameOfLife and GameOfLife3D examples.
+const auto LIFE = OuterTotalisticRule::fromString("B3/S23");
+const auto LIFE_3D = OuterTotalisticRule::fromString("B6/S57");
+
+struct Options {
+  bool quick = false;
+  double minSeconds = 0.5;
+  size_t threads = 0;
+};
+
+struct Result {
+  std::string rule;
+  std::string engine;
+  std::vector<size_t> shape;
+  Wrapping wrapping;
+  size_t threads;
+  size_t generations;
+  double seconds;
+  size_t peakRssKiB;
+};
+
+// Peak RSS
+// ========--------------------------------------------------------------------
+// Linux can reset the high water mark through /proc/self/clear_refs, which
+// gives a peak per run. Elsewhere getrusage only has the peak of the whole
+// process so far.
+void resetPeakRss() {
+#ifdef __linux__
+  std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+size_t getPeakRssKiB() {
+#ifdef __linux__
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::stoul(line.substr(6));
+    }
+  }
+#endif
+#ifdef __unix__
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#else
+  return 0;
+#endif
+}
+
+// Runs
+// ====------------------------------------------------------------------------
+
+// Calls f with every coordinate in shape, first dimension fastest.
+template <typename F>
+void forEachCoordinate(const std::vector<size_t>& shape, F&& f) {
+  std::vector<size_t> coord(shape.size(), 0);
+  while (true) {
+    f(coord);
+    size_t i = 0;
+    for (; i < shape.size(); ++i) {
+      if (++coord[i] < shape[i]) break;
+      coord[i] = 0;
+    }
+    if (i == shape.size()) return;
+  }
+}
+
+// Builds a grid with makeGrid, fills it through setValue with randomCell and
+// steps it until minSeconds have passed. One untimed warm-up generation
+// comes first.
+template <typename MakeGrid, typename RandomCell, typename Step>
+Result run(const std::string& rule, const std::string& engine,
+           const std::vector<size_t>& shape, Wrapping wrapping,
+           size_t threads, const Options& options, MakeGrid&& makeGrid,
+           RandomCell&& randomCell, Step&& step) {
+  resetPeakRss();
+  auto grid = makeGrid();
+  grid->setNumThreads(threads);
+
+  std::mt19937 rng(1);
+  forEachCoordinate(shape, [&](const std::vector<size_t>& coord) {
+    grid->setValue(coord, randomCell(rng));
+  });
+  step(*grid);
+
+  size_t generations = 0;
+  double seconds = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (generations < 3 || seconds < options.minSeconds) {
+    step(*grid);
+    ++generations;
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+  }
+
+  return {rule,    engine,      shape,  wrapping,
+          threads, generations, seconds, getPeakRssKiB()};
+}
+
+template <typename F>
+void forEachSweep(const std::vector<size_t>& sizes, size_t numDimensions,
+                  const std::vector<size_t>& threadCounts, F&& f) {
+  for (auto size : sizes) {
+    for (auto wrapping : {Wrapping::BOUNDED, Wrapping::TOROIDAL}) {
+      for (auto threads : threadCounts) {
+        f(std::vector<size_t>(numDimensions, size), wrapping, threads);
+      }
+    }
+  }
+}
+
+void runLife(const std::string& rule, const OuterTotalisticRule& life,
+             const std::vector<size_t>& sizes, size_t numDimensions,
+             const std::vector<size_t>& threadCounts, const Options& options,
+             std::vector<Result>& results) {
+  auto randomBit = [](std::mt19937& rng) { return rng() % 2 == 0; };
+  forEachSweep(sizes, numDimensions, threadCounts,
+               [&](const std::vector<size_t>& shape, Wrapping wrapping,
+                   size_t threads) {
+                 results.push_back(run(
+                     rule, "BitGrid", shape, wrapping, threads, options,
+                     [&]() {
+                       return std::make_unique<BitGrid>(shape, wrapping, life);
+                     },
+                     randomBit, [](BitGrid& grid) { grid.update(); }));
+                 results.push_back(run(
+                     rule, "Grid", shape, wrapping, threads, options,
+                     [&]() {
+                       return std::make_unique<Grid<uint8_t>>(
+                           shape, wrapping, methuselah::MOORE, nullptr);
+                     },
+                     [](std::mt19937& rng) -> uint8_t { return rng() % 2; },
+                     [&](Grid<uint8_t>& grid) { grid.update(life); }));
+               });
+}
+
+void runFluidFlow(const std::vector<size_t>& sizes,
+                  const std::vector<size_t>& threadCounts,
+                  const Options& options, std::vector<Result>& results) {
+  using fluidFlow::Cell;
+  forEachSweep(
+      sizes, 2, threadCounts,
+      [&](const std::vector<size_t>& shape, Wrapping wrapping,
+          size_t threads) {
+        results.push_back(run(
+            "fluidFlow", "Grid", shape, wrapping, threads, options,
+            [&]() {
+              return std::make_unique<Grid<Cell>>(
+                  shape, wrapping, methuselah::MOORE, nullptr, Cell{0, false});
+            },
+            [](std::mt19937& rng) {
+              return Cell{static_cast<uint8_t>(rng() % fluidFlow::WATER_MAX),
+                          true};
+            },
+            [](Grid<Cell>& grid) { grid.update<fluidFlow::Update>(); }));
+      });
+}
+
+void runSandpile(const std::vector<size_t>& sizes,
+                 const std::vector<size_t>& threadCounts,
+                 const Options& options, std::vector<Result>& results) {
+  using sandpile::Cell;
+  forEachSweep(
+      sizes, 2, threadCounts,
+      [&](const std::vector<size_t>& shape, Wrapping wrapping,
+          size_t threads) {
+        results.push_back(run(
+            "sandpile", "Grid", shape, wrapping, threads, options,
+            [&]() {
+              return std::make_unique<Grid<Cell>>(shape, wrapping,
+                                                  methuselah::MOORE, nullptr,
+                                                  Cell{false, false});
+            },
+            [](std::mt19937& rng) { return Cell{rng() % 4 == 0, true}; },
+            [](Grid<Cell>& grid) { grid.update<sandpile::Update>(); }));
+
+        auto table = RuleTable<Cell>::get<sandpile::Update>(sandpile::STATES);
+        results.push_back(run(
+            "sandpile", "RuleTable", shape, wrapping, threads, options,
+            [&]() {
+              return std::make_unique<Grid<Cell>>(shape, wrapping,
+                                                  methuselah::MOORE, nullptr,
+                                                  Cell{false, false});
+            },
+            [](std::mt19937& rng) { return Cell{rng() % 4 == 0, true}; },
+            [&](Grid<Cell>& grid) { grid.update(*table); }));
+
+        results.push_back(run(
+            "sandpile", "Blocks", shape, wrapping, threads, options,
+            [&]() {
+              auto grid = std::make_unique<Grid<Cell>>(
+                  shape, wrapping, methuselah::MOORE, nullptr,
+                  Cell{false, false});
+              grid->setUpdateMode(methuselah::UpdateMode::IN_PLACE);
+              return grid;
+            },
+            [](std::mt19937& rng) { return Cell{rng() % 4 == 0, true}; },
+            [](Grid<Cell>& grid) {
+              grid.updateBlocks<sandpile::BlockUpdate>();
+            }));
+      });
+}
+
+// Lenia with the Orbium kernel and growth. Convolutions wrap around, so
+// only toroidal grids run.
+void runLenia(const std::vector<size_t>& sizes, size_t numDimensions,
+              const std::vector<size_t>& threadCounts, const Options& options,
+              std::vector<Result>& results) {
+  const size_t radius = 13;
+  auto kernel = Convolution<float>::leniaKernel(numDimensions, radius);
+  for (auto size : sizes) {
+    std::vector<size_t> shape(numDimensions, size);
+    Convolution<float> convolution(shape, radius, kernel);
+    for (auto threads : threadCounts) {
+      results.push_back(run(
+          numDimensions == 2 ? "lenia" : "lenia3D", "Convolution", shape,
+          Wrapping::TOROIDAL, threads, options,
+          [&]() {
+            return std::make_unique<Grid<float>>(
+                shape, Wrapping::TOROIDAL, methuselah::MOORE, nullptr, 0.0f);
+          },
+          [](std::mt19937& rng) {
+            return std::uniform_real_distribution<float>(0, 1)(rng);
+          },
+          [&](Grid<float>& grid) {
+            grid.update(convolution, LeniaGrowth<float>());
+          }));
+    }
+  }
+}
+
+// Output
+// ======----------------------------------------------------------------------
+void printJson(const std::vector<Result>& results) {
+  std::printf("{\n  \"benchmarks\": [");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& result = results[i];
+    size_t numCells = 1;
+    std::string shape;
+    for (auto extent : result.shape) {
+      numCells *= extent;
+      shape += (shape.empty() ? "" : ", ") + std::to_string(extent);
+    }
+    auto cellUpdates = static_cast<double>(numCells) * result.generations;
+
+    std::printf(i ? ",\n" : "\n");
+    std::printf("    {\"rule\": \"%s\", \"engine\": \"%s\", ",
+                result.rule.c_str(), result.engine.c_str());
+    std::printf("\"dimensions\": %zu, \"shape\": [%s], \"wrapping\": \"%s\", ",
+                result.shape.size(), shape.c_str(),
+                result.wrapping == Wrapping::TOROIDAL ? "toroidal"
+                                                      : "bounded");
+    std::printf("\"threads\": %zu, \"generations\": %zu, \"seconds\": %.6f, ",
+                result.threads, result.generations, result.seconds);
+    std::printf("\"cellUpdatesPerSecond\": %.6g, \"nsPerCell\": %.6g, ",
+                cellUpdates / result.seconds,
+                result.seconds * 1e9 / cellUpdates);
+    std::printf("\"peakRssKiB\": %zu}", result.peakRssKiB);
+  }
+  std::printf("\n  ]\n}\n");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  for (auto i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--quick") {
+      options.quick = true;
+    } else if (arg.compare(0, 11, "--min-time=") == 0) {
+      options.minSeconds = std::stod(arg.substr(11));
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      options.threads = std::stoul(arg.substr(10));
+    } else {
+      std::fprintf(stderr,
+                   "Usage: %s [--quick] [--min-time=SECONDS] [--threads=N]\n",
+                   argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<size_t> threadCounts;
+  if (options.threads) {
+    threadCounts.push_back(options.threads);
+  } else {
+    size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t threads = 1; threads < maxThreads; threads *= 2) {
+      threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+  }
+
+  std::vector<size_t> sizes2D{256, 1024, 4096};
+  std::vector<size_t> sizes3D{32, 64, 128};
+  if (options.quick) {
+    sizes2D.resize(1);
+    sizes3D.resize(1);
+  }
+
+  std::vector<Result> results;
+  runLife("gameOfLife", LIFE, sizes2D, 2, threadCounts, options, results);
+  runLife("gameOfLife3D", LIFE_3D, sizes3D, 3, threadCounts, options,
+          results);
+  runFluidFlow(sizes2D, threadCounts, options, results);
+  runSandpile(sizes2D, threadCounts, options, results);
+  runLenia(sizes2D, 2, threadCounts, options, results);
+  runLenia(sizes3D, 3, threadCounts, options, results);
+  printJson(results);
+}
@@ -4,22 +4,28 @@
 #include <time.h>
 
 #include <algorithm>
+#include <iostream>
 
 #include "color.h"
 #include "eventHandler.h"
+#include "fluidFlowRule.h"
 #include "gridRenderer.h"
 #include "methuselah.h"
+#include "simulationRunner.h"
 
 using methuselah::EventHandler;
+using methuselah::FrameView;
 using methuselah::Grid;
 using methuselah::Neighborhood;
 using methuselah::Ortho2DColorRenderer;
+using methuselah::SimulationRunner;
 using methuselah::Wrapping;
 
 constexpr unsigned int CELL_SIZE = 20;
 
 constexpr bool USE_DELAY = true;
 constexpr unsigned int DELAY = 100;
+constexpr unsigned int FRAME_DELAY = 16;
 
 constexpr unsigned short int GRID_WIDTH = 30;
 constexpr unsigned short int GRID_HEIGHT = 30;
@@ -27,7 +33,7 @@ constexpr unsigned short int GRID_HEIGHT = 30;
 constexpr unsigned short int WINDOW_WIDTH = GRID_WIDTH * CELL_SIZE;
 constexpr unsigned short int WINDOW_HEIGHT = GRID_HEIGHT * CELL_SIZE;
 
-constexpr uint8_t WATER_MAX = 7;
+using fluidFlow::WATER_MAX;
 
 // Helper Functions
 // ================
@@ -49,29 +55,8 @@ double cosineSimilarity(std::vector<double> vectorA,
 
 // Fluid Flow
 // ==========
-constexpr uint8_t NUM_NEIGHBORS = 8;
-
-struct Cell {
-  uint8_t water;
-  bool passable;
-};
-
-void update(Cell* cell, std::vector<Cell*> neighbors) {
-  auto sum = 0;
-  if (cell->passable) {
-    for (auto i = 0; i < 8 && cell->water < WATER_MAX; ++i) {
-      if (neighbors[i]->passable && neighbors[i]->water > cell->water) {
-        ++sum;
-      }
-    }
-
-    if (sum && cell->water < WATER_MAX) {
-      ++cell->water;
-    } else if (!sum && cell->water) {
-      --cell->water;
-    }
-  }
-}
+using fluidFlow::Cell;
+using fluidFlow::Update;
 
 Color colorize(const Cell& cell) {
   // return gradient(cell.water / (double)(WATER_MAX));
@@ -111,40 +96,54 @@ int main() {
         std::shared_ptr<Grid<Cell>>(new Grid<Cell>{{GRID_WIDTH, GRID_HEIGHT},
                                                    Wrapping::TOROIDAL,
                                                    Neighborhood::MOORE,
-                                                   update,
+                                                   nullptr,
                                                    Cell{0, false}});
     randomize(*grid);
+    grid->setFieldReduction([](const Cell& cell) { return cell.water; });
 
-    Ortho2DColorRenderer<Cell> renderer{grid,      colorize,     CELL_SIZE,
-                                        CELL_SIZE, WINDOW_WIDTH, WINDOW_HEIGHT};
+    SimulationRunner<Cell> runner{
+        grid, [](Grid<Cell>& grid) { grid.update<Update>(); },
+        USE_DELAY ? 1000.0 / DELAY : 0, true};
+
+    Ortho2DColorRenderer<Cell, FrameView<Cell>> renderer{
+        runner.getView(), colorize,     CELL_SIZE,
+        CELL_SIZE,        WINDOW_WIDTH, WINDOW_HEIGHT};
     EventHandler eventHandler;
-    eventHandler.registerKeyDownAction(SDLK_r, [&]() { randomize(*grid); });
+    eventHandler.registerKeyDownAction(SDLK_r, [&]() {
+      runner.post([](Grid<Cell>& grid) { randomize(grid); });
+    });
+
+    eventHandler.registerKeyDownAction(
+        SDLK_p, [&]() { runner.setPaused(!runner.getPaused()); });
 
-    auto paused = true;
-    eventHandler.registerKeyDownAction(SDLK_p, [&]() { paused ^= true; });
+    eventHandler.registerKeyDownAction(SDLK_SPACE,
+                                       [&]() { runner.stepOnce(); });
 
-    auto oneStep = false;
-    eventHandler.registerKeyDownAction(SDLK_SPACE, [&]() { oneStep = true; });
+    eventHandler.registerKeyDownAction(SDLK_s, [&]() {
+      runner.post([](Grid<Cell>& grid) {
+        auto& statistics = grid.getStatistics();
+        std::cout << "generation " << statistics.generation << ": water "
+                  << statistics.fieldSum << ", " << statistics.fieldMin
+                  << " to " << statistics.fieldMax << " per cell\n";
+      });
+    });
 
     eventHandler.registerMouseClickAction([&](int32_t x, int32_t y) {
       size_t cellX = x / CELL_SIZE;
       size_t cellY = y / CELL_SIZE;
-      bool passable = grid->getValue({cellX, cellY}).passable ^ true;
-      grid->setValue({cellX, cellY}, Cell{0, passable});
+      runner.post([=](Grid<Cell>& grid) {
+        bool passable = grid.getValue({cellX, cellY}).passable ^ true;
+        grid.setValue({cellX, cellY}, Cell{0, passable});
+      });
     });
 
     auto running = true;
     while (running) {
       eventHandler.handleAll();
-      if (!paused || oneStep) {
-        grid->update();
-      }
+      runner.acquire();
       renderer.render();
       running = !eventHandler.receivedQuitSignal();
-      if (USE_DELAY) {
-        SDL_Delay(DELAY);
-      }
-      oneStep = false;
+      SDL_Delay(FRAME_DELAY);
     }
   }
 
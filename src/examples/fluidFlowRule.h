@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+#include "methuselah.h"
+
+// The fluid flow rule on its own, shared by the FluidFlow example and the
+// headless benchmarks.
+namespace fluidFlow {
+
+constexpr uint8_t WATER_MAX = 7;
+
+struct Cell {
+  uint8_t water;
+  bool passable;
+};
+
+struct Update {
+  static constexpr size_t numNeighbors = methuselah::mooreNeighborhoodSize(2);
+
+  void operator()(
+      Cell& cell,
+      const methuselah::StencilView<Cell, numNeighbors>& neighbors) const {
+    auto sum = 0;
+    if (cell.passable) {
+      for (auto i = 0; i < 8 && cell.water < WATER_MAX; ++i) {
+        if (neighbors[i].passable && neighbors[i].water > cell.water) {
+          ++sum;
+        }
+      }
+
+      if (sum && cell.water < WATER_MAX) {
+        ++cell.water;
+      } else if (!sum && cell.water) {
+        --cell.water;
+      }
+    }
+  }
+};
+
+}  // namespace fluidFlow
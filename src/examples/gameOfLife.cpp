@@ -5,6 +5,7 @@
 #include "eventHandler.h"
 #include "gridRenderer.h"
 #include "methuselah.h"
+#include "simulationRunner.h"
 
 using namespace methuselah;
 
@@ -12,6 +13,7 @@ constexpr unsigned int CELL_SIZE = 10;
 
 constexpr bool USE_DELAY = true;
 constexpr unsigned int DELAY = 100;
+constexpr unsigned int FRAME_DELAY = 16;
 
 constexpr unsigned short int GRID_WIDTH = 20;
 constexpr unsigned short int GRID_HEIGHT = 20;
@@ -19,20 +21,9 @@ constexpr unsigned short int GRID_HEIGHT = 20;
 constexpr unsigned short int WINDOW_WIDTH = GRID_WIDTH * CELL_SIZE;
 constexpr unsigned short int WINDOW_HEIGHT = GRID_HEIGHT * CELL_SIZE;
 
-void lifeUpdate(bool* cell, std::vector<bool*> neighbors) {
-  auto numNeighbors = 0;
-  for (const auto& neighbor : neighbors) {
-    numNeighbors += *neighbor;
-  }
-  auto alive = *cell;
-  if (alive && (numNeighbors < 2 || numNeighbors > 3)) {
-    *cell = false;
-  } else if (!alive && numNeighbors == 3) {
-    *cell = true;
-  }
-}
+const auto LIFE = OuterTotalisticRule::fromString("B3/S23");
 
-void randomize(Grid<bool>& grid, unsigned short mod = 2) {
+void randomize(BitGrid& grid, unsigned short mod = 2) {
   srand(time(0));
   auto coord = std::vector<size_t>{0, 0};
   for (auto i = 0; i < GRID_HEIGHT; ++i) {
@@ -54,27 +45,28 @@ std::tuple<uint8_t, uint8_t, uint8_t, uint8_t> colorize(const bool& alive) {
 
 int main() {
   {
-    auto grid =
-        std::shared_ptr<Grid<bool>>(new Grid<bool>{{GRID_WIDTH, GRID_HEIGHT},
-                                                   Wrapping::TOROIDAL,
-                                                   Neighborhood::MOORE,
-                                                   lifeUpdate});
+    auto grid = std::shared_ptr<BitGrid>(
+        new BitGrid{{GRID_WIDTH, GRID_HEIGHT}, Wrapping::TOROIDAL, LIFE});
     randomize(*grid);
 
-    Ortho2DColorRenderer<bool> renderer{grid,      colorize,     CELL_SIZE,
-                                        CELL_SIZE, WINDOW_WIDTH, WINDOW_HEIGHT};
+    SimulationRunner<bool, BitGrid> runner{
+        grid, [](BitGrid& grid) { grid.update(); },
+        USE_DELAY ? 1000.0 / DELAY : 0};
+
+    Ortho2DColorRenderer<bool, FrameView<bool>> renderer{
+        runner.getView(), colorize,     CELL_SIZE,
+        CELL_SIZE,        WINDOW_WIDTH, WINDOW_HEIGHT};
     EventHandler eventHandler;
-    eventHandler.registerKeyDownAction(SDLK_r, [&]() { randomize(*grid); });
+    eventHandler.registerKeyDownAction(
+        SDLK_r, [&]() { runner.post([](BitGrid& grid) { randomize(grid); }); });
 
     auto running = true;
     while (running) {
       eventHandler.handleAll();
-      grid->update();
+      runner.acquire();
       renderer.render();
       running = !eventHandler.receivedQuitSignal();
-      if (USE_DELAY) {
-        SDL_Delay(DELAY);
-      }
+      SDL_Delay(FRAME_DELAY);
     }
   }
 
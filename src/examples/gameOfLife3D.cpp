@@ -7,6 +7,7 @@
 #include "eventHandler.h"
 #include "gridRenderer.h"
 #include "methuselah.h"
+#include "simulationRunner.h"
 
 using namespace methuselah;
 
@@ -15,6 +16,7 @@ constexpr unsigned int CELL_HEIGHT = 16;
 
 constexpr bool USE_DELAY = true;
 constexpr unsigned int DELAY = 50;
+constexpr unsigned int FRAME_DELAY = 16;
 
 constexpr unsigned short int SCALE = 2;
 
@@ -30,20 +32,10 @@ constexpr unsigned short int WINDOW_WIDTH =
 constexpr unsigned short int WINDOW_HEIGHT =
     (((GRID_HEIGHT / 2) + (GRID_DEPTH - 1)) * CELL_HEIGHT) * SCALE;
 
-void lifeUpdate(bool* cell, std::vector<bool*> neighbors) {
-  auto numNeighbors = 0;
-  for (const auto& neighbor : neighbors) {
-    numNeighbors += *neighbor;
-  }
-  auto alive = *cell;
-  if (alive && !(numNeighbors == 5 || numNeighbors == 7)) {
-    *cell = false;
-  } else if (!alive && (numNeighbors == 6)) {
-    *cell = true;
-  }
-}
+// Born with 6 live neighbors, survives with 5 or 7.
+const auto LIFE_3D = OuterTotalisticRule::fromString("B6/S57");
 
-void randomize(Grid<bool>& grid, unsigned short mod = 12) {
+void randomize(BitGrid& grid, unsigned short mod = 12) {
   srand(time(0));
   auto coord = std::vector<size_t>{0, 0, 0};
   for (auto i = 0; i < GRID_DEPTH; ++i) {
@@ -72,77 +64,86 @@ SDL_Rect mapper(const bool& alive, const std::vector<size_t>& coord) {
   return {0, 0, CELL_WIDTH, CELL_HEIGHT};
 }
 
-void drawGlider_S56B2(std::shared_ptr<Grid<bool>> grid, size_t x, size_t y,
-                      size_t z) {
-  grid->setValue({x + 0, y + 0, z + 0}, true);
-  grid->setValue({x + 1, y + 0, z + 0}, true);
+void drawGlider_S56B2(BitGrid& grid, size_t x, size_t y, size_t z) {
+  grid.setValue({x + 0, y + 0, z + 0}, true);
+  grid.setValue({x + 1, y + 0, z + 0}, true);
 
-  grid->setValue({x + 0, y + 1, z + 0}, true);
-  grid->setValue({x + 1, y + 1, z + 0}, true);
+  grid.setValue({x + 0, y + 1, z + 0}, true);
+  grid.setValue({x + 1, y + 1, z + 0}, true);
 
-  grid->setValue({x + 0, y + 2, z + 0}, true);
-  grid->setValue({x + 1, y + 2, z + 0}, true);
+  grid.setValue({x + 0, y + 2, z + 0}, true);
+  grid.setValue({x + 1, y + 2, z + 0}, true);
 
-  grid->setValue({x + 0, y + 2, z - 1}, true);
-  grid->setValue({x + 1, y + 2, z - 1}, true);
+  grid.setValue({x + 0, y + 2, z - 1}, true);
+  grid.setValue({x + 1, y + 2, z - 1}, true);
 
-  grid->setValue({x + 0, y + 1, z - 2}, true);
-  grid->setValue({x + 1, y + 1, z - 2}, true);
+  grid.setValue({x + 0, y + 1, z - 2}, true);
+  grid.setValue({x + 1, y + 1, z - 2}, true);
 }
 
 int main() {
   {
-    auto grid = std::shared_ptr<Grid<bool>>(
-        new Grid<bool>{{GRID_WIDTH, GRID_HEIGHT, GRID_DEPTH},
-                       Wrapping::TOROIDAL,
-                       Neighborhood::MOORE,
-                       lifeUpdate});
+    auto grid = std::shared_ptr<BitGrid>(
+        new BitGrid{{GRID_WIDTH, GRID_HEIGHT, GRID_DEPTH},
+                    Wrapping::TOROIDAL,
+                    LIFE_3D});
     randomize(*grid);
 
-    IsometricSpriteRenderer<bool> renderer{
-        grid,        mapper,       "data/isometric.png", CELL_WIDTH,
-        CELL_HEIGHT, WINDOW_WIDTH, WINDOW_HEIGHT,        ORIGIN_X,
-        ORIGIN_Y,    SCALE};
+    SimulationRunner<bool, BitGrid> runner{
+        grid, [](BitGrid& grid) { grid.update(); },
+        USE_DELAY ? 1000.0 / DELAY : 0, true};
+    runner.stepOnce();
+
+    IsometricSpriteRenderer<bool, FrameView<bool>> renderer{
+        runner.getView(), mapper,       "data/isometric.png", CELL_WIDTH,
+        CELL_HEIGHT,      WINDOW_WIDTH, WINDOW_HEIGHT,        ORIGIN_X,
+        ORIGIN_Y,         SCALE};
 
     EventHandler eventHandler;
-    eventHandler.registerKeyDownAction(SDLK_r, [&]() { randomize(*grid); });
+    eventHandler.registerKeyDownAction(
+        SDLK_r, [&]() { runner.post([](BitGrid& grid) { randomize(grid); }); });
 
     srand(time(0));
     eventHandler.registerKeyDownAction(SDLK_g, [&]() {
-      try {
-        drawGlider_S56B2(grid, rand() % GRID_WIDTH, rand() % GRID_HEIGHT,
-                         rand() % GRID_DEPTH);
-      } catch (std::out_of_range e) {
-        std::cout << "oops\n";
-      }
+      size_t x = rand() % GRID_WIDTH;
+      size_t y = rand() % GRID_HEIGHT;
+      size_t z = rand() % GRID_DEPTH;
+      runner.post([=](BitGrid& grid) {
+        try {
+          drawGlider_S56B2(grid, x, y, z);
+        } catch (std::out_of_range e) {
+          std::cout << "oops\n";
+        }
+      });
     });
 
-    auto paused = true;
-    eventHandler.registerKeyDownAction(SDLK_p, [&]() { paused ^= true; });
+    eventHandler.registerKeyDownAction(
+        SDLK_p, [&]() { runner.setPaused(!runner.getPaused()); });
 
-    auto oneStep = true;
-    eventHandler.registerKeyDownAction(SDLK_SPACE, [&]() { oneStep = true; });
+    eventHandler.registerKeyDownAction(SDLK_SPACE,
+                                       [&]() { runner.stepOnce(); });
 
     eventHandler.registerKeyDownAction(
         SDLK_UP, [&]() { renderer.incrementRenderDepth(); });
     eventHandler.registerKeyDownAction(
         SDLK_DOWN, [&]() { renderer.decrementRenderDepth(); });
 
-    eventHandler.registerKeyDownAction(SDLK_RIGHT, [&]() { currentLevel++; });
-    eventHandler.registerKeyDownAction(SDLK_LEFT, [&]() { currentLevel--; });
+    eventHandler.registerKeyDownAction(SDLK_RIGHT, [&]() {
+      currentLevel++;
+      renderer.invalidate();
+    });
+    eventHandler.registerKeyDownAction(SDLK_LEFT, [&]() {
+      currentLevel--;
+      renderer.invalidate();
+    });
 
     auto running = true;
     while (running) {
       eventHandler.handleAll();
-      if (!paused || oneStep) {
-        grid->update();
-      }
+      runner.acquire();
       renderer.render();
       running = !eventHandler.receivedQuitSignal();
-      if (USE_DELAY) {
-        SDL_Delay(DELAY);
-      }
-      oneStep = false;
+      SDL_Delay(FRAME_DELAY);
     }
   }
 
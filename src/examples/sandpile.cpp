@@ -8,17 +8,23 @@
 #include "eventHandler.h"
 #include "gridRenderer.h"
 #include "methuselah.h"
+#include "sandpileRule.h"
+#include "simulationRunner.h"
 
 using methuselah::EventHandler;
+using methuselah::FrameView;
 using methuselah::Grid;
 using methuselah::Neighborhood;
 using methuselah::Ortho2DColorRenderer;
+using methuselah::SimulationRunner;
+using methuselah::UpdateMode;
 using methuselah::Wrapping;
 
 constexpr unsigned int CELL_SIZE = 10;
 
 constexpr bool USE_DELAY = true;
 constexpr unsigned int DELAY = 50;
+constexpr unsigned int FRAME_DELAY = 16;
 
 constexpr unsigned short int GRID_WIDTH = 60;
 constexpr unsigned short int GRID_HEIGHT = 80;
@@ -26,23 +32,10 @@ constexpr unsigned short int GRID_HEIGHT = 80;
 constexpr unsigned short int WINDOW_WIDTH = GRID_WIDTH * CELL_SIZE;
 constexpr unsigned short int WINDOW_HEIGHT = GRID_HEIGHT * CELL_SIZE;
 
-// Fluid Flow
-// ==========
-struct Cell {
-  bool sand;
-  bool passable;
-};
-
-void update(Cell* cell, std::vector<Cell*> neighbors) {
-  if (!cell->sand &&
-      (neighbors[0]->sand || neighbors[1]->sand || neighbors[2]->sand)) {
-    cell->sand = true;
-  } else if (cell->sand && ((!neighbors[5]->sand && neighbors[5]->passable) ||
-                            (!neighbors[6]->sand && neighbors[6]->passable) ||
-                            (!neighbors[7]->sand && neighbors[7]->passable))) {
-    cell->sand = false;
-  }
-}
+// Sandpile
+// ========
+using sandpile::BlockUpdate;
+using sandpile::Cell;
 
 std::tuple<uint8_t, uint8_t, uint8_t, uint8_t> colorize(const Cell& cell) {
   uint8_t r{50}, g{50}, b{150};
@@ -80,33 +73,36 @@ int main() {
         std::shared_ptr<Grid<Cell>>(new Grid<Cell>{{GRID_WIDTH, GRID_HEIGHT},
                                                    Wrapping::BOUNDED,
                                                    Neighborhood::MOORE,
-                                                   update,
+                                                   nullptr,
                                                    Cell{false, false}});
+    grid->setUpdateMode(UpdateMode::IN_PLACE);
     randomize(*grid);
 
-    Ortho2DColorRenderer<Cell> renderer{grid,      colorize,     CELL_SIZE,
-                                        CELL_SIZE, WINDOW_WIDTH, WINDOW_HEIGHT};
+    SimulationRunner<Cell> runner{
+        grid, [](Grid<Cell>& grid) { grid.updateBlocks<BlockUpdate>(); },
+        USE_DELAY ? 1000.0 / DELAY : 0};
+
+    Ortho2DColorRenderer<Cell, FrameView<Cell>> renderer{
+        runner.getView(), colorize,     CELL_SIZE,
+        CELL_SIZE,        WINDOW_WIDTH, WINDOW_HEIGHT};
     EventHandler eventHandler;
-    eventHandler.registerKeyDownAction(SDLK_r, [&]() { randomize(*grid); });
+    eventHandler.registerKeyDownAction(SDLK_r, [&]() {
+      runner.post([](Grid<Cell>& grid) { randomize(grid); });
+    });
 
-    auto paused = false;
-    eventHandler.registerKeyDownAction(SDLK_p, [&]() { paused ^= true; });
+    eventHandler.registerKeyDownAction(
+        SDLK_p, [&]() { runner.setPaused(!runner.getPaused()); });
 
-    auto oneStep = false;
-    eventHandler.registerKeyDownAction(SDLK_SPACE, [&]() { oneStep = true; });
+    eventHandler.registerKeyDownAction(SDLK_SPACE,
+                                       [&]() { runner.stepOnce(); });
 
     auto running = true;
     while (running) {
       eventHandler.handleAll();
-      if (!paused || oneStep) {
-        grid->update();
-      }
+      runner.acquire();
       renderer.render();
       running = !eventHandler.receivedQuitSignal();
-      if (USE_DELAY) {
-        SDL_Delay(DELAY);
-      }
-      oneStep = false;
+      SDL_Delay(FRAME_DELAY);
     }
   }
 
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "methuselah.h"
+
+// The sandpile rule on its own, shared by the Sandpile example and the
+// headless benchmarks.
+namespace sandpile {
+
+struct Cell {
+  bool sand;
+  bool passable;
+};
+
+// Every cell state, to tabulate Update over with methuselah::RuleTable.
+inline const std::vector<Cell> STATES{
+    {false, false}, {true, false}, {false, true}, {true, true}};
+
+struct Update {
+  static constexpr size_t numNeighbors = methuselah::mooreNeighborhoodSize(2);
+
+  void operator()(
+      Cell& cell,
+      const methuselah::StencilView<Cell, numNeighbors>& neighbors) const {
+    if (!cell.sand &&
+        (neighbors[0].sand || neighbors[1].sand || neighbors[2].sand)) {
+      cell.sand = true;
+    } else if (cell.sand && ((!neighbors[5].sand && neighbors[5].passable) ||
+                             (!neighbors[6].sand && neighbors[6].passable) ||
+                             (!neighbors[7].sand && neighbors[7].passable))) {
+      cell.sand = false;
+    }
+  }
+};
+
+// The same sand as a block rule for Grid::updateBlocks, which moves grains
+// instead of creating and destroying them, so sand is conserved. Grains
+// fall into the empty passable cell below them, or slide diagonally down
+// when that one is taken. Blocks are cells {0, 1} over {2, 3}, down being
+// towards higher rows like neighbors[5..7] above.
+struct BlockUpdate {
+  static constexpr size_t numDimensions = 2;
+
+  static bool fall(Cell& from, Cell& to) {
+    if (!from.sand || to.sand || !to.passable) return false;
+    from.sand = false;
+    to.sand = true;
+    return true;
+  }
+
+  void operator()(std::array<Cell, 4>& block, size_t) const {
+    fall(block[0], block[2]);
+    fall(block[1], block[3]);
+    if (block[2].sand) fall(block[0], block[3]);
+    if (block[3].sand) fall(block[1], block[2]);
+  }
+};
+
+}  // namespace sandpile
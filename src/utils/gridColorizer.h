@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "methuselah.h"
+
+namespace methuselah {
+
+// Colors a 2D grid into RGBA pixels, one pixel per cell. Grids with
+// readRow(row, f), like Grid and BitGrid, are read a row at a time and
+// colorized straight into the pixels, spread over a pool of threads; other
+// grids go through getValue cell by cell.
+//
+// Cells of trivially copyable types up to 2 bytes are looked up by their
+// bytes in a table of colors, so colorize runs once per distinct cell and
+// must depend on nothing but the cell; call forgetColors() when it changes.
+// Other cells are colorized one by one, concurrently with more than one
+// thread.
+template <typename T, typename GridType = Grid<T>>
+class GridColorizer {
+  using UsesTable = std::integral_constant<
+      bool, std::is_trivially_copyable<T>::value && sizeof(T) <= 2>;
+
+  // Colors a thread looked up but didn't find in the table.
+  struct alignas(64) Misses {
+    std::vector<uint32_t> keys;
+    std::vector<T> cells;
+    std::vector<uint8_t> pending;
+  };
+
+  // What readRow is called with, to tell grids that have it.
+  struct RowReader {
+    void operator()(size_t, const T*, size_t) const {}
+  };
+
+ public:
+  using Colorize =
+      std::function<std::tuple<uint8_t, uint8_t, uint8_t, uint8_t>(const T&)>;
+
+  GridColorizer(std::shared_ptr<GridType> grid, Colorize colorize)
+      : grid(grid), colorize(colorize), threadMisses(1) {
+    auto shape = grid->getShape();
+    width = shape[0];
+    height = shape[1];
+    coord = std::vector<size_t>{0, 0};
+    forgetColors();
+  }
+
+  size_t getWidth() const { return width; }
+  size_t getHeight() const { return height; }
+
+  // Writes the generation grid->getValue() reads as RGBA bytes, row y of
+  // the grid starting at pixels + y * pitch.
+  void draw(uint8_t* pixels, size_t pitch) {
+    colorizeRows(pixels, pitch, 0);
+    learnColors(UsesTable());
+  }
+
+  size_t getNumThreads() const { return threadMisses.size(); }
+
+  // Same as Grid::setNumThreads, for colorizing rows.
+  void setNumThreads(size_t numThreads) {
+    if (numThreads == 0) {
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadPool.reset(numThreads > 1 ? new ThreadPool(numThreads) : nullptr);
+    threadMisses.resize(numThreads);
+  }
+
+  // Drops the table of colors, for when colorize changes what it returns.
+  void forgetColors() {
+    if (UsesTable::value) {
+      colors.assign(size_t(1) << (8 * sizeof(T)), 0);
+      known.assign(colors.size(), 0);
+    }
+  }
+
+ private:
+  std::shared_ptr<GridType> grid;
+  Colorize colorize;
+  std::vector<size_t> coord;
+  size_t width;
+  size_t height;
+  std::unique_ptr<ThreadPool> threadPool;
+  // Color of every key in RGBA byte order, and whether it is known yet.
+  std::vector<uint32_t> colors;
+  std::vector<uint8_t> known;
+  std::vector<Misses> threadMisses;
+
+  static uint32_t getKey(const T& cell) {
+    uint16_t key = 0;
+    std::memcpy(&key, &cell, sizeof(T));
+    return key;
+  }
+
+  uint32_t getColor(const T& cell) const {
+    auto color = colorize(cell);
+    uint8_t bytes[4] = {std::get<0>(color), std::get<1>(color),
+                        std::get<2>(color), std::get<3>(color)};
+    uint32_t result;
+    std::memcpy(&result, bytes, sizeof(result));
+    return result;
+  }
+
+  // Grids that read a row at a time.
+  template <typename G = GridType>
+  auto colorizeRows(uint8_t* pixels, size_t pitch, int)
+      -> decltype(std::declval<G&>().readRow(size_t(0), RowReader()),
+                  void()) {
+    auto colorizeRow = [&](size_t y, size_t thread) {
+      auto out = reinterpret_cast<uint32_t*>(pixels + y * pitch);
+      grid->readRow(y, [&](size_t x, const T* cells, size_t length) {
+        colorizeCells(cells, length, out + x, threadMisses[thread],
+                      UsesTable());
+      });
+    };
+    if (!threadPool) {
+      for (size_t y = 0; y < height; ++y) {
+        colorizeRow(y, 0);
+      }
+      return;
+    }
+    auto chunk =
+        std::max<size_t>(1, height / (threadPool->getNumThreads() * 4));
+    auto numChunks = (height + chunk - 1) / chunk;
+    threadPool->run(numChunks, [&](size_t i, size_t thread) {
+      auto end = std::min<size_t>(height, (i + 1) * chunk);
+      for (auto y = i * chunk; y < end; ++y) {
+        colorizeRow(y, thread);
+      }
+    });
+  }
+
+  // Any other grid.
+  void colorizeRows(uint8_t* pixels, size_t pitch, long) {
+    for (size_t y = 0; y < height; ++y) {
+      auto out = reinterpret_cast<uint32_t*>(pixels + y * pitch);
+      coord[1] = y;
+      for (size_t x = 0; x < width; ++x) {
+        coord[0] = x;
+        T cell = grid->getValue(coord);
+        colorizeCells(&cell, 1, out + x, threadMisses[0], UsesTable());
+      }
+    }
+  }
+
+  // Looks every cell up in the table first, and only goes back over the
+  // run to colorize cells whose color isn't known yet, so the common case
+  // is a branchless gather.
+  void colorizeCells(const T* cells, size_t length, uint32_t* out,
+                     Misses& misses, std::true_type) {
+    uint8_t allKnown = 1;
+    for (size_t x = 0; x < length; ++x) {
+      auto key = getKey(cells[x]);
+      out[x] = colors[key];
+      allKnown &= known[key];
+    }
+    if (allKnown) return;
+
+    misses.pending.resize(colors.size());
+    for (size_t x = 0; x < length; ++x) {
+      auto key = getKey(cells[x]);
+      if (known[key]) continue;
+      out[x] = getColor(cells[x]);
+      if (!misses.pending[key]) {
+        misses.pending[key] = 1;
+        misses.keys.push_back(key);
+        misses.cells.push_back(cells[x]);
+      }
+    }
+  }
+
+  void colorizeCells(const T* cells, size_t length, uint32_t* out, Misses&,
+                     std::false_type) {
+    for (size_t x = 0; x < length; ++x) {
+      out[x] = getColor(cells[x]);
+    }
+  }
+
+  // Adds the colors the threads missed to the table.
+  void learnColors(std::true_type) {
+    for (auto& misses : threadMisses) {
+      for (size_t i = 0; i < misses.keys.size(); ++i) {
+        auto key = misses.keys[i];
+        misses.pending[key] = 0;
+        if (known[key]) continue;
+        colors[key] = getColor(misses.cells[i]);
+        known[key] = 1;
+      }
+      misses.keys.clear();
+      misses.cells.clear();
+    }
+  }
+
+  void learnColors(std::false_type) {}
+};
+
+}  // namespace methuselah
@@ -3,19 +3,30 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
+#include "gridColorizer.h"
 #include "methuselah.h"
 
 namespace methuselah {
 
-template <typename T>
+// GridType can be any grid with getShape() and getValue(coordinates), such
+// as Grid<T> or BitGrid.
+template <typename T, typename GridType = Grid<T>>
 class GridRenderer {
  public:
-  GridRenderer(std::shared_ptr<Grid<T>> grid, uint16_t cellWidth,
+  GridRenderer(std::shared_ptr<GridType> grid, uint16_t cellWidth,
                uint16_t cellHeight, uint16_t windowWidth, uint16_t windowHeight)
       : grid(grid),
         cellWidth(cellWidth),
@@ -35,7 +46,7 @@ class GridRenderer {
   virtual void render() = 0;
 
  protected:
-  std::shared_ptr<Grid<T>> grid;
+  std::shared_ptr<GridType> grid;
   uint16_t const cellWidth;
   uint16_t const cellHeight;
   uint16_t const windowWidth;
@@ -45,79 +56,141 @@ class GridRenderer {
   std::unique_ptr<SDL_Renderer, decltype(&SDL_DestroyRenderer)> renderer;
 };
 
-template <typename T>
-class Ortho2DColorRenderer : public GridRenderer<T> {
+// Draws a 2D grid one pixel per cell into a streaming texture, which is
+// uploaded once per frame and scaled to cellWidth x cellHeight per cell by
+// the renderer. Cells are colorized straight into the locked texture by a
+// GridColorizer, which says what colorize may depend on.
+template <typename T, typename GridType = Grid<T>>
+class Ortho2DColorRenderer : public GridRenderer<T, GridType> {
+  using Colorize = typename GridColorizer<T, GridType>::Colorize;
+
  public:
-  Ortho2DColorRenderer(
-      std::shared_ptr<Grid<T>> grid,
-      std::function<std::tuple<uint8_t, uint8_t, uint8_t, uint8_t>(const T&)>
-          colorize,
-      uint16_t cellWidth, uint16_t cellHeight, uint16_t windowWidth,
-      uint16_t windowHeight)
-      : colorize(colorize),
-        GridRenderer<T>(grid, cellWidth, cellHeight, windowWidth,
-                        windowHeight) {
-    auto shape = grid->getShape();
-    gridWidth = shape[0];
-    gridHeight = shape[1];
-    coord = std::vector<size_t>{0, 0};
+  Ortho2DColorRenderer(std::shared_ptr<GridType> grid, Colorize colorize,
+                       uint16_t cellWidth, uint16_t cellHeight,
+                       uint16_t windowWidth, uint16_t windowHeight)
+      : GridRenderer<T, GridType>(grid, cellWidth, cellHeight, windowWidth,
+                                  windowHeight),
+        colorizer(grid, colorize),
+        texture(nullptr, SDL_DestroyTexture) {
+    gridWidth = colorizer.getWidth();
+    gridHeight = colorizer.getHeight();
+
+    texture.reset(SDL_CreateTexture(renderer.get(), SDL_PIXELFORMAT_RGBA32,
+                                    SDL_TEXTUREACCESS_STREAMING, gridWidth,
+                                    gridHeight));
+    if (!texture) throw std::runtime_error(SDL_GetError());
+    SDL_SetTextureBlendMode(texture.get(), SDL_BLENDMODE_NONE);
   }
 
   void render() {
-    rect.x = 0;
-    rect.y = 0;
-
-    for (auto i = 0; i < gridHeight; ++i) {
-      rect.y = i * cellHeight;
-      coord[1] = i;
-      for (auto j = 0; j < gridWidth; ++j) {
-        rect.x = j * cellWidth;
-        coord[0] = j;
-
-        auto value = grid->getValue(coord);
-        auto color = colorize(value);
-        auto r = std::get<0>(color);
-        auto g = std::get<1>(color);
-        auto b = std::get<2>(color);
-        auto a = std::get<3>(color);
-        SDL_SetRenderDrawColor(renderer.get(), r, g, b, a);
-        SDL_RenderFillRect(renderer.get(), &rect);
-      }
-    }
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(texture.get(), nullptr, &pixels, &pitch) != 0)
+      throw std::runtime_error(SDL_GetError());
+    colorizer.draw(static_cast<uint8_t*>(pixels), pitch);
+    SDL_UnlockTexture(texture.get());
 
+    SDL_Rect dest{0, 0, gridWidth * cellWidth, gridHeight * cellHeight};
+    SDL_RenderCopy(renderer.get(), texture.get(), nullptr, &dest);
     SDL_RenderPresent(renderer.get());
   }
 
-  using GridRenderer<T>::grid;
-  using GridRenderer<T>::rect;
-  using GridRenderer<T>::renderer;
-  using GridRenderer<T>::cellWidth;
-  using GridRenderer<T>::cellHeight;
+  size_t getNumThreads() const { return colorizer.getNumThreads(); }
+
+  // Same as Grid::setNumThreads, for colorizing rows.
+  void setNumThreads(size_t numThreads) {
+    colorizer.setNumThreads(numThreads);
+  }
+
+  // Drops the table of colors, for when colorize changes what it returns.
+  void forgetColors() { colorizer.forgetColors(); }
+
+  using GridRenderer<T, GridType>::grid;
+  using GridRenderer<T, GridType>::rect;
+  using GridRenderer<T, GridType>::renderer;
+  using GridRenderer<T, GridType>::cellWidth;
+  using GridRenderer<T, GridType>::cellHeight;
 
  private:
-  std::function<std::tuple<uint8_t, uint8_t, uint8_t, uint8_t>(const T&)>
-      colorize;
-  std::vector<size_t> coord;
+  GridColorizer<T, GridType> colorizer;
   uint16_t gridWidth;
   uint16_t gridHeight;
+  std::unique_ptr<SDL_Texture, decltype(&SDL_DestroyTexture)> texture;
 };
 
-template <typename T>
-class IsometricSpriteRenderer : public GridRenderer<T> {
+// Draws a 3D grid as isometric sprites, stacked up layer by layer from
+// layer 0 to renderDepth - 1. mapper(cell, coordinates) picks the sprite of
+// every cell below renderDepth from the spritesheet, and rects of no area
+// draw nothing. It's only asked again about cells that may have changed:
+// those in the tiles a Grid with change tracking on reports, or else those
+// whose bytes differ from the last frame, or every cell if T isn't
+// trivially copyable. Call invalidate() when anything else mapper looks at
+// changes.
+//
+// Frames are drawn onto a canvas that persists between them, and only the
+// screen tiles over cells whose sprite changed since the last frame are
+// cleared and drawn again. A cell's sprite lands exactly where the one of
+// the cell a step down along every axis does, so sprites that are opaque
+// wherever any sprite in use is visible hide the cells under them: every
+// such screen spot remembers the topmost layer holding one, and the cells
+// below it are skipped. Within a tile cells are drawn a layer at a time,
+// with one color mod for the whole layer.
+template <typename T, typename GridType = Grid<T>>
+class IsometricSpriteRenderer : public GridRenderer<T, GridType> {
+  using Mapper =
+      std::function<SDL_Rect(const T&, const std::vector<size_t>&)>;
+
+  // Side of the square tiles of the canvas that are redrawn, in pixels.
+  static constexpr int TILE_SIZE = 64;
+
+  // A sprite mapper picked, with the alpha of each of its pixels.
+  struct Sprite {
+    SDL_Rect src;
+    std::vector<uint8_t> alpha;
+    bool occludes;
+  };
+
+  struct RectHash {
+    size_t operator()(const SDL_Rect& rect) const {
+      uint64_t h = 0;
+      for (auto x : {rect.x, rect.y, rect.w, rect.h}) {
+        h = (h ^ static_cast<uint32_t>(x)) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+      }
+      return static_cast<size_t>(h);
+    }
+  };
+
+  struct RectEqual {
+    bool operator()(const SDL_Rect& a, const SDL_Rect& b) const {
+      return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+    }
+  };
+
+  // What forEachChangedTile is called with, to tell grids that have it.
+  struct TileVisitor {
+    void operator()(const std::vector<size_t>&,
+                    const std::vector<size_t>&) const {}
+  };
+
  public:
-  IsometricSpriteRenderer(std::shared_ptr<Grid<T>> grid,
-                          std::function<SDL_Rect(const T&, std::vector<size_t>)> mapper,
+  IsometricSpriteRenderer(std::shared_ptr<GridType> grid, Mapper mapper,
                           std::string spritesheetPath, uint16_t cellWidth,
                           uint16_t cellHeight, uint16_t windowWidth,
                           uint16_t windowHeight, int originX, int originY,
                           uint16_t scale)
-      : mapper(mapper),
-        spritesheet(nullptr, SDL_DestroyTexture),
+      : GridRenderer<T, GridType>(grid, cellWidth, cellHeight, windowWidth,
+                                  windowHeight),
+        mapper(mapper),
+        scale(scale),
         originX(originX),
         originY(originY),
-        scale(scale),
-        GridRenderer<T>(grid, cellWidth, cellHeight, windowWidth,
-                        windowHeight) {
+        spritesheet(nullptr, SDL_DestroyTexture),
+        canvas(nullptr, SDL_DestroyTexture),
+        lastSprite(0),
+        coord{0, 0, 0},
+        stale(true),
+        seenChanges(0) {
     auto shape = grid->getShape();
     gridWidth = shape[0];
     gridHeight = shape[1];
@@ -130,36 +203,45 @@ class IsometricSpriteRenderer : public GridRenderer<T> {
       throw -1;
     }
     spritesheet.reset(SDL_CreateTextureFromSurface(renderer.get(), surface));
+    readAlpha(surface);
     SDL_FreeSurface(surface);
+
+    canvas.reset(SDL_CreateTexture(renderer.get(), SDL_PIXELFORMAT_RGBA32,
+                                   SDL_TEXTUREACCESS_TARGET, windowWidth,
+                                   windowHeight));
+    if (!canvas) throw std::runtime_error(SDL_GetError());
+
+    // Cells one step apart along every axis only share a spot when half a
+    // cell is exactly two quarters of one.
+    culling = cellHeight / 2 == cellHeight / 4 * 2;
+    spotsPerRow = gridWidth + gridHeight - 1;
+    topLayer.assign(spotsPerRow * (spotsPerRow + 2 * (gridDepth - 1)), 0);
+    spotDirty.assign(topLayer.size(), 0);
+    spriteIds.assign(size_t(gridWidth) * gridHeight * gridDepth, 0);
+    // Sprite 0 stands for cells that aren't drawn.
+    sprites.push_back(Sprite{SDL_Rect{0, 0, 0, 0}, {}, false});
+
+    tilesPerRow = (windowWidth + TILE_SIZE - 1) / TILE_SIZE;
+    tileDirty.assign(tilesPerRow * ((windowHeight + TILE_SIZE - 1) /
+                                    TILE_SIZE), 1);
   }
 
   void render() {
-    SDL_RenderClear(renderer.get());
-
-    std::vector<size_t> coord{0, 0, 0};
-    for (int z = 0; z < renderDepth; ++z) {
-      coord[2] = z;
-      for (int y = 0; y < gridHeight; ++y) {
-        coord[1] = y;
-        for (int x = 0; x < gridWidth; ++x) {
-          coord[0] = x;
-          auto dest = toDestRect(x, y, z);
-          auto src = mapper(grid->getValue(coord), coord);
+    findChanges();
+    findTopLayers();
 
-          auto colorShift = (uint8_t)(((z+15)/(gridDepth + 15.0))*255);
-          SDL_SetTextureColorMod(spritesheet.get(), colorShift, colorShift, colorShift);
-          SDL_RenderCopy(renderer.get(), spritesheet.get(), &src, &dest);
-        }
-      }
-    }
+    SDL_SetRenderTarget(renderer.get(), canvas.get());
+    redrawTiles();
+    SDL_SetRenderTarget(renderer.get(), nullptr);
+    SDL_RenderCopy(renderer.get(), canvas.get(), nullptr, nullptr);
     SDL_RenderPresent(renderer.get());
   }
 
-  using GridRenderer<T>::grid;
-  using GridRenderer<T>::rect;
-  using GridRenderer<T>::renderer;
-  using GridRenderer<T>::cellWidth;
-  using GridRenderer<T>::cellHeight;
+  using GridRenderer<T, GridType>::grid;
+  using GridRenderer<T, GridType>::rect;
+  using GridRenderer<T, GridType>::renderer;
+  using GridRenderer<T, GridType>::cellWidth;
+  using GridRenderer<T, GridType>::cellHeight;
 
   void incrementRenderDepth() {
     if (renderDepth >= gridDepth - 1) {
@@ -167,6 +249,7 @@ class IsometricSpriteRenderer : public GridRenderer<T> {
     } else {
       renderDepth += 1;
     }
+    stale = true;
   }
 
   void decrementRenderDepth() {
@@ -175,16 +258,22 @@ class IsometricSpriteRenderer : public GridRenderer<T> {
     } else {
       renderDepth -= 1;
     }
+    stale = true;
   }
 
+  // Asks mapper about every cell again in the next frame, for when what it
+  // picks changes for reasons other than the cells.
+  void invalidate() { stale = true; }
+
  private:
   SDL_Rect toDestRect(int x, int y, int z) {
     return {((originX * cellWidth) + (x - y) * (cellWidth / 2)) * scale,
-            ((originY * cellHeight) + (x + y) * (cellHeight / 4) - (z * (cellHeight / 2))) * scale,
+            ((originY * cellHeight) + (x + y) * (cellHeight / 4) -
+             (z * (cellHeight / 2))) * scale,
             cellWidth * scale, cellHeight * scale};
   }
 
-  std::function<SDL_Rect(const T&, std::vector<size_t>)> mapper;
+  Mapper mapper;
   uint16_t scale;
   uint16_t gridWidth;
   uint16_t gridHeight;
@@ -193,6 +282,382 @@ class IsometricSpriteRenderer : public GridRenderer<T> {
   int originX;
   int originY;
   std::unique_ptr<SDL_Texture, decltype(&SDL_DestroyTexture)> spritesheet;
+  std::unique_ptr<SDL_Texture, decltype(&SDL_DestroyTexture)> canvas;
+  // Alpha of every pixel of the spritesheet.
+  std::vector<uint8_t> sheetAlpha;
+  int sheetWidth;
+  int sheetHeight;
+  std::vector<Sprite> sprites;
+  std::unordered_map<SDL_Rect, uint16_t, RectHash, RectEqual> spritesBySrc;
+  size_t lastSprite;
+  std::vector<size_t> coord;
+  // Sprite of every cell in the last frame, and the bytes of every cell
+  // when they're compared to find changes.
+  std::vector<uint16_t> spriteIds;
+  std::vector<uint8_t> lastCells;
+  // Whether every cell is mapped again in the next frame, and the change
+  // count of a change tracking grid as of the last one.
+  bool stale;
+  uint64_t seenChanges;
+  // Spots are numbered by x - y and then by x + y - 2z, offset to start
+  // at 0. Each one holds the topmost layer with an occluding sprite on it,
+  // or 0.
+  bool culling;
+  size_t spotsPerRow;
+  std::vector<uint16_t> topLayer;
+  std::vector<uint8_t> spotDirty;
+  std::vector<size_t> dirtySpots;
+  size_t tilesPerRow;
+  std::vector<uint8_t> tileDirty;
+
+  // Grids that read a row at a time.
+  template <typename F, typename G = GridType>
+  auto readRow(size_t row, F&& f, int)
+      -> decltype(std::declval<G&>().readRow(row, f), void()) {
+    grid->readRow(row, f);
+  }
+
+  // Any other grid.
+  template <typename F>
+  void readRow(size_t row, F&& f, long) {
+    std::vector<size_t> coord{0, row % gridHeight, row / gridHeight};
+    for (size_t x = 0; x < gridWidth; ++x) {
+      coord[0] = x;
+      T cell = grid->getValue(coord);
+      f(x, static_cast<const T*>(&cell), 1);
+    }
+  }
+
+  void readAlpha(SDL_Surface* surface) {
+    auto converted =
+        SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+    if (converted == nullptr) throw std::runtime_error(SDL_GetError());
+    sheetWidth = converted->w;
+    sheetHeight = converted->h;
+    sheetAlpha.resize(size_t(sheetWidth) * sheetHeight);
+    SDL_LockSurface(converted);
+    for (int y = 0; y < sheetHeight; ++y) {
+      auto row = static_cast<const uint8_t*>(converted->pixels) +
+                 y * converted->pitch;
+      for (int x = 0; x < sheetWidth; ++x) {
+        sheetAlpha[y * sheetWidth + x] = row[x * 4 + 3];
+      }
+    }
+    SDL_UnlockSurface(converted);
+    SDL_FreeSurface(converted);
+  }
+
+  // Maps the cells that may have changed since the last frame to their
+  // sprites, and marks what changed.
+  void findChanges() {
+    if (!findTrackedChanges(0)) {
+      findChangedCells();
+    }
+    stale = false;
+  }
+
+  // Grids that can track changes.
+  template <typename G = GridType>
+  auto findTrackedChanges(int)
+      -> decltype(std::declval<G&>().forEachChangedTile(uint64_t(0),
+                                                        TileVisitor()),
+                  bool()) {
+    if (!grid->getChangeTracking()) return false;
+    lastCells.clear();
+    auto since = seenChanges;
+    seenChanges = grid->getChangeCount();
+    if (stale) {
+      for (size_t z = 0; z < gridDepth; ++z) {
+        for (size_t y = 0; y < gridHeight; ++y) {
+          mapRow(0, gridWidth, y, z, nullptr);
+        }
+      }
+      return true;
+    }
+    grid->forEachChangedTile(since, [&](const std::vector<size_t>& lo,
+                                        const std::vector<size_t>& hi) {
+      for (auto z = lo[2]; z < hi[2]; ++z) {
+        for (auto y = lo[1]; y < hi[1]; ++y) {
+          mapRow(lo[0], hi[0], y, z, nullptr);
+        }
+      }
+    });
+    return true;
+  }
+
+  // Any other grid.
+  bool findTrackedChanges(long) { return false; }
+
+  // Compares the bytes of every cell with the last frame's, when T is
+  // trivially copyable, and maps the ones that differ.
+  void findChangedCells() {
+    uint8_t* last = nullptr;
+    if (std::is_trivially_copyable<T>::value) {
+      if (lastCells.size() != spriteIds.size() * sizeof(T)) {
+        lastCells.assign(spriteIds.size() * sizeof(T), 0);
+        stale = true;
+      }
+      last = lastCells.data();
+    }
+    for (size_t z = 0; z < gridDepth; ++z) {
+      for (size_t y = 0; y < gridHeight; ++y) {
+        auto row = (z * gridHeight + y) * gridWidth * sizeof(T);
+        mapRow(0, gridWidth, y, z, last ? last + row : nullptr);
+      }
+    }
+  }
+
+  // Maps cells x0 to x1 - 1 of row y of layer z to their sprites. With
+  // last, cells whose bytes match the ones there are skipped, unless the
+  // frame is stale, and the others are copied over.
+  void mapRow(size_t x0, size_t x1, size_t y, size_t z, uint8_t* last) {
+    auto ids = &spriteIds[(z * gridHeight + y) * gridWidth];
+    if (z >= renderDepth) {
+      for (auto x = x0; x < x1; ++x) {
+        setSprite(x, y, z, ids[x], 0);
+      }
+      return;
+    }
+    coord[1] = y;
+    coord[2] = z;
+    readRow(z * gridHeight + y,
+            [&](size_t first, const T* cells, size_t length) {
+              auto end = std::min(first + length, x1);
+              for (auto x = std::max(first, x0); x < end; ++x) {
+                auto& cell = cells[x - first];
+                if (last) {
+                  auto bytes = reinterpret_cast<const uint8_t*>(&cell);
+                  auto old = last + x * sizeof(T);
+                  if (!stale && std::memcmp(old, bytes, sizeof(T)) == 0)
+                    continue;
+                  std::memcpy(old, bytes, sizeof(T));
+                }
+                coord[0] = x;
+                setSprite(x, y, z, ids[x], getSpriteId(mapper(cell, coord)));
+              }
+            },
+            0);
+  }
+
+  void setSprite(size_t x, size_t y, size_t z, uint16_t& id,
+                 uint16_t newId) {
+    if (id == newId) return;
+    id = newId;
+    markTiles(toDestRect(x, y, z));
+    if (!culling) return;
+    auto spot = getSpot(x, y, z);
+    if (!spotDirty[spot]) {
+      spotDirty[spot] = 1;
+      dirtySpots.push_back(spot);
+    }
+  }
+
+  size_t getSpot(size_t x, size_t y, size_t z) const {
+    return (x + y + 2 * (gridDepth - 1 - z)) * spotsPerRow + x +
+           (gridHeight - 1) - y;
+  }
+
+  uint16_t getSpriteId(const SDL_Rect& src) {
+    if (src.w <= 0 || src.h <= 0) return 0;
+    if (lastSprite && RectEqual()(src, sprites[lastSprite].src))
+      return lastSprite;
+    auto found = spritesBySrc.find(src);
+    if (found != spritesBySrc.end()) {
+      lastSprite = found->second;
+      return lastSprite;
+    }
+    addSprite(src);
+    lastSprite = sprites.size() - 1;
+    spritesBySrc.emplace(src, lastSprite);
+    return lastSprite;
+  }
+
+  void addSprite(const SDL_Rect& src) {
+    if (sprites.size() > std::numeric_limits<uint16_t>::max())
+      throw InvalidOperationException("Mapper picked too many sprites.");
+    Sprite sprite{src, std::vector<uint8_t>(size_t(src.w) * src.h, 0), false};
+    for (int y = 0; y < src.h; ++y) {
+      for (int x = 0; x < src.w; ++x) {
+        auto sheetX = src.x + x;
+        auto sheetY = src.y + y;
+        if (sheetX >= 0 && sheetX < sheetWidth && sheetY >= 0 &&
+            sheetY < sheetHeight) {
+          sprite.alpha[y * src.w + x] =
+              sheetAlpha[sheetY * sheetWidth + sheetX];
+        }
+      }
+    }
+    sprites.push_back(std::move(sprite));
+
+    // Whether a sprite occludes depends on every sprite in use, so a new
+    // one may change it for the others too.
+    auto changed = false;
+    for (size_t id = 1; id < sprites.size(); ++id) {
+      auto occludes = culling && covers(sprites[id]);
+      changed = changed || occludes != sprites[id].occludes;
+      sprites[id].occludes = occludes;
+    }
+    if (changed) {
+      for (size_t spot = 0; spot < spotDirty.size(); ++spot) {
+        if (!spotDirty[spot]) {
+          spotDirty[spot] = 1;
+          dirtySpots.push_back(spot);
+        }
+      }
+      std::fill(tileDirty.begin(), tileDirty.end(), 1);
+    }
+  }
+
+  // Whether sprite is opaque wherever any sprite in use is visible. Rects
+  // of no area are mapped to sprite 0, so they don't count as in use.
+  bool covers(const Sprite& sprite) const {
+    auto& src = sprite.src;
+    if (src.x < 0 || src.y < 0 || src.x + src.w > sheetWidth ||
+        src.y + src.h > sheetHeight)
+      return false;
+    for (size_t id = 1; id < sprites.size(); ++id) {
+      auto& other = sprites[id];
+      if (other.src.w != src.w || other.src.h != src.h) return false;
+      for (size_t i = 0; i < other.alpha.size(); ++i) {
+        if (other.alpha[i] && sprite.alpha[i] != 255) return false;
+      }
+    }
+    return true;
+  }
+
+  // Finds the topmost occluding layer of every spot that changed.
+  void findTopLayers() {
+    for (auto spot : dirtySpots) {
+      spotDirty[spot] = 0;
+      auto u = static_cast<long>(spot % spotsPerRow) - (gridHeight - 1);
+      auto v = static_cast<long>(spot / spotsPerRow) - 2 * (gridDepth - 1);
+      topLayer[spot] = 0;
+      for (auto z = static_cast<long>(renderDepth) - 1; z > 0; --z) {
+        // x - y = u and x + y = v + 2z.
+        auto x = (u + v + 2 * z) / 2;
+        auto y = x - u;
+        if (x < 0 || y < 0 || x >= gridWidth || y >= gridHeight) continue;
+        auto id = spriteIds[(z * gridHeight + y) * gridWidth + x];
+        if (sprites[id].occludes) {
+          topLayer[spot] = static_cast<uint16_t>(z);
+          break;
+        }
+      }
+    }
+    dirtySpots.clear();
+  }
+
+  void markTiles(const SDL_Rect& dest) {
+    auto firstX = std::max(0, dest.x / TILE_SIZE);
+    auto firstY = std::max(0, dest.y / TILE_SIZE);
+    auto lastX = std::min<int>(tilesPerRow - 1,
+                               (dest.x + dest.w - 1) / TILE_SIZE);
+    auto lastY = std::min<int>(tileDirty.size() / tilesPerRow - 1,
+                               (dest.y + dest.h - 1) / TILE_SIZE);
+    for (auto y = firstY; y <= lastY; ++y) {
+      for (auto x = firstX; x <= lastX; ++x) {
+        tileDirty[y * tilesPerRow + x] = 1;
+      }
+    }
+  }
+
+  // Clears and redraws the runs of dirty tiles in every row of tiles,
+  // each clipped to its run.
+  void redrawTiles() {
+    SDL_SetRenderDrawColor(renderer.get(), 0, 0, 0, 255);
+    auto numRows = tileDirty.size() / tilesPerRow;
+    for (size_t row = 0; row < numRows; ++row) {
+      auto dirty = &tileDirty[row * tilesPerRow];
+      for (size_t first = 0; first < tilesPerRow;) {
+        if (!dirty[first]) {
+          ++first;
+          continue;
+        }
+        auto end = first;
+        while (end < tilesPerRow && dirty[end]) {
+          dirty[end++] = 0;
+        }
+        SDL_Rect clip{static_cast<int>(first) * TILE_SIZE,
+                      static_cast<int>(row) * TILE_SIZE,
+                      static_cast<int>(end - first) * TILE_SIZE, TILE_SIZE};
+        SDL_RenderSetClipRect(renderer.get(), &clip);
+        SDL_RenderFillRect(renderer.get(), &clip);
+        drawCells(clip);
+        first = end;
+      }
+    }
+    SDL_RenderSetClipRect(renderer.get(), nullptr);
+  }
+
+  // Draws every visible cell whose sprite overlaps clip, in the order a
+  // full redraw draws them in: by layer, then row, then column.
+  void drawCells(const SDL_Rect& clip) {
+    // Sprites are placed along x - y and x + y - 2z in steps of a half
+    // and a quarter of a cell.
+    long spriteWidth = cellWidth * scale;
+    long spriteHeight = cellHeight * scale;
+    long stepX = cellWidth / 2 * scale;
+    long stepY = cellHeight / 4 * scale;
+    long layerStep = cellHeight / 2 * scale;
+    long left = originX * cellWidth * scale;
+    long top = originY * cellHeight * scale;
+
+    long minU, maxU;
+    overlapping(clip.x, clip.w, left, stepX, spriteWidth, minU, maxU);
+    minU = std::max<long>(minU, 1 - static_cast<long>(gridHeight));
+    maxU = std::min<long>(maxU, gridWidth - 1);
+    for (size_t z = 0; z < renderDepth; ++z) {
+      long minV, maxV;
+      overlapping(clip.y, clip.h, top - z * layerStep, stepY, spriteHeight,
+                  minV, maxV);
+      minV = std::max<long>(minV, 0);
+      maxV = std::min<long>(maxV, gridWidth + gridHeight - 2);
+      if (minU > maxU || minV > maxV) continue;
+
+      auto colorModSet = false;
+      auto firstY = std::max<long>(0, ceilDiv(minV - maxU, 2));
+      auto lastY = std::min<long>(gridHeight - 1, floorDiv(maxV - minU, 2));
+      for (auto y = firstY; y <= lastY; ++y) {
+        auto firstX = std::max({0L, y + minU, minV - y});
+        auto lastX = std::min({gridWidth - 1L, y + maxU, maxV - y});
+        auto ids = &spriteIds[(z * gridHeight + y) * gridWidth];
+        for (auto x = firstX; x <= lastX; ++x) {
+          auto id = ids[x];
+          if (!id || (culling && z < topLayer[getSpot(x, y, z)])) continue;
+          if (!colorModSet) {
+            auto colorShift =
+                (uint8_t)(((z + 15) / (gridDepth + 15.0)) * 255);
+            SDL_SetTextureColorMod(spritesheet.get(), colorShift, colorShift,
+                                   colorShift);
+            colorModSet = true;
+          }
+          auto dest = toDestRect(x, y, z);
+          SDL_RenderCopy(renderer.get(), spritesheet.get(), &sprites[id].src,
+                         &dest);
+        }
+      }
+    }
+  }
+
+  // The range of n for which a sprite at origin + n * step, size long,
+  // overlaps the length pixels from start.
+  static void overlapping(long start, long length, long origin, long step,
+                          long size, long& min, long& max) {
+    if (step == 0) {
+      auto overlaps = origin < start + length && origin + size > start;
+      min = overlaps ? std::numeric_limits<int>::min() : 1;
+      max = overlaps ? std::numeric_limits<int>::max() : 0;
+      return;
+    }
+    min = floorDiv(start - size - origin, step) + 1;
+    max = ceilDiv(start + length - origin, step) - 1;
+  }
+
+  static long floorDiv(long a, long b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+  }
+
+  static long ceilDiv(long a, long b) { return -floorDiv(-a, b); }
 };
 
 }  // namespace methuselah
@@ -0,0 +1,640 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gridColorizer.h"
+#include "methuselah.h"
+#include "simulationRunner.h"
+
+namespace methuselah {
+
+// Encoders
+// ========--------------------------------------------------------------------
+// Turns frames of RGBA pixels into files or streams for a
+// HeadlessColorRenderer. encode() runs on the renderer's workers, for
+// several frames at once, and write() on one of them at a time, strictly
+// in frame order, for what has to go out in sequence.
+class FrameEncoder {
+ public:
+  virtual ~FrameEncoder() = default;
+
+  // Called once, before any frame, with the size of every frame.
+  virtual void begin(size_t, size_t) {}
+
+  // Encodes frame number frame, width * height pixels in RGBA byte order,
+  // into out, which holds what the last call on this buffer left in it.
+  virtual void encode(uint64_t frame, const uint8_t* pixels, size_t width,
+                      size_t height, std::vector<uint8_t>& out) const = 0;
+
+  virtual void write(uint64_t, const std::vector<uint8_t>&) {}
+
+  // Called once every frame rendered so far is written.
+  virtual void flush() {}
+};
+
+namespace {  // PNG helpers
+const uint16_t DEFLATE_LENGTH_BASE[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t DEFLATE_LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                          1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DEFLATE_DISTANCE_BASE[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,    25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513,   769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+const uint8_t DEFLATE_DISTANCE_EXTRA[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                            3, 3, 4,  4,  5,  5,  6,  6,
+                                            7, 7, 8,  8,  9,  9,  10, 10,
+                                            11, 11, 12, 12, 13, 13};
+constexpr size_t DEFLATE_WINDOW = 32768;
+constexpr size_t DEFLATE_MAX_MATCH = 258;
+constexpr int DEFLATE_HASH_BITS = 15;
+
+// Packs bits into bytes least significant bit first, as deflate does.
+class DeflateBitWriter {
+ public:
+  explicit DeflateBitWriter(std::vector<uint8_t>& out)
+      : out(out), bits(0), numBits(0) {}
+
+  void write(uint32_t value, int count) {
+    bits |= uint64_t(value) << numBits;
+    numBits += count;
+    while (numBits >= 8) {
+      out.push_back(uint8_t(bits));
+      bits >>= 8;
+      numBits -= 8;
+    }
+  }
+
+  // Huffman codes are packed most significant bit first.
+  void writeCode(uint32_t code, int length) {
+    write(reverseBits(code, length), length);
+  }
+
+  // A symbol of the fixed literal/length code.
+  void writeSymbol(uint32_t symbol) {
+    static const auto codes = []() {
+      std::vector<std::pair<uint16_t, uint8_t>> codes(288);
+      for (uint32_t symbol = 0; symbol < 288; ++symbol) {
+        if (symbol < 144) {
+          codes[symbol] = {0x30 + symbol, 8};
+        } else if (symbol < 256) {
+          codes[symbol] = {0x190 + symbol - 144, 9};
+        } else if (symbol < 280) {
+          codes[symbol] = {symbol - 256, 7};
+        } else {
+          codes[symbol] = {0xC0 + symbol - 280, 8};
+        }
+        codes[symbol].first =
+            reverseBits(codes[symbol].first, codes[symbol].second);
+      }
+      return codes;
+    }();
+    write(codes[symbol].first, codes[symbol].second);
+  }
+
+  void writeMatch(size_t length, size_t distance) {
+    auto code = std::upper_bound(DEFLATE_LENGTH_BASE,
+                                 DEFLATE_LENGTH_BASE + 29, length) -
+                DEFLATE_LENGTH_BASE - 1;
+    writeSymbol(257 + code);
+    write(length - DEFLATE_LENGTH_BASE[code], DEFLATE_LENGTH_EXTRA[code]);
+    code = std::upper_bound(DEFLATE_DISTANCE_BASE,
+                            DEFLATE_DISTANCE_BASE + 30, distance) -
+           DEFLATE_DISTANCE_BASE - 1;
+    writeCode(code, 5);
+    write(distance - DEFLATE_DISTANCE_BASE[code], DEFLATE_DISTANCE_EXTRA[code]);
+  }
+
+  void finish() {
+    if (numBits > 0) out.push_back(uint8_t(bits));
+    bits = 0;
+    numBits = 0;
+  }
+
+ private:
+  static uint32_t reverseBits(uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; ++i) {
+      reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    return reversed;
+  }
+
+  std::vector<uint8_t>& out;
+  uint64_t bits;
+  int numBits;
+};
+
+// Number of bytes a and b have in common from the start, up to max.
+inline size_t matchLength(const uint8_t* a, const uint8_t* b, size_t max) {
+  size_t length = 0;
+  for (; length + 8 <= max; length += 8) {
+    auto diff = loadLittleEndian(a + length) ^ loadLittleEndian(b + length);
+    if (diff) return length + countTrailingZeros(diff) / 8;
+  }
+  while (length < max && a[length] == b[length]) {
+    ++length;
+  }
+  return length;
+}
+
+// Compresses data, rows of stride bytes with 4 bytes per pixel, into a
+// single deflate block with the fixed Huffman codes, matching greedily.
+// Every position first tries the pixel before and the one above, where
+// images repeat most, and then the last position whose next 4 bytes hashed
+// the same.
+void deflateFixed(const uint8_t* data, size_t size, size_t stride,
+                  std::vector<uint8_t>& out) {
+  DeflateBitWriter writer(out);
+  writer.write(1, 1);  // Last block
+  writer.write(1, 2);  // Fixed codes
+  // Positions plus one, with 0 for none.
+  std::vector<size_t> head(size_t(1) << DEFLATE_HASH_BITS, 0);
+  size_t neighbors[2] = {4, stride};
+  size_t i = 0;
+  while (i < size) {
+    auto max = std::min(DEFLATE_MAX_MATCH, size - i);
+    size_t length = 0;
+    size_t distance = 0;
+    for (auto back : neighbors) {
+      if (back > i || back > DEFLATE_WINDOW) continue;
+      auto found = matchLength(data + i, data + i - back, max);
+      if (found > length) {
+        length = found;
+        distance = back;
+      }
+    }
+    if (length < max && i + 4 <= size) {
+      uint32_t word;
+      std::memcpy(&word, data + i, 4);
+      auto& slot = head[(word * 2654435761u) >> (32 - DEFLATE_HASH_BITS)];
+      if (slot != 0 && i - (slot - 1) <= DEFLATE_WINDOW) {
+        auto candidate = slot - 1;
+        auto found = matchLength(data + i, data + candidate, max);
+        if (found > length) {
+          length = found;
+          distance = i - candidate;
+        }
+      }
+      slot = i + 1;
+    }
+    if (length >= 3) {
+      writer.writeMatch(length, distance);
+      i += length;
+    } else {
+      writer.writeSymbol(data[i]);
+      ++i;
+    }
+  }
+  writer.writeSymbol(256);
+  writer.finish();
+}
+
+uint32_t adler32(const uint8_t* data, size_t size) {
+  uint32_t a = 1, b = 0;
+  while (size > 0) {
+    // The largest run that can't overflow b before the modulo.
+    auto run = std::min<size_t>(size, 5552);
+    for (size_t i = 0; i < run; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += run;
+    size -= run;
+  }
+  return (b << 16) | a;
+}
+
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+  static const auto table = []() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t n = 0; n < 256; ++n) {
+      auto c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      table[n] = c;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+void appendBigEndian(std::vector<uint8_t>& out, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(uint8_t(value >> shift));
+  }
+}
+
+// Appends a PNG chunk of type holding the bytes of data from start on,
+// which are already at the end of out.
+void finishPngChunk(std::vector<uint8_t>& out, size_t start,
+                    const char* type) {
+  auto length = uint32_t(out.size() - start);
+  uint8_t header[8];
+  for (int i = 0; i < 4; ++i) {
+    header[i] = uint8_t(length >> (24 - 8 * i));
+    header[4 + i] = uint8_t(type[i]);
+  }
+  out.insert(out.begin() + start, header, header + 8);
+  appendBigEndian(out, crc32(&out[start + 4], length + 4));
+}
+}  // namespace
+
+// Writes every frame to its own PNG file, prefix followed by the frame
+// number padded to digits digits, such as frames/life000042.png. Files are
+// compressed and written on the workers, in parallel, with a fast greedy
+// deflate that mostly finds runs of the same color and rows like the one
+// above; they are larger than what zlib would make, and smaller than raw
+// pixels by about the factor the image is uniform.
+class PngSequenceEncoder : public FrameEncoder {
+ public:
+  explicit PngSequenceEncoder(const std::string& prefix, size_t digits = 6)
+      : prefix(prefix), digits(digits) {}
+
+  void encode(uint64_t frame, const uint8_t* pixels, size_t width,
+              size_t height, std::vector<uint8_t>& out) const override {
+    // Scanlines each start with filter type 0, none.
+    auto rowSize = width * 4 + 1;
+    out.resize(height * rowSize);
+    for (size_t y = 0; y < height; ++y) {
+      out[y * rowSize] = 0;
+      std::memcpy(&out[y * rowSize + 1], pixels + y * width * 4, width * 4);
+    }
+    std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    auto start = png.size();
+    appendBigEndian(png, uint32_t(width));
+    appendBigEndian(png, uint32_t(height));
+    // 8 bits per channel, RGBA, default compression, filters, no interlace.
+    png.insert(png.end(), {8, 6, 0, 0, 0});
+    finishPngChunk(png, start, "IHDR");
+
+    start = png.size();
+    png.insert(png.end(), {0x78, 0x01});
+    deflateFixed(out.data(), out.size(), rowSize, png);
+    appendBigEndian(png, adler32(out.data(), out.size()));
+    finishPngChunk(png, start, "IDAT");
+    finishPngChunk(png, png.size(), "IEND");
+
+    auto path = getPath(frame);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(png.data()), png.size());
+    if (!file) throw std::runtime_error("Can't write frame " + path + ".");
+  }
+
+  std::string getPath(uint64_t frame) const {
+    auto number = std::to_string(frame);
+    if (number.size() < digits) {
+      number.insert(0, digits - number.size(), '0');
+    }
+    return prefix + number + ".png";
+  }
+
+ private:
+  std::string prefix;
+  size_t digits;
+};
+
+// Streams every frame into one YUV4MPEG2 file, uncompressed, at
+// framesPerSecond frames a second, or to stdout with path "-" to pipe
+// into an encoder such as ffmpeg. Colors go to full range 4:4:4 YCbCr with
+// the BT.601 matrix, so that single cells keep their color; alpha is
+// dropped. Workers convert frames in parallel, and the stream is written in
+// order.
+class Y4mEncoder : public FrameEncoder {
+ public:
+  explicit Y4mEncoder(const std::string& path, uint32_t framesPerSecond = 30,
+                      uint32_t frameDuration = 1)
+      : path(path),
+        framesPerSecond(framesPerSecond),
+        frameDuration(frameDuration) {
+    if (framesPerSecond == 0 || frameDuration == 0)
+      throw std::invalid_argument("Frame rates must be positive.");
+    if (path != "-") {
+      file.open(path, std::ios::binary | std::ios::trunc);
+      if (!file) throw std::runtime_error("Can't create video " + path + ".");
+    }
+  }
+
+  void begin(size_t width, size_t height) override {
+    getStream() << "YUV4MPEG2 W" << width << " H" << height << " F"
+                << framesPerSecond << ":" << frameDuration
+                << " Ip A1:1 C444 XCOLORRANGE=FULL\n";
+    check();
+  }
+
+  void encode(uint64_t, const uint8_t* pixels, size_t width, size_t height,
+              std::vector<uint8_t>& out) const override {
+    static const char FRAME_HEADER[] = "FRAME\n";
+    auto headerSize = sizeof(FRAME_HEADER) - 1;
+    auto planeSize = width * height;
+    out.resize(headerSize + planeSize * 3);
+    std::memcpy(out.data(), FRAME_HEADER, headerSize);
+    auto luma = &out[headerSize];
+    auto blue = luma + planeSize;
+    auto red = blue + planeSize;
+    for (size_t i = 0; i < planeSize; ++i) {
+      int r = pixels[i * 4];
+      int g = pixels[i * 4 + 1];
+      int b = pixels[i * 4 + 2];
+      luma[i] = uint8_t((77 * r + 150 * g + 29 * b + 128) >> 8);
+      blue[i] = uint8_t(
+          std::min(255, (-43 * r - 85 * g + 128 * b + 32896) >> 8));
+      red[i] = uint8_t(
+          std::min(255, (128 * r - 107 * g - 21 * b + 32896) >> 8));
+    }
+  }
+
+  void write(uint64_t, const std::vector<uint8_t>& encoded) override {
+    getStream().write(reinterpret_cast<const char*>(encoded.data()),
+                      encoded.size());
+    check();
+  }
+
+  void flush() override {
+    getStream().flush();
+    check();
+  }
+
+ private:
+  std::string path;
+  uint32_t framesPerSecond;
+  uint32_t frameDuration;
+  std::ofstream file;
+
+  std::ostream& getStream() {
+    if (path == "-") return std::cout;
+    return file;
+  }
+
+  void check() {
+    if (!getStream())
+      throw std::runtime_error("Can't write video " + path + ".");
+  }
+};
+
+// Headless
+// ========--------------------------------------------------------------------
+// Renders a 2D grid with readRow() without a window: render() copies the
+// generation the grid shows and hands it to a pool of workers, which
+// colorize it into RGBA pixels, one per cell, and encode them with encoder
+// while the simulation goes on. Every frame has a GridColorizer of its own,
+// which says what colorize may depend on; colorize runs on the workers,
+// concurrently, and must be safe to call that way. At most queueLength
+// frames are rendered and not yet written at a time; render() waits for
+// the oldest one to be written before reusing its buffers, so a run that
+// outpaces its encoder is slowed down to it rather than growing without
+// bound. That makes memory about queueLength frames, allocated as they're
+// needed.
+//
+// Errors from colorize or the encoder surface on the next render() or
+// flush(), and no frames are written after one.
+template <typename T, typename GridType = Grid<T>>
+class HeadlessColorRenderer {
+  using Colorize = typename GridColorizer<T, GridType>::Colorize;
+
+  struct Frame {
+    uint64_t number;
+    std::shared_ptr<GridFrame<T>> cells;
+    std::unique_ptr<GridColorizer<T, GridFrame<T>>> colorizer;
+    // The renderer's colorsVersion when the frame was rendered, and when
+    // its colorizer's table was started.
+    uint64_t colorsVersion;
+    uint64_t tableVersion;
+    std::vector<uint8_t> pixels;
+    std::vector<uint8_t> encoded;
+  };
+
+ public:
+  // numWorkers 0 means one per hardware thread, and queueLength 0 one more
+  // frame than there are workers.
+  HeadlessColorRenderer(std::shared_ptr<GridType> grid, Colorize colorize,
+                        std::shared_ptr<FrameEncoder> encoder,
+                        size_t numWorkers = 0, size_t queueLength = 0)
+      : grid(grid),
+        colorize(colorize),
+        encoder(encoder),
+        colorsVersion(0),
+        numFrames(0),
+        numWritten(0),
+        writing(false),
+        stopping(false) {
+    if (numWorkers == 0) {
+      numWorkers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto shape = grid->getShape();
+    width = shape[0];
+    height = shape[1];
+    this->queueLength = queueLength == 0 ? numWorkers + 1 : queueLength;
+    encoder->begin(getWidth(), getHeight());
+    for (size_t i = 0; i < numWorkers; ++i) {
+      workers.emplace_back([this]() { work(); });
+    }
+  }
+
+  HeadlessColorRenderer(const HeadlessColorRenderer&) = delete;
+  HeadlessColorRenderer& operator=(const HeadlessColorRenderer&) = delete;
+
+  // Writes whatever is still queued first, but drops any error doing so;
+  // call flush() to see them.
+  ~HeadlessColorRenderer() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      written.wait(lock, [&]() { return isDrained(); });
+      stopping = true;
+    }
+    queued.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    try {
+      if (!error) encoder->flush();
+    } catch (...) {
+    }
+  }
+
+  size_t getWidth() const { return width; }
+  size_t getHeight() const { return height; }
+
+  // Copies the generation the grid shows as the next frame and queues it
+  // for colorizing and encoding.
+  void render() {
+    Frame* frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      written.wait(lock, [&]() {
+        return error || !spareFrames.empty() || frames.size() < queueLength;
+      });
+      if (error) std::rethrow_exception(error);
+      if (spareFrames.empty()) {
+        frames.emplace_back(new Frame());
+        auto& added = *frames.back();
+        added.cells = std::make_shared<GridFrame<T>>(grid->getShape());
+        added.colorizer.reset(
+            new GridColorizer<T, GridFrame<T>>(added.cells, colorize));
+        added.tableVersion = colorsVersion;
+        added.pixels.resize(getWidth() * getHeight() * 4);
+        spareFrames.push_back(&added);
+      }
+      frame = spareFrames.back();
+      spareFrames.pop_back();
+    }
+    try {
+      frame->cells->copyFrom(*grid, 0, threadPool.get());
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      spareFrames.push_back(frame);
+      throw;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      frame->number = numFrames++;
+      frame->colorsVersion = colorsVersion;
+      pending.push_back(frame);
+    }
+    queued.notify_one();
+  }
+
+  // Waits until every frame rendered so far is written, and flushes the
+  // encoder.
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    written.wait(lock, [&]() { return isDrained(); });
+    if (error) std::rethrow_exception(error);
+    encoder->flush();
+  }
+
+  // Number of frames rendered so far.
+  uint64_t getNumFrames() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return numFrames;
+  }
+
+  size_t getNumThreads() const {
+    return threadPool ? threadPool->getNumThreads() : 1;
+  }
+
+  // Same as Grid::setNumThreads, for copying rows on the calling thread,
+  // apart from the workers.
+  void setNumThreads(size_t numThreads) {
+    if (numThreads == 0) {
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadPool.reset(numThreads > 1 ? new ThreadPool(numThreads) : nullptr);
+  }
+
+  // Drops the tables of colors, for when colorize changes what it returns.
+  // Frames rendered from then on are colorized from scratch.
+  void forgetColors() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++colorsVersion;
+  }
+
+ private:
+  std::shared_ptr<GridType> grid;
+  Colorize colorize;
+  size_t width;
+  size_t height;
+  std::unique_ptr<ThreadPool> threadPool;
+  std::shared_ptr<FrameEncoder> encoder;
+  size_t queueLength;
+  std::vector<std::thread> workers;
+  // Guarded by mutex.
+  mutable std::mutex mutex;
+  std::condition_variable queued;
+  std::condition_variable written;
+  uint64_t colorsVersion;
+  std::vector<std::unique_ptr<Frame>> frames;
+  std::vector<Frame*> spareFrames;
+  std::deque<Frame*> pending;
+  // Frames encoded but waiting for the ones before them to be written.
+  std::map<uint64_t, Frame*> encoded;
+  uint64_t numFrames;
+  uint64_t numWritten;
+  bool writing;
+  bool stopping;
+  std::exception_ptr error;
+
+  bool isDrained() const { return numWritten == numFrames && !writing; }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      queued.wait(lock, [&]() { return stopping || !pending.empty(); });
+      if (pending.empty()) return;
+      auto frame = pending.front();
+      pending.pop_front();
+      if (!error) {
+        lock.unlock();
+        auto failure = tryTo([&]() {
+          if (frame->tableVersion != frame->colorsVersion) {
+            frame->colorizer->forgetColors();
+            frame->tableVersion = frame->colorsVersion;
+          }
+          frame->colorizer->draw(frame->pixels.data(), getWidth() * 4);
+          encoder->encode(frame->number, frame->pixels.data(), getWidth(),
+                          getHeight(), frame->encoded);
+        });
+        lock.lock();
+        if (failure && !error) error = failure;
+      }
+      encoded[frame->number] = frame;
+
+      // Whoever finds the next frame to write writes it and every one
+      // after it that is ready, while the others carry on encoding.
+      if (writing) continue;
+      writing = true;
+      for (auto next = encoded.find(numWritten); next != encoded.end();
+           next = encoded.find(numWritten)) {
+        frame = next->second;
+        encoded.erase(next);
+        if (!error) {
+          lock.unlock();
+          auto failure = tryTo(
+              [&]() { encoder->write(frame->number, frame->encoded); });
+          lock.lock();
+          if (failure && !error) error = failure;
+        }
+        ++numWritten;
+        spareFrames.push_back(frame);
+        written.notify_all();
+      }
+      writing = false;
+      written.notify_all();
+    }
+  }
+
+  template <typename F>
+  static std::exception_ptr tryTo(F&& f) {
+    try {
+      f();
+    } catch (...) {
+      return std::current_exception();
+    }
+    return nullptr;
+  }
+};
+
+}  // namespace methuselah
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "methuselah.h"
+
+namespace methuselah {
+
+// A copy of one generation of a grid, stored densely in row-major order.
+// Reads like the grids renderers take, through getShape(), getValue() and
+// readRow().
+template <typename T>
+class GridFrame {
+ public:
+  explicit GridFrame(const std::vector<size_t>& shape)
+      : shape(shape),
+        size(multiplyAll<size_t>(shape)),
+        cells(new T[size]()),
+        generation(0) {}
+
+  // Copies the generation grid.getValue() reads, grid being any grid with
+  // readRow() and the same shape, spreading rows over threadPool if given.
+  template <typename GridType>
+  void copyFrom(GridType& grid, uint64_t generation,
+                ThreadPool* threadPool = nullptr) {
+    auto numRows = size / shape[0];
+    auto copyRows = [&](size_t begin, size_t end) {
+      for (auto row = begin; row < end; ++row) {
+        auto out = &cells[row * shape[0]];
+        grid.readRow(row, [&](size_t x, const T* run, size_t length) {
+          std::copy(run, run + length, out + x);
+        });
+      }
+    };
+    if (!threadPool) {
+      copyRows(0, numRows);
+    } else {
+      auto chunk =
+          std::max<size_t>(1, numRows / (threadPool->getNumThreads() * 4));
+      threadPool->run((numRows + chunk - 1) / chunk, [&](size_t i, size_t) {
+        copyRows(i * chunk, std::min(numRows, (i + 1) * chunk));
+      });
+    }
+    this->generation = generation;
+  }
+
+  const T& getValue(const std::vector<size_t>& coordinates) const {
+    if (coordinates.size() != shape.size())
+      throw InvalidOperationException(
+          "Coordinate numDimensions do not match grid's numDimensions.");
+    size_t idx = 0;
+    for (auto i = shape.size(); i-- > 0;) {
+      if (coordinates[i] >= shape[i])
+        throw std::out_of_range(
+            "Can't access values for out of bounds indices");
+      idx = idx * shape[i] + coordinates[i];
+    }
+    return cells[idx];
+  }
+
+  // Same as Grid::readRow, with every row in one run.
+  template <typename F>
+  void readRow(size_t row, F&& f) const {
+    if (row >= size / shape[0])
+      throw std::out_of_range("Can't read rows past the end of the grid.");
+    f(size_t(0), static_cast<const T*>(&cells[row * shape[0]]), shape[0]);
+  }
+
+  const std::vector<size_t>& getShape() const { return shape; }
+
+  // Number of generations the runner stepped before this one was copied.
+  uint64_t getGeneration() const { return generation; }
+
+ private:
+  std::vector<size_t> shape;
+  size_t size;
+  std::unique_ptr<T[]> cells;
+  uint64_t generation;
+};
+
+// The frame a SimulationRunner last handed to the display thread, for
+// renderers to draw from in place of the grid.
+template <typename T>
+class FrameView {
+ public:
+  const T& getValue(const std::vector<size_t>& coordinates) const {
+    return frame->getValue(coordinates);
+  }
+
+  template <typename F>
+  void readRow(size_t row, F&& f) const {
+    frame->readRow(row, f);
+  }
+
+  const std::vector<size_t>& getShape() const { return frame->getShape(); }
+
+  uint64_t getGeneration() const { return frame->getGeneration(); }
+
+ private:
+  template <typename, typename>
+  friend class SimulationRunner;
+
+  const GridFrame<T>* frame = nullptr;
+};
+
+// Steps a grid on a thread of its own, so that rendering and event
+// handling run at display rate on the calling thread: a slow frame doesn't
+// hold the simulation back, and a slow generation doesn't hold input back.
+//
+// Generations go from one thread to the other through three frames. The
+// simulation thread copies a generation into the back frame and swaps it
+// with the middle one, and acquire() swaps the middle frame for the front
+// one, the one getView() shows, when a newer one is there. Each swap is a
+// single atomic exchange, so neither thread ever waits on the other. While
+// the display thread hasn't taken the last frame yet, generations aren't
+// copied at all, which keeps unthrottled runs from copying generations
+// nobody would see.
+//
+// Runs start right away, at targetRate generations a second as
+// setTargetRate() takes it, unless paused. Once they started, anything that
+// touches the grid, such as edits from event handlers, goes through post()
+// to run on the simulation thread between generations.
+template <typename T, typename GridType = Grid<T>>
+class SimulationRunner {
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  SimulationRunner(std::shared_ptr<GridType> grid,
+                   std::function<void(GridType&)> step, double targetRate = 0,
+                   bool paused = false)
+      : grid(grid),
+        step(step),
+        view(new FrameView<T>()),
+        middle(MIDDLE),
+        back(BACK),
+        generation(0),
+        dirty(false),
+        front(FRONT),
+        paused(paused),
+        targetRate(targetRate),
+        requestedSteps(0),
+        stopping(false) {
+    checkTargetRate(targetRate);
+    for (size_t i = 0; i < 3; ++i) {
+      frames.emplace_back(grid->getShape());
+    }
+    frames[front].copyFrom(*grid, generation);
+    view->frame = &frames[front];
+    thread = std::thread([this]() { run(); });
+  }
+
+  SimulationRunner(const SimulationRunner&) = delete;
+  SimulationRunner& operator=(const SimulationRunner&) = delete;
+
+  ~SimulationRunner() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+  }
+
+  // What renderers should draw from, which acquire() moves forward.
+  std::shared_ptr<FrameView<T>> getView() const { return view; }
+
+  // Moves the view to the latest generation published, and returns whether
+  // there was a newer one. Rethrows what the step threw, if it threw.
+  bool acquire() {
+    if (failed.load(std::memory_order_acquire)) {
+      std::rethrow_exception(error);
+    }
+    if (!(middle.load(std::memory_order_relaxed) & FRESH)) return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+    view->frame = &frames[front];
+    return true;
+  }
+
+  // Runs command(grid) on the simulation thread before the next
+  // generation, even while paused.
+  void post(std::function<void(GridType&)> command) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      commands.push_back(std::move(command));
+    }
+    wake.notify_one();
+  }
+
+  bool getPaused() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return paused;
+  }
+
+  void setPaused(bool paused) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      this->paused = paused;
+    }
+    wake.notify_one();
+  }
+
+  // Steps one more generation right away, paused or not.
+  void stepOnce() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++requestedSteps;
+    }
+    wake.notify_one();
+  }
+
+  double getTargetRate() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return targetRate;
+  }
+
+  // Steps at most generationsPerSecond generations a second, or as many as
+  // possible with 0. Runs that fall behind carry on from where they are
+  // rather than catching up in a burst.
+  void setTargetRate(double generationsPerSecond) {
+    checkTargetRate(generationsPerSecond);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      targetRate = generationsPerSecond;
+    }
+    wake.notify_one();
+  }
+
+ private:
+  // The middle frame's index shares its atomic with whether it is newer
+  // than the front one.
+  static constexpr uint8_t INDEX = 3;
+  static constexpr uint8_t FRESH = 4;
+  static constexpr uint8_t FRONT = 0;
+  static constexpr uint8_t MIDDLE = 1;
+  static constexpr uint8_t BACK = 2;
+
+  std::shared_ptr<GridType> grid;
+  std::function<void(GridType&)> step;
+  std::vector<GridFrame<T>> frames;
+  std::shared_ptr<FrameView<T>> view;
+  std::atomic<uint8_t> middle;
+  // Owned by the simulation thread.
+  uint8_t back;
+  uint64_t generation;
+  // Whether the grid changed since it was last copied.
+  bool dirty;
+  // Owned by the display thread.
+  uint8_t front;
+  // Guarded by mutex.
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  std::vector<std::function<void(GridType&)>> commands;
+  bool paused;
+  double targetRate;
+  size_t requestedSteps;
+  bool stopping;
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;
+  std::thread thread;
+
+  static void checkTargetRate(double generationsPerSecond) {
+    if (!(generationsPerSecond >= 0))
+      throw std::invalid_argument("Target rates can't be negative.");
+  }
+
+  void run() {
+    try {
+      loop();
+    } catch (...) {
+      error = std::current_exception();
+      failed.store(true, std::memory_order_release);
+    }
+  }
+
+  void loop() {
+    std::vector<std::function<void(GridType&)>> pending;
+    auto next = Clock::now();
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (stopping) return;
+      auto now = Clock::now();
+      auto due = !paused && (targetRate <= 0 || now >= next);
+      if (commands.empty() && requestedSteps == 0 && !due) {
+        // Whatever happened last gets shown before going to sleep.
+        if (dirty) {
+          lock.unlock();
+          publish(true);
+          continue;
+        }
+        if (paused) {
+          wake.wait(lock);
+          next = Clock::now();
+        } else {
+          wake.wait_until(lock, next);
+        }
+        continue;
+      }
+      std::swap(pending, commands);
+      auto requested = !due && requestedSteps > 0;
+      if (requested) {
+        --requestedSteps;
+      }
+      Clock::duration period{};
+      if (targetRate > 0) {
+        period = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(1 / targetRate));
+      }
+      lock.unlock();
+
+      for (auto& command : pending) {
+        command(*grid);
+      }
+      dirty = dirty || !pending.empty();
+      pending.clear();
+      if (due || requested) {
+        step(*grid);
+        ++generation;
+        dirty = true;
+        if (due) {
+          next = std::max(next + period, now);
+        }
+      }
+      publish(false);
+    }
+  }
+
+  // Copies the grid into the back frame and swaps it into the middle,
+  // unless the display thread hasn't taken the middle one yet and force
+  // is false.
+  void publish(bool force) {
+    if (!dirty) return;
+    if (!force && (middle.load(std::memory_order_relaxed) & FRESH)) return;
+    frames[back].copyFrom(*grid, generation);
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    dirty = false;
+  }
+};
+
+}  // namespace methuselah
@@ -0,0 +1,167 @@
+// Checks that Grid::update(generations), which carries cache-sized blocks
+// through several generations at once, leaves the grid bit-identical to
+// the same number of calls to update().
+//
+// Usage: TemporalBlockingTest
+//
+// Exits with a non-zero status and names the failing case on a mismatch.
+
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "methuselah.h"
+
+using methuselah::Grid;
+using methuselah::OuterTotalisticRule;
+using methuselah::StencilView;
+using methuselah::Wrapping;
+
+namespace {
+
+struct Life {
+  static constexpr size_t numNeighbors = methuselah::mooreNeighborhoodSize(2);
+  void operator()(uint8_t& cell,
+                  const StencilView<uint8_t, numNeighbors>& neighbors) const {
+    auto count = 0;
+    for (auto neighbor : neighbors) {
+      count += neighbor;
+    }
+    cell = count == 3 || (cell && count == 2);
+  }
+};
+
+// Sums the neighborhood into a cell of several states, so every neighbor
+// and its position in the stencil matter.
+void weightedSum(int* cell, const std::vector<int*>& neighbors) {
+  auto sum = *cell;
+  for (size_t i = 0; i < neighbors.size(); ++i) {
+    sum += *neighbors[i] * static_cast<int>(i + 1);
+  }
+  *cell = sum % 7;
+}
+
+size_t failures = 0;
+
+template <typename T>
+void fill(Grid<T>& grid, int numStates) {
+  std::mt19937 rng(1);
+  auto size = grid.getSize();
+  auto& shape = grid.getShape();
+  std::vector<size_t> coords(shape.size());
+  for (size_t i = 0; i < size; ++i) {
+    auto rest = i;
+    for (size_t d = 0; d < shape.size(); ++d) {
+      coords[d] = rest % shape[d];
+      rest /= shape[d];
+    }
+    grid.setValue(coords, static_cast<T>(rng() % numStates));
+  }
+}
+
+template <typename T>
+bool sameCells(Grid<T>& a, Grid<T>& b) {
+  auto size = a.getSize();
+  auto& shape = a.getShape();
+  std::vector<size_t> coords(shape.size());
+  for (size_t i = 0; i < size; ++i) {
+    auto rest = i;
+    for (size_t d = 0; d < shape.size(); ++d) {
+      coords[d] = rest % shape[d];
+      rest /= shape[d];
+    }
+    if (a.getValue(coords) != b.getValue(coords)) return false;
+  }
+  return true;
+}
+
+// Runs makeGrid's grid through update(blocked, generations) and through
+// generations calls to update(single), then one more single generation
+// on both, and compares the cells after each.
+template <typename T, typename MakeGrid, typename Blocked, typename Single>
+void check(const std::string& name, int numStates, MakeGrid makeGrid,
+           Blocked blocked, Single single) {
+  for (size_t generations : {1, 3, 5}) {
+    for (size_t threads : {1, 4}) {
+      auto a = makeGrid();
+      auto b = makeGrid();
+      a.setNumThreads(threads);
+      b.setNumThreads(threads);
+      fill(a, numStates);
+      fill(b, numStates);
+
+      blocked(a, generations);
+      for (size_t i = 0; i < generations; ++i) {
+        single(b);
+      }
+      auto same = sameCells(a, b) &&
+                  a.getGeneration() == b.getGeneration();
+      single(a);
+      single(b);
+      same = same && sameCells(a, b);
+
+      std::printf("%-4s %s, %zu generations, %zu threads\n",
+                  same ? "ok" : "FAIL", name.c_str(), generations, threads);
+      if (!same) ++failures;
+    }
+  }
+}
+
+void checkWrapping(const char* wrappingName, Wrapping wrapping) {
+  auto name = [&](const char* grid) {
+    return std::string(grid) + ", " + wrappingName;
+  };
+
+  // Rows of bytes are kept at least TEMPORAL_ROW_BYTES long, so this one
+  // is cut into blocks of rows only.
+  auto life = [&] {
+    return Grid<uint8_t>({2100, 300}, wrapping, methuselah::MOORE, nullptr);
+  };
+  check<uint8_t>(
+      name("2D Life functor"), 2, life,
+      [](Grid<uint8_t>& grid, size_t n) { grid.update(Life(), n); },
+      [](Grid<uint8_t>& grid) { grid.update<Life>(); });
+
+  auto rule = OuterTotalisticRule::fromString("B36/S23");
+  check<uint8_t>(
+      name("2D outer totalistic"), 2, life,
+      [&](Grid<uint8_t>& grid, size_t n) { grid.update(rule, n); },
+      [&](Grid<uint8_t>& grid) { grid.update(rule); });
+
+  auto sum2D = [&] {
+    return Grid<int>({600, 300}, wrapping, methuselah::MOORE, weightedSum);
+  };
+  check<int>(
+      name("2D cellUpdate"), 7, sum2D,
+      [](Grid<int>& grid, size_t n) { grid.update(n); },
+      [](Grid<int>& grid) { grid.update(); });
+
+  // Radius 2 doubles the margins, and blocks are cut in two dimensions.
+  auto sum3D = [&] {
+    return Grid<int>({24, 64, 64}, wrapping, methuselah::VON_NEUMANN,
+                     weightedSum, 0, 2);
+  };
+  check<int>(
+      name("3D radius 2 cellUpdate"), 7,
+      [&] {
+        auto grid = sum3D();
+        grid.setNeighborhood(methuselah::VON_NEUMANN, 2);
+        return grid;
+      },
+      [](Grid<int>& grid, size_t n) { grid.update(n); },
+      [](Grid<int>& grid) { grid.update(); });
+}
+
+}  // namespace
+
+int main() {
+  checkWrapping("toroidal", methuselah::TOROIDAL);
+  checkWrapping("bounded", methuselah::BOUNDED);
+  if (failures) {
+    std::printf("%zu cases failed\n", failures);
+    return 1;
+  }
+  return 0;
+}